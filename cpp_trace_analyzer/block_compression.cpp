@@ -0,0 +1,416 @@
+#include "block_compression.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t LAST_LITERALS = 5;
+// No match starts in the last MATCH_SEARCH_LIMIT bytes.
+static constexpr size_t MATCH_SEARCH_LIMIT = 12;
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr uint32_t HASH_BITS = 14;
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline uint8_t *write_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = static_cast<uint8_t>(length);
+    return op;
+}
+
+static inline uint8_t *write_sequence(uint8_t *op, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literal_len, 15) << 4);
+    if (literal_len >= 15) {
+        op = write_length(op, literal_len - 15);
+    }
+    std::memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (offset == 0) {
+        return op;
+    }
+
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    size_t extra = match_len - MIN_MATCH;
+    *token |= static_cast<uint8_t>(std::min<size_t>(extra, 15));
+    if (extra >= 15) {
+        op = write_length(op, extra - 15);
+    }
+    return op;
+}
+
+size_t block_compress_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+size_t compress_block(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint8_t *op = dst;
+    const uint8_t *anchor = src;
+
+    if (n > MATCH_SEARCH_LIMIT) {
+        // Positions relative to `src`, so zero-initialized entries point at the start.
+        thread_local std::array<uint32_t, 1 << HASH_BITS> table;
+        table.fill(0);
+
+        const uint8_t *match_limit = src + n - MATCH_SEARCH_LIMIT;
+        const uint8_t *match_end_limit = src + n - LAST_LITERALS;
+        const uint8_t *ip = src + 1;
+
+        while (ip < match_limit) {
+            // Find a match, stepping faster through incompressible data.
+            const uint8_t *match;
+            uint32_t misses = 1 << 6;
+            while (true) {
+                uint32_t h = hash4(read32(ip));
+                match = src + table[h];
+                table[h] = ip - src;
+                if (match < ip && static_cast<size_t>(ip - match) <= MAX_OFFSET && read32(match) == read32(ip)) {
+                    break;
+                }
+                ip += misses++ >> 6;
+                if (ip >= match_limit) {
+                    goto last_literals;
+                }
+            }
+
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+
+            const uint8_t *p = ip + MIN_MATCH;
+            const uint8_t *m = match + MIN_MATCH;
+            while (p + 8 <= match_end_limit) {
+                uint64_t diff = read64(p) ^ read64(m);
+                if (diff != 0) {
+                    p += __builtin_ctzll(diff) / 8;
+                    goto match_found;
+                }
+                p += 8;
+                m += 8;
+            }
+            while (p < match_end_limit && *p == *m) {
+                p++;
+                m++;
+            }
+        match_found:
+            op = write_sequence(op, anchor, ip - anchor, ip - match, p - ip);
+            ip = p;
+            anchor = ip;
+            if (ip < match_limit) {
+                table[hash4(read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+
+last_literals:
+    op = write_sequence(op, anchor, src + n - anchor, 0, 0);
+    return op - dst;
+}
+
+[[noreturn]] static void corrupt_block() {
+    throw std::runtime_error("Corrupt compressed block");
+}
+
+static inline size_t read_length(const uint8_t *& ip, const uint8_t *iend, size_t length) {
+    uint8_t byte;
+    do {
+        if (ip >= iend) {
+            corrupt_block();
+        }
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+void decompress_block(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    const uint8_t *ip = src;
+    const uint8_t *const iend = src + src_size;
+    uint8_t *op = dst;
+    uint8_t *const oend = dst + dst_size;
+
+    while (true) {
+        if (ip >= iend) {
+            corrupt_block();
+        }
+        uint8_t token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len < 15 && iend - ip >= 32 && oend - op >= 32) {
+            // Short literals away from both ends: one unconditional copy. This is never the last
+            // sequence, whose literals run up to the end of the input.
+            std::memcpy(op, ip, 16);
+            ip += literal_len;
+            op += literal_len;
+        } else {
+            if (literal_len == 15) {
+                literal_len = read_length(ip, iend, literal_len);
+            }
+            if (literal_len > static_cast<size_t>(iend - ip) || literal_len > static_cast<size_t>(oend - op)) {
+                corrupt_block();
+            }
+            // Copy whole 16-byte chunks when both buffers have room for the overrun.
+            if (literal_len + 16 <= static_cast<size_t>(iend - ip) && literal_len + 16 <= static_cast<size_t>(oend - op)) {
+                for (size_t i = 0; i < literal_len; i += 16) {
+                    std::memcpy(op + i, ip + i, 16);
+                }
+            } else {
+                std::memcpy(op, ip, literal_len);
+            }
+            ip += literal_len;
+            op += literal_len;
+
+            if (ip == iend) {
+                // The last sequence has no match.
+                if (op != oend) {
+                    corrupt_block();
+                }
+                return;
+            }
+            if (iend - ip < 2) {
+                corrupt_block();
+            }
+        }
+
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        size_t match_len = token & 0xf;
+        if (match_len < 15 && offset >= 8 && offset <= static_cast<size_t>(op - dst) && oend - op >= 24) {
+            // Matches of up to 18 bytes: three unconditional 8-byte copies.
+            const uint8_t *match = op - offset;
+            std::memcpy(op, match, 8);
+            std::memcpy(op + 8, match + 8, 8);
+            std::memcpy(op + 16, match + 16, 8);
+            op += match_len + MIN_MATCH;
+            continue;
+        }
+        if (match_len == 15) {
+            match_len = read_length(ip, iend, match_len);
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(op - dst) || match_len > static_cast<size_t>(oend - op)) {
+            corrupt_block();
+        }
+
+        const uint8_t *match = op - offset;
+        if (match_len + 8 <= static_cast<size_t>(oend - op)) {
+            // Short offsets repeat a pattern, which also repeats at the first multiple of the
+            // offset of at least 8. Past that distance every 8-byte chunk reads bytes written
+            // before it.
+            size_t distance = offset;
+            size_t i = 0;
+            if (offset < 8) {
+                distance = offset * ((8 + offset - 1) / offset);
+                for (; i < distance && i < match_len; i++) {
+                    op[i] = match[i];
+                }
+            }
+            for (; i < match_len; i += 8) {
+                std::memcpy(op + i, op + i - distance, 8);
+            }
+        } else {
+            for (size_t i = 0; i < match_len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+}
+
+void shuffle_bytes(const uint8_t *src, size_t n, size_t element_size, uint8_t *dst) {
+    for (size_t b = 0; b < element_size; b++) {
+        uint8_t *plane = dst + b * n;
+        for (size_t i = 0; i < n; i++) {
+            plane[i] = src[i * element_size + b];
+        }
+    }
+}
+
+void unshuffle_bytes(const uint8_t *src, size_t n, size_t element_size, uint8_t *dst) {
+    for (size_t b = 0; b < element_size; b++) {
+        const uint8_t *plane = src + b * n;
+        for (size_t i = 0; i < n; i++) {
+            dst[i * element_size + b] = plane[i];
+        }
+    }
+}
+
+ParallelBlockTraceReader::ParallelBlockTraceReader(FetchFunction fetch, DecodeFunction decode, uint32_t threads)
+    : fetch_(std::move(fetch)), decode_(std::move(decode)), next_block_(0), consumed_(0), end_block_(UINT64_MAX),
+      input_finished_(false), stop_(false), current_(nullptr), current_pos_(0) {
+    if (threads == 0) {
+        threads = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+    }
+    // Two blocks in flight per worker keep them busy while the consumer drains one.
+    slots_.resize(2 * threads);
+    for (uint32_t i = 0; i < threads; i++) {
+        workers_.emplace_back(&ParallelBlockTraceReader::work, this);
+    }
+}
+
+ParallelBlockTraceReader::~ParallelBlockTraceReader() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker: workers_) {
+        worker.join();
+    }
+}
+
+void ParallelBlockTraceReader::work() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [&] { return stop_ || input_finished_ || next_block_ < consumed_ + slots_.size(); });
+        if (stop_ || input_finished_) {
+            return;
+        }
+
+        // Fetching under the lock keeps the blocks in order.
+        uint64_t block = next_block_++;
+        Slot& slot = slots_[block % slots_.size()];
+        try {
+            if (!fetch_(slot.raw)) {
+                input_finished_ = true;
+                end_block_ = std::min(end_block_, block);
+                cv_.notify_all();
+                return;
+            }
+        } catch (...) {
+            slot.error = std::current_exception();
+            slot.ready = true;
+            input_finished_ = true;
+            end_block_ = std::min(end_block_, block + 1);
+            cv_.notify_all();
+            return;
+        }
+
+        lock.unlock();
+        try {
+            decode_(slot.raw, slot.records);
+        } catch (...) {
+            slot.error = std::current_exception();
+        }
+        lock.lock();
+        slot.ready = true;
+        cv_.notify_all();
+    }
+}
+
+size_t ParallelBlockTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records) {
+        if (current_ == nullptr || current_pos_ == current_->records.size()) {
+            std::unique_lock lock(mutex_);
+            if (current_ != nullptr) {
+                current_->ready = false;
+                current_ = nullptr;
+                consumed_++;
+                cv_.notify_all();
+            }
+            Slot& next = slots_[consumed_ % slots_.size()];
+            cv_.wait(lock, [&] { return next.ready || consumed_ >= end_block_; });
+            // Blocks decoded past an error are ready, but never handed out.
+            if (!next.ready || consumed_ >= end_block_) {
+                break;
+            }
+            if (next.error) {
+                // Return the records before the error first.
+                if (n > 0) {
+                    break;
+                }
+                auto error = next.error;
+                next.error = nullptr;
+                next.ready = false;
+                consumed_++;
+                // Nothing is read past an error.
+                end_block_ = consumed_;
+                stop_ = true;
+                cv_.notify_all();
+                std::rethrow_exception(error);
+            }
+            current_ = &next;
+            current_pos_ = 0;
+        }
+
+        size_t count = std::min(current_->records.size() - current_pos_, max_records - n);
+        std::memcpy(records + n, current_->records.data() + current_pos_, count * sizeof(TraceRecord));
+        current_pos_ += count;
+        n += count;
+    }
+    return n;
+}
+
+BlockTraceReader::BlockTraceReader(ParallelBlockTraceReader::FetchFunction fetch, ParallelBlockTraceReader::DecodeFunction decode)
+    : fetch_(std::move(fetch)), decode_(std::move(decode)), pos_(0), finished_(false) {}
+
+size_t BlockTraceReader::read(TraceRecord *records, size_t max_records) {
+    if (error_ != nullptr) {
+        finished_ = true;
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+    size_t n = 0;
+    while (n < max_records) {
+        if (pos_ == records_.size()) {
+            if (finished_) {
+                break;
+            }
+            try {
+                if (!fetch_(raw_)) {
+                    finished_ = true;
+                    break;
+                }
+                decode_(raw_, records_);
+            } catch (...) {
+                // Nothing is read past an error.
+                records_.clear();
+                pos_ = 0;
+                finished_ = true;
+                if (n == 0) {
+                    throw;
+                }
+                error_ = std::current_exception();
+                break;
+            }
+            pos_ = 0;
+            continue;
+        }
+
+        size_t count = std::min(records_.size() - pos_, max_records - n);
+        std::memcpy(records + n, records_.data() + pos_, count * sizeof(TraceRecord));
+        pos_ += count;
+        n += count;
+    }
+    return n;
+}
+
+std::unique_ptr<TraceReader> open_block_trace_reader(ParallelBlockTraceReader::FetchFunction fetch,
+                                                     ParallelBlockTraceReader::DecodeFunction decode, uint32_t threads) {
+    if (threads == 1) {
+        return std::make_unique<BlockTraceReader>(std::move(fetch), std::move(decode));
+    }
+    return std::make_unique<ParallelBlockTraceReader>(std::move(fetch), std::move(decode), threads);
+}
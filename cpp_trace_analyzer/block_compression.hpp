@@ -0,0 +1,112 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+/*
+ * LZ77 block codec in the LZ4 block layout, built for decompression speed rather than ratio.
+ *
+ * A block is a series of sequences: a token byte (literal length in the high nibble, match length
+ * minus 4 in the low one, 15 meaning more length bytes follow), the literals, and a 2-byte little
+ * endian match offset followed by the extra match length bytes. The last sequence has literals
+ * only. The last 5 bytes are always literals and no match starts in the last 12 bytes, which lets
+ * the decoder copy in whole words.
+ *
+ * Blocks are independent, the compressor keeps no state between them.
+ */
+
+// Largest compressed size of `n` bytes.
+size_t block_compress_bound(size_t n);
+
+// Compresses `n` bytes into `dst`, which must hold block_compress_bound(n) bytes. Returns the
+// compressed size.
+size_t compress_block(const uint8_t *src, size_t n, uint8_t *dst);
+
+// Decompresses a whole block into exactly `dst_size` bytes. Throws std::runtime_error on corrupt
+// input, never reading or writing out of bounds.
+void decompress_block(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
+
+// Transposes `n` elements of `element_size` bytes into byte planes: byte b of every element, then
+// byte b + 1... Fields that change slowly from element to element become long runs for the codec.
+void shuffle_bytes(const uint8_t *src, size_t n, size_t element_size, uint8_t *dst);
+void unshuffle_bytes(const uint8_t *src, size_t n, size_t element_size, uint8_t *dst);
+
+// Decodes the blocks of a trace on several threads and returns their records in order.
+//
+// `fetch` reads the next raw block into its argument and returns false after the last one. It is
+// called on one thread at a time, in block order. `decode` turns a raw block into records and
+// runs concurrently on the worker threads. Errors of either are rethrown by read() once the records
+// of the blocks before them were returned.
+class ParallelBlockTraceReader : public TraceReader {
+public:
+    using FetchFunction = std::function<bool(std::vector<uint8_t>&)>;
+    using DecodeFunction = std::function<void(const std::vector<uint8_t>&, std::vector<TraceRecord>&)>;
+
+    // `threads` 0 uses every hardware thread, up to 8.
+    ParallelBlockTraceReader(FetchFunction fetch, DecodeFunction decode, uint32_t threads = 0);
+    ~ParallelBlockTraceReader() override;
+
+    ParallelBlockTraceReader(const ParallelBlockTraceReader&) = delete;
+    ParallelBlockTraceReader& operator=(const ParallelBlockTraceReader&) = delete;
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+private:
+    struct Slot {
+        std::vector<uint8_t> raw;
+        std::vector<TraceRecord> records;
+        std::exception_ptr error;
+        bool ready = false;
+    };
+
+    FetchFunction fetch_;
+    DecodeFunction decode_;
+    std::vector<Slot> slots_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // Blocks claimed by the workers and blocks handed to the consumer. Block i lives in slot
+    // i % slots_.size().
+    uint64_t next_block_;
+    uint64_t consumed_;
+    // Number of blocks, known once `fetch_` runs out or fails.
+    uint64_t end_block_;
+    bool input_finished_;
+    bool stop_;
+
+    Slot *current_;
+    size_t current_pos_;
+
+    void work();
+};
+
+// The same as ParallelBlockTraceReader, decoding on the calling thread: for readers that are many
+// and each read a little at a time, such as the inputs of a merge.
+class BlockTraceReader : public TraceReader {
+public:
+    BlockTraceReader(ParallelBlockTraceReader::FetchFunction fetch, ParallelBlockTraceReader::DecodeFunction decode);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+private:
+    ParallelBlockTraceReader::FetchFunction fetch_;
+    ParallelBlockTraceReader::DecodeFunction decode_;
+    std::vector<uint8_t> raw_;
+    std::vector<TraceRecord> records_;
+    size_t pos_;
+    bool finished_;
+    // Raised by the next read, once the records before it were returned.
+    std::exception_ptr error_;
+};
+
+// A BlockTraceReader for `threads` 1, a ParallelBlockTraceReader otherwise.
+std::unique_ptr<TraceReader> open_block_trace_reader(ParallelBlockTraceReader::FetchFunction fetch,
+                                                     ParallelBlockTraceReader::DecodeFunction decode, uint32_t threads);
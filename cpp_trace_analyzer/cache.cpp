@@ -1,36 +1,455 @@
 #include "cache.hpp"
+#include "cache_kernels.hpp"
+#include "trace_next_use.hpp"
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
-Cache::Cache(uint64_t cache_size, uint32_t sets, uint32_t assoc, uint32_t block_size)
-    : cache_size_(cache_size), block_size_(block_size), misses_(0), hits_(0) {
+Cache::Cache(uint64_t cache_size, uint32_t sets, uint32_t assoc, uint32_t block_size, ReplacementPolicy policy,
+             CacheOrganization organization)
+    : cache_size_(cache_size), block_size_(block_size), misses_(0), hits_(0), policy_(policy), brrip_fills_(0),
+      psel_(1u << (PSEL_BITS - 1)), organization_(organization), clock_(0) {
 
-    cache_.resize(sets, CacheSet(assoc));
-
-    auto block_bits = (uint32_t) std::log2(block_size);
-    auto set_bits = (uint32_t) std::log2(cache_.size());
-
-    tag_bits_ = 64 - set_bits - block_bits;
+    allocate_lines(sets, assoc);
+    set_geometry(sets, block_size);
 }
 
-Cache::Cache(uint64_t cache_size, uint32_t assoc, uint32_t block_size)
-        : cache_size_(cache_size), block_size_(block_size), misses_(0), hits_(0) {
+Cache::Cache(uint64_t cache_size, uint32_t assoc, uint32_t block_size, ReplacementPolicy policy,
+             CacheOrganization organization)
+        : cache_size_(cache_size), block_size_(block_size), misses_(0), hits_(0), policy_(policy), brrip_fills_(0),
+          psel_(1u << (PSEL_BITS - 1)), organization_(organization), clock_(0) {
 
     if (!Cache::is_power_of_2(cache_size)) {
         throw std::invalid_argument("Cache size should be power of 2!");
     }
 
-    cache_.resize(compute_sets(assoc), CacheSet(assoc));
-
-    if (cache_.empty() || (block_size * assoc > cache_size)) {
+    uint32_t sets = compute_sets(assoc);
+    if (sets == 0 || (block_size * assoc > cache_size)) {
         throw std::invalid_argument("Invalid cache size (not big enough)!");
     }
 
-    auto block_bits = (uint32_t) std::log2(block_size);
-    auto set_bits = (uint32_t) std::log2(cache_.size());
+    allocate_lines(sets, assoc);
+    set_geometry(sets, block_size);
+}
+
+void Cache::allocate_lines(uint32_t sets, uint32_t assoc) {
+    const bool skewed = organization_ != CacheOrganization::SET_ASSOCIATIVE;
+    const bool indexed = policy_ == ReplacementPolicy::LRU && assoc >= INDEXED_LRU_ASSOC && !skewed;
+    if (skewed && policy_ != ReplacementPolicy::LRU && policy_ != ReplacementPolicy::MIN) {
+        throw std::invalid_argument("Skewed caches replace by LRU or MIN only!");
+    }
+    if (assoc == 0 || (assoc > MAX_ASSOC && !indexed)) {
+        throw std::invalid_argument("Associativity should be between 1 and " + std::to_string(MAX_ASSOC) + "!");
+    }
+    if ((indexed || skewed) && (uint64_t) sets * assoc >= NO_LINE) {
+        throw std::invalid_argument("Too many lines in the cache!");
+    }
+    sets_ = sets;
+    assoc_ = assoc;
+    kernels_ = &cache_kernels();
+
+    // All invalid. Under LRU way 0 is the first to be replaced, the other policies fill the
+    // invalid ways in order anyway.
+    initial_set_.resize(assoc);
+    for (uint32_t way = 0; way < assoc; way++) {
+        uint64_t state = 0;
+        switch (policy_) {
+            case ReplacementPolicy::LRU:
+                state = indexed || skewed ? 0 : assoc - 1 - way;
+                break;
+            case ReplacementPolicy::NRU:
+                state = 1;
+                break;
+            case ReplacementPolicy::SRRIP:
+            case ReplacementPolicy::BRRIP:
+            case ReplacementPolicy::DRRIP:
+                state = RRPV_MAX;
+                break;
+            case ReplacementPolicy::PLRU:
+            case ReplacementPolicy::MIN:
+                break;
+        }
+        initial_set_[way] = state << TAG_BITS;
+    }
+    if (!indexed && !skewed) {
+        uint64_t blocks = ((sets - 1ull) >> Cache::log2(SET_BLOCK_SETS)) + 1;
+        set_block_bits_ = std::min(Cache::log2(SET_BLOCK_SETS), Cache::log2(std::bit_ceil((uint64_t) sets)));
+        set_page_bits_ = std::min(Cache::log2(SET_PAGE_BLOCKS), Cache::log2(std::bit_ceil(blocks)));
+        set_block_words_ = ((size_t) 1 << set_block_bits_) * assoc;
+        set_pages_.resize(((sets - 1ull) >> (set_block_bits_ + set_page_bits_)) + 1);
+        set_blocks_ = TagStore(set_block_arrays() * set_block_words_, ((sets - 1ull) >> set_block_bits_) + 1);
+        return;
+    }
+
+    lines_.resize((size_t) sets * assoc);
+    for (size_t set = 0; set < sets; set++) {
+        std::copy(initial_set_.begin(), initial_set_.end(), lines_.begin() + set * assoc);
+    }
+    if (policy_ == ReplacementPolicy::MIN) {
+        next_uses_.assign(lines_.size(), NextUseReader::NEVER);
+    }
+    if (skewed) {
+        // Odd multipliers from splitmix64, a different hash for every way.
+        skew_multipliers_.resize(assoc);
+        uint64_t seed = 0;
+        for (auto& multiplier: skew_multipliers_) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            multiplier = (z ^ (z >> 31)) | 1;
+        }
+        if (policy_ == ReplacementPolicy::LRU) {
+            last_uses_.assign(lines_.size(), 0);
+        }
+        walk_.reserve(std::max(assoc, ZCACHE_CANDIDATES));
+    }
+    if (indexed) {
+        // The same order as the ranks: from the last way to way 0, the first to be replaced.
+        lru_head_.resize(sets);
+        lru_links_.resize(lines_.size());
+        for (uint32_t set = 0; set < sets; set++) {
+            uint32_t first = set * assoc;
+            lru_head_[set] = first + assoc - 1;
+            for (uint32_t way = 0; way < assoc; way++) {
+                lru_links_[first + way] = {first + (way + assoc - 1) % assoc, first + (way + 1) % assoc};
+            }
+        }
+        auto slots = std::bit_ceil(2 * lines_.size());
+        line_index_.assign(slots, NO_LINE);
+        line_index_shift_ = 64 - Cache::log2(slots);
+    }
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    addrs_.assign(lines_.size(), 0);
+#endif
+}
+
+void Cache::set_geometry(uint32_t sets, uint32_t block_size) {
+    block_bits_ = Cache::log2(block_size);
+    set_bits_ = Cache::log2(sets);
+    tag_bits_ = ADDRESS_SIZE - set_bits_ - block_bits_;
+    set_mask_ = Cache::mask(set_bits_);
+    tag_mask_ = Cache::mask(tag_bits_);
+
+    if (organization_ != CacheOrganization::SET_ASSOCIATIVE) {
+        access_ = &Cache::access_skewed;
+        return;
+    }
+    switch (policy_) {
+        case ReplacementPolicy::LRU:
+            access_ = indexed_lru() ? &Cache::access_indexed : select_access<ReplacementPolicy::LRU>();
+            break;
+        case ReplacementPolicy::PLRU:
+            access_ = select_access<ReplacementPolicy::PLRU>();
+            break;
+        case ReplacementPolicy::NRU:
+            access_ = select_access<ReplacementPolicy::NRU>();
+            break;
+        case ReplacementPolicy::SRRIP:
+            access_ = select_access<ReplacementPolicy::SRRIP>();
+            break;
+        case ReplacementPolicy::BRRIP:
+            access_ = select_access<ReplacementPolicy::BRRIP>();
+            break;
+        case ReplacementPolicy::DRRIP:
+            access_ = select_access<ReplacementPolicy::DRRIP>();
+            break;
+        case ReplacementPolicy::MIN:
+            access_ = select_access<ReplacementPolicy::MIN>();
+            break;
+    }
+}
 
-    tag_bits_ = ADDRESS_SIZE - set_bits - block_bits;
+template <ReplacementPolicy POLICY>
+Cache::AccessFunction Cache::select_access() const {
+    AccessFunction result = nullptr;
+    if (Cache::is_power_of_2(block_size_) && Cache::is_power_of_2(sets_)) {
+        // The block sizes and associativities of the experiments in statistics_generator.cpp.
+        switch (block_bits_) {
+            case 5:
+                result = specialized_access<5, POLICY, 1, 2, 4, 8, 16>(assoc_);
+                break;
+            case 6:
+                result = specialized_access<6, POLICY, 1, 2, 4, 8, 16>(assoc_);
+                break;
+            case 7:
+                result = specialized_access<7, POLICY, 1, 2, 4, 8, 16>(assoc_);
+                break;
+        }
+    }
+    return result != nullptr ? result : &Cache::access_specialized<0, 0, POLICY>;
+}
+
+template <uint32_t BLOCK_BITS, ReplacementPolicy POLICY, uint32_t... ASSOCS>
+Cache::AccessFunction Cache::specialized_access(uint32_t assoc) {
+    AccessFunction result = nullptr;
+    ((assoc == ASSOCS ? result = &Cache::access_specialized<BLOCK_BITS, ASSOCS, POLICY> : result), ...);
+    return result;
+}
+
+template <uint32_t BLOCK_BITS, uint32_t ASSOC, ReplacementPolicy POLICY>
+bool Cache::access_specialized(Cache& cache, uintptr_t addr) {
+    if constexpr (ASSOC == 0) {
+        LocationInfo loc = cache.location(addr);
+        if (loc.set_index >= cache.sets()) {
+            return cache.access(loc, addr);
+        }
+        return cache.access_set<0, POLICY>(loc.set_index, loc.tag, addr);
+    } else {
+        uint64_t block = addr >> BLOCK_BITS;
+        return cache.access_set<ASSOC, POLICY>(block & cache.set_mask_, (block >> cache.set_bits_) & cache.tag_mask_, addr);
+    }
+}
+
+bool Cache::access_indexed(Cache& cache, uintptr_t addr) {
+    LocationInfo loc = cache.location(addr);
+    if (loc.set_index >= cache.sets()) {
+        return cache.access(loc, addr);
+    }
+    return cache.access_indexed_set(loc.set_index, loc.tag, addr);
+}
+
+bool Cache::access_indexed_set(uint32_t set_index, uint64_t tag, [[maybe_unused]] uintptr_t addr) {
+    const uint64_t line = VALID_BIT | (tag & TAG_MASK);
+    const size_t first = (size_t) set_index * assoc_;
+    const size_t slot_mask = line_index_.size() - 1;
+    const size_t home = line_index_home(set_index, line);
+
+    size_t slot = home;
+    uint32_t found;
+    while ((found = line_index_[slot]) != NO_LINE && (lines_[found] != line || found - first >= assoc_)) {
+        slot = (slot + 1) & slot_mask;
+    }
+
+    uint32_t& head = lru_head_[set_index];
+    if (found != NO_LINE) {
+        update_hits();
+        if (found != head) {
+            // Out of its place in the list and back in front of the head.
+            auto& links = lru_links_[found];
+            lru_links_[links.prev].next = links.next;
+            lru_links_[links.next].prev = links.prev;
+            uint32_t last = lru_links_[head].prev;
+            lru_links_[last].next = found;
+            links = {head, last};
+            lru_links_[head].prev = found;
+            head = found;
+        }
+        return true;
+    }
+
+    update_misses();
+    // The list is circular: the least recently used line becomes the head as is.
+    uint32_t victim = lru_links_[head].prev;
+    if ((lines_[victim] & VALID_BIT) != 0) {
+        remove_from_index(victim);
+        slot = home;
+    }
+    lines_[victim] = line;
+    while (line_index_[slot] != NO_LINE) {
+        slot = (slot + 1) & slot_mask;
+    }
+    line_index_[slot] = victim;
+    head = victim;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    addrs_[victim] = addr;
+#endif
+    return false;
+}
+
+size_t Cache::line_index_home(uint32_t set_index, uint64_t line) const noexcept {
+    uint64_t key = (line & TAG_MASK) + set_index * 0xff51afd7ed558ccdull;
+    return (key * 0x9e3779b97f4a7c15ull) >> line_index_shift_;
+}
+
+void Cache::remove_from_index(uint32_t line_number) noexcept {
+    const size_t slot_mask = line_index_.size() - 1;
+    size_t slot = line_index_home(line_number / assoc_, lines_[line_number]);
+    while (line_index_[slot] != line_number) {
+        slot = (slot + 1) & slot_mask;
+    }
+    // Backward shift: the lines after the hole move into it unless their probe starts past it.
+    for (size_t next = (slot + 1) & slot_mask; line_index_[next] != NO_LINE; next = (next + 1) & slot_mask) {
+        uint32_t moved = line_index_[next];
+        size_t home = line_index_home(moved / assoc_, lines_[moved]);
+        if (((next - home) & slot_mask) >= ((next - slot) & slot_mask)) {
+            line_index_[slot] = moved;
+            slot = next;
+        }
+    }
+    line_index_[slot] = NO_LINE;
+}
+
+bool Cache::access_skewed(Cache& cache, uintptr_t addr) {
+    LocationInfo loc = cache.location(addr);
+    if (loc.set_index >= cache.sets()) {
+        return cache.access(loc, addr);
+    }
+    return cache.access_skewed_set(loc.set_index, loc.tag, addr);
+}
+
+bool Cache::access_skewed_set(uint32_t set_index, uint64_t tag, [[maybe_unused]] uintptr_t addr) {
+    if (policy_ == ReplacementPolicy::MIN && next_use_ == nullptr) {
+        throw std::runtime_error("MIN replacement needs the next uses of the accesses");
+    }
+    // The block number, the tag of its lines.
+    const uint64_t key = (tag * sets_ + set_index) & TAG_MASK;
+    const uint64_t line = VALID_BIT | key;
+
+    walk_.clear();
+    for (uint32_t way = 0; way < assoc_; way++) {
+        uint32_t line_number = skew_row(key, way) * assoc_ + way;
+        if (lines_[line_number] == line) {
+            update_hits();
+            touch_skewed(line_number);
+            return true;
+        }
+        walk_.push_back({line_number, way, NO_LINE});
+    }
+
+    update_misses();
+    uint32_t victim;
+    if (organization_ == CacheOrganization::ZCACHE) {
+        victim = zcache_make_room();
+    } else {
+        victim = walk_[0].line;
+        uint64_t victim_order = eviction_order(victim);
+        for (uint32_t way = 1; way < assoc_ && victim_order != UINT64_MAX; way++) {
+            uint64_t order = eviction_order(walk_[way].line);
+            if (order > victim_order) {
+                victim = walk_[way].line;
+                victim_order = order;
+            }
+        }
+    }
+    lines_[victim] = line;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    addrs_[victim] = addr;
+#endif
+    touch_skewed(victim);
+    return false;
+}
+
+uint32_t Cache::skew_row(uint64_t key, uint32_t way) const noexcept {
+    // Multiplicative hashing, the high half reduced to the rows by a multiply-high so any number
+    // of rows works.
+    return (uint32_t) ((((key * skew_multipliers_[way]) >> 32) * sets_) >> 32);
+}
+
+uint64_t Cache::eviction_order(uint32_t line_number) const noexcept {
+    if ((lines_[line_number] & VALID_BIT) == 0) {
+        return UINT64_MAX;
+    }
+    return policy_ == ReplacementPolicy::MIN ? next_uses_[line_number] : UINT64_MAX - 1 - last_uses_[line_number];
+}
+
+void Cache::touch_skewed(uint32_t line_number) {
+    if (policy_ == ReplacementPolicy::MIN) {
+        next_uses_[line_number] = next_use_->next_use();
+    } else {
+        last_uses_[line_number] = ++clock_;
+    }
+}
+
+uint32_t Cache::zcache_make_room() {
+    // Breadth first from the rows of the block: every line reached could move to its rows in the
+    // other ways, and the line there is reached in turn, unless it is on the path already. Level by
+    // level, so that the lines of the next level are prefetched together.
+    size_t best = 0;
+    uint64_t best_order = 0;
+    for (size_t level = 0, level_end = walk_.size(); level < level_end; level = level_end, level_end = walk_.size()) {
+        for (size_t i = level; i < level_end; i++) {
+            uint64_t order = eviction_order(walk_[i].line);
+            if (i == 0 || order > best_order) {
+                best = i;
+                best_order = order;
+            }
+        }
+        if (best_order == UINT64_MAX) {
+            break;
+        }
+
+        for (size_t i = level; i < level_end && walk_.size() < ZCACHE_CANDIDATES; i++) {
+            const auto candidate = walk_[i];
+            const uint64_t moved = lines_[candidate.line] & TAG_MASK;
+            for (uint32_t way = 0; way < assoc_ && walk_.size() < ZCACHE_CANDIDATES; way++) {
+                if (way == candidate.way) {
+                    continue;
+                }
+                uint32_t next = skew_row(moved, way) * assoc_ + way;
+                bool on_path = false;
+                for (uint32_t j = (uint32_t) i; j != NO_LINE && !on_path; j = walk_[j].parent) {
+                    on_path = walk_[j].line == next;
+                }
+                if (!on_path) {
+                    walk_.push_back({next, way, (uint32_t) i});
+                    __builtin_prefetch(&lines_[next]);
+                    __builtin_prefetch(policy_ == ReplacementPolicy::MIN ? &next_uses_[next] : &last_uses_[next]);
+                }
+            }
+        }
+    }
+
+    // Each line on the path moves one step towards the victim, which is overwritten.
+    size_t i = best;
+    for (; walk_[i].parent != NO_LINE; i = walk_[i].parent) {
+        const uint32_t to = walk_[i].line, from = walk_[walk_[i].parent].line;
+        lines_[to] = lines_[from];
+        if (policy_ == ReplacementPolicy::MIN) {
+            next_uses_[to] = next_uses_[from];
+        } else {
+            last_uses_[to] = last_uses_[from];
+        }
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+        addrs_[to] = addrs_[from];
+#endif
+    }
+    return walk_[i].line;
+}
+
+bool Cache::indexed_lru() const noexcept {
+    return !lru_head_.empty();
+}
+
+uint64_t Cache::allocated_sets() const noexcept {
+    if (set_pages_.empty()) {
+        return sets_;
+    }
+    // The last block may go past the last set.
+    uint64_t past_last = ((((sets_ - 1ull) >> set_block_bits_) + 1) << set_block_bits_) - sets_;
+    return ((uint64_t) set_blocks_.blocks() << set_block_bits_) - (set_block(sets_ - 1) != nullptr ? past_last : 0);
+}
+
+uint64_t Cache::allocated_bytes() const noexcept {
+    if (set_pages_.empty()) {
+        uint64_t words = lines_.size() + next_uses_.size();
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+        words += addrs_.size();
+#endif
+        return words * sizeof(uint64_t);
+    }
+    uint64_t pages = std::count_if(set_pages_.begin(), set_pages_.end(), [](const std::vector<uint32_t>& page) {
+        return !page.empty();
+    });
+    return (uint64_t) set_blocks_.blocks() * set_block_arrays() * set_block_words_ * sizeof(uint64_t) +
+           (pages << set_page_bits_) * sizeof(uint32_t);
+}
+
+void Cache::set_tag_store(const TagStoreOptions& options) {
+    if (set_pages_.empty()) {
+        throw std::invalid_argument("Only caches that allocate their sets on first touch have a tag store!");
+    }
+    if (set_blocks_.blocks() != 0) {
+        throw std::logic_error("The tag store should be set before the first access");
+    }
+    set_blocks_ = TagStore(set_block_arrays() * set_block_words_, ((sets_ - 1ull) >> set_block_bits_) + 1, options);
+}
+
+const TagStore& Cache::tag_store() const noexcept {
+    return set_blocks_;
 }
 
 uint64_t Cache::cache_size() const noexcept {
@@ -38,11 +457,11 @@ uint64_t Cache::cache_size() const noexcept {
 }
 
 uint32_t Cache::sets() const noexcept {
-    return cache_.size();
+    return sets_;
 }
 
 uint32_t Cache::assoc() const {
-    return cache_.at(0).associativity();
+    return assoc_;
 }
 
 uint32_t Cache::block_size() const noexcept {
@@ -53,146 +472,349 @@ uint32_t Cache::tag_bits() const noexcept {
     return tag_bits_;
 }
 
-uint32_t Cache::misses() const noexcept {
+uint32_t Cache::block_bits() const noexcept {
+    return block_bits_;
+}
+
+uint32_t Cache::set_bits() const noexcept {
+    return set_bits_;
+}
+
+ReplacementPolicy Cache::policy() const noexcept {
+    return policy_;
+}
+
+CacheOrganization Cache::organization() const noexcept {
+    return organization_;
+}
+
+uint64_t Cache::misses() const noexcept {
     return misses_;
 }
 
-uint32_t Cache::hits() const noexcept {
+uint64_t Cache::hits() const noexcept {
     return hits_;
 }
 
 void Cache::update_hits() noexcept {
-    hits_++;
+    hits_ += stats_enabled_;
+}
+
+void Cache::add_hits(uint32_t n) noexcept {
+    if (stats_enabled_) {
+        hits_ += n;
+    }
 }
 
 void Cache::update_misses() noexcept {
-    misses_++;
+    misses_ += stats_enabled_;
+}
+
+void Cache::reset_stats() noexcept {
+    misses_ = 0;
+    hits_ = 0;
+}
+
+void Cache::set_stats_enabled(bool enabled) noexcept {
+    stats_enabled_ = enabled;
 }
 
 uint32_t Cache::compute_sets(uint32_t assoc) const {
     if (cache_size() % (block_size() * assoc) != 0) {
         throw std::invalid_argument("Block size * associativity should be a multiple of cache size!");
     }
-    return cache_size() / ((uint64_t) block_size() * assoc);
-}
-
-CacheSet::CacheSet(uint32_t assoc) : assoc_(assoc), lru_stats_(assoc), cache_lines_(assoc) {
-    for (size_t i = 0; i < assoc; i++) {
-        lru_stats_[i] = i;
+    uint64_t sets = cache_size() / ((uint64_t) block_size() * assoc);
+    if (sets > UINT32_MAX) {
+        throw std::invalid_argument("Too many sets in the cache!");
     }
+    return sets;
 }
 
 bool Cache::access(uintptr_t addr) {
-    return access(Cache::compute_location_info(addr, block_size(), sets(), tag_bits()), addr);
+    return access_(*this, addr);
+}
+
+LocationInfo Cache::location(uintptr_t addr) const noexcept {
+    return {
+            .set_index = static_cast<uint32_t>((addr >> block_bits_) & set_mask_),
+            .tag = (addr >> (block_bits_ + set_bits_)) & tag_mask_
+    };
 }
 
 bool Cache::access(const LocationInfo& loc, uintptr_t addr) {
-    bool hit = false;
-
-    try {
-        assert(loc.set_index < sets());
-        if (loc.set_index >= sets()) {
-            throw std::exception();
-        }
-        auto &set = cache_[loc.set_index];
-        int32_t way = -1;
-        for (int i = 0; i < set.associativity(); i++) {
-            auto& cache_line = set.cache_line(i);
-            if (cache_line.tag == loc.tag && cache_line.state == CacheLineState::VALID) {
-                way = i;
-                break;
+    assert(loc.set_index < sets());
+    if (loc.set_index >= sets()) {
+        std::cerr << "Set " << loc.set_index << " out of range" << std::endl;
+        return false;
+    }
+    if (organization_ != CacheOrganization::SET_ASSOCIATIVE) {
+        return access_skewed_set(loc.set_index, loc.tag, addr);
+    }
+    switch (policy_) {
+        case ReplacementPolicy::LRU:
+            if (indexed_lru()) {
+                return access_indexed_set(loc.set_index, loc.tag, addr);
             }
-        }
+            return access_set<0, ReplacementPolicy::LRU>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::PLRU:
+            return access_set<0, ReplacementPolicy::PLRU>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::NRU:
+            return access_set<0, ReplacementPolicy::NRU>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::SRRIP:
+            return access_set<0, ReplacementPolicy::SRRIP>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::BRRIP:
+            return access_set<0, ReplacementPolicy::BRRIP>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::DRRIP:
+            return access_set<0, ReplacementPolicy::DRRIP>(loc.set_index, loc.tag, addr);
+        case ReplacementPolicy::MIN:
+            return access_set<0, ReplacementPolicy::MIN>(loc.set_index, loc.tag, addr);
+    }
+    return false;
+}
 
-        if (way == -1) {
-            way = set.evict();
-        }
+size_t Cache::set_block_arrays() const noexcept {
+    size_t arrays = policy_ == ReplacementPolicy::MIN ? 2 : 1;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    arrays++;
+#endif
+    return arrays;
+}
 
-        auto& cache_line = set.cache_line(way);
-        if (cache_line.state == CacheLineState::INVALID) {
-            update_misses();
-            cache_line.state = CacheLineState::VALID;
-            cache_line.tag = loc.tag;
-            cache_line.addr = addr;
-        } else {
-            hit = true;
-            update_hits();
-        }
+uint64_t *Cache::allocate_set_block(uint32_t set_index) {
+    auto& page = set_pages_[set_index >> (set_block_bits_ + set_page_bits_)];
+    page.resize((size_t) 1 << set_page_bits_);
+    uint32_t number = set_blocks_.allocate();
+    page[(set_index >> set_block_bits_) & ((1u << set_page_bits_) - 1)] = number + 1;
+
+    uint64_t *words = set_blocks_.block(number);
+    for (size_t first = 0; first < set_block_words_; first += assoc_) {
+        std::copy(initial_set_.begin(), initial_set_.end(), words + first);
+    }
+    if (policy_ == ReplacementPolicy::MIN) {
+        std::fill_n(words + set_block_words_, set_block_words_, NextUseReader::NEVER);
+    }
+    return words;
+}
 
-        set.update_lru(way, true);
+inline uint64_t *Cache::set_lines(uint32_t set_index) {
+    const auto& page = set_pages_[set_index >> (set_block_bits_ + set_page_bits_)];
+    uint32_t block = page.empty() ? 0 : page[(set_index >> set_block_bits_) & ((1u << set_page_bits_) - 1)];
+    uint64_t *first = block != 0 ? set_blocks_.block(block - 1) : allocate_set_block(set_index);
+    return first + (size_t) (set_index & ((1u << set_block_bits_) - 1)) * assoc_;
+}
 
+const uint64_t *Cache::set_block(uint32_t set_index) const noexcept {
+    const auto& page = set_pages_[set_index >> (set_block_bits_ + set_page_bits_)];
+    if (page.empty()) {
+        return nullptr;
     }
-    catch (const std::exception& ex) {
-        std::cerr << ex.what() << std::endl;
+    uint32_t block = page[(set_index >> set_block_bits_) & ((1u << set_page_bits_) - 1)];
+    return block != 0 ? set_blocks_.peek(block - 1) : nullptr;
+}
+
+template <uint32_t ASSOC, ReplacementPolicy POLICY>
+bool Cache::access_set(uint32_t set_index, uint64_t tag, [[maybe_unused]] uintptr_t addr) {
+    const uint32_t assoc = ASSOC == 0 ? assoc_ : ASSOC;
+    uint64_t *set = set_lines(set_index);
+    const uint64_t line = VALID_BIT | (tag & TAG_MASK);
+    if constexpr (POLICY == ReplacementPolicy::MIN) {
+        if (next_use_ == nullptr) {
+            throw std::runtime_error("MIN replacement needs the next uses of the accesses");
+        }
     }
 
+    uint32_t way = kernels_->find_line(set, assoc, line);
+    bool hit = way != assoc;
+    if (hit) {
+        update_hits();
+    } else {
+        update_misses();
+        way = victim<POLICY>(set, assoc);
+        set[way] = (set[way] & RANK_MASK) | line;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+        set[(POLICY == ReplacementPolicy::MIN ? 2 : 1) * set_block_words_ + way] = addr;
+#endif
+    }
+    touch<POLICY>(set, assoc, set_index, way, hit);
+
     return hit;
 }
 
-uint32_t CacheSet::associativity() const noexcept {
-    return assoc_;
+// Replacement state of a line word, and the word with another state.
+static inline uint64_t line_state(uint64_t word) {
+    return (word & Cache::RANK_MASK) >> Cache::TAG_BITS;
 }
 
-uint32_t CacheSet::evict() {
-    uint32_t way = lru_stats_.at(0);
+static inline uint64_t with_line_state(uint64_t word, uint64_t state) {
+    return (word & ~Cache::RANK_MASK) | (state << Cache::TAG_BITS);
+}
 
-    cache_lines_[way].state = CacheLineState::INVALID;
+// Node `node` of a PLRU tree: bit 0 of the state of way `node`, or bit 1 of way `node - assoc`.
+static inline uint64_t plru_node(const uint64_t *set, uint32_t assoc, uint32_t node) {
+    return node < assoc ? line_state(set[node]) & 1 : line_state(set[node - assoc]) >> 1;
+}
 
-    update_lru(way, false);
+static inline void set_plru_node(uint64_t *set, uint32_t assoc, uint32_t node, uint64_t value) {
+    uint32_t way = node < assoc ? node : node - assoc;
+    uint64_t bit = node < assoc ? 1 : 2;
+    set[way] = with_line_state(set[way], (line_state(set[way]) & ~bit) | (value ? bit : 0));
+}
 
-    return way;
+ReplacementPolicy Cache::duel_role(uint32_t set_index) const noexcept {
+    // Sets 0, DUEL_PERIOD, ... lead for SRRIP and the ones right after them for BRRIP, so every
+    // cache with two sets or more has leaders of both kinds.
+    switch (set_index % DUEL_PERIOD) {
+        case 0:
+            return ReplacementPolicy::SRRIP;
+        case 1:
+            return ReplacementPolicy::BRRIP;
+        default:
+            return ReplacementPolicy::DRRIP;
+    }
 }
 
-void CacheSet::update_lru(uint32_t way, bool is_valid) {
-    /*
-     * An LRU vector has `associativity` items, initially set as
-     * [0, 1, ..., associativity - 1].
-     * The first item is the one that will be evicted (least recently used).
-     * Upon access, we swap the accessed way to the end of the vector
-     * and also swap the other ways accordingly so the least recently used
-     * way is on position 0.
-     */
-    try {
-        uint32_t next_way = way;
+template <ReplacementPolicy POLICY>
+uint32_t Cache::victim(uint64_t *set, uint32_t assoc) {
+    if constexpr (POLICY == ReplacementPolicy::LRU) {
+        // Invalid ways always have the highest ranks.
+        return kernels_->find_rank(set, assoc, (uint64_t) (assoc - 1) << TAG_BITS);
+    } else {
+        for (uint32_t way = 0; way < assoc; way++) {
+            if ((set[way] & VALID_BIT) == 0) {
+                return way;
+            }
+        }
 
-        if (is_valid) {
-            ssize_t i = associativity() - 1;
-            do {
-                std::swap(lru_stats_.at(i), next_way);
-                i--;
-            } while (next_way != way);
+        if constexpr (POLICY == ReplacementPolicy::PLRU) {
+            // Follow the bits from the root, node i has children 2i + 1 and 2i + 2, away from the
+            // right halves past the last way.
+            uint32_t node = 0, first_way = 0;
+            for (uint32_t ways = std::bit_ceil(assoc); ways > 1; ways /= 2) {
+                uint32_t right = first_way + ways / 2 < assoc ? (uint32_t) plru_node(set, assoc, node) : 0;
+                node = 2 * node + 1 + right;
+                first_way += right * ways / 2;
+            }
+            return first_way;
+        } else if constexpr (POLICY == ReplacementPolicy::MIN) {
+            const uint64_t *next_uses = set + set_block_words_;
+            return (uint32_t) (std::max_element(next_uses, next_uses + assoc) - next_uses);
+        } else if constexpr (POLICY == ReplacementPolicy::NRU) {
+            for (uint32_t way = 0; way < assoc; way++) {
+                if (line_state(set[way]) != 0) {
+                    return way;
+                }
+            }
+            for (uint32_t way = 0; way < assoc; way++) {
+                set[way] = with_line_state(set[way], 1);
+            }
+            return 0;
         } else {
-            size_t i = 0;
-            do {
-                std::swap(lru_stats_.at(i), next_way);
-                i++;
-            } while (next_way != way);
+            // Age every way by as much as it takes the oldest to reach RRPV_MAX.
+            uint64_t oldest = 0;
+            for (uint32_t way = 0; way < assoc; way++) {
+                oldest = std::max(oldest, line_state(set[way]));
+            }
+            uint32_t victim = 0;
+            for (uint32_t way = assoc; way-- > 0;) {
+                set[way] += (RRPV_MAX - oldest) << TAG_BITS;
+                victim = line_state(set[way]) == RRPV_MAX ? way : victim;
+            }
+            return victim;
         }
-    } catch (std::out_of_range &e) {
-        std::cerr << e.what() << std::endl;
     }
 }
 
-CacheSet::CacheLine& CacheSet::cache_line(uint32_t assoc) {
-    return cache_lines_[assoc];
+template <ReplacementPolicy POLICY>
+void Cache::touch(uint64_t *set, uint32_t assoc, uint32_t set_index, uint32_t way, bool hit) {
+    if constexpr (POLICY == ReplacementPolicy::LRU) {
+        // The accessed way becomes the most recently used, the ones used after it age by one.
+        kernels_->age_below(set, assoc, set[way] & RANK_MASK);
+        set[way] &= ~RANK_MASK;
+    } else if constexpr (POLICY == ReplacementPolicy::PLRU) {
+        // Every node on the path to the way points to the other half.
+        uint32_t node = way + std::bit_ceil(assoc) - 1;
+        while (node > 0) {
+            uint32_t parent = (node - 1) / 2;
+            set_plru_node(set, assoc, parent, node == 2 * parent + 1);
+            node = parent;
+        }
+    } else if constexpr (POLICY == ReplacementPolicy::NRU) {
+        set[way] = with_line_state(set[way], 0);
+    } else if constexpr (POLICY == ReplacementPolicy::MIN) {
+        set[set_block_words_ + way] = next_use_->next_use();
+    } else {
+        uint64_t rrpv = 0;
+        if (!hit) {
+            auto fill_policy = POLICY;
+            if constexpr (POLICY == ReplacementPolicy::DRRIP) {
+                // Misses of the leaders move the selector away from their policy.
+                fill_policy = duel_role(set_index);
+                if (fill_policy == ReplacementPolicy::SRRIP && psel_ < (1u << PSEL_BITS) - 1) {
+                    psel_++;
+                } else if (fill_policy == ReplacementPolicy::BRRIP && psel_ > 0) {
+                    psel_--;
+                } else if (fill_policy == ReplacementPolicy::DRRIP) {
+                    fill_policy = psel_ >= (1u << (PSEL_BITS - 1)) ? ReplacementPolicy::BRRIP : ReplacementPolicy::SRRIP;
+                }
+            }
+            rrpv = RRPV_MAX - 1;
+            if (fill_policy == ReplacementPolicy::BRRIP && ++brrip_fills_ % BRRIP_FILL_PERIOD != 0) {
+                rrpv = RRPV_MAX;
+            }
+        }
+        set[way] = with_line_state(set[way], rrpv);
+    }
 }
 
-bool Cache::exists(uintptr_t addr) {
-    for (auto& cache_set: cache_) {
-        for (size_t a = 0; a < cache_set.associativity(); a++) {
-            if (cache_set.cache_line(a).addr == addr) {
+bool Cache::exists(uintptr_t addr) const {
+    LocationInfo loc = location(addr);
+    if (loc.set_index >= sets()) {
+        return false;
+    }
+    if (organization_ != CacheOrganization::SET_ASSOCIATIVE) {
+        const uint64_t key = (loc.tag * sets_ + loc.set_index) & TAG_MASK;
+        for (uint32_t way = 0; way < assoc_; way++) {
+            if (lines_[skew_row(key, way) * assoc_ + way] == (VALID_BIT | key)) {
                 return true;
             }
         }
+        return false;
     }
+    const uint64_t *set = lines(loc.set_index);
+    return kernels_->find_line(set, assoc_, VALID_BIT | (loc.tag & TAG_MASK)) != assoc_;
+}
 
-    return false;
+void Cache::set_next_use(std::shared_ptr<const NextUseReader> next_use) {
+    next_use_ = std::move(next_use);
+}
+
+const uint64_t *Cache::lines(uint32_t set) const noexcept {
+    if (set_pages_.empty()) {
+        return lines_.data() + (size_t) set * assoc_;
+    }
+    const uint64_t *block = set_block(set);
+    if (block == nullptr) {
+        return initial_set_.data();
+    }
+    return block + (size_t) (set & ((1u << set_block_bits_) - 1)) * assoc_;
+}
+
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+uint64_t Cache::line_addr(uint32_t set, uint32_t way) const noexcept {
+    if (set_pages_.empty()) {
+        return addrs_[(size_t) set * assoc_ + way];
+    }
+    if (set_block(set) == nullptr) {
+        return 0;
+    }
+    return lines(set)[(policy_ == ReplacementPolicy::MIN ? 2 : 1) * set_block_words_ + way];
 }
+#endif
 
 bool Cache::access(uint32_t client_id, uintptr_t addr) {
     return access(addr);
 }
 
-uint32_t Cache::misses(uint32_t client_id) const noexcept {
+uint64_t Cache::misses(uint32_t client_id) const noexcept {
     return misses();
 }
@@ -1,65 +1,52 @@
 #pragma once
 
+#include <bit>
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
 #include <vector>
 
-constexpr uint32_t ADDRESS_SIZE = sizeof(uintptr_t) * 8;
+#include "cache_organization.hpp"
+#include "replacement_policy.hpp"
+#include "tag_store.hpp"
 
-enum class CacheLineState {
-    VALID,
-    INVALID
-};
+struct CacheKernels;
+class NextUseReader;
+
+constexpr uint32_t ADDRESS_SIZE = sizeof(uintptr_t) * 8;
 
 struct LocationInfo {
     uint32_t set_index;
     uint64_t tag;
 };
 
-class CacheSet {
-public:
-    explicit CacheSet(uint32_t assoc);
-
-    struct CacheLine {
-        CacheLineState state;
-        uint32_t tag;
-        uint64_t addr; // For debug.
-
-        explicit CacheLine() : state(CacheLineState::INVALID), tag(0), addr(0) {}
-    };
-
-    uint32_t associativity() const noexcept;
-    uint32_t evict();
-    void update_lru(uint32_t way, bool is_valid);
-    CacheLine& cache_line(uint32_t way);
-private:
-    uint32_t assoc_;
-    std::vector<uint32_t> lru_stats_;
-    std::vector<CacheLine> cache_lines_;
-};
-
 class Cache {
 public:
     Cache() = default;
     // cache_size and block_size in bytes.
-    Cache(uint64_t cache_size, uint32_t sets, uint32_t assoc, uint32_t block_size);
-    Cache(uint64_t cache_size, uint32_t assoc, uint32_t block_size);
+    Cache(uint64_t cache_size, uint32_t sets, uint32_t assoc, uint32_t block_size,
+          ReplacementPolicy policy = ReplacementPolicy::LRU,
+          CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
+    Cache(uint64_t cache_size, uint32_t assoc, uint32_t block_size,
+          ReplacementPolicy policy = ReplacementPolicy::LRU,
+          CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     // Creates a bitmask consisting of ones, of size `bits`.
     // For example, if bits == 2, returns 0b11.
-    static uint32_t mask(uint32_t bits) {
-        int result = 0;
-        for (size_t i = 0; i < bits; i++) {
-            result = (result << 1) | 0x1;
-        }
-        return result;
+    static constexpr uint64_t mask(uint32_t bits) {
+        return bits >= 64 ? ~0ull : (1ull << bits) - 1;
+    }
+
+    // floor(log2(x)), for x > 0.
+    static constexpr uint32_t log2(uint64_t x) {
+        return std::bit_width(x) - 1;
     }
 
     // Extracts location information from the address, using masking.
     static LocationInfo compute_location_info(uintptr_t addr, uint32_t block_size, uint32_t sets, uint32_t tag_bits) {
-        auto block_bits = (uint32_t) std::log2(block_size);
-        auto set_bits = (uint32_t) std::log2(sets);
+        auto block_bits = log2(block_size);
+        auto set_bits = log2(sets);
 
         return {
                 .set_index = static_cast<uint32_t>((addr >> block_bits) & mask(set_bits)),
@@ -71,34 +58,224 @@ public:
         return (x & (x - 1)) == 0;
     }
 
-    // Used for debugging.
-    bool exists(uintptr_t addr);
+    // Whether the line holding `addr` is cached. Used for debugging.
+    bool exists(uintptr_t addr) const;
     bool access(uintptr_t addr);
 
     // Used only for API uniformity with other caches
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const noexcept;
+    uint64_t misses(uint32_t client_id) const noexcept;
 
     // Returns if its a hit or not.
     bool access(const LocationInfo& loc, uintptr_t addr);
+    // Location of `addr` in this cache, same as compute_location_info().
+    LocationInfo location(uintptr_t addr) const noexcept;
     uint64_t cache_size() const noexcept;
     uint32_t sets() const noexcept;
     uint32_t assoc() const;
     uint32_t block_size() const noexcept;
     uint32_t tag_bits() const noexcept;
-    uint32_t misses() const noexcept;
-    uint32_t hits() const noexcept;
+    uint32_t block_bits() const noexcept;
+    uint32_t set_bits() const noexcept;
+    ReplacementPolicy policy() const noexcept;
+    // Under the skewed organizations, sets() is the number of rows of each way.
+    CacheOrganization organization() const noexcept;
+    uint64_t misses() const noexcept;
+    uint64_t hits() const noexcept;
     void update_hits() noexcept;
+    // Counts `n` hits that did not go through access(), see CollapsingTraceReader.
+    void add_hits(uint32_t n) noexcept;
     void update_misses() noexcept;
+    // Zeroes the hit and miss counters.
+    void reset_stats() noexcept;
+    // While disabled, accesses still update the cache contents but not the counters, e.g. to warm
+    // the cache outside a region of interest.
+    void set_stats_enabled(bool enabled) noexcept;
+
+    /*
+     * Every line is one word: the tag in the low TAG_BITS bits, the replacement state above it and
+     * the valid bit on top. Under LRU the state is a rank: 0 is the most recently used way and
+     * assoc - 1 the next victim, and the ranks of a set are always a permutation of
+     * 0 .. assoc - 1, so the replacement order is kept even for invalid lines. The other policies
+     * are in replacement_policy.hpp. Tags are truncated to TAG_BITS bits, more than any physical
+     * address needs. In the skewed organizations the row does not tell the set, so the tag is the
+     * whole block number and the state is elsewhere, see cache_organization.hpp.
+     */
+    static constexpr uint32_t TAG_BITS = 48;
+    static constexpr uint32_t RANK_BITS = 15;
+    static constexpr uint64_t TAG_MASK = (1ull << TAG_BITS) - 1;
+    static constexpr uint64_t RANK_ONE = 1ull << TAG_BITS;
+    static constexpr uint64_t RANK_MASK = ((1ull << RANK_BITS) - 1) << TAG_BITS;
+    static constexpr uint64_t VALID_BIT = 1ull << 63;
+    // Largest associativity, except under indexed LRU.
+    static constexpr uint32_t MAX_ASSOC = 1u << RANK_BITS;
+    // From this associativity up, LRU keeps no ranks: the lines of each set are in a recency
+    // list and found through a hash index, so an access costs the same at any associativity, even
+    // a fully associative cache (a single set). The ranks stay 0.
+    static constexpr uint32_t INDEXED_LRU_ASSOC = 64;
+    // Lines a zcache miss chooses the victim from, as in the Z4/52 design of the paper.
+    static constexpr uint32_t ZCACHE_CANDIDATES = 52;
+    // Largest RRPV of the RRIP policies, and the BRRIP fills per fill at RRPV_MAX - 1.
+    static constexpr uint64_t RRPV_MAX = 3;
+    static constexpr uint32_t BRRIP_FILL_PERIOD = 32;
+    // DRRIP: one set of each leader kind per DUEL_PERIOD sets, and the bits of the counter.
+    static constexpr uint32_t DUEL_PERIOD = 32;
+    static constexpr uint32_t PSEL_BITS = 10;
+
+    // Under ReplacementPolicy::MIN, the stream of next uses of the accesses to this cache. Whoever
+    // feeds the cache advances it before each access, see MultiLevelCache. Caches without it
+    // throw std::runtime_error on their first access under MIN.
+    void set_next_use(std::shared_ptr<const NextUseReader> next_use);
+    // Whether the cache uses indexed LRU, see INDEXED_LRU_ASSOC.
+    bool indexed_lru() const noexcept;
+    // Sets holding memory. Set-associative caches other than indexed LRU ones allocate their sets
+    // on first touch, in blocks of up to SET_BLOCK_SETS sets found through pages of up to
+    // SET_PAGE_BLOCKS blocks, so that memory follows the blocks the trace touches rather than the
+    // size of the cache. That makes caches far larger than a clustered footprint cheap, not a
+    // scattered one: a footprint touching every block costs as much as the whole cache. Indexed
+    // LRU caches (see INDEXED_LRU_ASSOC) and the skewed organizations hold all their sets.
+    uint64_t allocated_sets() const noexcept;
+    // Bytes of the allocated set blocks and of their pages, or of all the sets. A block is
+    // SET_BLOCK_SETS * assoc() * 8 bytes per array: the line words, their next uses under MIN and
+    // their addresses in ASGARD_CACHE_DEBUG_ADDR builds. A page is SET_PAGE_BLOCKS * 4 bytes.
+    uint64_t allocated_bytes() const noexcept;
+    static constexpr uint32_t SET_BLOCK_SETS = 16;
+    static constexpr uint32_t SET_PAGE_BLOCKS = 256;
+    // Where those caches keep their set blocks, e.g. in a file for caches larger than the memory
+    // of the host. Throws std::invalid_argument for the other caches and std::logic_error once the
+    // cache was accessed.
+    void set_tag_store(const TagStoreOptions& options);
+    const TagStore& tag_store() const noexcept;
+
+    // The `assoc()` line words of `set`, also of the sets not allocated yet.
+    const uint64_t *lines(uint32_t set) const noexcept;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    // Address of the access that brought in the line at `way` of `set`.
+    uint64_t line_addr(uint32_t set, uint32_t way) const noexcept;
+#endif
 private:
-    std::vector<CacheSet> cache_;
+    // Of the caches that hold all their sets: sets() * assoc() line words, set after set.
+    std::vector<uint64_t> lines_;
+    // Of the others, the pages of set blocks, both empty until the first access to one of their
+    // sets. Pages hold one plus the number of each block in `set_blocks_`, 0 if not allocated. A
+    // block holds the line words of its sets, set after set, then under MIN their next uses (and
+    // the addresses of the lines in debug builds).
+    std::vector<std::vector<uint32_t>> set_pages_;
+    TagStore set_blocks_;
+    uint32_t set_block_bits_;
+    uint32_t set_page_bits_;
+    size_t set_block_words_;
+    // Line words of a set that was never accessed.
+    std::vector<uint64_t> initial_set_;
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    std::vector<uint64_t> addrs_;
+#endif
+    uint32_t sets_;
+    uint32_t assoc_;
+    // Set scans, see cache_kernels.hpp.
+    const CacheKernels *kernels_;
+    // The address split, computed once.
+    uint32_t block_bits_;
+    uint32_t set_bits_;
+    uint64_t set_mask_;
+    uint64_t tag_mask_;
     // Actual size of the cache.
     uint64_t cache_size_;
     // Block bytes in bytes.
     uint32_t block_size_;
     // Tag bits.
     uint32_t tag_bits_;
-    uint32_t misses_, hits_;
+    uint64_t misses_, hits_;
+    bool stats_enabled_ = true;
+
+    ReplacementPolicy policy_;
+    // BRRIP fills so far, for the bimodal fill.
+    uint32_t brrip_fills_;
+    // DRRIP policy selector: SRRIP leader misses count up, BRRIP leader misses down. The other
+    // sets follow BRRIP from half the range up.
+    uint32_t psel_;
+    // MIN: next use of every line of the skewed organizations (the set blocks hold the others),
+    // and where the ones of the accesses come from.
+    std::vector<uint64_t> next_uses_;
+    std::shared_ptr<const NextUseReader> next_use_;
+
+    // Indexed LRU: per set, a circular list of its lines from the most recently used one,
+    // `lru_head_`, so the victim is the previous one of the head. Lines are numbered
+    // set * assoc + way. `line_index_` finds the valid lines by set and tag, with linear probing,
+    // at most half full.
+    static constexpr uint32_t NO_LINE = UINT32_MAX;
+    struct LruLinks {
+        uint32_t next;
+        uint32_t prev;
+    };
+    std::vector<uint32_t> lru_head_;
+    std::vector<LruLinks> lru_links_;
+    std::vector<uint32_t> line_index_;
+    uint32_t line_index_shift_;
+
+    CacheOrganization organization_;
+    // Skewed organizations: the odd multiplier of the hash of each way, the time of the last
+    // access of every line under LRU, and the candidates of the last miss: the rows of the block,
+    // then in a zcache the lines reached from them, each with the candidate it was reached from.
+    struct ZcacheCandidate {
+        uint32_t line;
+        uint32_t way;
+        uint32_t parent;
+    };
+    std::vector<uint64_t> skew_multipliers_;
+    std::vector<uint64_t> last_uses_;
+    uint64_t clock_;
+    std::vector<ZcacheCandidate> walk_;
+
+    /*
+     * access(addr) goes through `access_`, an instance of access_specialized() for the replacement
+     * policy and, when the block size and associativity are among the common ones, for them too, so
+     * the address split and the set offset are shifts by constants. ASSOC == 0 is the generic
+     * version, for any geometry.
+     */
+    using AccessFunction = bool (*)(Cache& cache, uintptr_t addr);
+    AccessFunction access_;
+
+    template <uint32_t BLOCK_BITS, uint32_t ASSOC, ReplacementPolicy POLICY>
+    static bool access_specialized(Cache& cache, uintptr_t addr);
+    template <ReplacementPolicy POLICY>
+    AccessFunction select_access() const;
+    template <uint32_t BLOCK_BITS, ReplacementPolicy POLICY, uint32_t... ASSOCS>
+    static AccessFunction specialized_access(uint32_t assoc);
+    template <uint32_t ASSOC, ReplacementPolicy POLICY>
+    bool access_set(uint32_t set_index, uint64_t tag, uintptr_t addr);
+    // Line words of `set_index` in its set block, allocating the block on the first access.
+    uint64_t *set_lines(uint32_t set_index);
+    uint64_t *allocate_set_block(uint32_t set_index);
+    // Arrays of SET_BLOCK_SETS * assoc() words in a set block.
+    size_t set_block_arrays() const noexcept;
+    // The set block of `set_index`, nullptr if not allocated.
+    const uint64_t *set_block(uint32_t set_index) const noexcept;
+    // Way to fill on a miss in `set`.
+    template <ReplacementPolicy POLICY>
+    uint32_t victim(uint64_t *set, uint32_t assoc);
+    // Updates the replacement state of `set` after an access to `way`.
+    template <ReplacementPolicy POLICY>
+    void touch(uint64_t *set, uint32_t assoc, uint32_t set_index, uint32_t way, bool hit);
+    static bool access_indexed(Cache& cache, uintptr_t addr);
+    bool access_indexed_set(uint32_t set_index, uint64_t tag, uintptr_t addr);
+    // Slot of `line_index_` where the probe for a line word of `set_index` starts.
+    size_t line_index_home(uint32_t set_index, uint64_t line) const noexcept;
+    void remove_from_index(uint32_t line_number) noexcept;
+    static bool access_skewed(Cache& cache, uintptr_t addr);
+    bool access_skewed_set(uint32_t set_index, uint64_t tag, uintptr_t addr);
+    // Row of the block `key` in `way`.
+    uint32_t skew_row(uint64_t key, uint32_t way) const noexcept;
+    // Of a line of a skewed cache, higher for the better victims. Invalid lines come first.
+    uint64_t eviction_order(uint32_t line_number) const noexcept;
+    void touch_skewed(uint32_t line_number);
+    // On a zcache miss, with the rows of the block in `walk_`, frees the best line reachable by
+    // relocations and returns where the block goes.
+    uint32_t zcache_make_room();
+    // Under DRRIP, the policy of the leader sets: SRRIP, BRRIP, or DRRIP for the followers.
+    ReplacementPolicy duel_role(uint32_t set_index) const noexcept;
 
     uint32_t compute_sets(uint32_t assoc) const;
+    void allocate_lines(uint32_t sets, uint32_t assoc);
+    void set_geometry(uint32_t sets, uint32_t block_size);
 };
@@ -0,0 +1,215 @@
+#include "cache_kernels.hpp"
+
+#include <stdexcept>
+
+#include "cache.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ASGARD_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static uint32_t find_line_scalar(const uint64_t *set, uint32_t assoc, uint64_t line) {
+    for (uint32_t i = 0; i < assoc; i++) {
+        if ((set[i] & ~Cache::RANK_MASK) == line) {
+            return i;
+        }
+    }
+    return assoc;
+}
+
+static uint32_t find_rank_scalar(const uint64_t *set, uint32_t assoc, uint64_t rank) {
+    for (uint32_t i = 0; i < assoc; i++) {
+        if ((set[i] & Cache::RANK_MASK) == rank) {
+            return i;
+        }
+    }
+    return assoc;
+}
+
+static void age_below_scalar(uint64_t *set, uint32_t assoc, uint64_t rank) {
+    for (uint32_t i = 0; i < assoc; i++) {
+        set[i] += (set[i] & Cache::RANK_MASK) < rank ? Cache::RANK_ONE : 0;
+    }
+}
+
+static const CacheKernels scalar_kernels = {"scalar", find_line_scalar, find_rank_scalar, age_below_scalar};
+
+#ifdef ASGARD_X86_KERNELS
+
+// Each kernel handles as many whole vectors as fit in the set and leaves the rest of the ways to
+// the scalar loop.
+
+__attribute__((target("sse2")))
+static uint32_t find_matching_sse2(const uint64_t *set, uint32_t assoc, uint64_t value, uint64_t mask) {
+    const __m128i values = _mm_set1_epi64x((long long) value);
+    const __m128i masks = _mm_set1_epi64x((long long) mask);
+    uint32_t i = 0;
+    for (; i + 2 <= assoc; i += 2) {
+        __m128i words = _mm_and_si128(_mm_loadu_si128((const __m128i *) (set + i)), masks);
+        // SSE2 has no 64-bit compare, both halves have to match.
+        __m128i equal = _mm_cmpeq_epi32(words, values);
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        int found = _mm_movemask_pd(_mm_castsi128_pd(equal));
+        if (found != 0) {
+            return i + __builtin_ctz(found);
+        }
+    }
+    for (; i < assoc; i++) {
+        if ((set[i] & mask) == value) {
+            return i;
+        }
+    }
+    return assoc;
+}
+
+__attribute__((target("sse2")))
+static uint32_t find_line_sse2(const uint64_t *set, uint32_t assoc, uint64_t line) {
+    return find_matching_sse2(set, assoc, line, ~Cache::RANK_MASK);
+}
+
+__attribute__((target("sse2")))
+static uint32_t find_rank_sse2(const uint64_t *set, uint32_t assoc, uint64_t rank) {
+    return find_matching_sse2(set, assoc, rank, Cache::RANK_MASK);
+}
+
+__attribute__((target("sse2")))
+static void age_below_sse2(uint64_t *set, uint32_t assoc, uint64_t rank) {
+    // Ranks are below bit 63, so they compare right as the signed high half of each word.
+    const __m128i ranks = _mm_set1_epi64x((long long) rank);
+    const __m128i rank_mask = _mm_set1_epi64x((long long) Cache::RANK_MASK);
+    const __m128i one = _mm_set1_epi64x((long long) Cache::RANK_ONE);
+    uint32_t i = 0;
+    for (; i + 2 <= assoc; i += 2) {
+        __m128i words = _mm_loadu_si128((const __m128i *) (set + i));
+        __m128i lower = _mm_cmplt_epi32(_mm_and_si128(words, rank_mask), ranks);
+        lower = _mm_shuffle_epi32(lower, _MM_SHUFFLE(3, 3, 1, 1));
+        _mm_storeu_si128((__m128i *) (set + i), _mm_add_epi64(words, _mm_and_si128(lower, one)));
+    }
+    age_below_scalar(set + i, assoc - i, rank);
+}
+
+static const CacheKernels sse2_kernels = {"sse2", find_line_sse2, find_rank_sse2, age_below_sse2};
+
+__attribute__((target("avx2")))
+static uint32_t find_matching_avx2(const uint64_t *set, uint32_t assoc, uint64_t value, uint64_t mask) {
+    const __m256i values = _mm256_set1_epi64x((long long) value);
+    const __m256i masks = _mm256_set1_epi64x((long long) mask);
+    uint32_t i = 0;
+    for (; i + 4 <= assoc; i += 4) {
+        __m256i words = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (set + i)), masks);
+        int found = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(words, values)));
+        if (found != 0) {
+            return i + __builtin_ctz(found);
+        }
+    }
+    for (; i < assoc; i++) {
+        if ((set[i] & mask) == value) {
+            return i;
+        }
+    }
+    return assoc;
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_line_avx2(const uint64_t *set, uint32_t assoc, uint64_t line) {
+    return find_matching_avx2(set, assoc, line, ~Cache::RANK_MASK);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_rank_avx2(const uint64_t *set, uint32_t assoc, uint64_t rank) {
+    return find_matching_avx2(set, assoc, rank, Cache::RANK_MASK);
+}
+
+__attribute__((target("avx2")))
+static void age_below_avx2(uint64_t *set, uint32_t assoc, uint64_t rank) {
+    const __m256i ranks = _mm256_set1_epi64x((long long) rank);
+    const __m256i rank_mask = _mm256_set1_epi64x((long long) Cache::RANK_MASK);
+    const __m256i one = _mm256_set1_epi64x((long long) Cache::RANK_ONE);
+    uint32_t i = 0;
+    for (; i + 4 <= assoc; i += 4) {
+        __m256i words = _mm256_loadu_si256((const __m256i *) (set + i));
+        __m256i lower = _mm256_cmpgt_epi64(ranks, _mm256_and_si256(words, rank_mask));
+        _mm256_storeu_si256((__m256i *) (set + i), _mm256_add_epi64(words, _mm256_and_si256(lower, one)));
+    }
+    age_below_scalar(set + i, assoc - i, rank);
+}
+
+static const CacheKernels avx2_kernels = {"avx2", find_line_avx2, find_rank_avx2, age_below_avx2};
+
+// With masked loads and stores the last, partial vector needs no scalar loop.
+__attribute__((target("avx512f")))
+static uint32_t find_matching_avx512(const uint64_t *set, uint32_t assoc, uint64_t value, uint64_t mask) {
+    const __m512i values = _mm512_set1_epi64((long long) value);
+    const __m512i masks = _mm512_set1_epi64((long long) mask);
+    for (uint32_t i = 0; i < assoc; i += 8) {
+        __mmask8 ways = assoc - i >= 8 ? 0xff : (__mmask8) ((1u << (assoc - i)) - 1);
+        __m512i words = _mm512_maskz_loadu_epi64(ways, set + i);
+        __mmask8 found = _mm512_mask_cmpeq_epi64_mask(ways, _mm512_and_si512(words, masks), values);
+        if (found != 0) {
+            return i + __builtin_ctz(found);
+        }
+    }
+    return assoc;
+}
+
+__attribute__((target("avx512f")))
+static uint32_t find_line_avx512(const uint64_t *set, uint32_t assoc, uint64_t line) {
+    return find_matching_avx512(set, assoc, line, ~Cache::RANK_MASK);
+}
+
+__attribute__((target("avx512f")))
+static uint32_t find_rank_avx512(const uint64_t *set, uint32_t assoc, uint64_t rank) {
+    return find_matching_avx512(set, assoc, rank, Cache::RANK_MASK);
+}
+
+__attribute__((target("avx512f")))
+static void age_below_avx512(uint64_t *set, uint32_t assoc, uint64_t rank) {
+    const __m512i ranks = _mm512_set1_epi64((long long) rank);
+    const __m512i rank_mask = _mm512_set1_epi64((long long) Cache::RANK_MASK);
+    const __m512i one = _mm512_set1_epi64((long long) Cache::RANK_ONE);
+    for (uint32_t i = 0; i < assoc; i += 8) {
+        __mmask8 ways = assoc - i >= 8 ? 0xff : (__mmask8) ((1u << (assoc - i)) - 1);
+        __m512i words = _mm512_maskz_loadu_epi64(ways, set + i);
+        __mmask8 lower = _mm512_mask_cmplt_epu64_mask(ways, _mm512_and_si512(words, rank_mask), ranks);
+        _mm512_mask_storeu_epi64(set + i, lower, _mm512_add_epi64(words, one));
+    }
+}
+
+static const CacheKernels avx512_kernels = {"avx512", find_line_avx512, find_rank_avx512, age_below_avx512};
+
+#endif
+
+std::vector<const CacheKernels*> available_cache_kernels() {
+    std::vector<const CacheKernels*> kernels = {&scalar_kernels};
+#ifdef ASGARD_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.push_back(&sse2_kernels);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&avx2_kernels);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(&avx512_kernels);
+    }
+#endif
+    return kernels;
+}
+
+static const CacheKernels *selected_kernels = nullptr;
+
+const CacheKernels& cache_kernels() {
+    static const CacheKernels *widest = available_cache_kernels().back();
+    return selected_kernels != nullptr ? *selected_kernels : *widest;
+}
+
+void select_cache_kernels(const std::string& name) {
+    for (const auto *kernels: available_cache_kernels()) {
+        if (kernels->name == name) {
+            selected_kernels = kernels;
+            return;
+        }
+    }
+    throw std::invalid_argument("Cache kernels '" + name + "' are unknown or not supported by this CPU");
+}
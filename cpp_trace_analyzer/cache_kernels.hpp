@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Kernels over the packed line words of a cache set (see Cache). Besides the scalar reference,
+ * x86-64 builds have SSE2, AVX2 and AVX-512 versions compiled for their instruction set only; the
+ * widest one the CPU supports is selected the first time a cache is built, unless
+ * select_cache_kernels() picked one before.
+ */
+struct CacheKernels {
+    const char *name;
+    // Way whose word equals `line` once its rank bits are cleared, `assoc` if none does.
+    uint32_t (*find_line)(const uint64_t *set, uint32_t assoc, uint64_t line);
+    // Way whose rank bits equal `rank`, `assoc` if none does.
+    uint32_t (*find_rank)(const uint64_t *set, uint32_t assoc, uint64_t rank);
+    // Adds one to the ranks lower than `rank`.
+    void (*age_below)(uint64_t *set, uint32_t assoc, uint64_t rank);
+};
+
+// The kernels this CPU can run, scalar first and widest last.
+std::vector<const CacheKernels*> available_cache_kernels();
+// Kernels used by the caches built from now on.
+const CacheKernels& cache_kernels();
+// Selects the kernels by name ("scalar", "sse2", "avx2" or "avx512"). Throws std::invalid_argument
+// if they are unknown or this CPU can not run them.
+void select_cache_kernels(const std::string& name);
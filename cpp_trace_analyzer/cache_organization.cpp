@@ -0,0 +1,19 @@
+#include "cache_organization.hpp"
+
+#include <iterator>
+#include <stdexcept>
+
+static const char *const organization_names[] = {"set", "skewed", "zcache"};
+
+CacheOrganization parse_cache_organization(const std::string& name) {
+    for (size_t i = 0; i < std::size(organization_names); i++) {
+        if (name == organization_names[i]) {
+            return static_cast<CacheOrganization>(i);
+        }
+    }
+    throw std::invalid_argument("Unknown cache organization '" + name + "'");
+}
+
+const char *cache_organization_name(CacheOrganization organization) {
+    return organization_names[static_cast<size_t>(organization)];
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+/*
+ * How Cache places the lines of a block:
+ *
+ *   SET_ASSOCIATIVE  in any way of the set given by the address bits.
+ *   SKEWED           in one row per way, each way hashing the block differently, so blocks that
+ *                    conflict in one way rarely do in the others (Seznec, ISCA 1993).
+ *   ZCACHE           skewed, but a miss also considers the lines that the first candidates could
+ *                    move to in their other ways, and the lines those could move to, up to
+ *                    ZCACHE_CANDIDATES. The victim's line is replaced and the lines on the way to
+ *                    it are relocated (Sanchez and Kozyrakis, MICRO 2010).
+ *
+ * The skewed organizations replace by LRU, kept as the time of the last access of each line, or
+ * by MIN.
+ */
+enum class CacheOrganization {
+    SET_ASSOCIATIVE,
+    SKEWED,
+    ZCACHE
+};
+
+// Parses "set", "skewed" or "zcache". Throws std::invalid_argument otherwise.
+CacheOrganization parse_cache_organization(const std::string& name);
+const char *cache_organization_name(CacheOrganization organization);
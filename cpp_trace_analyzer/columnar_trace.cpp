@@ -0,0 +1,436 @@
+#include "columnar_trace.hpp"
+#include "block_compression.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+static constexpr size_t MAX_CPUS = 256;
+
+static size_t type_column_bytes(uint32_t n) {
+    return (n + 3) / 4;
+}
+
+void encode_columnar_block(const TraceRecord *records, uint32_t n, ColumnarBlockHeader& header, std::vector<uint8_t>& out) {
+    out.clear();
+
+    header.num_records = n;
+    header.flags = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (records[i].timestamp != 0) {
+            header.flags |= ColumnarBlockHeader::HAS_TIMESTAMPS;
+            break;
+        }
+    }
+
+    // vCPU column.
+    for (uint32_t i = 0; i < n; i++) {
+        out.push_back(records[i].cpu_index);
+    }
+
+    // Type column, four 2-bit types per byte.
+    size_t type_start = out.size();
+    out.resize(type_start + type_column_bytes(n), 0);
+    for (uint32_t i = 0; i < n; i++) {
+        out[type_start + i / 4] |= (static_cast<uint8_t>(records[i].type) & 0x3) << ((i % 4) * 2);
+    }
+
+    // Address column, deltas against the previous address of the same vCPU.
+    size_t addr_start = out.size();
+    uint64_t last_addr[MAX_CPUS] = {};
+    for (uint32_t i = 0; i < n; i++) {
+        auto& last = last_addr[records[i].cpu_index];
+        varint_encode(zigzag_encode(static_cast<int64_t>(records[i].addr - last)), out);
+        last = records[i].addr;
+    }
+    header.addr_bytes = out.size() - addr_start;
+
+    // Timestamp column, deltas against the previous record.
+    size_t timestamp_start = out.size();
+    if (header.flags & ColumnarBlockHeader::HAS_TIMESTAMPS) {
+        uint64_t last_timestamp = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            varint_encode(zigzag_encode(static_cast<int64_t>(records[i].timestamp - last_timestamp)), out);
+            last_timestamp = records[i].timestamp;
+        }
+    }
+    header.timestamp_bytes = out.size() - timestamp_start;
+}
+
+void decode_columnar_block(const ColumnarBlockHeader& header, const uint8_t *payload, size_t payload_size, std::vector<TraceRecord>& records) {
+    uint32_t n = header.num_records;
+    size_t types_offset = n;
+    size_t addr_offset = types_offset + type_column_bytes(n);
+    size_t timestamp_offset = addr_offset + header.addr_bytes;
+    if (timestamp_offset + header.timestamp_bytes != payload_size) {
+        throw std::runtime_error("Corrupt columnar trace block (inconsistent column sizes)");
+    }
+
+    records.resize(n);
+
+    for (uint32_t i = 0; i < n; i++) {
+        records[i].cpu_index = payload[i];
+        records[i].type = static_cast<AccessType>((payload[types_offset + i / 4] >> ((i % 4) * 2)) & 0x3);
+    }
+
+    uint64_t last_addr[MAX_CPUS] = {};
+    const uint8_t *p = payload + addr_offset;
+    const uint8_t *end = p + header.addr_bytes;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t v;
+        p = varint_decode(p, end, v);
+        if (p == nullptr) {
+            throw std::runtime_error("Corrupt columnar trace block (truncated address column)");
+        }
+        auto& last = last_addr[records[i].cpu_index];
+        last += static_cast<uint64_t>(zigzag_decode(v));
+        records[i].addr = last;
+    }
+
+    if (header.flags & ColumnarBlockHeader::HAS_TIMESTAMPS) {
+        uint64_t last_timestamp = 0;
+        p = payload + timestamp_offset;
+        end = p + header.timestamp_bytes;
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t v;
+            p = varint_decode(p, end, v);
+            if (p == nullptr) {
+                throw std::runtime_error("Corrupt columnar trace block (truncated timestamp column)");
+            }
+            last_timestamp += static_cast<uint64_t>(zigzag_decode(v));
+            records[i].timestamp = last_timestamp;
+        }
+    } else {
+        for (uint32_t i = 0; i < n; i++) {
+            records[i].timestamp = 0;
+        }
+    }
+}
+
+ColumnarBlockSummary summarize_columnar_block(const TraceRecord *records, uint32_t n) {
+    ColumnarBlockSummary summary{};
+    summary.min_addr = UINT64_MAX;
+    for (uint32_t i = 0; i < n; i++) {
+        summary.min_addr = std::min(summary.min_addr, records[i].addr);
+        summary.max_addr = std::max(summary.max_addr, records[i].addr);
+        summary.core_mask[records[i].cpu_index / 64] |= 1ull << (records[i].cpu_index % 64);
+        summary.type_counts[static_cast<uint8_t>(records[i].type) & 0x3]++;
+    }
+    return summary;
+}
+
+ColumnarTraceWriter::ColumnarTraceWriter(const std::string& path, uint32_t block_records, bool compress_blocks)
+    : file_(path, std::ios::binary | std::ios::trunc), block_records_(block_records), compress_blocks_(compress_blocks),
+      offset_(0), num_records_(0), closed_(false) {
+    if (!file_.is_open()) {
+        throw std::runtime_error("Could not open '" + path + "' for writing");
+    }
+    if (block_records == 0) {
+        throw std::invalid_argument("Block size should be at least one record!");
+    }
+
+    ColumnarFileHeader header{};
+    std::memcpy(header.magic, COLUMNAR_TRACE_MAGIC, sizeof(header.magic));
+    header.version = COLUMNAR_TRACE_VERSION;
+    header.block_records = block_records;
+    file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    offset_ = sizeof(header);
+
+    pending_.reserve(block_records);
+}
+
+ColumnarTraceWriter::~ColumnarTraceWriter() {
+    try {
+        close();
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+void ColumnarTraceWriter::write(const TraceRecord *records, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        pending_.push_back(records[i]);
+        if (pending_.size() == block_records_) {
+            flush_block();
+        }
+    }
+}
+
+void ColumnarTraceWriter::flush_block() {
+    if (pending_.empty()) {
+        return;
+    }
+
+    ColumnarBlockHeader header{};
+    encode_columnar_block(pending_.data(), pending_.size(), header, encoded_);
+
+    index_.push_back(ColumnarBlockIndexEntry{
+            .offset = offset_,
+            .first_record = num_records_,
+            .first_timestamp = pending_.front().timestamp,
+            .last_timestamp = pending_.back().timestamp,
+            .num_records = header.num_records,
+            .reserved = 0
+    });
+
+    summaries_.push_back(summarize_columnar_block(pending_.data(), pending_.size()));
+
+    if (compress_blocks_) {
+        compressed_.resize(sizeof(uint32_t) + block_compress_bound(encoded_.size()));
+        auto compressed_size = static_cast<uint32_t>(compress_block(encoded_.data(), encoded_.size(), compressed_.data() + sizeof(uint32_t)));
+        if (sizeof(uint32_t) + compressed_size < encoded_.size()) {
+            std::memcpy(compressed_.data(), &compressed_size, sizeof(compressed_size));
+            compressed_.resize(sizeof(uint32_t) + compressed_size);
+            encoded_.swap(compressed_);
+            header.flags |= ColumnarBlockHeader::LZ_COMPRESSED;
+        }
+    }
+
+    file_.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file_.write(reinterpret_cast<const char *>(encoded_.data()), encoded_.size());
+    offset_ += sizeof(header) + encoded_.size();
+    num_records_ += pending_.size();
+    pending_.clear();
+}
+
+void ColumnarTraceWriter::close() {
+    if (closed_) {
+        return;
+    }
+    flush_block();
+
+    ColumnarBlockHeader end_of_blocks{};
+    file_.write(reinterpret_cast<const char *>(&end_of_blocks), sizeof(end_of_blocks));
+    offset_ += sizeof(end_of_blocks);
+
+    ColumnarFooter footer{};
+    footer.index_offset = offset_;
+    footer.num_blocks = index_.size();
+    footer.num_records = num_records_;
+    std::memcpy(footer.magic, COLUMNAR_FOOTER_MAGIC, sizeof(footer.magic));
+
+    file_.write(reinterpret_cast<const char *>(index_.data()), index_.size() * sizeof(ColumnarBlockIndexEntry));
+    file_.write(reinterpret_cast<const char *>(summaries_.data()), summaries_.size() * sizeof(ColumnarBlockSummary));
+    file_.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    offset_ += index_.size() * sizeof(ColumnarBlockIndexEntry) + summaries_.size() * sizeof(ColumnarBlockSummary) + sizeof(footer);
+
+    file_.close();
+    closed_ = true;
+    if (file_.fail()) {
+        throw std::runtime_error("Error while writing columnar trace");
+    }
+}
+
+uint64_t ColumnarTraceWriter::num_records() const noexcept {
+    return num_records_ + pending_.size();
+}
+
+uint64_t ColumnarTraceWriter::bytes_written() const noexcept {
+    return offset_;
+}
+
+ColumnarTraceReader::ColumnarTraceReader(const std::string& path)
+    : file_(path, std::ios::binary), block_pos_(0), finished_(false) {
+    if (!file_.is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+
+    ColumnarFileHeader header{};
+    if (!file_.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, COLUMNAR_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + path + "' is not a columnar trace");
+    }
+    if (header.version < COLUMNAR_TRACE_MIN_VERSION || header.version > COLUMNAR_TRACE_VERSION) {
+        throw std::runtime_error("Unsupported columnar trace version " + std::to_string(header.version));
+    }
+    block_records_ = header.block_records;
+}
+
+bool ColumnarTraceReader::load_next_block() {
+    if (finished_) {
+        return false;
+    }
+
+    ColumnarBlockHeader header{};
+    if (!read_columnar_block(file_, header, stored_)) {
+        finished_ = true;
+        return false;
+    }
+    decode_stored_columnar_block(header, stored_.data(), stored_.size(), payload_, block_);
+    block_pos_ = 0;
+    return true;
+}
+
+bool read_columnar_block(std::istream& file, ColumnarBlockHeader& header, std::vector<uint8_t>& stored) {
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        throw std::runtime_error("Truncated columnar trace (missing end of blocks marker)");
+    }
+    if (header.num_records == 0) {
+        return false;
+    }
+
+    size_t stored_size = header.num_records + type_column_bytes(header.num_records) +
+                         (size_t) header.addr_bytes + header.timestamp_bytes;
+    if (header.flags & ColumnarBlockHeader::LZ_COMPRESSED) {
+        uint32_t compressed_size;
+        if (!file.read(reinterpret_cast<char *>(&compressed_size), sizeof(compressed_size))) {
+            throw std::runtime_error("Truncated columnar trace block");
+        }
+        stored_size = compressed_size;
+    }
+    stored.resize(stored_size);
+    if (!file.read(reinterpret_cast<char *>(stored.data()), stored_size)) {
+        throw std::runtime_error("Truncated columnar trace block");
+    }
+    return true;
+}
+
+void decode_stored_columnar_block(const ColumnarBlockHeader& header, const uint8_t *stored, size_t stored_size,
+                                  std::vector<uint8_t>& payload, std::vector<TraceRecord>& records) {
+    if (!(header.flags & ColumnarBlockHeader::LZ_COMPRESSED)) {
+        decode_columnar_block(header, stored, stored_size, records);
+        return;
+    }
+    payload.resize(header.num_records + type_column_bytes(header.num_records) + (size_t) header.addr_bytes + header.timestamp_bytes);
+    decompress_block(stored, stored_size, payload.data(), payload.size());
+    decode_columnar_block(header, payload.data(), payload.size(), records);
+}
+
+std::unique_ptr<TraceReader> open_parallel_columnar_reader(const std::string& path, uint32_t threads) {
+    auto file = std::make_shared<std::ifstream>(path, std::ios::binary);
+    if (!file->is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+    ColumnarFileHeader header{};
+    if (!file->read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, COLUMNAR_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + path + "' is not a columnar trace");
+    }
+    if (header.version < COLUMNAR_TRACE_MIN_VERSION || header.version > COLUMNAR_TRACE_VERSION) {
+        throw std::runtime_error("Unsupported columnar trace version " + std::to_string(header.version));
+    }
+
+    // A raw block is the block header followed by the stored payload.
+    auto stored = std::make_shared<std::vector<uint8_t>>();
+    auto fetch = [file, stored](std::vector<uint8_t>& raw) {
+        ColumnarBlockHeader block_header{};
+        if (!read_columnar_block(*file, block_header, *stored)) {
+            return false;
+        }
+        raw.resize(sizeof(block_header) + stored->size());
+        std::memcpy(raw.data(), &block_header, sizeof(block_header));
+        std::memcpy(raw.data() + sizeof(block_header), stored->data(), stored->size());
+        return true;
+    };
+    auto decode = [](const std::vector<uint8_t>& raw, std::vector<TraceRecord>& records) {
+        ColumnarBlockHeader block_header{};
+        std::memcpy(&block_header, raw.data(), sizeof(block_header));
+        thread_local std::vector<uint8_t> payload;
+        decode_stored_columnar_block(block_header, raw.data() + sizeof(block_header), raw.size() - sizeof(block_header), payload, records);
+    };
+    return open_block_trace_reader(fetch, decode, threads);
+}
+
+size_t ColumnarTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records) {
+        if (block_pos_ == block_.size() && !load_next_block()) {
+            break;
+        }
+        size_t available = block_.size() - block_pos_;
+        size_t count = std::min(available, max_records - n);
+        std::memcpy(records + n, block_.data() + block_pos_, count * sizeof(TraceRecord));
+        block_pos_ += count;
+        n += count;
+    }
+    return n;
+}
+
+uint32_t ColumnarTraceReader::block_records() const noexcept {
+    return block_records_;
+}
+
+void ColumnarTraceReader::seek(uint64_t offset) {
+    file_.clear();
+    if (!file_.seekg(offset)) {
+        throw std::runtime_error("Could not seek to columnar block at " + std::to_string(offset));
+    }
+    block_.clear();
+    block_pos_ = 0;
+    finished_ = false;
+}
+
+static ColumnarFooter read_columnar_footer(std::ifstream& file, const std::string& path) {
+    file.seekg(0, std::ios::end);
+    auto size = static_cast<uint64_t>(file.tellg());
+    ColumnarFooter footer{};
+    if (size < sizeof(ColumnarFileHeader) + sizeof(footer)) {
+        throw std::runtime_error("'" + path + "' is too small to be a columnar trace");
+    }
+    file.seekg(size - sizeof(footer));
+    file.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    if (!file || std::memcmp(footer.magic, COLUMNAR_FOOTER_MAGIC, sizeof(footer.magic)) != 0) {
+        throw std::runtime_error("'" + path + "' has no block index (was the writer closed?)");
+    }
+    return footer;
+}
+
+std::vector<ColumnarBlockIndexEntry> read_columnar_index(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+
+    auto footer = read_columnar_footer(file, path);
+    std::vector<ColumnarBlockIndexEntry> index(footer.num_blocks);
+    file.seekg(footer.index_offset);
+    file.read(reinterpret_cast<char *>(index.data()), index.size() * sizeof(ColumnarBlockIndexEntry));
+    if (!file) {
+        throw std::runtime_error("Truncated block index in '" + path + "'");
+    }
+    return index;
+}
+
+std::vector<ColumnarBlockSummary> read_columnar_summaries(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+
+    ColumnarFileHeader header{};
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, COLUMNAR_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + path + "' is not a columnar trace");
+    }
+    if (header.version < 2) {
+        return {};
+    }
+
+    auto footer = read_columnar_footer(file, path);
+    std::vector<ColumnarBlockSummary> summaries(footer.num_blocks);
+    file.seekg(footer.index_offset + footer.num_blocks * sizeof(ColumnarBlockIndexEntry));
+    file.read(reinterpret_cast<char *>(summaries.data()), summaries.size() * sizeof(ColumnarBlockSummary));
+    if (!file) {
+        throw std::runtime_error("Truncated block summaries in '" + path + "'");
+    }
+    return summaries;
+}
+
+bool is_columnar_trace(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(COLUMNAR_TRACE_MAGIC)];
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, COLUMNAR_TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+uint64_t convert_to_columnar(TraceReader& input, const std::string& output_path, uint32_t block_records, bool compress_blocks) {
+    ColumnarTraceWriter writer(output_path, block_records, compress_blocks);
+
+    std::vector<TraceRecord> batch(block_records);
+    size_t n;
+    while ((n = input.read(batch.data(), batch.size())) > 0) {
+        writer.write(batch.data(), n);
+    }
+    writer.close();
+    return writer.num_records();
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+#include "trace_writer.hpp"
+
+/*
+ * Columnar trace container.
+ *
+ *   file header | block | block | ... | end-of-blocks marker | block index | block summaries | footer
+ *
+ * Every block holds up to `block_records` records split in columns: vCPU ids (one byte each),
+ * access types (2 bits each), addresses as zig-zag varint deltas against the previous address of
+ * the same vCPU and, when present, timestamps as zig-zag varint deltas against the previous record.
+ * Delta state is reset at every block, so blocks decode independently of each other.
+ *
+ * Blocks are self-delimiting, so the file can be replayed front to back without seeking; the
+ * index footer is only needed for random access. Block summaries (address range, cores and access
+ * types of each block) let filtered readers skip blocks without decoding them. They were added in
+ * version 2, version 1 files have none and are still read.
+ *
+ * Since version 3 a block payload may also be LZ compressed (see block_compression.hpp), flagged
+ * by LZ_COMPRESSED. Its stored form is then a 32-bit compressed size followed by the compressed
+ * bytes.
+ */
+
+constexpr char COLUMNAR_TRACE_MAGIC[8] = {'A', 'S', 'G', 'C', 'O', 'L', 'T', 'R'};
+constexpr char COLUMNAR_FOOTER_MAGIC[8] = {'A', 'S', 'G', 'C', 'I', 'D', 'X', '1'};
+constexpr uint32_t COLUMNAR_TRACE_VERSION = 3;
+constexpr uint32_t COLUMNAR_TRACE_MIN_VERSION = 1;
+constexpr uint32_t COLUMNAR_DEFAULT_BLOCK_RECORDS = 64 * 1024;
+
+struct ColumnarFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;
+};
+
+struct ColumnarBlockHeader {
+    // Zero marks the end of the blocks.
+    uint32_t num_records;
+    uint32_t flags;
+    uint32_t addr_bytes;
+    uint32_t timestamp_bytes;
+
+    static constexpr uint32_t HAS_TIMESTAMPS = 0x1;
+    static constexpr uint32_t LZ_COMPRESSED = 0x2;
+};
+
+struct ColumnarBlockIndexEntry {
+    // File offset of the block header.
+    uint64_t offset;
+    uint64_t first_record;
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint32_t num_records;
+    uint32_t reserved;
+};
+
+struct ColumnarBlockSummary {
+    uint64_t min_addr;
+    uint64_t max_addr;
+    // Bit i is set if core i has records in the block.
+    uint64_t core_mask[4];
+    // Records per AccessType.
+    uint32_t type_counts[4];
+
+    bool has_core(uint8_t cpu_index) const noexcept { return (core_mask[cpu_index / 64] >> (cpu_index % 64)) & 1; }
+};
+
+static_assert(sizeof(ColumnarBlockSummary) == 64);
+
+struct ColumnarFooter {
+    uint64_t index_offset;
+    uint64_t num_blocks;
+    uint64_t num_records;
+    char magic[8];
+};
+
+// Zig-zag maps signed deltas to unsigned so that small negative deltas stay small.
+inline uint64_t zigzag_encode(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+inline void varint_encode(uint64_t v, std::vector<uint8_t>& out) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+// Returns the position after the decoded value, or nullptr if it runs past `end`.
+inline const uint8_t *varint_decode(const uint8_t *p, const uint8_t *end, uint64_t& v) {
+    v = 0;
+    for (uint32_t shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return p;
+        }
+    }
+    return nullptr;
+}
+
+class ColumnarTraceWriter : public TraceWriter {
+public:
+    // With `compress_blocks`, payloads are also LZ compressed when that makes them smaller.
+    explicit ColumnarTraceWriter(const std::string& path, uint32_t block_records = COLUMNAR_DEFAULT_BLOCK_RECORDS,
+                                 bool compress_blocks = false);
+    ~ColumnarTraceWriter() override;
+
+    ColumnarTraceWriter(const ColumnarTraceWriter&) = delete;
+    ColumnarTraceWriter& operator=(const ColumnarTraceWriter&) = delete;
+
+    void write(const TraceRecord *records, size_t n) override;
+    // Flushes the last block and writes the index. Called by the destructor if needed.
+    void close() override;
+
+    uint64_t num_records() const noexcept;
+    uint64_t bytes_written() const noexcept;
+private:
+    std::ofstream file_;
+    uint32_t block_records_;
+    bool compress_blocks_;
+    std::vector<TraceRecord> pending_;
+    std::vector<ColumnarBlockIndexEntry> index_;
+    std::vector<ColumnarBlockSummary> summaries_;
+    std::vector<uint8_t> encoded_;
+    std::vector<uint8_t> compressed_;
+    uint64_t offset_;
+    uint64_t num_records_;
+    bool closed_;
+
+    void flush_block();
+};
+
+class ColumnarTraceReader : public TraceReader {
+public:
+    explicit ColumnarTraceReader(const std::string& path);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+
+    uint32_t block_records() const noexcept;
+
+    // Continues reading from the block starting at byte `offset`, as found in the block index.
+    void seek(uint64_t offset);
+private:
+    std::ifstream file_;
+    uint32_t block_records_;
+    std::vector<uint8_t> stored_;
+    std::vector<uint8_t> payload_;
+    std::vector<TraceRecord> block_;
+    size_t block_pos_;
+    bool finished_;
+
+    bool load_next_block();
+};
+
+// Encodes `n` records into `out`, filling in the header sizes.
+void encode_columnar_block(const TraceRecord *records, uint32_t n, ColumnarBlockHeader& header, std::vector<uint8_t>& out);
+
+// Decodes a block payload into `records`. Throws std::runtime_error on corrupt input.
+void decode_columnar_block(const ColumnarBlockHeader& header, const uint8_t *payload, size_t payload_size, std::vector<TraceRecord>& records);
+
+// Reads the next block header and stored payload from `file`. Returns false at the end of the
+// blocks.
+bool read_columnar_block(std::istream& file, ColumnarBlockHeader& header, std::vector<uint8_t>& stored);
+
+// Decodes a stored payload, decompressing it into `payload` first if needed.
+void decode_stored_columnar_block(const ColumnarBlockHeader& header, const uint8_t *stored, size_t stored_size,
+                                  std::vector<uint8_t>& payload, std::vector<TraceRecord>& records);
+
+// Reads a columnar file front to back, decoding blocks on `threads` threads (0 for all, 1 for the
+// calling thread only).
+std::unique_ptr<TraceReader> open_parallel_columnar_reader(const std::string& path, uint32_t threads = 0);
+
+ColumnarBlockSummary summarize_columnar_block(const TraceRecord *records, uint32_t n);
+
+// Reads the block index from the footer of a columnar trace file.
+std::vector<ColumnarBlockIndexEntry> read_columnar_index(const std::string& path);
+
+// Reads the summary of every block, in block order. Empty for version 1 files.
+std::vector<ColumnarBlockSummary> read_columnar_summaries(const std::string& path);
+
+bool is_columnar_trace(const std::string& path);
+
+// Re-encodes any readable trace as a columnar trace. Returns the number of records converted.
+uint64_t convert_to_columnar(TraceReader& input, const std::string& output_path,
+                             uint32_t block_records = COLUMNAR_DEFAULT_BLOCK_RECORDS, bool compress_blocks = false);
@@ -0,0 +1,185 @@
+#include "compressed_trace.hpp"
+#include "block_compression.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+static constexpr size_t RECORD_SIZE = BinaryTraceReader::RECORD_SIZE;
+
+CompressedBlockHeader encode_compressed_block(const TraceRecord *records, uint32_t n, std::vector<uint8_t>& stored) {
+    thread_local std::vector<uint8_t> plain, shuffled;
+    plain.resize(n * RECORD_SIZE);
+    shuffled.resize(n * RECORD_SIZE);
+
+    uint64_t last_timestamp = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t *out = plain.data() + i * RECORD_SIZE;
+        uint64_t delta = records[i].timestamp - last_timestamp;
+        last_timestamp = records[i].timestamp;
+        std::memcpy(out, &records[i].addr, sizeof(uint64_t));
+        std::memcpy(out + 8, &delta, sizeof(uint64_t));
+        out[16] = static_cast<uint8_t>(records[i].type);
+        out[17] = records[i].cpu_index;
+    }
+    shuffle_bytes(plain.data(), n, RECORD_SIZE, shuffled.data());
+
+    stored.resize(block_compress_bound(shuffled.size()));
+    size_t compressed_size = compress_block(shuffled.data(), shuffled.size(), stored.data());
+    if (compressed_size < shuffled.size()) {
+        stored.resize(compressed_size);
+    } else {
+        stored.assign(shuffled.begin(), shuffled.end());
+    }
+    return CompressedBlockHeader{.num_records = n, .stored_bytes = static_cast<uint32_t>(stored.size())};
+}
+
+void decode_compressed_block(const CompressedBlockHeader& header, const uint8_t *stored, std::vector<TraceRecord>& records) {
+    const size_t n = header.num_records;
+    thread_local std::vector<uint8_t> plain, shuffled;
+    plain.resize(n * RECORD_SIZE);
+
+    const uint8_t *planes = stored;
+    if (header.stored_bytes != n * RECORD_SIZE) {
+        shuffled.resize(n * RECORD_SIZE);
+        decompress_block(stored, header.stored_bytes, shuffled.data(), shuffled.size());
+        planes = shuffled.data();
+    }
+    unshuffle_bytes(planes, n, RECORD_SIZE, plain.data());
+
+    records.resize(n);
+    uint64_t timestamp = 0;
+    for (size_t i = 0; i < n; i++) {
+        const uint8_t *in = plain.data() + i * RECORD_SIZE;
+        uint64_t delta;
+        std::memcpy(&records[i].addr, in, sizeof(uint64_t));
+        std::memcpy(&delta, in + 8, sizeof(uint64_t));
+        timestamp += delta;
+        records[i].timestamp = timestamp;
+        records[i].type = static_cast<AccessType>(in[16]);
+        records[i].cpu_index = in[17];
+        records[i].weight = 1;
+    }
+}
+
+bool read_compressed_block(std::istream& file, uint32_t block_records, CompressedBlockHeader& header, std::vector<uint8_t>& stored) {
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        throw std::runtime_error("Truncated compressed trace (missing end of blocks marker)");
+    }
+    if (header.num_records == 0) {
+        return false;
+    }
+    // Both sizes are checked before anything is allocated for the block.
+    if (header.num_records > block_records ||
+        header.stored_bytes > block_compress_bound((size_t) header.num_records * RECORD_SIZE)) {
+        throw std::runtime_error("Corrupt compressed trace block header");
+    }
+    stored.resize(header.stored_bytes);
+    if (!file.read(reinterpret_cast<char *>(stored.data()), stored.size())) {
+        throw std::runtime_error("Truncated compressed trace block");
+    }
+    return true;
+}
+
+CompressedTraceWriter::CompressedTraceWriter(const std::string& path, uint32_t block_records)
+    : BufferedTraceWriter(path, 4 * 1024 * 1024), block_records_(block_records), closed_(false) {
+    if (block_records == 0) {
+        throw std::invalid_argument("Block size should be at least one record!");
+    }
+
+    CompressedTraceHeader header{};
+    std::memcpy(header.magic, COMPRESSED_TRACE_MAGIC, sizeof(header.magic));
+    header.version = COMPRESSED_TRACE_VERSION;
+    header.block_records = block_records;
+    uint8_t *out = reserve(sizeof(header));
+    std::memcpy(out, &header, sizeof(header));
+    commit(out + sizeof(header));
+
+    pending_.reserve(block_records);
+}
+
+CompressedTraceWriter::~CompressedTraceWriter() {
+    try {
+        close();
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+void CompressedTraceWriter::write(const TraceRecord *records, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        pending_.push_back(records[i]);
+        if (pending_.size() == block_records_) {
+            flush_block();
+        }
+    }
+}
+
+void CompressedTraceWriter::flush_block() {
+    if (pending_.empty()) {
+        return;
+    }
+    auto header = encode_compressed_block(pending_.data(), pending_.size(), stored_);
+    uint8_t *out = reserve(sizeof(header) + stored_.size());
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), stored_.data(), stored_.size());
+    commit(out + sizeof(header) + stored_.size());
+    pending_.clear();
+}
+
+void CompressedTraceWriter::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    flush_block();
+    CompressedBlockHeader end_of_blocks{};
+    uint8_t *out = reserve(sizeof(end_of_blocks));
+    std::memcpy(out, &end_of_blocks, sizeof(end_of_blocks));
+    commit(out + sizeof(end_of_blocks));
+    BufferedTraceWriter::close();
+}
+
+std::unique_ptr<TraceReader> open_compressed_trace_reader(const std::string& path, uint32_t threads, uint64_t offset) {
+    auto file = std::make_shared<std::ifstream>(path, std::ios::binary);
+    if (!file->is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+    CompressedTraceHeader header{};
+    if (!file->read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, COMPRESSED_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + path + "' is not a compressed trace");
+    }
+    if (header.version != COMPRESSED_TRACE_VERSION) {
+        throw std::runtime_error("Unsupported compressed trace version " + std::to_string(header.version));
+    }
+    if (offset != 0 && !file->seekg(offset)) {
+        throw std::runtime_error("Could not seek to compressed block at " + std::to_string(offset));
+    }
+
+    // A raw block is the block header followed by the stored block.
+    auto stored = std::make_shared<std::vector<uint8_t>>();
+    auto fetch = [file, stored, block_records = header.block_records](std::vector<uint8_t>& raw) {
+        CompressedBlockHeader block_header{};
+        if (!read_compressed_block(*file, block_records, block_header, *stored)) {
+            return false;
+        }
+        raw.resize(sizeof(block_header) + stored->size());
+        std::memcpy(raw.data(), &block_header, sizeof(block_header));
+        std::memcpy(raw.data() + sizeof(block_header), stored->data(), stored->size());
+        return true;
+    };
+    auto decode = [](const std::vector<uint8_t>& raw, std::vector<TraceRecord>& records) {
+        CompressedBlockHeader block_header{};
+        std::memcpy(&block_header, raw.data(), sizeof(block_header));
+        decode_compressed_block(block_header, raw.data() + sizeof(block_header), records);
+    };
+    return open_block_trace_reader(fetch, decode, threads);
+}
+
+bool is_compressed_trace(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(COMPRESSED_TRACE_MAGIC)];
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, COMPRESSED_TRACE_MAGIC, sizeof(magic)) == 0;
+}
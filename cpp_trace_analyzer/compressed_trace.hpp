@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+#include "trace_writer.hpp"
+
+/*
+ * Compressed binary trace container: the tracer plugin's 18-byte records in independently
+ * compressed blocks.
+ *
+ *   file header | block header | stored block | ... | end-of-blocks marker (num_records == 0)
+ *
+ * A block keeps the plugin record layout with each timestamp replaced by its delta to the previous
+ * record, shuffled into byte planes and LZ compressed (see block_compression.hpp). The high bytes
+ * of addresses and timestamps turn into long runs, so blocks typically shrink several-fold. A block
+ * that does not compress is stored shuffled only, in which case stored_bytes is the raw size.
+ *
+ * Blocks are self-delimiting, so compressed traces can also be streamed through pipes.
+ */
+
+constexpr char COMPRESSED_TRACE_MAGIC[8] = {'A', 'S', 'G', 'T', 'L', 'Z', 'B', '1'};
+constexpr uint32_t COMPRESSED_TRACE_VERSION = 1;
+constexpr uint32_t COMPRESSED_DEFAULT_BLOCK_RECORDS = 64 * 1024;
+
+struct CompressedTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_records;
+};
+
+struct CompressedBlockHeader {
+    // Zero marks the end of the blocks.
+    uint32_t num_records;
+    uint32_t stored_bytes;
+};
+
+// Encodes `n` records into `stored`, returning the header of the block.
+CompressedBlockHeader encode_compressed_block(const TraceRecord *records, uint32_t n, std::vector<uint8_t>& stored);
+
+// Decodes a stored block into `records`. Throws std::runtime_error on corrupt input.
+void decode_compressed_block(const CompressedBlockHeader& header, const uint8_t *stored, std::vector<TraceRecord>& records);
+
+// Reads the next block header and stored block from `file`. Returns false at the end of the blocks.
+// `block_records` is the one of the file header, no block holds more records.
+bool read_compressed_block(std::istream& file, uint32_t block_records, CompressedBlockHeader& header, std::vector<uint8_t>& stored);
+
+class CompressedTraceWriter : public BufferedTraceWriter {
+public:
+    explicit CompressedTraceWriter(const std::string& path, uint32_t block_records = COMPRESSED_DEFAULT_BLOCK_RECORDS);
+    ~CompressedTraceWriter() override;
+
+    void write(const TraceRecord *records, size_t n) override;
+    // Flushes the last block and the end marker. Called by the destructor if needed.
+    void close() override;
+private:
+    uint32_t block_records_;
+    std::vector<TraceRecord> pending_;
+    std::vector<uint8_t> stored_;
+    bool closed_;
+
+    void flush_block();
+};
+
+// Reads a compressed trace, decompressing blocks on `threads` threads (0 for all, 1 for the calling
+// thread only). Reading starts at the block at byte `offset` when given, as found in a TraceIndex.
+std::unique_ptr<TraceReader> open_compressed_trace_reader(const std::string& path, uint32_t threads = 0, uint64_t offset = 0);
+
+bool is_compressed_trace(const std::string& path);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <bitset>
@@ -6,7 +7,8 @@
 #include "llc_partitioning.hpp"
 
 WayPartitioning::WayPartitioning(uint64_t cache_size, uint32_t block_size,
-                                 const std::vector<uint32_t>& n_ways) {
+                                 const std::vector<uint32_t>& n_ways, ReplacementPolicy policy,
+                                 CacheOrganization organization) {
 
     uint32_t s_ways = 0;
     for (const auto& way: n_ways) {
@@ -20,7 +22,7 @@ WayPartitioning::WayPartitioning(uint64_t cache_size, uint32_t block_size,
 
     way_partitioned_caches_.resize(n_ways.size());
     for (size_t i = 0; i < n_ways.size(); i++) {
-        way_partitioned_caches_[i] = Cache((cache_size * n_ways[i]) / s_ways, sets, n_ways[i], block_size);
+        way_partitioned_caches_[i] = Cache((cache_size * n_ways[i]) / s_ways, sets, n_ways[i], block_size, policy, organization);
     }
 }
 
@@ -28,19 +30,17 @@ bool WayPartitioning::access(uint32_t client_id, uintptr_t addr) {
     if (client_id >= way_partitioned_caches_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
-    auto& cache = way_partitioned_caches_[client_id];
-    auto loc = Cache::compute_location_info(addr, cache.block_size(), cache.sets(), cache.tag_bits());
-    return cache.access(loc, addr);
+    return way_partitioned_caches_[client_id].access(addr);
 }
 
-uint32_t WayPartitioning::misses(uint32_t client_id) const {
+uint64_t WayPartitioning::misses(uint32_t client_id) const {
     if (client_id >= way_partitioned_caches_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
     return way_partitioned_caches_[client_id].misses();
 }
 
-uint32_t WayPartitioning::hits(uint32_t client_id) const {
+uint64_t WayPartitioning::hits(uint32_t client_id) const {
     if (client_id >= way_partitioned_caches_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
@@ -54,11 +54,41 @@ const Cache &WayPartitioning::get_cache(uint32_t client_id) const {
     return way_partitioned_caches_.at(client_id);
 }
 
-InterNodePartitioning::InterNodePartitioning(uint64_t slice_size, uint32_t assoc, uint32_t block_size, const std::vector<uint32_t>& n_slices) {
+uint32_t WayPartitioning::block_size() const noexcept {
+    return way_partitioned_caches_[0].block_size();
+}
+
+void WayPartitioning::reset_stats() noexcept {
+    for (auto& cache: way_partitioned_caches_) {
+        cache.reset_stats();
+    }
+}
+
+void WayPartitioning::set_stats_enabled(bool enabled) noexcept {
+    for (auto& cache: way_partitioned_caches_) {
+        cache.set_stats_enabled(enabled);
+    }
+}
+
+void WayPartitioning::set_next_use(const std::shared_ptr<const NextUseReader>& next_use) {
+    for (auto& cache: way_partitioned_caches_) {
+        cache.set_next_use(next_use);
+    }
+}
+
+void WayPartitioning::set_tag_store(const TagStoreOptions& options) {
+    auto shared = options.shared();
+    for (auto& cache: way_partitioned_caches_) {
+        cache.set_tag_store(shared);
+    }
+}
+
+InterNodePartitioning::InterNodePartitioning(uint64_t slice_size, uint32_t assoc, uint32_t block_size, const std::vector<uint32_t>& n_slices,
+                                             ReplacementPolicy policy, CacheOrganization organization) {
     num_clusters = 0;
     memory_nodes_.resize(n_slices.size());
     for (size_t i = 0; i < n_slices.size(); i++) {
-        std::vector<Cache> slices(n_slices[i], Cache(slice_size, assoc, block_size));
+        std::vector<Cache> slices(n_slices[i], Cache(slice_size, assoc, block_size, policy, organization));
         memory_nodes_[i] = slices;
         num_clusters += n_slices[i];
     }
@@ -77,24 +107,24 @@ bool InterNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     auto& memory_node = memory_nodes_[client_id];
 
     // // Using block bits as page offset bits.
-    auto block_offset_bits = (uint32_t) std::log2(memory_node[0].block_size());
-    auto set_offset_bits = (uint32_t) std::log2(memory_node[0].sets());
+    auto block_offset_bits = memory_node[0].block_bits();
+    auto set_offset_bits = memory_node[0].set_bits();
 
-    auto node_selection = static_cast<uint32_t>(addr >> (set_offset_bits + block_offset_bits)) & bit_mask_n_bits_right((uint32_t) std::log2(num_clusters));
+    auto node_selection = static_cast<uint32_t>(addr >> (set_offset_bits + block_offset_bits)) & bit_mask_n_bits_right(Cache::log2(num_clusters));
     auto& slice = memory_node[node_selection % memory_node.size()];
 
-    return slice.access(Cache::compute_location_info(addr, slice.block_size(), slice.sets(), slice.tag_bits()), addr);
+    return slice.access(addr);
 }
 
 
-uint32_t InterNodePartitioning::misses(uint32_t client_id) const {
+uint64_t InterNodePartitioning::misses(uint32_t client_id) const {
     // Sum of all misses of all memory nodes.
     if (client_id >= memory_nodes_.size()) {
         throw std::invalid_argument("Invalid client_id given!!");
     }
     auto& memory_node = memory_nodes_[client_id];
 
-    uint32_t misses = 0;
+    uint64_t misses = 0;
     for (const auto& slice: memory_node) {
         misses += slice.misses();
     }
@@ -102,14 +132,14 @@ uint32_t InterNodePartitioning::misses(uint32_t client_id) const {
     return misses;
 }
 
-uint32_t InterNodePartitioning::hits(uint32_t client_id) const {
+uint64_t InterNodePartitioning::hits(uint32_t client_id) const {
     // Sum of all hits of all memory nodes.
     if (client_id >= memory_nodes_.size()) {
         throw std::invalid_argument("Invalid client_id given!!");
     }
     auto& memory_node = memory_nodes_[client_id];
 
-    uint32_t hits = 0;
+    uint64_t hits = 0;
     for (const auto& slice: memory_node) {
         hits += slice.hits();
     }
@@ -126,10 +156,59 @@ const std::vector<Cache> &InterNodePartitioning::memory_nodes(uint32_t client_id
     return memory_nodes_[client_id];
 }
 
+uint32_t InterNodePartitioning::block_size() const noexcept {
+    // A client may have no slices.
+    for (const auto& slices: memory_nodes_) {
+        if (!slices.empty()) {
+            return slices[0].block_size();
+        }
+    }
+    return 0;
+}
+
+void InterNodePartitioning::reset_stats() noexcept {
+    for (auto& memory_node: memory_nodes_) {
+        for (auto& slice: memory_node) {
+            slice.reset_stats();
+        }
+    }
+}
+
+void InterNodePartitioning::set_stats_enabled(bool enabled) noexcept {
+    for (auto& memory_node: memory_nodes_) {
+        for (auto& slice: memory_node) {
+            slice.set_stats_enabled(enabled);
+        }
+    }
+}
+
+void InterNodePartitioning::set_next_use(const std::shared_ptr<const NextUseReader>& next_use) {
+    for (auto& memory_node: memory_nodes_) {
+        for (auto& slice: memory_node) {
+            slice.set_next_use(next_use);
+        }
+    }
+}
+
+void InterNodePartitioning::set_tag_store(const TagStoreOptions& options) {
+    auto shared = options.shared();
+    for (auto& memory_node: memory_nodes_) {
+        for (auto& slice: memory_node) {
+            slice.set_tag_store(shared);
+        }
+    }
+}
+
 IntraNodePartitioning::IntraNodePartitioning(uint64_t cache_size, uint32_t assoc,
-                                             uint32_t block_size, std::vector<fixed_bits_t> aux_table)
-                                             : cache_(cache_size, assoc, block_size),
-                                               aux_table_(std::move(aux_table)), stats_(aux_table_.size(), {0, 0}) {}
+                                             uint32_t block_size, std::vector<fixed_bits_t> aux_table,
+                                             ReplacementPolicy policy, CacheOrganization organization)
+                                             : cache_(cache_size, assoc, block_size, policy, organization),
+                                               aux_table_(std::move(aux_table)), stats_(aux_table_.size(), {0, 0}) {
+    // The fixed bits select the set of each access, skewed organizations have none.
+    if (organization != CacheOrganization::SET_ASSOCIATIVE) {
+        throw std::invalid_argument("Intra-node partitioning needs a set-associative cache!");
+    }
+}
 
 bool IntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     if (client_id >= aux_table_.size()) {
@@ -140,8 +219,8 @@ bool IntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     // Create a bitset of the addr.
     std::bitset<64> baddr(addr);
 
-    auto block_offset_bits = (uint32_t) std::log2(cache_.block_size());
-    auto set_bits = (size_t) std::log2(cache_.sets());
+    auto block_offset_bits = cache_.block_bits();
+    auto set_bits = (size_t) cache_.set_bits();
 
     // Replace the most significant set_index with the `fixed_bits`
     auto bit_start = block_offset_bits + set_bits - bits_info.n_bits;
@@ -159,8 +238,10 @@ bool IntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     };
 
     auto& stats = stats_[client_id];
-    uint32_t misses = cache_.misses();
     bool hit = cache_.access(loc, addr);
+    if (!stats_enabled_) {
+        return hit;
+    }
     if (!hit) {
         stats.first++;
     } else {
@@ -169,14 +250,14 @@ bool IntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     return hit;
 }
 
-uint32_t IntraNodePartitioning::misses(uint32_t client_id) const {
+uint64_t IntraNodePartitioning::misses(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
     return stats_[client_id].first;
 }
 
-uint32_t IntraNodePartitioning::hits(uint32_t client_id) const {
+uint64_t IntraNodePartitioning::hits(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
@@ -187,14 +268,37 @@ Cache &IntraNodePartitioning::cache() {
     return cache_;
 }
 
+uint32_t IntraNodePartitioning::block_size() const noexcept {
+    return cache_.block_size();
+}
+
+void IntraNodePartitioning::reset_stats() noexcept {
+    cache_.reset_stats();
+    std::fill(stats_.begin(), stats_.end(), std::make_pair(0u, 0u));
+}
+
+void IntraNodePartitioning::set_stats_enabled(bool enabled) noexcept {
+    cache_.set_stats_enabled(enabled);
+    stats_enabled_ = enabled;
+}
+
+void IntraNodePartitioning::set_next_use(const std::shared_ptr<const NextUseReader>& next_use) {
+    cache_.set_next_use(next_use);
+}
+
+void IntraNodePartitioning::set_tag_store(const TagStoreOptions& options) {
+    cache_.set_tag_store(options);
+}
+
 ClusterWayPartitioning::ClusterWayPartitioning(uint32_t n_clusters, uint64_t slice_size, uint32_t block_size,
-                                               const std::vector<uint32_t> &n_ways) {
+                                               const std::vector<uint32_t> &n_ways, ReplacementPolicy policy,
+                                               CacheOrganization organization) {
     // n_clusters should be power of 2
     if (!Cache::is_power_of_2(n_clusters)) {
         throw std::invalid_argument("n_clusters should be power of 2!");
     }
 
-    clusters_.resize(n_clusters, WayPartitioning(slice_size, block_size, n_ways));
+    clusters_.resize(n_clusters, WayPartitioning(slice_size, block_size, n_ways, policy, organization));
     stats_.resize(n_ways.size(), {0, 0});
     block_size_ = block_size;
 }
@@ -205,8 +309,8 @@ bool ClusterWayPartitioning::access(uint32_t client_id, uintptr_t addr) {
     }
 
     // Get slice id.
-    auto slice_id_bits = (uint32_t) log2(clusters_.size());
-    auto block_offset_bits = (uint32_t) std::log2(block_size_);
+    auto slice_id_bits = Cache::log2(clusters_.size());
+    auto block_offset_bits = Cache::log2(block_size_);
     auto cluster = (uint32_t) (addr >> block_offset_bits) & bit_mask_n_bits_right(slice_id_bits);
     assert(cluster < clusters_.size());
 
@@ -216,6 +320,9 @@ bool ClusterWayPartitioning::access(uint32_t client_id, uintptr_t addr) {
     auto new_addr = ((addr >> slice_id_bits) & ~block_offset_mask) | (addr & block_offset_mask);
 
     bool hit = clusters_[cluster].access(client_id, new_addr);
+    if (!stats_enabled_) {
+        return hit;
+    }
     if (!hit) {
         stats_[client_id].first++;
     } else {
@@ -224,14 +331,14 @@ bool ClusterWayPartitioning::access(uint32_t client_id, uintptr_t addr) {
     return hit;
 }
 
-uint32_t ClusterWayPartitioning::misses(uint32_t client_id) const {
+uint64_t ClusterWayPartitioning::misses(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
     return stats_[client_id].first;
 }
 
-uint32_t ClusterWayPartitioning::hits(uint32_t client_id) const {
+uint64_t ClusterWayPartitioning::hits(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
@@ -246,9 +353,46 @@ uint32_t ClusterWayPartitioning::n_clusters() const {
     return clusters_.size();
 }
 
+uint32_t ClusterWayPartitioning::block_size() const noexcept {
+    return block_size_;
+}
+
+void ClusterWayPartitioning::reset_stats() noexcept {
+    for (auto& cluster: clusters_) {
+        cluster.reset_stats();
+    }
+    std::fill(stats_.begin(), stats_.end(), std::make_pair(0u, 0u));
+}
+
+void ClusterWayPartitioning::set_stats_enabled(bool enabled) noexcept {
+    for (auto& cluster: clusters_) {
+        cluster.set_stats_enabled(enabled);
+    }
+    stats_enabled_ = enabled;
+}
+
+void ClusterWayPartitioning::set_next_use(const std::shared_ptr<const NextUseReader>& next_use) {
+    for (auto& cluster: clusters_) {
+        cluster.set_next_use(next_use);
+    }
+}
+
+void ClusterWayPartitioning::set_tag_store(const TagStoreOptions& options) {
+    auto shared = options.shared();
+    for (auto& cluster: clusters_) {
+        cluster.set_tag_store(shared);
+    }
+}
+
 InterIntraNodePartitioning::InterIntraNodePartitioning(uint32_t assoc, uint32_t block_size,
-                                                       const std::vector<std::vector<uint32_t>> &n_cache_sizes,
-                                                       const std::vector<inter_intra_aux_table_t>& aux_tables_per_client) {
+                                                       const std::vector<std::vector<uint64_t>> &n_cache_sizes,
+                                                       const std::vector<inter_intra_aux_table_t>& aux_tables_per_client,
+                                                       ReplacementPolicy policy, CacheOrganization organization) {
+    // The aux tables select the set of each access, skewed organizations have none.
+    if (organization != CacheOrganization::SET_ASSOCIATIVE) {
+        throw std::invalid_argument("Inter-intra node partitioning needs set-associative caches!");
+    }
+
     // Check that all clusters contain cache sizes for each client.
     uint32_t n_clients = aux_tables_per_client.size();
     for (const auto& cache_sizes_per_cluster: n_cache_sizes) {
@@ -266,7 +410,7 @@ InterIntraNodePartitioning::InterIntraNodePartitioning(uint32_t assoc, uint32_t
         inp_[cluster].resize(clients);
         for (uint32_t client = 0; client < clients; client++) {
             if (n_cache_sizes[cluster][client] > 0) {
-                Cache cache(n_cache_sizes[cluster][client], assoc, block_size);
+                Cache cache(n_cache_sizes[cluster][client], assoc, block_size, policy, organization);
                 inp_[cluster][client] = cache;
                 if (cache.sets() > max_num_sets) {
                     max_num_sets = cache.sets();
@@ -288,7 +432,7 @@ bool InterIntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     }
 
     // Get the node selection bits (after set_index).
-    auto block_offset_bits = (uint32_t) std::log2(block_size_);
+    auto block_offset_bits = Cache::log2(block_size_);
     auto node_selection_bits = ADDRESS_SIZE - (block_offset_bits + set_bits_);
 
     auto node_selection = (addr >> (block_offset_bits + set_bits_)) & bit_mask_n_bits_right(node_selection_bits);
@@ -308,6 +452,9 @@ bool InterIntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     auto& cache = inp_[cluster_id][client_id];
     if (cache.cache_size() > 0) {
         bool hit = cache.access(addr);
+        if (!stats_enabled_) {
+            return hit;
+        }
         if (!hit) {
             stats_[client_id].first++;
         } else {
@@ -318,14 +465,14 @@ bool InterIntraNodePartitioning::access(uint32_t client_id, uintptr_t addr) {
     return false;
 }
 
-uint32_t InterIntraNodePartitioning::misses(uint32_t client_id) const {
+uint64_t InterIntraNodePartitioning::misses(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
     return stats_[client_id].first;
 }
 
-uint32_t InterIntraNodePartitioning::hits(uint32_t client_id) const {
+uint64_t InterIntraNodePartitioning::hits(uint32_t client_id) const {
     if (client_id >= stats_.size()) {
         throw std::invalid_argument("Invalid client_id given!");
     }
@@ -342,3 +489,45 @@ Cache& InterIntraNodePartitioning::get_cache_slice(uint32_t client_id, uint32_t
 uint32_t InterIntraNodePartitioning::n_clusters() const {
     return inp_.size();
 }
+
+uint32_t InterIntraNodePartitioning::block_size() const noexcept {
+    return block_size_;
+}
+
+void InterIntraNodePartitioning::reset_stats() noexcept {
+    for (auto& cluster: inp_) {
+        for (auto& cache: cluster) {
+            cache.reset_stats();
+        }
+    }
+    std::fill(stats_.begin(), stats_.end(), std::make_pair(0u, 0u));
+}
+
+void InterIntraNodePartitioning::set_stats_enabled(bool enabled) noexcept {
+    for (auto& cluster: inp_) {
+        for (auto& cache: cluster) {
+            cache.set_stats_enabled(enabled);
+        }
+    }
+    stats_enabled_ = enabled;
+}
+
+void InterIntraNodePartitioning::set_next_use(const std::shared_ptr<const NextUseReader>& next_use) {
+    for (auto& cluster: inp_) {
+        for (auto& cache: cluster) {
+            cache.set_next_use(next_use);
+        }
+    }
+}
+
+void InterIntraNodePartitioning::set_tag_store(const TagStoreOptions& options) {
+    auto shared = options.shared();
+    for (auto& cluster: inp_) {
+        for (auto& cache: cluster) {
+            // Not the empty slices of the clients without cores in the cluster.
+            if (cache.cache_size() != 0) {
+                cache.set_tag_store(shared);
+            }
+        }
+    }
+}
@@ -5,17 +5,34 @@
 #include <bitset>
 
 #include "cache.hpp"
+#include "trace_next_use.hpp"
+
+/*
+ * Every partitioning scheme can be the shared cache of a MultiLevelCache, through the same
+ * interface as a Cache: block_size(), reset_stats(), set_stats_enabled(), set_next_use() and
+ * set_tag_store(). A scheme applies each of them to all its caches, which have one block size,
+ * read the same next uses and keep their tag stores within one resident budget, see
+ * TagStoreOptions::shared().
+ */
 
 class WayPartitioning {
 public:
-    WayPartitioning(uint64_t cache_size, uint32_t block_size, const std::vector<uint32_t> &n_ways);
+    WayPartitioning(uint64_t cache_size, uint32_t block_size, const std::vector<uint32_t> &n_ways,
+                    ReplacementPolicy policy = ReplacementPolicy::LRU,
+                    CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     // Returns if its a hit or not.
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const;
-    uint32_t hits(uint32_t client_id) const;
+    uint64_t misses(uint32_t client_id) const;
+    uint64_t hits(uint32_t client_id) const;
     Cache& get_cache(uint32_t client_id);
     const Cache& get_cache(uint32_t client_id) const;
+    // The shared cache interface, see the top of the file.
+    uint32_t block_size() const noexcept;
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+    void set_next_use(const std::shared_ptr<const NextUseReader>& next_use);
+    void set_tag_store(const TagStoreOptions& options);
 private:
     std::vector<Cache> way_partitioned_caches_;
 };
@@ -25,12 +42,20 @@ public:
     // clients is the number of clients in the system.
     // n_slices is how many slices each client has.
     // the rest are information for LLC slice.
-    InterNodePartitioning(uint64_t cache_size, uint32_t assoc, uint32_t block_size, const std::vector<uint32_t> &n_slices);
+    InterNodePartitioning(uint64_t cache_size, uint32_t assoc, uint32_t block_size, const std::vector<uint32_t> &n_slices,
+                          ReplacementPolicy policy = ReplacementPolicy::LRU,
+                          CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const;
-    uint32_t hits(uint32_t client_id) const;
+    uint64_t misses(uint32_t client_id) const;
+    uint64_t hits(uint32_t client_id) const;
     const std::vector<Cache> &memory_nodes(uint32_t client_id);
+    // The shared cache interface, see the top of the file.
+    uint32_t block_size() const noexcept;
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+    void set_next_use(const std::shared_ptr<const NextUseReader>& next_use);
+    void set_tag_store(const TagStoreOptions& options);
 private:
     // Memory node list per client.
     // memory_nodes[i][j] = slice j of client i
@@ -45,35 +70,53 @@ struct fixed_bits_t {
 
 class IntraNodePartitioning {
 public:
-    IntraNodePartitioning(uint64_t cache_size, uint32_t assoc, uint32_t block_size, std::vector<fixed_bits_t> aux_table);
+    // Throws std::invalid_argument unless `organization` is set-associative, the aux table picks sets.
+    IntraNodePartitioning(uint64_t cache_size, uint32_t assoc, uint32_t block_size, std::vector<fixed_bits_t> aux_table,
+                          ReplacementPolicy policy = ReplacementPolicy::LRU,
+                          CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const;
-    uint32_t hits(uint32_t client_id) const;
+    uint64_t misses(uint32_t client_id) const;
+    uint64_t hits(uint32_t client_id) const;
     Cache &cache();
+    // The shared cache interface, see the top of the file.
+    uint32_t block_size() const noexcept;
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+    void set_next_use(const std::shared_ptr<const NextUseReader>& next_use);
+    void set_tag_store(const TagStoreOptions& options);
 private:
     Cache cache_;
     std::vector<fixed_bits_t> aux_table_;
     // Hits/Misses per client.
-    std::vector<std::pair<uint32_t, uint32_t>> stats_;
+    std::vector<std::pair<uint64_t, uint64_t>> stats_;
+    bool stats_enabled_ = true;
 };
 
 class ClusterWayPartitioning {
 public:
     ClusterWayPartitioning(uint32_t n_clusters, uint64_t slice_size, uint32_t block_size,
-                           const std::vector<uint32_t> &n_ways);
+                           const std::vector<uint32_t> &n_ways, ReplacementPolicy policy = ReplacementPolicy::LRU,
+                           CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const;
-    uint32_t hits(uint32_t client_id) const;
+    uint64_t misses(uint32_t client_id) const;
+    uint64_t hits(uint32_t client_id) const;
     std::vector<WayPartitioning> &clusters();
     uint32_t n_clusters() const;
+    // The shared cache interface, see the top of the file.
+    uint32_t block_size() const noexcept;
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+    void set_next_use(const std::shared_ptr<const NextUseReader>& next_use);
+    void set_tag_store(const TagStoreOptions& options);
 private:
     uint32_t block_size_;
     using cluster_t_intra_node_t = WayPartitioning;
     std::vector<cluster_t_intra_node_t> clusters_;
     // Hits/Misses per client.
-    std::vector<std::pair<uint32_t, uint32_t>> stats_;
+    std::vector<std::pair<uint64_t, uint64_t>> stats_;
+    bool stats_enabled_ = true;
 };
 
 struct inter_intra_aux_table_entry_t {
@@ -88,17 +131,26 @@ struct inter_intra_aux_table_t {
 
 class InterIntraNodePartitioning {
 public:
+    // Throws std::invalid_argument unless `organization` is set-associative, the aux tables pick sets.
     InterIntraNodePartitioning(uint32_t assoc, uint32_t block_size,
                                // n_cache_sizes[clusterId][client] -> Size of the private cache of that client
-                               const std::vector<std::vector<uint32_t>> &n_cache_sizes,
+                               const std::vector<std::vector<uint64_t>> &n_cache_sizes,
                                // aux_tables_per_client[client] -> Auxiliary table for client
-                               const std::vector<inter_intra_aux_table_t>& aux_tables_per_client);
+                               const std::vector<inter_intra_aux_table_t>& aux_tables_per_client,
+                               ReplacementPolicy policy = ReplacementPolicy::LRU,
+                               CacheOrganization organization = CacheOrganization::SET_ASSOCIATIVE);
 
     bool access(uint32_t client_id, uintptr_t addr);
-    uint32_t misses(uint32_t client_id) const;
-    uint32_t hits(uint32_t client_id) const;
+    uint64_t misses(uint32_t client_id) const;
+    uint64_t hits(uint32_t client_id) const;
     Cache& get_cache_slice(uint32_t client_id, uint32_t cluster_id);
     uint32_t n_clusters() const;
+    // The shared cache interface, see the top of the file.
+    uint32_t block_size() const noexcept;
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+    void set_next_use(const std::shared_ptr<const NextUseReader>& next_use);
+    void set_tag_store(const TagStoreOptions& options);
 private:
     std::vector<inter_intra_aux_table_t> aux_tables_per_client_;
     // inp[cluster][client] -> Cache of that client has in cluster.
@@ -107,7 +159,8 @@ private:
     // Set bits is the maximum number of set bits for each cache.
     uint32_t set_bits_;
     // Hits/Misses per client.
-    std::vector<std::pair<uint32_t, uint32_t>> stats_;
+    std::vector<std::pair<uint64_t, uint64_t>> stats_;
+    bool stats_enabled_ = true;
 };
 
 template <class L2Cache>
@@ -118,6 +171,9 @@ public:
 
     // Returns true if hits in either L1 or L2
     bool access(uint32_t core_id, uint32_t client_id, uintptr_t addr);
+    // Same as `weight` consecutive accesses of core_id to the line of addr: the first one as above,
+    // the rest L1 hits.
+    bool access(uint32_t core_id, uint32_t client_id, uintptr_t addr, uint32_t weight);
 
     Cache& get_private_cache(uint32_t core_id);
 
@@ -125,15 +181,27 @@ public:
     const L2Cache& get_shared_cache() const;
 
     // returns the number of misses in the L2 cache
-    [[nodiscard]] uint32_t misses(uint32_t client_id) const;
-    [[nodiscard]] uint32_t num_total_accesses(uint32_t client_id) const;
+    [[nodiscard]] uint64_t misses(uint32_t client_id) const;
+    [[nodiscard]] uint64_t num_total_accesses(uint32_t client_id) const;
+
+    // Of every level.
+    void reset_stats() noexcept;
+    void set_stats_enabled(bool enabled) noexcept;
+
+    // Of the shared cache only. Its next uses are of the accesses that miss in the private caches,
+    // see build_shared_next_use(), advanced before every shared access. The private caches stay in
+    // memory.
+    void set_next_use(std::shared_ptr<NextUseReader> next_use);
+    void set_tag_store(const TagStoreOptions& options);
 
 private:
     std::vector<Cache> private_caches_;
     L2Cache shared_cache_;
+    std::shared_ptr<NextUseReader> next_use_;
+    uint32_t shared_block_bits_ = 0;
 };
 template<class L2Cache>
-uint32_t MultiLevelCache<L2Cache>::num_total_accesses(uint32_t client_id) const {
+uint64_t MultiLevelCache<L2Cache>::num_total_accesses(uint32_t client_id) const {
     return shared_cache_.misses(client_id) + shared_cache_.hits(client_id);
 }
 template<class L2Cache>
@@ -142,7 +210,7 @@ const L2Cache &MultiLevelCache<L2Cache>::get_shared_cache() const {
 }
 
 template<class L2Cache>
-uint32_t MultiLevelCache<L2Cache>::misses(uint32_t client_id) const {
+uint64_t MultiLevelCache<L2Cache>::misses(uint32_t client_id) const {
     return shared_cache_.misses(client_id);
 }
 
@@ -156,9 +224,49 @@ bool MultiLevelCache<L2Cache>::access(uint32_t core_id, uint32_t client_id, uint
     }
 
     // We didn't hit in L1, try in shared L2
+    if (next_use_ != nullptr) {
+        next_use_->advance(addr >> shared_block_bits_);
+    }
     return shared_cache_.access(client_id, addr);
 }
 
+template<class L2Cache>
+bool MultiLevelCache<L2Cache>::access(uint32_t core_id, uint32_t client_id, uintptr_t addr, uint32_t weight) {
+    bool hit = access(core_id, client_id, addr);
+    if (weight > 1) {
+        get_private_cache(core_id).add_hits(weight - 1);
+    }
+    return hit;
+}
+
+template<class L2Cache>
+void MultiLevelCache<L2Cache>::reset_stats() noexcept {
+    for (auto& private_cache: private_caches_) {
+        private_cache.reset_stats();
+    }
+    shared_cache_.reset_stats();
+}
+
+template<class L2Cache>
+void MultiLevelCache<L2Cache>::set_stats_enabled(bool enabled) noexcept {
+    for (auto& private_cache: private_caches_) {
+        private_cache.set_stats_enabled(enabled);
+    }
+    shared_cache_.set_stats_enabled(enabled);
+}
+
+template<class L2Cache>
+void MultiLevelCache<L2Cache>::set_next_use(std::shared_ptr<NextUseReader> next_use) {
+    shared_cache_.set_next_use(next_use);
+    next_use_ = std::move(next_use);
+    shared_block_bits_ = Cache::log2(shared_cache_.block_size());
+}
+
+template<class L2Cache>
+void MultiLevelCache<L2Cache>::set_tag_store(const TagStoreOptions& options) {
+    shared_cache_.set_tag_store(options);
+}
+
 template<class L2Cache>
 Cache &MultiLevelCache<L2Cache>::get_private_cache(uint32_t core_id) {
     return private_caches_.at(core_id);
@@ -1,8 +1,26 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
 #include <iostream>
-#include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
+#include "cache_kernels.hpp"
+#include "cache_organization.hpp"
+#include "columnar_trace.hpp"
+#include "compressed_trace.hpp"
+#include "llc_partitioning.hpp"
+#include "replacement_policy.hpp"
 #include "statistics_generator.hpp"
+#include "trace_index.hpp"
+#include "trace_metadata.hpp"
+#include "trace_next_use.hpp"
+#include "trace_prefetcher.hpp"
+#include "trace_reader.hpp"
+#include "trace_roi.hpp"
+#include "trace_splitter.hpp"
+
+#include <unistd.h>
 
 static const std::string& get_opt(const std::vector<std::string>& args, const std::string& option) {
     auto itr =  std::find(args.begin(), args.end(), option);
@@ -14,27 +32,21 @@ static const std::string& get_opt(const std::vector<std::string>& args, const st
 }
 
 static void analyze_trace_file(const std::string& trace_file_name) {
-    std::ifstream trace_file(trace_file_name);
-
-    if (!trace_file.is_open()) {
-        std::cerr << "Could not open " << trace_file_name << std::endl;
+    std::unique_ptr<TraceReader> trace;
+    try {
+        trace = open_trace_reader(trace_file_name, detect_trace_format(trace_file_name));
+    } catch (const std::exception& ex) {
+        std::cerr << "Could not open " << trace_file_name << ": " << ex.what() << std::endl;
         return;
     }
 
-    uintptr_t addr, cpu_index;
-    bool is_store;
-    size_t line_no = 1;
-    while (true) {
-        // This reads until it encounters white space, not just newline.
-        if (!(trace_file >> std::hex >> addr >> std::hex >> cpu_index >> is_store)) {
-            if (trace_file.eof()) {
-                return;
-            }
-            std::cerr << "Format error on line " << line_no << std::endl;
-            return;
-        }
-        ++line_no;
-        std::cout << std::hex << addr << " " << std::hex << cpu_index << " " << is_store << std::endl;
+    try {
+        for_each_trace_record(*trace, [](const TraceRecord& record) {
+            std::cout << std::hex << record.addr << " " << std::hex << (uint32_t) record.cpu_index << " "
+                      << (uint32_t) record.type << " " << std::dec << record.timestamp << std::endl;
+        });
+    } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << std::endl;
     }
 }
 
@@ -61,12 +73,455 @@ int main_standalone(int argc, char *argv[]) {
     return 0;
 }
 
-int main_statistics(int arg, char** argv) {
-    generate_stats();
+// Converts a text or plugin binary trace into the columnar format.
+int main_convert(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    auto input = get_opt(args, "-i");
+    auto output = get_opt(args, "-o");
+    if (input.empty() || output.empty()) {
+        std::cerr << "<usage> cpp_trace_analyzer convert -i <trace_file> -o <output_file> [-f text|binary|columnar|compressed] "
+                     "[--output-format columnar|compressed] [-b <block_records>] [-z]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto& format_name = get_opt(args, "-f");
+        auto format = format_name.empty() ? detect_trace_format(input) : parse_trace_format(format_name);
+        auto& output_format_name = get_opt(args, "--output-format");
+        auto output_format = output_format_name.empty() ? TraceFormat::COLUMNAR : parse_trace_format(output_format_name);
+        auto& block_records = get_opt(args, "-b");
+        // LZ compress columnar blocks too.
+        bool compress = std::find(args.begin(), args.end(), "-z") != args.end();
+
+        auto reader = open_trace_reader(input, format);
+        uint64_t n = 0;
+        if (output_format == TraceFormat::COLUMNAR) {
+            n = convert_to_columnar(*reader, output,
+                                    block_records.empty() ? COLUMNAR_DEFAULT_BLOCK_RECORDS : std::stoul(block_records), compress);
+        } else if (output_format == TraceFormat::COMPRESSED) {
+            CompressedTraceWriter writer(output, block_records.empty() ? COMPRESSED_DEFAULT_BLOCK_RECORDS : std::stoul(block_records));
+            std::vector<TraceRecord> batch(COMPRESSED_DEFAULT_BLOCK_RECORDS);
+            size_t count;
+            while ((count = reader->read(batch.data(), batch.size())) > 0) {
+                writer.write(batch.data(), count);
+                n += count;
+            }
+            writer.close();
+        } else {
+            throw std::invalid_argument("Traces can only be converted to the columnar and compressed formats");
+        }
+        std::cout << "Converted " << n << " records into " << output << std::endl;
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
     return 0;
 }
 
-int main(int argc, char** argv) {
-    main_statistics(argc, argv);
+// Comma-separated numbers, decimal or 0x-prefixed hex.
+static std::vector<uint64_t> parse_number_list(const std::string& list) {
+    std::vector<uint64_t> numbers;
+    std::stringstream stream(list);
+    for (std::string number; std::getline(stream, number, ',');) {
+        numbers.push_back(std::stoull(number, nullptr, 0));
+    }
+    return numbers;
+}
+
+// Splits a trace into one file per core, client or address range.
+int main_split(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    auto input = get_opt(args, "-i");
+    auto output_prefix = get_opt(args, "-o");
+    if (input.empty() || output_prefix.empty()) {
+        std::cerr << "<usage> cpp_trace_analyzer split -i <trace_file> -o <output_prefix> [-f text|binary|columnar|compressed] "
+                     "[--by core|client|address] [--clients <client of core 0>,...] [--ranges <bound>,...] "
+                     "[--output-format text|binary|columnar|compressed] [-j <threads>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto& format_name = get_opt(args, "-f");
+        auto format = format_name.empty() ? detect_trace_format(input) : parse_trace_format(format_name);
+
+        SplitOptions options;
+        auto& mode = get_opt(args, "--by");
+        if (!mode.empty()) {
+            options.mode = parse_split_mode(mode);
+        }
+        for (auto client: parse_number_list(get_opt(args, "--clients"))) {
+            options.core_clients.push_back(client);
+        }
+        options.address_bounds = parse_number_list(get_opt(args, "--ranges"));
+        auto& output_format = get_opt(args, "--output-format");
+        if (!output_format.empty()) {
+            options.output_format = parse_trace_format(output_format);
+        }
+        auto& threads = get_opt(args, "-j");
+        if (!threads.empty()) {
+            options.threads = std::stoul(threads);
+        }
+
+        // Reading overlaps with partitioning and writing. Markers are dropped, they are not of one
+        // core or address range.
+        PrefetchingTraceReader reader(std::make_unique<RoiTraceReader>(open_trace_reader(input, format), RoiMode::OFF));
+        for (const auto& output: split_trace(reader, output_prefix, options)) {
+            std::cout << output.path << ": " << output.records << " records" << std::endl;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+// Builds the sidecar index of a trace and prints its balanced partitions.
+int main_index(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    auto input = get_opt(args, "-i");
+    if (input.empty()) {
+        std::cerr << "<usage> cpp_trace_analyzer index -i <trace_file> [-f text|binary|columnar|compressed] [-n <records per entry>] [-k <partitions>]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto& format_name = get_opt(args, "-f");
+        auto format = format_name.empty() ? detect_trace_format(input) : parse_trace_format(format_name);
+        auto& interval = get_opt(args, "-n");
+        auto& partitions = get_opt(args, "-k");
+
+        auto index = TraceIndex::build(input, format, interval.empty() ? TRACE_INDEX_DEFAULT_INTERVAL : std::stoull(interval));
+        if (format != TraceFormat::COLUMNAR) {
+            index.save(trace_index_path(input));
+        }
+        std::cout << input << ": " << index.num_records() << " records, " << index.entries().size() << " index entries" << std::endl;
+        for (const auto& slice: index.partitions(partitions.empty() ? 1 : std::stoul(partitions))) {
+            std::cout << "records [" << slice.begin_record << ", " << slice.end_record << ")" << std::endl;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+// Prints the metadata of a trace, building its sidecar if needed.
+int main_info(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    auto input = get_opt(args, "-i");
+    if (input.empty()) {
+        std::cerr << "<usage> cpp_trace_analyzer info -i <trace_file> [-f text|binary|columnar|compressed] [--rebuild]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto& format_name = get_opt(args, "-f");
+        auto format = format_name.empty() ? detect_trace_format(input) : parse_trace_format(format_name);
+
+        TraceMetadata metadata;
+        if (std::find(args.begin(), args.end(), "--rebuild") != args.end()) {
+            metadata = TraceMetadata::build(input, format);
+            metadata.save(trace_metadata_path(input));
+        } else {
+            metadata = TraceMetadata::load_or_build(input, format);
+        }
+        std::cout << input << ": " << metadata << std::endl;
+        std::cout << std::hex << "content hash " << metadata.content_hash << std::dec << std::endl;
+        for (size_t core = 0; core < metadata.core_counts.size(); core++) {
+            if (metadata.core_counts[core] > 0) {
+                std::cout << "core " << core << ": " << metadata.core_counts[core] << " records" << std::endl;
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+// Replays a trace through a shared cache under every replacement policy, printing the misses of
+// each and the throughput of the simulation.
+int main_policies(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    auto input = get_opt(args, "-i");
+    if (input.empty()) {
+        std::cerr << "<usage> cpp_trace_analyzer policies -i <trace_file> [-f text|binary|columnar|compressed] "
+                     "[-s <shared cache MiB>] [-a <assoc>] [--policies lru,plru,...] [--organization set|skewed|zcache] "
+                     "[--tag-store <dir> [--resident <MiB>]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        auto& format_name = get_opt(args, "-f");
+        auto format = format_name.empty() ? detect_trace_format(input) : parse_trace_format(format_name);
+        auto& size = get_opt(args, "-s");
+        auto& assoc = get_opt(args, "-a");
+        uint64_t cache_size = (size.empty() ? 8 : std::stoull(size)) * 1024 * 1024;
+        uint32_t cache_assoc = assoc.empty() ? 16 : std::stoul(assoc);
+        auto& organization_name = get_opt(args, "--organization");
+        auto organization = organization_name.empty() ? CacheOrganization::SET_ASSOCIATIVE
+                                                      : parse_cache_organization(organization_name);
+        TagStoreOptions tag_store;
+        tag_store.directory = get_opt(args, "--tag-store");
+        auto& resident = get_opt(args, "--resident");
+        if (!resident.empty()) {
+            tag_store.resident_bytes = std::stoull(resident) * 1024 * 1024;
+        }
+        std::vector<ReplacementPolicy> policies;
+        std::stringstream policy_names(get_opt(args, "--policies"));
+        for (std::string name; std::getline(policy_names, name, ',');) {
+            policies.push_back(parse_replacement_policy(name));
+        }
+        if (policies.empty() && organization != CacheOrganization::SET_ASSOCIATIVE) {
+            policies = {ReplacementPolicy::LRU, ReplacementPolicy::MIN};
+        } else if (policies.empty()) {
+            policies = {ReplacementPolicy::LRU, ReplacementPolicy::PLRU, ReplacementPolicy::NRU,
+                        ReplacementPolicy::SRRIP, ReplacementPolicy::BRRIP, ReplacementPolicy::DRRIP,
+                        ReplacementPolicy::MIN};
+        }
+
+        // Decoded once, so that only the simulation is timed.
+        std::vector<TraceRecord> records;
+        uint32_t num_cores = 1;
+        auto reader = open_trace_reader(input, format);
+        for_each_trace_record(*reader, [&](const TraceRecord& record) {
+            if (!record.is_marker()) {
+                records.push_back(record);
+                num_cores = std::max<uint32_t>(num_cores, record.cpu_index + 1);
+            }
+        });
+
+        // The private caches of the experiments, 64 KiB 4-way.
+        const uint32_t block_size = 64;
+        Cache private_cache(64 * 1024, 4, block_size);
+
+        // MIN reads the next uses from a file built by a pass of its own, not timed either.
+        std::string next_use_path;
+        if (std::find(policies.begin(), policies.end(), ReplacementPolicy::MIN) != policies.end()) {
+            next_use_path = (std::filesystem::temp_directory_path() /
+                             ("asgard_next_use_" + std::to_string(::getpid()))).string();
+            build_shared_next_use(*open_trace_reader(input, format), num_cores, private_cache, block_size, next_use_path);
+        }
+        struct RemoveFile {
+            const std::string& path;
+            ~RemoveFile() {
+                std::error_code error;
+                std::filesystem::remove(path, error);
+            }
+        } remove_next_use{next_use_path};
+
+        for (auto policy: policies) {
+            MultiLevelCache<Cache> cache(num_cores, private_cache, Cache(cache_size, cache_assoc, block_size, policy, organization));
+            if (policy == ReplacementPolicy::MIN) {
+                cache.set_next_use(std::make_shared<NextUseReader>(next_use_path));
+            }
+            if (!tag_store.directory.empty()) {
+                cache.set_tag_store(tag_store);
+            }
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& record: records) {
+                cache.access(record.cpu_index, 0, record.addr);
+            }
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+            auto& shared = cache.get_shared_cache();
+            uint64_t accesses = shared.misses() + shared.hits();
+            std::cout << replacement_policy_name(policy) << ": " << shared.misses() << " misses of " << accesses
+                      << " shared accesses (" << (accesses == 0 ? 0 : 100.0 * shared.misses() / accesses) << "%), "
+                      << records.size() / seconds.count() / 1e6 << " M records/s" << std::endl;
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return EXIT_FAILURE;
+    }
     return 0;
+}
+
+int main_statistics(int argc, char** argv) {
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        args.emplace_back(argv[i]);
+    }
+
+    StatisticsOptions options;
+    try {
+        auto& trace_name = get_opt(args, "--trace");
+        if (!trace_name.empty()) {
+            options.trace_name = trace_name;
+        }
+        auto& format = get_opt(args, "--format");
+        if (!format.empty()) {
+            options.trace_format = parse_trace_format(format);
+        }
+        auto& core_stride = get_opt(args, "--merge-core-stride");
+        if (!core_stride.empty()) {
+            options.merge_core_stride = std::stoul(core_stride);
+        }
+        auto parse_bound = [&](const std::string& option, uint64_t& bound) {
+            auto& value = get_opt(args, option);
+            if (!value.empty()) {
+                bound = std::stoull(value, nullptr, 0);
+            }
+        };
+        parse_bound("--start-record", options.slice.begin_record);
+        parse_bound("--end-record", options.slice.end_record);
+        parse_bound("--start-time", options.slice.begin_timestamp);
+        parse_bound("--end-time", options.slice.end_timestamp);
+        auto& partition = get_opt(args, "--partition");
+        if (!partition.empty()) {
+            auto slash = partition.find('/');
+            if (slash == std::string::npos) {
+                throw std::invalid_argument("Partitions are given as <index>/<count>");
+            }
+            options.partition = std::stoul(partition.substr(0, slash));
+            options.num_partitions = std::stoul(partition.substr(slash + 1));
+            if (options.partition >= options.num_partitions) {
+                throw std::invalid_argument("Partition index out of range");
+            }
+        }
+        auto& cores = get_opt(args, "--cores");
+        if (!cores.empty()) {
+            std::vector<uint32_t> kept_cores;
+            for (auto core: parse_number_list(cores)) {
+                kept_cores.push_back(core);
+            }
+            options.filter.keep_only_cores(kept_cores);
+        }
+        auto& addr_range = get_opt(args, "--addr-range");
+        if (!addr_range.empty()) {
+            auto colon = addr_range.find(':');
+            if (colon == std::string::npos) {
+                throw std::invalid_argument("Address ranges are given as <first>:<last>");
+            }
+            options.filter.min_addr = std::stoull(addr_range.substr(0, colon), nullptr, 0);
+            options.filter.max_addr = std::stoull(addr_range.substr(colon + 1), nullptr, 0);
+        }
+        auto& types = get_opt(args, "--types");
+        if (!types.empty()) {
+            std::vector<AccessType> kept_types;
+            std::stringstream type_stream(types);
+            for (std::string type; std::getline(type_stream, type, ',');) {
+                if (type == "insn") {
+                    kept_types.push_back(AccessType::INSTRUCTION);
+                } else if (type == "load") {
+                    kept_types.push_back(AccessType::LOAD);
+                } else if (type == "store") {
+                    kept_types.push_back(AccessType::STORE);
+                } else {
+                    throw std::invalid_argument("Unknown access type '" + type + "'");
+                }
+            }
+            options.filter.keep_only_types(kept_types);
+        }
+        options.cache_traces = std::find(args.begin(), args.end(), "--no-trace-cache") == args.end();
+        auto& cache_budget = get_opt(args, "--trace-cache-budget");
+        if (!cache_budget.empty()) {
+            options.cache_options.raw_budget_bytes = std::stoull(cache_budget) * 1024 * 1024;
+        }
+        auto& sample_period = get_opt(args, "--sample-period");
+        if (!sample_period.empty()) {
+            options.sampling.period = std::stoull(sample_period);
+        }
+        auto& sample_window = get_opt(args, "--sample-window");
+        if (!sample_window.empty()) {
+            options.sampling.window = std::stoull(sample_window);
+        }
+        auto& sample_warming = get_opt(args, "--sample-warming");
+        if (!sample_warming.empty()) {
+            options.sampling.warming = std::stoull(sample_warming);
+        }
+        auto& confidence = get_opt(args, "--sample-confidence");
+        if (!confidence.empty()) {
+            options.sampling.confidence = std::stod(confidence);
+        }
+        options.sampling.validate();
+        auto& roi = get_opt(args, "--roi");
+        if (!roi.empty()) {
+            options.roi_mode = parse_roi_mode(roi);
+        }
+        if (options.roi_mode != RoiMode::OFF && options.sampling.enabled()) {
+            // Resets and pauses at the markers would fall in the middle of the sampling windows.
+            throw std::invalid_argument("Sampling can not be combined with regions of interest (--roi)");
+        }
+        options.collapse_repeats = std::find(args.begin(), args.end(), "--no-collapse") == args.end();
+        options.prefetch = std::find(args.begin(), args.end(), "--no-prefetch") == args.end();
+        auto& buffer_records = get_opt(args, "--prefetch-buffer");
+        if (!buffer_records.empty()) {
+            options.prefetch_options.buffer_records = std::stoul(buffer_records);
+        }
+        auto& depth = get_opt(args, "--prefetch-depth");
+        if (!depth.empty()) {
+            options.prefetch_options.depth = std::stoul(depth);
+        }
+        auto& llc_policy = get_opt(args, "--llc-policy");
+        if (!llc_policy.empty()) {
+            options.llc_policy = parse_replacement_policy(llc_policy);
+        }
+        auto& llc_organization = get_opt(args, "--llc-organization");
+        if (!llc_organization.empty()) {
+            options.llc_organization = parse_cache_organization(llc_organization);
+        }
+        options.llc_tag_store.directory = get_opt(args, "--llc-tag-store");
+        auto& llc_resident = get_opt(args, "--llc-resident");
+        if (!llc_resident.empty()) {
+            options.llc_tag_store.resident_bytes = std::stoull(llc_resident) * 1024 * 1024;
+        }
+        if (!options.llc_tag_store.directory.empty() && options.llc_organization != CacheOrganization::SET_ASSOCIATIVE) {
+            throw std::invalid_argument("Only set-associative shared caches have a tag store");
+        }
+        if (options.llc_policy == ReplacementPolicy::MIN && options.sampling.enabled() && options.sampling.warming != 0) {
+            // The next uses are of every access, the records skipped between windows would be missing.
+            throw std::invalid_argument("MIN replacement needs continuous warming (--sample-warming 0) when sampling");
+        }
+        auto& kernels = get_opt(args, "--cache-kernels");
+        if (!kernels.empty()) {
+            select_cache_kernels(kernels);
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        std::cerr << "<usage> cpp_trace_analyzer [--trace <name|path|-|shm:/name>[,...]] [--format text|binary|columnar|compressed] [--merge-core-stride <cores>] [--start-record <n>] [--end-record <n>] [--start-time <ns>] [--end-time <ns>] [--partition <i>/<k>] [--cores <core>,...] [--addr-range <first>:<last>] [--types insn|load|store,...] [--no-trace-cache] [--trace-cache-budget <MiB>] [--sample-period <records> [--sample-window <records>] [--sample-warming <records>] [--sample-confidence <0-1>]] [--roi off|skip|warm] [--no-collapse] [--no-prefetch] [--prefetch-buffer <records>] [--prefetch-depth <buffers>] [--llc-policy lru|plru|nru|srrip|brrip|drrip|min] [--llc-organization set|skewed|zcache] [--llc-tag-store <dir> [--llc-resident <MiB>]] [--cache-kernels scalar|sse2|avx2|avx512]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    generate_stats(options);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "convert") {
+        return main_convert(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "index") {
+        return main_index(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "info") {
+        return main_info(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "policies") {
+        return main_policies(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string(argv[1]) == "split") {
+        return main_split(argc - 1, argv + 1);
+    }
+    return main_statistics(argc, argv);
 }
\ No newline at end of file
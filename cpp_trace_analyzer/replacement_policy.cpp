@@ -0,0 +1,19 @@
+#include "replacement_policy.hpp"
+
+#include <iterator>
+#include <stdexcept>
+
+static const char *const policy_names[] = {"lru", "plru", "nru", "srrip", "brrip", "drrip", "min"};
+
+ReplacementPolicy parse_replacement_policy(const std::string& name) {
+    for (size_t i = 0; i < std::size(policy_names); i++) {
+        if (name == policy_names[i]) {
+            return static_cast<ReplacementPolicy>(i);
+        }
+    }
+    throw std::invalid_argument("Unknown replacement policy '" + name + "'");
+}
+
+const char *replacement_policy_name(ReplacementPolicy policy) {
+    return policy_names[static_cast<size_t>(policy)];
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+/*
+ * Replacement policies of Cache. Their state lives in the RANK_BITS bits of each packed line word
+ * (see Cache), so none of them costs memory per line:
+ *
+ *   LRU    rank of the way, 0 for the most recently used.
+ *   PLRU   tree pseudo-LRU, each node pointing to the half of the set to replace next. Node i
+ *          is bit 0 of the state of way i, or bit 1 of way i - assoc. With an associativity
+ *          that is not a power of two, the tree spans the next one and the empty halves are
+ *          never replaced.
+ *   NRU    one "not recently used" bit, all of them set again when none is left.
+ *   SRRIP  2-bit re-reference prediction value (RRPV): 0 on a hit, 2 on a fill, victims at 3
+ *          (Jaleel et al., ISCA 2010).
+ *   BRRIP  SRRIP filling at 3, and at 2 only once every BRRIP_FILL_PERIOD fills.
+ *   DRRIP  set dueling between SRRIP and BRRIP: a few leader sets always use one of them and a
+ *          saturating counter of their misses picks the policy of the other sets.
+ *   MIN    Belady's optimal replacement, evicting the line used again furthest in the future. An
+ *          oracle: it needs the next uses of the accesses, see trace_next_use.hpp, and keeps
+ *          them next to the lines, 8 more bytes per line.
+ *
+ * With every policy, invalid ways are filled first.
+ */
+enum class ReplacementPolicy {
+    LRU,
+    PLRU,
+    NRU,
+    SRRIP,
+    BRRIP,
+    DRRIP,
+    MIN
+};
+
+// Parses "lru", "plru", "nru", "srrip", "brrip", "drrip" or "min". Throws std::invalid_argument otherwise.
+ReplacementPolicy parse_replacement_policy(const std::string& name);
+const char *replacement_policy_name(ReplacementPolicy policy);
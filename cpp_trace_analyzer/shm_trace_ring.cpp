@@ -0,0 +1,184 @@
+#include "shm_trace_ring.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Spins first, then yields, then sleeps, so an idle end does not burn a core for long.
+static void backoff(uint32_t& attempt) {
+    if (attempt < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (attempt < 128) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    attempt++;
+}
+
+static size_t ring_mapping_size(uint64_t capacity) {
+    return sizeof(ShmRingHeader) + capacity * sizeof(ShmRingSlot);
+}
+
+bool is_shm_trace(const std::string& path) {
+    return path.rfind(SHM_TRACE_PREFIX, 0) == 0;
+}
+
+ShmTraceReader::ShmTraceReader(const std::string& name, uint64_t capacity) : name_(name), tail_(0), cancelled_(false) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        throw std::invalid_argument("Ring capacity should be power of 2!");
+    }
+
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create shared memory '" + name + "': " + std::strerror(errno));
+    }
+    mapping_size_ = ring_mapping_size(capacity);
+    void *addr = MAP_FAILED;
+    if (::ftruncate(fd, mapping_size_) == 0) {
+        addr = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int error = errno;
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("Could not map shared memory '" + name + "': " + std::strerror(error));
+    }
+
+    header_ = new (addr) ShmRingHeader();
+    slots_ = reinterpret_cast<ShmRingSlot *>(static_cast<uint8_t *>(addr) + sizeof(ShmRingHeader));
+    header_->version = SHM_RING_VERSION;
+    header_->slot_size = sizeof(ShmRingSlot);
+    header_->capacity = capacity;
+    for (uint64_t i = 0; i < capacity; i++) {
+        new (&slots_[i]) ShmRingSlot();
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    // Producers spin on the magic before touching anything else.
+    header_->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+}
+
+ShmTraceReader::~ShmTraceReader() {
+    ::munmap(header_, mapping_size_);
+    ::shm_unlink(name_.c_str());
+}
+
+size_t ShmTraceReader::read(TraceRecord *records, size_t max_records) {
+    const uint64_t capacity = header_->capacity;
+    const uint64_t mask = capacity - 1;
+
+    size_t n = 0;
+    uint32_t attempt = 0;
+    while (n < max_records) {
+        auto& slot = slots_[tail_ & mask];
+        if (slot.sequence.load(std::memory_order_acquire) == tail_ + 1) {
+            records[n++] = BinaryTraceReader::decode(slot.record);
+            // Hand the slot back to the producer that will claim it one lap later.
+            slot.sequence.store(tail_ + capacity, std::memory_order_release);
+            tail_++;
+            attempt = 0;
+            continue;
+        }
+
+        // Empty. Return what we have rather than wait for a full batch.
+        if (n > 0) {
+            break;
+        }
+        // `closed` is set after the last producer finished writing, so if nothing was claimed
+        // past our position once it is set, the trace is over.
+        if (header_->closed.load(std::memory_order_acquire) &&
+            header_->head.load(std::memory_order_acquire) == tail_) {
+            break;
+        }
+        // Records left in the ring stay there, the producers are not waited for either.
+        if (cancelled_.load(std::memory_order_relaxed)) {
+            break;
+        }
+        backoff(attempt);
+    }
+    header_->tail.store(tail_, std::memory_order_relaxed);
+    return n;
+}
+
+void ShmTraceReader::cancel() noexcept {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+ShmTraceWriter::ShmTraceWriter(const std::string& name) {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open shared memory '" + name + "': " + std::strerror(errno));
+    }
+    struct stat st {};
+    void *addr = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ShmRingHeader)) {
+        addr = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("Could not map shared memory '" + name + "'");
+    }
+    mapping_size_ = st.st_size;
+    header_ = static_cast<ShmRingHeader *>(addr);
+    slots_ = reinterpret_cast<ShmRingSlot *>(static_cast<uint8_t *>(addr) + sizeof(ShmRingHeader));
+
+    uint32_t attempt = 0;
+    while (header_->magic.load(std::memory_order_acquire) != SHM_RING_MAGIC) {
+        if (attempt > 100000) {
+            ::munmap(header_, mapping_size_);
+            throw std::runtime_error("Shared memory '" + name + "' is not a trace ring");
+        }
+        backoff(attempt);
+    }
+    if (header_->version != SHM_RING_VERSION || header_->slot_size != sizeof(ShmRingSlot) ||
+        ring_mapping_size(header_->capacity) > mapping_size_) {
+        ::munmap(header_, mapping_size_);
+        throw std::runtime_error("Incompatible trace ring in '" + name + "'");
+    }
+}
+
+ShmTraceWriter::~ShmTraceWriter() {
+    ::munmap(header_, mapping_size_);
+}
+
+void ShmTraceWriter::write(const TraceRecord& record) {
+    const uint64_t mask = header_->capacity - 1;
+
+    uint64_t pos = header_->head.load(std::memory_order_relaxed);
+    uint32_t attempt = 0;
+    while (true) {
+        auto& slot = slots_[pos & mask];
+        uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<int64_t>(sequence - pos);
+        if (diff == 0) {
+            if (header_->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                std::memcpy(slot.record, &record.addr, 8);
+                std::memcpy(slot.record + 8, &record.timestamp, 8);
+                slot.record[16] = static_cast<uint8_t>(record.type);
+                slot.record[17] = record.cpu_index;
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return;
+            }
+        } else if (diff < 0) {
+            // Full: wait for the consumer instead of dropping the record.
+            backoff(attempt);
+            pos = header_->head.load(std::memory_order_relaxed);
+        } else {
+            pos = header_->head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void ShmTraceWriter::close() {
+    header_->closed.store(1, std::memory_order_release);
+}
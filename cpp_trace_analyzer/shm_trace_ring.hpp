@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "trace_reader.hpp"
+
+/*
+ * Shared-memory transport between the tracer plugin and the simulator.
+ *
+ * The segment is a POSIX shm object holding a header followed by a power-of-two ring of slots.
+ * Producers (one per vCPU thread) and the single consumer follow the bounded MPMC queue protocol
+ * of D. Vyukov: every slot carries a sequence number that tells whether it is free for the
+ * producer claiming position `pos` (sequence == pos) or holds a record for the consumer
+ * (sequence == pos + 1). A full ring makes producers wait, so records are never dropped.
+ *
+ * The consumer creates the segment, producers attach to it. The layout is mirrored by
+ * qemu-tracer/.../components/trace/shm_ring.rs, keep both in sync.
+ */
+
+constexpr uint64_t SHM_RING_MAGIC = 0x474e495254475341; // "ASGTRING"
+constexpr uint32_t SHM_RING_VERSION = 1;
+constexpr uint64_t SHM_RING_DEFAULT_CAPACITY = 1 << 20;
+
+// Prefix of trace paths naming a shared-memory ring, e.g. "shm:/asgard".
+constexpr const char *SHM_TRACE_PREFIX = "shm:";
+
+struct ShmRingHeader {
+    // Written last by the creator, with release semantics.
+    alignas(64) std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    // Next position claimed by a producer.
+    alignas(64) std::atomic<uint64_t> head;
+    // Next position read by the consumer.
+    alignas(64) std::atomic<uint64_t> tail;
+    // Set once every producer is done.
+    alignas(64) std::atomic<uint32_t> closed;
+};
+
+struct ShmRingSlot {
+    std::atomic<uint64_t> sequence;
+    // Same 18-byte record the plugin writes to trace files.
+    uint8_t record[18];
+    uint8_t padding[6];
+};
+
+static_assert(sizeof(ShmRingSlot) == 32);
+static_assert(sizeof(ShmRingHeader) == 256);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+bool is_shm_trace(const std::string& path);
+
+// Consumer end: creates the segment and reads records until the producers close it.
+class ShmTraceReader : public TraceReader {
+public:
+    // `name` is the shm object name, starting with a slash. `capacity` must be a power of 2.
+    explicit ShmTraceReader(const std::string& name, uint64_t capacity = SHM_RING_DEFAULT_CAPACITY);
+    ~ShmTraceReader() override;
+
+    ShmTraceReader(const ShmTraceReader&) = delete;
+    ShmTraceReader& operator=(const ShmTraceReader&) = delete;
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    std::string name_;
+    ShmRingHeader *header_;
+    ShmRingSlot *slots_;
+    size_t mapping_size_;
+    uint64_t tail_;
+    std::atomic<bool> cancelled_;
+};
+
+// Producer end. The tracer plugin has its own implementation, this one is for tools and tests.
+class ShmTraceWriter {
+public:
+    explicit ShmTraceWriter(const std::string& name);
+    ~ShmTraceWriter();
+
+    ShmTraceWriter(const ShmTraceWriter&) = delete;
+    ShmTraceWriter& operator=(const ShmTraceWriter&) = delete;
+
+    // Thread safe. Waits while the ring is full.
+    void write(const TraceRecord& record);
+    // Marks the end of the trace. Call once every producer thread is done.
+    void close();
+private:
+    ShmRingHeader *header_;
+    ShmRingSlot *slots_;
+    size_t mapping_size_;
+};
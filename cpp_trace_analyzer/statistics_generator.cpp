@@ -1,12 +1,32 @@
+#include <cmath>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <numeric>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <vector>
 
 #include "cache.hpp"
 #include "llc_partitioning.hpp"
+#include "statistics_generator.hpp"
+#include "trace_cache.hpp"
+#include "trace_collapse.hpp"
+#include "trace_filter.hpp"
+#include "trace_merger.hpp"
+#include "trace_metadata.hpp"
+#include "trace_next_use.hpp"
+#include "trace_prefetcher.hpp"
+#include "trace_reader.hpp"
+#include "trace_roi.hpp"
+#include "trace_sampling.hpp"
+#include "trace_splitter.hpp"
+
+#include <unistd.h>
 
 #define ASSERT(cond) \
     do \
@@ -18,34 +38,280 @@
         } \
     } while(0)
 
-void load_trace(const std::string& name, std::ifstream& out_file) {
-    out_file.open("../traces/" + name);
-    if (!out_file.is_open()) {
-        std::cerr << "Could not open trace file '" << name << "'" << std::endl;
+static StatisticsOptions stats_options;
+
+// Bare names refer to files in ../traces/, anything with a slash (or "-" for stdin) is used as is.
+static std::string trace_path(const std::string& name) {
+    if (name == STDIN_TRACE_PATH || name.find('/') != std::string::npos) {
+        return name;
+    }
+    return "../traces/" + name;
+}
+
+static TraceFormat trace_format(const std::string& path) {
+    return stats_options.trace_format.has_value() ? *stats_options.trace_format : detect_trace_format(path);
+}
+
+// Whether the experiments read the single trace file `name` from start to end, so its metadata
+// describes what they see.
+static bool reads_whole_file(const std::string& name) {
+    return name.find(',') == std::string::npos && !is_stream_trace(trace_path(name)) && stats_options.slice.whole_trace() &&
+           stats_options.num_partitions == 1 && stats_options.filter.keeps_everything();
+}
+
+// Whether any of the comma-separated traces of `name` is a stream.
+static bool reads_stream(const std::string& name) {
+    std::stringstream name_stream(name);
+    for (std::string part; std::getline(name_stream, part, ',');) {
+        if (is_stream_trace(trace_path(part))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Opens a single trace file or stream, without prefetching. The inputs of a merge are read
+// `sequential`ly, see open_trace_reader.
+static std::unique_ptr<TraceReader> open_trace(const std::string& path, bool sequential = false) {
+    if (is_stream_trace(path)) {
+        // A stream can be replayed only once.
+        static std::set<std::string> consumed_streams;
+        if (!consumed_streams.insert(path).second) {
+            throw std::runtime_error("the stream was already replayed by a previous experiment");
+        }
+    }
+
+    auto format = trace_format(path);
+    const auto& filter = stats_options.filter;
+    auto slice = stats_options.slice;
+    if (!slice.whole_trace() || stats_options.num_partitions > 1) {
+        if (is_stream_trace(path)) {
+            throw std::runtime_error("streams can not be sliced");
+        }
+        auto index = TraceIndex::load_or_build(path, format);
+        if (stats_options.num_partitions > 1) {
+            auto partition = index.partitions(stats_options.num_partitions).at(stats_options.partition);
+            slice.begin_record = partition.begin_record;
+            slice.end_record = partition.end_record;
+        }
+        auto sliced = open_trace_slice(path, index, slice, sequential);
+        if (filter.keeps_everything()) {
+            return sliced;
+        }
+        return std::make_unique<FilteredTraceReader>(std::move(sliced), filter);
+    }
+    if (!filter.keeps_everything()) {
+        return open_filtered_trace_reader(path, format, filter, sequential);
+    }
+    // The prefetch thread does the I/O, so binary traces are read explicitly rather than page-faulted in.
+    if (stats_options.prefetch && format == TraceFormat::BINARY && !is_stream_trace(path)) {
+        if (sequential) {
+            return std::make_unique<BufferedBinaryTraceReader>(path, SEQUENTIAL_READER_BUFFER_BYTES);
+        }
+        return std::make_unique<BufferedBinaryTraceReader>(path);
+    }
+    return open_trace_reader(path, format, sequential);
+}
+
+// `name` may list several comma-separated traces, which are merged by timestamp. A nonzero
+// `expected_records` bounds the prefetch buffers of small traces.
+static std::unique_ptr<TraceReader> open_traces(const std::string& name, uint64_t expected_records = 0) {
+    try {
+        std::vector<std::string> names;
+        std::stringstream name_stream(name);
+        for (std::string part; std::getline(name_stream, part, ',');) {
+            names.push_back(part);
+        }
+
+        std::unique_ptr<TraceReader> trace;
+        if (names.size() == 1) {
+            trace = open_trace(trace_path(name));
+        } else {
+            std::vector<std::unique_ptr<TraceReader>> inputs;
+            MergeOptions merge_options;
+            for (size_t i = 0; i < names.size(); i++) {
+                inputs.push_back(open_trace(trace_path(names[i]), true));
+                if (stats_options.merge_core_stride != 0) {
+                    merge_options.core_offsets.push_back(i * stats_options.merge_core_stride);
+                }
+            }
+            trace = std::make_unique<MergedTraceReader>(std::move(inputs), merge_options);
+        }
+
+        if (!stats_options.prefetch) {
+            return trace;
+        }
+        auto prefetch_options = stats_options.prefetch_options;
+        if (expected_records > 0) {
+            prefetch_options.buffer_records = std::min<uint64_t>(prefetch_options.buffer_records, expected_records);
+        }
+        return std::make_unique<PrefetchingTraceReader>(std::move(trace), prefetch_options);
+    } catch (const std::exception& ex) {
+        std::cerr << "Could not open trace file '" << name << "': " << ex.what() << std::endl;
         exit(EXIT_FAILURE);
     }
 }
 
-template <class Callable>
-void for_each_trace_line(std::ifstream& trace_file, Callable callable) {
-    uintptr_t addr, cpu_index;
-    bool is_store;
-    size_t line_no = 1;
-    while (true) {
-        // This reads until it encounters white space, not just newline.
-        if (!(trace_file >> std::hex >> addr >> std::hex >> cpu_index >> is_store)) {
-            if (trace_file.eof()) {
-                return;
+// Opens the trace, or replays it from memory when trace caching is on.
+static std::unique_ptr<TraceReader> replay_trace(const std::string& name) {
+    // The metadata sidecar sizes the buffers and cache up front. A trace without one gets it
+    // collected while it is cached.
+    std::optional<TraceMetadata> metadata;
+    bool whole_file = reads_whole_file(name);
+    if (whole_file) {
+        try {
+            metadata = TraceMetadata::load_current(trace_path(name), trace_format(trace_path(name)));
+        } catch (const std::runtime_error&) {
+            // The trace itself can not be opened, which open_traces reports.
+        }
+        if (metadata.has_value()) {
+            std::cerr << "Trace '" << name << "': " << *metadata << std::endl;
+        }
+    }
+    uint64_t expected_records = metadata.has_value() ? metadata->num_records : 0;
+
+    // Streams are simulated as they arrive. Caching one would read it to its end first: nothing
+    // would be simulated until the producer finishes, the ring would no longer pace the producer
+    // to the simulation, and the copy would grow for as long as the stream runs.
+    if (!stats_options.cache_traces || reads_stream(name)) {
+        return open_traces(name, expected_records);
+    }
+
+    // Experiments replay the same decoded copy, so each trace is parsed once per run.
+    static std::map<std::string, std::unique_ptr<CachedTrace>> trace_cache;
+    auto& cached = trace_cache[name];
+    if (cached == nullptr) {
+        auto trace = open_traces(name, expected_records);
+        MetadataCollectingTraceReader *collector = nullptr;
+        if (whole_file && !metadata.has_value()) {
+            auto collecting = std::make_unique<MetadataCollectingTraceReader>(std::move(trace));
+            collector = collecting.get();
+            trace = std::move(collecting);
+        }
+        auto cache_options = stats_options.cache_options;
+        cache_options.expected_records = expected_records;
+        try {
+            cached = std::make_unique<CachedTrace>(*trace, cache_options);
+        } catch (const std::runtime_error& ex) {
+            std::cerr << ex.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cerr << "Cached " << cached->num_records() << " records of '" << name << "' in "
+                  << cached->memory_bytes() / (1024 * 1024) << " MiB" << (cached->compressed() ? " (compressed)" : "") << std::endl;
+
+        if (collector != nullptr) {
+            auto path = trace_path(name);
+            try {
+                auto collected = collector->builder().finish(path, trace_format(path));
+                collected.save(trace_metadata_path(path));
+                std::cerr << "Trace '" << name << "': " << collected << std::endl;
+            } catch (const std::runtime_error& ex) {
+                // Read-only trace directories still work, the metadata is just collected every time.
+                std::cerr << "Warning: " << ex.what() << std::endl;
             }
-            std::cerr << "Format error on line " << line_no << std::endl;
+        }
+    }
+
+    // Decompressing blocks is worth overlapping with the simulation, copying raw ones is not.
+    if (cached->compressed() && stats_options.prefetch) {
+        return std::make_unique<PrefetchingTraceReader>(cached->replay(), stats_options.prefetch_options);
+    }
+    return cached->replay();
+}
+
+// The records are accesses only, whatever the region of interest mode: the markers of the trace are
+// followed by the ExperimentCaches overload of for_each_trace_line. With a nonzero `l1_block_size`,
+// the records are for a MultiLevelCache with private L1s of that block size and may be collapsed:
+// replay them with `record.weight`.
+std::unique_ptr<TraceReader> load_trace(const std::string& name, uint32_t l1_block_size = 0) {
+    auto trace = replay_trace(name);
+    if (l1_block_size != 0 && stats_options.collapse_repeats) {
+        trace = std::make_unique<CollapsingTraceReader>(std::move(trace), l1_block_size);
+    }
+    return std::make_unique<RoiTraceReader>(std::move(trace), stats_options.roi_mode);
+}
+
+// Next-use files of the shared cache accesses, one per trace, private cache configuration and shared
+// block size, removed at exit.
+class NextUseFiles {
+public:
+    ~NextUseFiles() {
+        for (const auto& [key, path]: paths_) {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    }
+
+    const std::string& get(const std::string& trace_name, uint32_t num_cores, const Cache& private_cache,
+                           uint32_t shared_block_size) {
+        auto key = trace_name + ":" + std::to_string(num_cores) + ":" + std::to_string(private_cache.cache_size()) + ":" +
+                   std::to_string(private_cache.assoc()) + ":" + std::to_string(private_cache.block_size()) + ":" +
+                   std::to_string(shared_block_size);
+        auto it = paths_.find(key);
+        if (it != paths_.end()) {
+            return it->second;
+        }
+        auto path = (std::filesystem::temp_directory_path() /
+                     ("asgard_next_use_" + std::to_string(::getpid()) + "_" + std::to_string(paths_.size()))).string();
+        try {
+            auto trace = load_trace(trace_name, private_cache.block_size());
+            build_shared_next_use(*trace, num_cores, private_cache, shared_block_size, path);
+        } catch (const std::exception& ex) {
+            std::cerr << "Could not compute the next uses for MIN replacement: " << ex.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return paths_.emplace(key, path).first->second;
+    }
+private:
+    std::map<std::string, std::string> paths_;
+};
+
+// Sets up the shared cache of every MultiLevelCache beyond its constructor: its tag store, and
+// under ReplacementPolicy::MIN its own reader of the next uses. Those need a pass over the trace of
+// their own, done once per configuration.
+template <class L2Cache>
+void prepare_shared_caches(std::vector<MultiLevelCache<L2Cache>>& caches, const std::string& trace_name,
+                           uint32_t num_cores, const Cache& private_cache) {
+    if (!stats_options.llc_tag_store.directory.empty()) {
+        try {
+            for (auto& cache: caches) {
+                cache.set_tag_store(stats_options.llc_tag_store);
+            }
+        } catch (const std::exception& ex) {
+            std::cerr << "Could not set up the tag store of the shared caches: " << ex.what() << std::endl;
             exit(EXIT_FAILURE);
         }
-        ++line_no;
-        callable(addr, cpu_index, is_store);
-//        std::cout << std::hex << addr << " " << std::hex << cpu_index << " " << is_store << std::endl;
+    }
+    if (stats_options.llc_policy != ReplacementPolicy::MIN) {
+        return;
+    }
+    static NextUseFiles files;
+    for (auto& cache: caches) {
+        const auto& path = files.get(trace_name, num_cores, private_cache, cache.get_shared_cache().block_size());
+        cache.set_next_use(std::make_shared<NextUseReader>(path));
+    }
+}
+
+static void print_prefetch_stats(TraceReader& trace) {
+    if (auto prefetcher = dynamic_cast<PrefetchingTraceReader *>(&trace)) {
+        auto stats = prefetcher->stats();
+        std::cerr << "Prefetch: simulation stalled " << stats.consumer_stall_seconds << " s waiting for the trace, reader stalled "
+                  << stats.producer_stall_seconds << " s waiting for the simulation (" << stats.buffers_filled << " buffers)" << std::endl;
     }
 }
 
+// The callable takes either a `const TraceRecord&` or `(addr, cpu_index, is_store)`.
+template <class Callable>
+void for_each_trace_line(TraceReader& trace, Callable callable) {
+    try {
+        for_each_trace_record(trace, callable);
+    } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    print_prefetch_stats(trace);
+}
+
 template <class T>
 std::ostream& operator<< (std::ostream& out, const std::vector<T>& v) {
     out << '[';
@@ -72,8 +338,8 @@ void header(const std::string& str) {
     std::cout << "\n[" << counter << "] " << str << "\n" << std::endl;
 }
 
-constexpr uint32_t KiB = 1024;
-constexpr uint32_t MiB = 1024 * KiB;
+constexpr uint64_t KiB = 1024;
+constexpr uint64_t MiB = 1024 * KiB;
 
 template <class InputType, class OutputType, class Callable>
 std::vector<OutputType> mapVector(const std::vector<InputType>& v, Callable callable) {
@@ -88,18 +354,228 @@ std::vector<OutputType> mapVector(const std::vector<InputType>& v, Callable call
 }
 
 template <class T>
-std::vector<uint32_t> getMisses(const std::vector<T>& caches, uint32_t client_id = 0) {
-    return mapVector<T, uint32_t>(caches, [client_id](const T& t){
+std::vector<uint64_t> getMisses(const std::vector<T>& caches, uint32_t client_id = 0) {
+    return mapVector<T, uint64_t>(caches, [client_id](const T& t){
         return t.misses(client_id);
     });
 }
 
+// The caches of an experiment, whose statistics follow the regions of interest of the trace.
+// Their misses are estimated from the sampled windows when sampling is on.
+class ExperimentCaches {
+public:
+    // Tracks the misses of client 0 of `caches`, which must outlive this object. Returns the index
+    // of the group for misses().
+    template <class T>
+    size_t track(const std::string& name, std::vector<T>& caches) {
+        if (sampled_.has_value()) {
+            throw std::logic_error("Caches should be tracked before the replay");
+        }
+        groups_.push_back({name, [&caches] {
+            return getMisses(caches);
+        }});
+        reset_stats_.push_back([&caches] {
+            for (auto& cache: caches) {
+                cache.reset_stats();
+            }
+        });
+        set_stats_enabled_.push_back([&caches](bool enabled) {
+            for (auto& cache: caches) {
+                cache.set_stats_enabled(enabled);
+            }
+        });
+        return groups_.size() - 1;
+    }
+
+    void reset_stats() {
+        for (const auto& reset: reset_stats_) {
+            reset();
+        }
+    }
+
+    // Inside the regions of interest. When sampling the stats are only collected in the windows too.
+    void set_stats_enabled(bool enabled) {
+        in_roi_ = enabled;
+        apply_stats_enabled();
+    }
+
+    // The records before the first window only warm the caches.
+    void begin_sampling() {
+        size_t num_caches = current_misses().size();
+        sampled_.emplace(num_caches);
+        in_window_ = false;
+        apply_stats_enabled();
+    }
+
+    void begin_window() {
+        sampled_->begin_window(current_misses());
+        in_window_ = true;
+        apply_stats_enabled();
+    }
+
+    void end_window(uint64_t accesses) {
+        sampled_->end_window(current_misses(), accesses);
+        in_window_ = false;
+        apply_stats_enabled();
+    }
+
+    void end_sampling(uint64_t total_accesses) {
+        try {
+            estimates_ = sampled_->estimates(total_accesses, stats_options.sampling.confidence);
+        } catch (const std::runtime_error& ex) {
+            std::cerr << ex.what() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        total_accesses_ = total_accesses;
+
+        double max_error = 0;
+        for (const auto& estimate: estimates_) {
+            max_error = std::max(max_error, estimate.relative_error());
+        }
+        std::cerr << "Sampled " << sampled_->measured_accesses() << " of " << total_accesses << " accesses in "
+                  << sampled_->windows() << " windows, misses within +-" << max_error * 100 << "% at "
+                  << stats_options.sampling.confidence * 100 << "% confidence" << std::endl;
+    }
+
+    // Misses of each cache of the group, the estimates when sampling.
+    std::vector<uint64_t> misses(size_t group) const {
+        if (!sampled_.has_value()) {
+            return groups_.at(group).second();
+        }
+        return mapVector<SampledEstimate, uint64_t>(group_estimates(group), [](const SampledEstimate& estimate) {
+            return static_cast<uint64_t>(std::llround(estimate.value));
+        });
+    }
+
+    // Counters of the caches other than the misses, e.g. their accesses, which only cover the
+    // windows when sampling. Scaled to the whole trace like the misses.
+    uint64_t estimate(uint64_t count) const {
+        if (!sampled_.has_value() || sampled_->measured_accesses() == 0) {
+            return count;
+        }
+        return static_cast<uint64_t>(std::llround(static_cast<double>(count) * total_accesses_ / sampled_->measured_accesses()));
+    }
+
+    template <class T>
+    std::vector<T> estimate(const std::vector<T>& counts) const {
+        return mapVector<T, T>(counts, [this](const T& count) {
+            return estimate(count);
+        });
+    }
+
+    // Accesses of the replayed records, or of the whole trace when sampling.
+    uint64_t analyzed_accesses(uint64_t replayed) const {
+        return sampled_.has_value() ? total_accesses_ : replayed;
+    }
+
+    // Prints the confidence intervals of the sampled misses as entries of the experiment output.
+    void print_intervals(std::ostream& out) const {
+        if (!sampled_.has_value()) {
+            return;
+        }
+        for (size_t group = 0; group < groups_.size(); group++) {
+            auto half_widths = mapVector<SampledEstimate, uint64_t>(group_estimates(group), [](const SampledEstimate& estimate) {
+                return static_cast<uint64_t>(std::llround(estimate.half_width));
+            });
+            out << "'" << groups_[group].first << "_interval': " << half_widths << ',' << std::endl;
+        }
+        out << "'sampled_windows': " << sampled_->windows() << ',' << std::endl;
+        out << "'sampled_accesses': " << sampled_->measured_accesses() << ',' << std::endl;
+        out << "'total_accesses': " << total_accesses_ << ',' << std::endl;
+    }
+private:
+    std::vector<std::pair<std::string, std::function<std::vector<uint64_t>()>>> groups_;
+    std::vector<std::function<void()>> reset_stats_;
+    std::vector<std::function<void(bool)>> set_stats_enabled_;
+    std::optional<SampledMisses> sampled_;
+    std::vector<SampledEstimate> estimates_;
+    uint64_t total_accesses_ = 0;
+    bool in_roi_ = true;
+    bool in_window_ = true;
+
+    void apply_stats_enabled() {
+        for (const auto& set_enabled: set_stats_enabled_) {
+            set_enabled(in_roi_ && in_window_);
+        }
+    }
+
+    std::vector<uint64_t> current_misses() const {
+        std::vector<uint64_t> misses;
+        for (const auto& group: groups_) {
+            auto group_misses = group.second();
+            misses.insert(misses.end(), group_misses.begin(), group_misses.end());
+        }
+        return misses;
+    }
+
+    std::vector<SampledEstimate> group_estimates(size_t group) const {
+        size_t begin = 0;
+        for (size_t i = 0; i < group; i++) {
+            begin += groups_[i].second().size();
+        }
+        size_t end = begin + groups_.at(group).second().size();
+        return {estimates_.begin() + begin, estimates_.begin() + end};
+    }
+};
+
+// Replays the trace into the experiment, sampling when enabled.
+template <class Callable>
+void replay_experiment(TraceReader& trace, Callable callable, ExperimentCaches& experiment) {
+    const auto& sampling = stats_options.sampling;
+    if (!sampling.enabled()) {
+        for_each_trace_line(trace, callable);
+        return;
+    }
+
+    experiment.begin_sampling();
+    uint64_t total_accesses;
+    try {
+        total_accesses = for_each_sampled_record(trace, sampling, callable,
+                                                 [&] { experiment.begin_window(); },
+                                                 [&](uint64_t accesses) { experiment.end_window(accesses); });
+    } catch (const std::runtime_error& ex) {
+        std::cerr << ex.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    print_prefetch_stats(trace);
+    experiment.end_sampling(total_accesses);
+}
+
+// Replays the records of load_trace() into an experiment. Markers in the trace reset the statistics
+// of the experiment's caches, or pause them outside the regions of interest. With sampling on only
+// the sampled records are replayed, and `experiment` estimates the misses of the whole trace from
+// the windows; the command line does not combine sampling with the markers.
+template <class Callable>
+void for_each_trace_line(TraceReader& trace, Callable callable, ExperimentCaches& experiment) {
+    auto *roi = dynamic_cast<RoiTraceReader *>(&trace);
+    if (roi != nullptr && roi->mode() != RoiMode::OFF) {
+        // Whether stats are being collected, and the RESET_STATS markers applied so far.
+        bool collecting = true;
+        uint64_t resets = 0;
+        bool warm = roi->mode() == RoiMode::WARM;
+        auto roi_callable = [&](const TraceRecord& record) {
+            if (roi->resets() != resets) {
+                resets = roi->resets();
+                experiment.reset_stats();
+            }
+            if (warm && roi->in_roi() != collecting) {
+                collecting = roi->in_roi();
+                experiment.set_stats_enabled(collecting);
+            }
+            callable(record);
+        };
+        replay_experiment(trace, roi_callable, experiment);
+        if (roi->regions() == 0) {
+            std::cerr << "Warning: the trace has no region of interest markers" << std::endl;
+        }
+        return;
+    }
+    replay_experiment(trace, callable, experiment);
+}
+
 void multiple_private_cache_sizes(const std::string& trace_name) {
     header("Multiple private cache sizes");
 
-    std::ifstream graph_trace;
-    load_trace(trace_name, graph_trace);
-
     // L1: 64KB 4-way, 64-byte blocks
 
     uint32_t num_cores = 2;
@@ -107,38 +583,41 @@ void multiple_private_cache_sizes(const std::string& trace_name) {
 
     Cache L1 {64* KiB, 4, block_size };
 
+    auto graph_trace = load_trace(trace_name, block_size);
+
     uint32_t l2_assoc = 8;
 
     std::vector<MultiLevelCache<Cache>> caches = {
-            {num_cores, L1, Cache(2 * MiB, l2_assoc, block_size)},
-            {num_cores, L1, Cache(4 * MiB, l2_assoc, block_size)},
-            {num_cores, L1, Cache(8 * MiB, l2_assoc, block_size)},
-            {num_cores, L1, Cache(16 * MiB, l2_assoc, block_size)},
-            {num_cores, L1, Cache(32 * MiB, l2_assoc, block_size)},
-            {num_cores, L1, Cache(64 * MiB, l2_assoc, block_size)},
+            {num_cores, L1, Cache(2 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(4 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(8 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(16 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(32 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(64 * MiB, l2_assoc, block_size, stats_options.llc_policy, stats_options.llc_organization)},
     };
+    prepare_shared_caches(caches, trace_name, num_cores, L1);
+
+    ExperimentCaches experiment;
+    auto l2_misses = experiment.track("misses", caches);
 
     size_t num_accesses = 0;
-    for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
-        num_accesses++;
+    for_each_trace_line(*graph_trace, [&](const TraceRecord& record){
+        num_accesses += record.weight;
 
         for(auto& cache: caches) {
-            cache.access(cpu_index, 0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
-    });
+    }, experiment);
 
-    auto misses = getMisses(caches);
-    std::cout << "Misses: " << misses << std::endl;
+    std::cout << "Misses: " << experiment.misses(l2_misses) << std::endl;
+    experiment.print_intervals(std::cout);
 
-    std::cout << "Analyzed " << num_accesses << " accesses" << std::endl;
+    std::cout << "Analyzed " << experiment.analyzed_accesses(num_accesses) << " accesses" << std::endl;
 }
 
 void multiple_private_cache_assocs(const std::string& trace_name) {
     header("Multiple private cache associativities");
 
-    std::ifstream graph_trace;
-    load_trace(trace_name, graph_trace);
-
     // L1: 64KB 4-way, 64-byte blocks
 
     uint32_t num_cores = 2;
@@ -146,13 +625,16 @@ void multiple_private_cache_assocs(const std::string& trace_name) {
 
     Cache L1 {64* KiB, 4, block_size };
 
-    uint32_t l2_size = 4 * MiB;
+    auto graph_trace = load_trace(trace_name, block_size);
+
+    uint64_t l2_size = 4 * MiB;
 
     std::vector<MultiLevelCache<Cache>> caches = {
-            {num_cores, L1, Cache(l2_size, 1, block_size)},
-            {num_cores, L1, Cache(l2_size, 2, block_size)},
-            {num_cores, L1, Cache(l2_size, 4, block_size)},
+            {num_cores, L1, Cache(l2_size, 1, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(l2_size, 2, block_size, stats_options.llc_policy, stats_options.llc_organization)},
+            {num_cores, L1, Cache(l2_size, 4, block_size, stats_options.llc_policy, stats_options.llc_organization)},
     };
+    prepare_shared_caches(caches, trace_name, num_cores, L1);
 
 //    std::vector<Cache> caches = {
 //                    Cache(l2_size, 1, block_size),
@@ -163,29 +645,32 @@ void multiple_private_cache_assocs(const std::string& trace_name) {
 //                    Cache(l2_size, 32, block_size)
 //            };
 
+    ExperimentCaches experiment;
+    auto l2_misses = experiment.track("misses", caches);
+
     size_t num_accesses = 0;
-    for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
-        num_accesses++;
+    for_each_trace_line(*graph_trace, [&](const TraceRecord& record){
+        num_accesses += record.weight;
 
         for(auto& cache: caches) {
-            cache.access(cpu_index,0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
-    });
+    }, experiment);
 
-    auto misses = getMisses(caches);
-    std::cout << "Misses: " << misses << std::endl;
+    std::cout << "Misses: " << experiment.misses(l2_misses) << std::endl;
+    experiment.print_intervals(std::cout);
 
-    std::cout << "Analyzed " << num_accesses << " accesses" << std::endl;
+    std::cout << "Analyzed " << experiment.analyzed_accesses(num_accesses) << " accesses" << std::endl;
 }
 
-std::vector<uint32_t> getWayPartitionedNumAccesses(std::vector<MultiLevelCache<WayPartitioning>>& caches) {
-    return mapVector<MultiLevelCache<WayPartitioning>, uint32_t>(caches, [](const MultiLevelCache<WayPartitioning>& cache) -> uint32_t {
+std::vector<uint64_t> getWayPartitionedNumAccesses(std::vector<MultiLevelCache<WayPartitioning>>& caches) {
+    return mapVector<MultiLevelCache<WayPartitioning>, uint64_t>(caches, [](const MultiLevelCache<WayPartitioning>& cache) -> uint64_t {
         return cache.num_total_accesses(0);
     });
 }
 
-std::vector<uint32_t> getIntraNumAccess(std::vector<MultiLevelCache<IntraNodePartitioning>>& caches) {
-    return mapVector<MultiLevelCache<IntraNodePartitioning>, uint32_t>(caches, [](const MultiLevelCache<IntraNodePartitioning>& cache) -> uint32_t {
+std::vector<uint64_t> getIntraNumAccess(std::vector<MultiLevelCache<IntraNodePartitioning>>& caches) {
+    return mapVector<MultiLevelCache<IntraNodePartitioning>, uint64_t>(caches, [](const MultiLevelCache<IntraNodePartitioning>& cache) -> uint64_t {
         return cache.num_total_accesses(0);
     });
 }
@@ -194,19 +679,17 @@ std::vector<uint32_t> getIntraNumAccess(std::vector<MultiLevelCache<IntraNodePar
 void intra_vs_way_partitioning(const std::string& trace_name) {
     header("Intra vs. way partitioning");
 
-    std::ifstream graph_trace;
-    load_trace(trace_name, graph_trace);
-
-
     uint32_t num_cores = 2;
     uint32_t block_size = 64;
 
     // L1: 64KB, 4-way, 64-byte blocks
     Cache L1 {64* KiB, 4, block_size};
 
+    auto graph_trace = load_trace(trace_name, block_size);
+
     // L2: total 8-way.
 
-    std::vector<uint32_t> sizes = {8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB, 256*MiB, 512*MiB};
+    std::vector<uint64_t> sizes = {8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB, 256*MiB, 512*MiB};
 
     std::vector<uint32_t> n_ways = {1, 7};
     //  Sum up all associativity
@@ -216,8 +699,9 @@ void intra_vs_way_partitioning(const std::string& trace_name) {
     std::vector<MultiLevelCache<WayPartitioning>> way_partitioned_caches;
     way_partitioned_caches.reserve(sizes.size());
     for(auto size : sizes) {
-        way_partitioned_caches.emplace_back(num_cores, L1, WayPartitioning{size, block_size, n_ways});
+        way_partitioned_caches.emplace_back(num_cores, L1, WayPartitioning{size, block_size, n_ways, stats_options.llc_policy, stats_options.llc_organization});
     }
+    prepare_shared_caches(way_partitioned_caches, trace_name, num_cores, L1);
 
     // Intra-node partitioning
 
@@ -239,49 +723,52 @@ void intra_vs_way_partitioning(const std::string& trace_name) {
     std::vector<MultiLevelCache<IntraNodePartitioning>> intra_node_caches;
     intra_node_caches.reserve(sizes.size());
     for(auto size: sizes) {
-        auto shared_cache = IntraNodePartitioning{size, total_assoc, block_size, aux_table};
+        auto shared_cache = IntraNodePartitioning{size, total_assoc, block_size, aux_table, stats_options.llc_policy};
         intra_node_caches.emplace_back(num_cores, L1, std::move(shared_cache));
     }
+    prepare_shared_caches(intra_node_caches, trace_name, num_cores, L1);
+
+    ExperimentCaches experiment;
+    auto way_partitioned_misses = experiment.track("way_partition_misses", way_partitioned_caches);
+    auto intra_node_misses = experiment.track("intra_node_misses", intra_node_caches);
 
     size_t num_accesses = 0;
-    for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
-        num_accesses++;
+    for_each_trace_line(*graph_trace, [&](const TraceRecord& record){
+        num_accesses += record.weight;
 
         for(auto& cache: way_partitioned_caches) {
-            cache.access(cpu_index,0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
 
         for(auto& cache: intra_node_caches) {
-            cache.access(cpu_index,0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
-    });
+    }, experiment);
 
     std::cout << "{\n";
     std::cout << "'cache_slice_sizes': " << sizes << ',' << std::endl;
 
-    auto way_partitioned_misses = getMisses(way_partitioned_caches);
-    std::cout << "'way_partition_misses': " << way_partitioned_misses << ',' << std::endl;
-
-    auto intra_node_misses = getMisses(intra_node_caches);
-    std::cout << "'intra_node_misses': " << intra_node_misses << ',' << std::endl;
+    std::cout << "'way_partition_misses': " << experiment.misses(way_partitioned_misses) << ',' << std::endl;
+    std::cout << "'intra_node_misses': " << experiment.misses(intra_node_misses) << ',' << std::endl;
+    experiment.print_intervals(std::cout);
 
-    std::cout << "'way_partition_accesses': " << getWayPartitionedNumAccesses(way_partitioned_caches) << ',' << std::endl;
-    std::cout << "'intra_node_accesses': " << getIntraNumAccess(intra_node_caches) << ',' << std::endl;
+    std::cout << "'way_partition_accesses': " << experiment.estimate(getWayPartitionedNumAccesses(way_partitioned_caches)) << ',' << std::endl;
+    std::cout << "'intra_node_accesses': " << experiment.estimate(getIntraNumAccess(intra_node_caches)) << ',' << std::endl;
 
-    std::cout << "'total_analyzed': " << num_accesses << ',' << std::endl;
+    std::cout << "'total_analyzed': " << experiment.analyzed_accesses(num_accesses) << ',' << std::endl;
     std::cout << "}" << std::endl;
 }
 
 // For each cache (a test run), returns a vector of clusters and how many accesses each cluster has received. Will not show every cluster, only the clusters the client has accessed
-std::vector<std::vector<uint32_t>> getInterNodeNumAccesses(std::vector<MultiLevelCache<InterNodePartitioning>>& caches) {
-    std::vector<std::vector<uint32_t>> res;
+std::vector<std::vector<uint64_t>> getInterNodeNumAccesses(std::vector<MultiLevelCache<InterNodePartitioning>>& caches) {
+    std::vector<std::vector<uint64_t>> res;
     res.reserve(caches.size());
 
     for(auto& multi_level_cache : caches) {
         auto& cache = multi_level_cache.get_shared_cache();
         auto& memory_nodes = cache.memory_nodes(0);
 
-        std::vector<uint32_t> accesses = mapVector<Cache, uint32_t>(memory_nodes, [](const Cache& cache){
+        std::vector<uint64_t> accesses = mapVector<Cache, uint64_t>(memory_nodes, [](const Cache& cache){
             return cache.hits() + cache.misses();
         });
 
@@ -291,15 +778,15 @@ std::vector<std::vector<uint32_t>> getInterNodeNumAccesses(std::vector<MultiLeve
     return res;
 }
 
-std::vector<std::vector<uint32_t>> getClusterWayPartitionedNumAccesses(std::vector<MultiLevelCache<ClusterWayPartitioning>>& caches) {
-    std::vector<std::vector<uint32_t>> res;
+std::vector<std::vector<uint64_t>> getClusterWayPartitionedNumAccesses(std::vector<MultiLevelCache<ClusterWayPartitioning>>& caches) {
+    std::vector<std::vector<uint64_t>> res;
     res.reserve(caches.size());
 
     for(auto& multi_level_cache : caches) {
         auto& cache = multi_level_cache.get_shared_cache();
         auto& memory_nodes = cache.clusters();
 
-        std::vector<uint32_t> accesses = mapVector<WayPartitioning, uint32_t>(memory_nodes, [](const WayPartitioning& cache){
+        std::vector<uint64_t> accesses = mapVector<WayPartitioning, uint64_t>(memory_nodes, [](const WayPartitioning& cache){
             return cache.hits(0) + cache.misses(0);
         });
 
@@ -309,14 +796,14 @@ std::vector<std::vector<uint32_t>> getClusterWayPartitionedNumAccesses(std::vect
     return res;
 }
 
-std::vector<std::vector<uint32_t>> getInterIntraNumAccesses(std::vector<MultiLevelCache<InterIntraNodePartitioning>>& caches, uint32_t num_clusters) {
-    std::vector<std::vector<uint32_t>> res;
+std::vector<std::vector<uint64_t>> getInterIntraNumAccesses(std::vector<MultiLevelCache<InterIntraNodePartitioning>>& caches, uint32_t num_clusters) {
+    std::vector<std::vector<uint64_t>> res;
     res.reserve(caches.size());
 
     for(auto& multi_level_cache : caches) {
         auto& cache = multi_level_cache.get_shared_cache();
 
-        std::vector<uint32_t> accesses;
+        std::vector<uint64_t> accesses;
         accesses.reserve(num_clusters);
 
         for(uint32_t cluster_id = 0; cluster_id < num_clusters; cluster_id++) {
@@ -343,15 +830,13 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
     uint32_t num_clusters = 8;
 
     // Size of a single slice
-    std::vector<uint32_t> sizes = {2*MiB, 4*MiB, 8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB};
+    std::vector<uint64_t> sizes = {2*MiB, 4*MiB, 8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB};
 
     auto test = [&](uint32_t num_slices_our_client_has) {
         ASSERT(num_slices_our_client_has > 0);
         ASSERT(num_slices_our_client_has <= num_clusters);
 
-        std::ifstream graph_trace;
-        load_trace(trace_name, graph_trace);
-
+        auto graph_trace = load_trace(trace_name, block_size);
 
         // Inter partitioning
 
@@ -362,11 +847,12 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
 
         std::vector<MultiLevelCache<InterNodePartitioning>> inter_node_partitioned_caches;
         for(auto size : sizes) {
-            auto shared_cache = InterNodePartitioning{size, num_clusters, block_size, n_slices};
+            auto shared_cache = InterNodePartitioning{size, num_clusters, block_size, n_slices, stats_options.llc_policy, stats_options.llc_organization};
 //            std::cerr << mapVector<Cache, uint32_t>(shared_cache.memory_nodes(0), [](const Cache& cache) -> uint32_t { return cache.cache_size(); }) << std::endl;
 
             inter_node_partitioned_caches.emplace_back(num_cores, L1, shared_cache);
         }
+        prepare_shared_caches(inter_node_partitioned_caches, trace_name, num_cores, L1);
 
         // Cluster way partitioning
 
@@ -376,21 +862,22 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
         way_partitioned_caches.reserve(sizes.size());
         for(auto size : sizes) {
             // Cache size is per slice?
-            auto shared_cache = ClusterWayPartitioning{num_clusters, size, block_size, n_ways};
+            auto shared_cache = ClusterWayPartitioning{num_clusters, size, block_size, n_ways, stats_options.llc_policy, stats_options.llc_organization};
 //            std::cerr << mapVector<WayPartitioning, uint32_t>(shared_cache.clusters(), [](const WayPartitioning& way_partitioning) -> uint32_t { return way_partitioning.get_cache(0).cache_size(); }) << std::endl;
 
             way_partitioned_caches.emplace_back(num_cores, L1, shared_cache);
         }
+        prepare_shared_caches(way_partitioned_caches, trace_name, num_cores, L1);
 
         // Inter-intra node partitioning
         std::vector<MultiLevelCache<InterIntraNodePartitioning>> inter_intra_node_caches;
         inter_intra_node_caches.reserve(sizes.size());
         for(auto size: sizes) {
             ASSERT(size % num_clusters == 0);
-            uint32_t cache_slice_size = size;
+            uint64_t cache_slice_size = size;
 
             // n_cache_sizes[clusterId][client] -> Size of the private cache of that client
-            std::vector<std::vector<uint32_t>> n_cache_sizes(num_clusters, std::vector<uint32_t>(2, 0));
+            std::vector<std::vector<uint64_t>> n_cache_sizes(num_clusters, std::vector<uint64_t>(2, 0));
 
             std::vector<inter_intra_aux_table_entry_t> own_slices;
             own_slices.resize(num_slices_our_client_has);
@@ -418,7 +905,7 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
                     inter_intra_aux_table_t{num_clusters - num_slices_our_client_has, other_slices}
             };
 
-            auto shared_cache = InterIntraNodePartitioning{num_clusters, block_size, n_cache_sizes, aux_tables_per_client};
+            auto shared_cache = InterIntraNodePartitioning{num_clusters, block_size, n_cache_sizes, aux_tables_per_client, stats_options.llc_policy};
 //
 //            for(uint32_t i = 0; i < num_clusters; i++) {
 //                auto& cache = shared_cache.get_cache_slice(0, i);
@@ -429,48 +916,50 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
 
             inter_intra_node_caches.emplace_back(num_cores, L1, std::move(shared_cache));
         }
+        prepare_shared_caches(inter_intra_node_caches, trace_name, num_cores, L1);
+
+        ExperimentCaches experiment;
+        auto inter_node_misses = experiment.track("inter_node_misses", inter_node_partitioned_caches);
+        auto way_partitioned_misses = experiment.track("way_partition_misses", way_partitioned_caches);
+        auto intra_node_misses = experiment.track("inter_intra_misses", inter_intra_node_caches);
 
         size_t num_accesses = 0;
-        for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
+        for_each_trace_line(*graph_trace, [&](const TraceRecord& record){
 //            std::cout << num_accesses << "/" << expected_num_accesses << std::endl;
-            num_accesses++;
+            num_accesses += record.weight;
 
             for(auto& cache: inter_node_partitioned_caches) {
-                cache.access(cpu_index,0, addr);
+                cache.access(record.cpu_index, 0, record.addr, record.weight);
             }
 
             for(auto& cache: way_partitioned_caches) {
-                cache.access(cpu_index,0, addr);
+                cache.access(record.cpu_index, 0, record.addr, record.weight);
             }
 
             // TODO: Enable after inter_intra_node_caches works properly
             for(auto& cache: inter_intra_node_caches) {
-                cache.access(cpu_index,0, addr);
+                cache.access(record.cpu_index, 0, record.addr, record.weight);
             }
-        });
+        }, experiment);
 
         std::cout <<  num_slices_our_client_has << ": {\n";
         std::cout << "'cache_slice_sizes': " << sizes << ',' << std::endl;
 
-        auto inter_node_misses = getMisses(inter_node_partitioned_caches);
-        std::cout << "'inter_node_misses': " << inter_node_misses << ',' << std::endl;
-
-        auto way_partitioned_misses = getMisses(way_partitioned_caches);
-        std::cout << "'way_partition_misses': " << way_partitioned_misses << ',' << std::endl;
-
-        auto intra_node_misses = getMisses(inter_intra_node_caches);
-        std::cout << "'inter_intra_misses': " << intra_node_misses << ',' << std::endl;
+        std::cout << "'inter_node_misses': " << experiment.misses(inter_node_misses) << ',' << std::endl;
+        std::cout << "'way_partition_misses': " << experiment.misses(way_partitioned_misses) << ',' << std::endl;
+        std::cout << "'inter_intra_misses': " << experiment.misses(intra_node_misses) << ',' << std::endl;
+        experiment.print_intervals(std::cout);
 
-        auto inter_node_accesses = getInterNodeNumAccesses(inter_node_partitioned_caches);
+        auto inter_node_accesses = experiment.estimate(getInterNodeNumAccesses(inter_node_partitioned_caches));
         std::cout << "'inter_node_accesses': " << inter_node_accesses << ',' << std::endl;
         
-        auto way_partitioned_accesses = getClusterWayPartitionedNumAccesses(way_partitioned_caches);
+        auto way_partitioned_accesses = experiment.estimate(getClusterWayPartitionedNumAccesses(way_partitioned_caches));
         std::cout << "'way_partition_accesses': " << way_partitioned_accesses << ',' << std::endl;
         
-        auto intra_node_accesses = getInterIntraNumAccesses(inter_intra_node_caches, num_clusters);
+        auto intra_node_accesses = experiment.estimate(getInterIntraNumAccesses(inter_intra_node_caches, num_clusters));
         std::cout << "'inter_intra_accesses': " << intra_node_accesses << ',' << std::endl;
 
-        std::cout << "'total_analyzed': " << num_accesses << "\n},"  << std::endl;
+        std::cout << "'total_analyzed': " << experiment.analyzed_accesses(num_accesses) << "\n},"  << std::endl;
     };
 
     std::stringstream ss;
@@ -490,9 +979,6 @@ void inter_vs_cluster_way_partitioning_vs_inter_intra(const std::string& trace_n
 void access_uniformity_way_vs_inter_intra(const std::string& trace_name) {
     header("Access uniformity way vs inter-intra...");
 
-    std::ifstream graph_trace;
-    load_trace(trace_name, graph_trace);
-
     // Test-case:
     //  8 clusters, each cluster with 2 cores
     //  The client has 3 cores (2 in one cluster, 1 in another cluster)
@@ -504,8 +990,10 @@ void access_uniformity_way_vs_inter_intra(const std::string& trace_name) {
     // L1: 64KB, 4-way, 64-byte blocks
     Cache L1 {64* KiB, 4, block_size};
 
+    auto graph_trace = load_trace(trace_name, block_size);
+
     // Size of a single slice
-    std::vector<uint32_t> sizes = {2*MiB, 4*MiB, 8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB};
+    std::vector<uint64_t> sizes = {2*MiB, 4*MiB, 8*MiB, 16*MiB, 32*MiB, 64*MiB, 128*MiB};
 
     // BE CAREFUL! Updating this parameters may require manually updating some of the tables below.
     uint32_t num_clusters = 8;
@@ -521,8 +1009,9 @@ void access_uniformity_way_vs_inter_intra(const std::string& trace_name) {
     way_partitioned_caches.reserve(sizes.size());
     for(auto size : sizes) {
         // TODO: Is cache-size per slice?
-        way_partitioned_caches.emplace_back(num_cores, L1, ClusterWayPartitioning{num_clusters, size, block_size, n_ways});
+        way_partitioned_caches.emplace_back(num_cores, L1, ClusterWayPartitioning{num_clusters, size, block_size, n_ways, stats_options.llc_policy, stats_options.llc_organization});
     }
+    prepare_shared_caches(way_partitioned_caches, trace_name, num_cores, L1);
 
 
     // Inter-intra node partitioning
@@ -530,11 +1019,11 @@ void access_uniformity_way_vs_inter_intra(const std::string& trace_name) {
     std::vector<MultiLevelCache<InterIntraNodePartitioning>> inter_intra_node_caches;
     inter_intra_node_caches.reserve(sizes.size());
     for(auto size: sizes) {
-        uint32_t cache_slice_size = size;
+        uint64_t cache_slice_size = size;
         ASSERT(cache_slice_size % 2 == 0);
 
         // n_cache_sizes[clusterId][client] -> Size of the private cache of that client
-        std::vector<std::vector<uint32_t>> n_cache_sizes(num_clusters, std::vector<uint32_t>(2, 0));
+        std::vector<std::vector<uint64_t>> n_cache_sizes(num_clusters, std::vector<uint64_t>(2, 0));
         n_cache_sizes[0][0] = cache_slice_size;
         n_cache_sizes[1][0] = cache_slice_size / 2;
 
@@ -560,83 +1049,95 @@ void access_uniformity_way_vs_inter_intra(const std::string& trace_name) {
                 inter_intra_aux_table_t{13, other_slices}
         };
 
-        auto shared_cache = InterIntraNodePartitioning{num_clusters * cores_per_cluster, block_size, n_cache_sizes, aux_tables_per_client};
+        auto shared_cache = InterIntraNodePartitioning{num_clusters * cores_per_cluster, block_size, n_cache_sizes, aux_tables_per_client, stats_options.llc_policy};
         inter_intra_node_caches.emplace_back(num_cores, L1, std::move(shared_cache));
     }
+    prepare_shared_caches(inter_intra_node_caches, trace_name, num_cores, L1);
+
 
+    ExperimentCaches experiment;
+    auto way_partitioned_misses = experiment.track("way_partition_misses", way_partitioned_caches);
+    auto intra_node_misses = experiment.track("inter_intra_node_misses", inter_intra_node_caches);
 
     size_t num_accesses = 0;
-    for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
+    for_each_trace_line(*graph_trace, [&](const TraceRecord& record){
         //            std::cout << num_accesses << "/" << expected_num_accesses << std::endl;
-        num_accesses++;
+        num_accesses += record.weight;
 
         for(auto& cache: way_partitioned_caches) {
-            cache.access(cpu_index,0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
 
         // TODO: Enable after inter_intra_node_caches works properly
         for(auto& cache: inter_intra_node_caches) {
-            cache.access(cpu_index,0, addr);
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
         }
-    });
+    }, experiment);
 
     std::cout << "{\n";
 
     std::cout << "'cache_slice_sizes': " << sizes << ',' << std::endl;
 
-    auto way_partitioned_misses = getMisses(way_partitioned_caches);
-    std::cout << "'way_partition_misses': " << way_partitioned_misses<< ',' << std::endl;
-
-    auto intra_node_misses = getMisses(inter_intra_node_caches);
-    std::cout << "'inter_intra_node_misses': " << intra_node_misses << ',' << std::endl;
+    std::cout << "'way_partition_misses': " << experiment.misses(way_partitioned_misses) << ',' << std::endl;
+    std::cout << "'inter_intra_node_misses': " << experiment.misses(intra_node_misses) << ',' << std::endl;
+    experiment.print_intervals(std::cout);
 
-    auto way_partitioned_accesses = getClusterWayPartitionedNumAccesses(way_partitioned_caches);
+    auto way_partitioned_accesses = experiment.estimate(getClusterWayPartitionedNumAccesses(way_partitioned_caches));
     std::cout << "'way_partition_accesses': " << way_partitioned_accesses << ',' << std::endl;
 
-    auto intra_node_accesses = getInterIntraNumAccesses(inter_intra_node_caches, num_clusters);
+    auto intra_node_accesses = experiment.estimate(getInterIntraNumAccesses(inter_intra_node_caches, num_clusters));
     std::cout << "'inter_intra_node_accesses': " << intra_node_accesses << ',' << std::endl;
 
-    std::cout << "'total_analyzed': " << num_accesses << ',' << std::endl;
+    std::cout << "'total_analyzed': " << experiment.analyzed_accesses(num_accesses) << ',' << std::endl;
 
     std::cout << "}" << std::endl;
 }
 
-void separate_trace_file_per_core() {
+void separate_trace_file_per_core(const std::string& trace_name) {
     header("Separating trace file into one per core...");
 
+    auto graph_trace = load_trace(trace_name);
 
-    std::ifstream graph_trace;
-    load_trace("qemu_graph_trace", graph_trace);
-
-    uint32_t num_cores = 2;
-    std::vector<std::ofstream> output_files{num_cores};
-    for(int i = 0; i < num_cores; i++) {
-        std::stringstream ss;
-        ss << "../traces/qemu_graph_trace_core_" << i;
-        output_files[i].open(ss.str());
-        if (!output_files[i].is_open()) {
-            std::cerr << "Couldn't open file '" << ss.str() << "'" << std::endl;
-            exit(EXIT_FAILURE);
-        }
+    SplitOptions options;
+    options.mode = SplitMode::CORE;
+    options.output_format = TraceFormat::TEXT;
+    std::vector<SplitOutput> outputs;
+    try {
+        outputs = split_trace(*graph_trace, trace_path(trace_name), options);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        exit(EXIT_FAILURE);
     }
 
-    std::vector<uint32_t> num_lines{num_cores, {}};
-
-    for_each_trace_line(graph_trace, [&](uintptr_t addr, uintptr_t cpu_index, uint32_t is_store){
-        num_lines[cpu_index]++;
-
-        auto& out = output_files[cpu_index];
-        out << "0x" << std::hex << addr << std::hex << " " << cpu_index << " " << is_store << "\n";
-    });
-
+    std::vector<uint64_t> num_lines;
+    for (const auto& output: outputs) {
+        num_lines.resize(output.index + 1);
+        num_lines[output.index] = output.records;
+    }
     std::cout << "Number of accesses per core: " << num_lines << std::endl;
 }
 
-void generate_stats() {
+void generate_stats(const StatisticsOptions& options) {
+    stats_options = options;
     std::cout << "Generating stats..." << std::endl;
-    //    separate_trace_file_per_core();
+    if (options.llc_policy != ReplacementPolicy::LRU) {
+        std::cout << "Shared cache replacement: " << replacement_policy_name(options.llc_policy) << std::endl;
+    }
+    if (options.llc_organization != CacheOrganization::SET_ASSOCIATIVE) {
+        // Node partitioning picks the set of every access, so its slices stay set-associative.
+        std::cout << "Shared cache organization: " << cache_organization_name(options.llc_organization)
+                  << " (set for node partitioning)" << std::endl;
+    }
+    if (!options.llc_tag_store.directory.empty()) {
+        // One budget for the tag stores of every shared cache of every experiment.
+        stats_options.llc_tag_store = options.llc_tag_store.shared();
+        // The results are the same, so not in the output.
+        std::cerr << "Shared cache tag stores in '" << options.llc_tag_store.directory << "', up to "
+                  << options.llc_tag_store.resident_bytes / (1024 * 1024) << " MiB resident in all" << std::endl;
+    }
+    const auto& trace_name = options.trace_name;
 
-    std::string trace_name = "qemu_graph_trace_page_rank";
+//    separate_trace_file_per_core(trace_name);
 
 //    multiple_private_cache_sizes(trace_name);
 //    multiple_private_cache_assocs(trace_name);
@@ -2,4 +2,63 @@
 
 #pragma once
 
-void generate_stats();
\ No newline at end of file
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "cache_organization.hpp"
+#include "replacement_policy.hpp"
+#include "tag_store.hpp"
+#include "trace_cache.hpp"
+#include "trace_filter.hpp"
+#include "trace_index.hpp"
+#include "trace_prefetcher.hpp"
+#include "trace_reader.hpp"
+#include "trace_roi.hpp"
+#include "trace_sampling.hpp"
+
+struct StatisticsOptions {
+    // A name in ../traces/, a path, or "-" for the standard input. Several comma-separated traces
+    // are merged by timestamp.
+    std::string trace_name = "qemu_graph_trace_page_rank";
+    // When merging, the cores of the i-th trace are renumbered from i * merge_core_stride.
+    // Zero keeps the original core numbers, e.g. for per-core traces of a single run.
+    uint32_t merge_core_stride = 0;
+    // Detected from the trace when not given. Required for the standard input.
+    std::optional<TraceFormat> trace_format;
+    // Part of each trace to replay, found through the trace index. Not supported on streams.
+    TraceSlice slice;
+    // Replays only the `partition`-th of `num_partitions` balanced partitions of each trace,
+    // e.g. to spread a long trace over several processes. Overrides the record bounds of `slice`.
+    uint32_t partition = 0;
+    uint32_t num_partitions = 1;
+    // Records of other cores, addresses or access types are dropped before the experiments.
+    // Columnar traces skip whole blocks that can not match.
+    TraceFilter filter;
+    // Decode each trace once and replay it from memory in every experiment. Turn off for traces
+    // that do not fit in memory even compressed. Streams are never cached: they are simulated as
+    // they arrive, by a single experiment.
+    bool cache_traces = true;
+    TraceCacheOptions cache_options;
+    // Fold each core's repeated accesses to one L1 line into a weighted record. Exact for the
+    // MultiLevelCache experiments, only faster.
+    bool collapse_repeats = true;
+    // What marker records in the trace do, see trace_roi.hpp. Counted accesses (total_analyzed)
+    // include the warming ones.
+    RoiMode roi_mode = RoiMode::OFF;
+    // Measure the caches in periodic windows only and estimate their misses and accesses for the
+    // whole trace, see trace_sampling.hpp.
+    SamplingOptions sampling;
+    // Of the shared caches of the experiments. The private L1 caches stay LRU.
+    ReplacementPolicy llc_policy = ReplacementPolicy::LRU;
+    // Of the shared caches too, see cache_organization.hpp.
+    CacheOrganization llc_organization = CacheOrganization::SET_ASSOCIATIVE;
+    // Of the shared caches too, in a file for caches larger than the memory, see tag_store.hpp.
+    // Set-associative organization only. `resident_bytes` bounds the stores of all of them together.
+    TagStoreOptions llc_tag_store;
+    // Decode the trace on a separate thread, ahead of the simulation.
+    bool prefetch = true;
+    PrefetchOptions prefetch_options;
+};
+
+void generate_stats(const StatisticsOptions& options = {});
@@ -0,0 +1,254 @@
+#include "tag_store.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+TagStoreOptions TagStoreOptions::shared() const {
+    TagStoreOptions options = *this;
+    if (options.residency == nullptr) {
+        options.residency = std::make_shared<TagStoreResidency>(resident_bytes);
+    }
+    return options;
+}
+
+TagStore::TagStore(size_t block_words, uint64_t max_blocks, TagStoreOptions options)
+        : block_words_(block_words), max_blocks_(max_blocks), options_(std::move(options)) {
+    // The largest power of 2 of blocks that fits in a chunk, but no more than the store can hold.
+    const size_t block_bytes = block_words * sizeof(uint64_t);
+    const uint32_t chunk_bits = std::bit_width(std::max<size_t>(TAG_STORE_CHUNK_BYTES / block_bytes, 1)) - 1;
+    const uint32_t max_bits = std::bit_width(std::bit_ceil(std::max<uint64_t>(max_blocks, 1))) - 1;
+    chunk_bits_ = std::min(chunk_bits, max_bits);
+    if (options_.directory.empty()) {
+        return;
+    }
+
+    mapping_bytes_ = (((std::max<uint64_t>(max_blocks, 1) - 1) >> chunk_bits_) + 1) * chunk_bytes();
+
+    static std::atomic<uint32_t> files = 0;
+    auto path = (std::filesystem::path(options_.directory) /
+                 ("asgard_tags_" + std::to_string(::getpid()) + "_" + std::to_string(files++))).string();
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd_ < 0) {
+        throw std::runtime_error("Could not create '" + path + "': " + std::strerror(errno));
+    }
+    // Only the descriptor refers to the file from now on, it goes away when closed.
+    ::unlink(path.c_str());
+
+    // Sparse: the disk holds only the chunks written back.
+    void *addr = MAP_FAILED;
+    if (::ftruncate(fd_, (off_t) mapping_bytes_) == 0) {
+        addr = ::mmap(nullptr, mapping_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    }
+    if (addr == MAP_FAILED) {
+        std::string error = std::strerror(errno);
+        ::close(fd_);
+        fd_ = -1;
+        throw std::runtime_error("Could not map '" + path + "': " + error);
+    }
+    mapping_ = static_cast<uint64_t *>(addr);
+    // The cache finds the blocks through its sets, in no order the kernel could guess. Chunks are
+    // read ahead by reference() instead.
+    ::madvise(mapping_, mapping_bytes_, MADV_RANDOM);
+
+    residency_ = options_.residency != nullptr ? options_.residency
+                                               : std::make_shared<TagStoreResidency>(options_.resident_bytes);
+    residency_->add(this);
+}
+
+TagStore::TagStore(const TagStore& other) {
+    if (other.block_words_ == 0) {
+        return;
+    }
+    TagStore copy(other.block_words_, other.max_blocks_, other.options_);
+    for (uint32_t number = 0; number < other.blocks_; number++) {
+        std::copy_n(other.peek(number), other.block_words_, copy.block(copy.allocate()));
+    }
+    swap(copy);
+}
+
+TagStore& TagStore::operator=(const TagStore& other) {
+    if (this != &other) {
+        TagStore copy(other);
+        swap(copy);
+    }
+    return *this;
+}
+
+TagStore::TagStore(TagStore&& other) noexcept {
+    swap(other);
+}
+
+TagStore& TagStore::operator=(TagStore&& other) noexcept {
+    swap(other);
+    return *this;
+}
+
+TagStore::~TagStore() {
+    if (residency_ != nullptr) {
+        residency_->remove(this);
+    }
+    if (mapping_ != nullptr) {
+        ::munmap(mapping_, mapping_bytes_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+uint32_t TagStore::allocate() {
+    if (blocks_ >= max_blocks_) {
+        throw std::logic_error("Tag store full");
+    }
+    const uint32_t number = blocks_++;
+    const uint32_t chunk = number >> chunk_bits_;
+    if (chunk == chunk_states_.size()) {
+        const size_t chunk_words = block_words_ << chunk_bits_;
+        if (mapping_ == nullptr) {
+            chunks_.emplace_back(chunk_words);
+            chunk_bases_.push_back(chunks_.back().data());
+            chunk_states_.push_back(REFERENCED);
+        } else {
+            chunk_bases_.push_back(mapping_ + chunk_words * chunk);
+            chunk_states_.push_back(NOT_RESIDENT);
+        }
+    }
+    return number;
+}
+
+const uint64_t *TagStore::peek(uint32_t number) const noexcept {
+    return chunk_bases_[number >> chunk_bits_] + (size_t) (number & ((1u << chunk_bits_) - 1)) * block_words_;
+}
+
+uint32_t TagStore::blocks() const noexcept {
+    return blocks_;
+}
+
+bool TagStore::mapped() const noexcept {
+    return mapping_ != nullptr;
+}
+
+uint64_t TagStore::resident_bytes() const noexcept {
+    return (mapping_ != nullptr ? resident_chunks_ : chunks_.size()) * chunk_bytes();
+}
+
+size_t TagStore::chunk_bytes() const noexcept {
+    return (block_words_ * sizeof(uint64_t)) << chunk_bits_;
+}
+
+void TagStore::reference(uint32_t chunk) {
+    if (chunk_states_[chunk] == NOT_RESIDENT) {
+        residency_->make_room(chunk_bytes());
+        resident_chunks_++;
+        residency_->resident_bytes_ += chunk_bytes();
+        // Read back ahead of the faults, with the next chunk: the blocks first touched after these
+        // are likely next.
+        const size_t offset = chunk * chunk_bytes();
+        ::madvise(reinterpret_cast<uint8_t *>(mapping_) + offset, std::min(2 * chunk_bytes(), mapping_bytes_ - offset),
+                  MADV_WILLNEED);
+    }
+    chunk_states_[chunk] = REFERENCED;
+}
+
+bool TagStore::clock_tick() {
+    auto& state = chunk_states_[clock_hand_];
+    bool dropped = false;
+    if (state == REFERENCED) {
+        state = RESIDENT;
+    } else if (state == RESIDENT) {
+        // Out of the page tables, the contents stay in the file. The kernel writes the dirty pages
+        // back and reclaims them as it needs the memory, meanwhile a chunk back soon costs no I/O.
+        ::madvise(reinterpret_cast<uint8_t *>(mapping_) + clock_hand_ * chunk_bytes(), chunk_bytes(), MADV_DONTNEED);
+        state = NOT_RESIDENT;
+        resident_chunks_--;
+        residency_->resident_bytes_ -= chunk_bytes();
+        dropped = true;
+    }
+    clock_hand_ = (clock_hand_ + 1) % (uint32_t) chunk_states_.size();
+    return dropped;
+}
+
+void TagStore::swap(TagStore& other) noexcept {
+    std::swap(block_words_, other.block_words_);
+    std::swap(max_blocks_, other.max_blocks_);
+    std::swap(options_, other.options_);
+    std::swap(chunk_bits_, other.chunk_bits_);
+    std::swap(blocks_, other.blocks_);
+    std::swap(chunk_bases_, other.chunk_bases_);
+    std::swap(chunk_states_, other.chunk_states_);
+    std::swap(chunks_, other.chunks_);
+    std::swap(fd_, other.fd_);
+    std::swap(mapping_, other.mapping_);
+    std::swap(mapping_bytes_, other.mapping_bytes_);
+    std::swap(resident_chunks_, other.resident_chunks_);
+    std::swap(residency_, other.residency_);
+    std::swap(clock_hand_, other.clock_hand_);
+    if (residency_ != nullptr) {
+        residency_->exchange(this, &other);
+    }
+    if (other.residency_ != nullptr && other.residency_ != residency_) {
+        other.residency_->exchange(this, &other);
+    }
+}
+
+TagStoreResidency::TagStoreResidency(uint64_t max_bytes) : max_bytes_(max_bytes) {}
+
+uint64_t TagStoreResidency::resident_bytes() const noexcept {
+    return resident_bytes_;
+}
+
+void TagStoreResidency::add(TagStore *store) {
+    max_bytes_ = std::max<uint64_t>(max_bytes_, 2 * store->chunk_bytes());
+    stores_.push_back(store);
+}
+
+void TagStoreResidency::remove(TagStore *store) noexcept {
+    auto it = std::find(stores_.begin(), stores_.end(), store);
+    if (it == stores_.end()) {
+        return;
+    }
+    resident_bytes_ -= store->resident_chunks_ * store->chunk_bytes();
+    if ((size_t) (it - stores_.begin()) < hand_) {
+        hand_--;
+    }
+    stores_.erase(it);
+}
+
+void TagStoreResidency::exchange(TagStore *a, TagStore *b) noexcept {
+    for (auto& store: stores_) {
+        if (store == a) {
+            store = b;
+        } else if (store == b) {
+            store = a;
+        }
+    }
+}
+
+void TagStoreResidency::make_room(uint64_t bytes) {
+    // Every resident chunk is found within two turns of the clock, the first one clearing the
+    // references.
+    while (resident_bytes_ > 0 && resident_bytes_ + bytes > max_bytes_) {
+        if (hand_ >= stores_.size()) {
+            hand_ = 0;
+        }
+        TagStore *store = stores_[hand_];
+        if (store->chunk_states_.empty()) {
+            hand_++;
+            continue;
+        }
+        store->clock_tick();
+        // On to the next store once the clock went past all the chunks of this one.
+        if (store->clock_hand_ == 0) {
+            hand_++;
+        }
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Storage of the set blocks of a cache that allocates its sets on first touch (see
+ * Cache::allocated_sets()). Blocks are numbered in the order they are first touched, so the blocks
+ * a trace uses together are stored together, and they are allocated in chunks of about
+ * TAG_STORE_CHUNK_BYTES.
+ *
+ * By default the chunks are in memory. With a directory, the blocks are in a file there, mapped
+ * into memory, so the cache can be larger than the memory of the host: at most `resident_bytes`
+ * of the chunks stay mapped in, over all the stores sharing a TagStoreResidency. A clock over their
+ * chunks picks the ones to drop, which the kernel writes back to the file, and a chunk mapped in
+ * again brings in the next one of its file with it, the blocks first touched right after its own.
+ * Either way the simulation is the same.
+ */
+
+constexpr size_t TAG_STORE_CHUNK_BYTES = 1 << 20;
+
+class TagStore;
+
+// The resident chunks of several mapped stores, e.g. of the slices of a partitioned cache, bounded
+// together by one clock over all of them. Not thread safe, like the caches.
+class TagStoreResidency {
+public:
+    // At least two chunks of the largest of the stores.
+    explicit TagStoreResidency(uint64_t max_bytes);
+
+    TagStoreResidency(const TagStoreResidency&) = delete;
+    TagStoreResidency& operator=(const TagStoreResidency&) = delete;
+
+    // Bytes of the chunks mapped in, over all the stores.
+    uint64_t resident_bytes() const noexcept;
+private:
+    friend class TagStore;
+
+    uint64_t max_bytes_;
+    uint64_t resident_bytes_ = 0;
+    std::vector<TagStore *> stores_;
+    // Of the clock: the store it is in, which keeps its own position.
+    size_t hand_ = 0;
+
+    void add(TagStore *store);
+    void remove(TagStore *store) noexcept;
+    // Points the entries of `a` to `b` and the other way round, after the two swapped contents.
+    void exchange(TagStore *a, TagStore *b) noexcept;
+    // Drops chunks until `bytes` more fit.
+    void make_room(uint64_t bytes);
+};
+
+struct TagStoreOptions {
+    // Directory of the file of the blocks, empty to keep them in memory. The file is removed as
+    // soon as it is created, so nothing is left behind.
+    std::string directory;
+    // Of the files of the stores sharing `residency`, at least two chunks.
+    uint64_t resident_bytes = 1ull << 30;
+    // Stores made with options that share a residency bound their resident chunks together, to
+    // the `resident_bytes` it was made with. Each store has one of its own otherwise.
+    std::shared_ptr<TagStoreResidency> residency = nullptr;
+
+    // These options with a residency for all the stores made with them, a new one if they have
+    // none, e.g. for the caches of a partitioning scheme.
+    TagStoreOptions shared() const;
+};
+
+class TagStore {
+public:
+    TagStore() = default;
+    // Up to `max_blocks` blocks of `block_words` words. Throws std::runtime_error if the file can
+    // not be created.
+    TagStore(size_t block_words, uint64_t max_blocks, TagStoreOptions options = {});
+    // Copies hold blocks of their own, in a file of their own if mapped, sharing the residency of
+    // the options of the original.
+    TagStore(const TagStore& other);
+    TagStore& operator=(const TagStore& other);
+    TagStore(TagStore&& other) noexcept;
+    TagStore& operator=(TagStore&& other) noexcept;
+    ~TagStore();
+
+    // Number of a new block of zeroes.
+    uint32_t allocate();
+    // Words of the block `number`, counted as an access for the resident budget. Blocks never
+    // move, the pointer stays valid as long as the store.
+    uint64_t *block(uint32_t number) {
+        const uint32_t chunk = number >> chunk_bits_;
+        if (chunk_states_[chunk] != REFERENCED) {
+            reference(chunk);
+        }
+        return chunk_bases_[chunk] + (size_t) (number & ((1u << chunk_bits_) - 1)) * block_words_;
+    }
+    // The same without counting an access.
+    const uint64_t *peek(uint32_t number) const noexcept;
+
+    uint32_t blocks() const noexcept;
+    bool mapped() const noexcept;
+    // Bytes of the chunks mapped in, or of all of them in memory.
+    uint64_t resident_bytes() const noexcept;
+private:
+    // Chunks the clock has not passed since their last access are REFERENCED, so accesses to
+    // them check only that.
+    enum ChunkState : uint8_t {
+        NOT_RESIDENT,
+        RESIDENT,
+        REFERENCED,
+    };
+
+    size_t block_words_ = 0;
+    uint64_t max_blocks_ = 0;
+    TagStoreOptions options_;
+    uint32_t chunk_bits_ = 0;
+    uint32_t blocks_ = 0;
+    std::vector<uint64_t *> chunk_bases_;
+    std::vector<ChunkState> chunk_states_;
+    // In memory.
+    std::vector<std::vector<uint64_t>> chunks_;
+    // Mapped.
+    int fd_ = -1;
+    uint64_t *mapping_ = nullptr;
+    size_t mapping_bytes_ = 0;
+    uint64_t resident_chunks_ = 0;
+    std::shared_ptr<TagStoreResidency> residency_;
+    uint32_t clock_hand_ = 0;
+
+    friend class TagStoreResidency;
+
+    size_t chunk_bytes() const noexcept;
+    // Maps the chunk in if needed and marks it REFERENCED.
+    void reference(uint32_t chunk);
+    // Moves the clock past one chunk, dropping it if unreferenced. Returns whether it was dropped.
+    bool clock_tick();
+    void swap(TagStore& other) noexcept;
+};
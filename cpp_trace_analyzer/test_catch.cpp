@@ -1,8 +1,41 @@
 #define CATCH_CONFIG_MAIN
 
+#include "block_compression.hpp"
 #include "cache.hpp"
+#include "cache_kernels.hpp"
+#include "columnar_trace.hpp"
+#include "compressed_trace.hpp"
 #include "catch.hpp"
 #include "llc_partitioning.hpp"
+#include "shm_trace_ring.hpp"
+#include "text_trace_parser.hpp"
+#include "trace_cache.hpp"
+#include "trace_collapse.hpp"
+#include "trace_filter.hpp"
+#include "trace_index.hpp"
+#include "trace_merger.hpp"
+#include "trace_metadata.hpp"
+#include "trace_next_use.hpp"
+#include "trace_prefetcher.hpp"
+#include "trace_reader.hpp"
+#include "trace_roi.hpp"
+#include "trace_sampling.hpp"
+#include "trace_splitter.hpp"
+#include "trace_writer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <numeric>
+#include <random>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
 #include <vector>
 
 using namespace std;
@@ -165,6 +198,479 @@ TEST_CASE("LRU policy works", "cache") {
     REQUIRE(pc2.misses() == 5);
 }
 
+TEST_CASE("Packed lines keep the exact LRU order", "cache") {
+    for (uint32_t assoc: {1u, 2u, 4u, 16u}) {
+        Cache cache(64 * 4 * assoc, assoc, 64);
+        // Per set, the cached blocks from most to least recently used.
+        std::vector<std::vector<uint64_t>> model(4);
+
+        std::mt19937_64 rng(assoc);
+        std::uniform_int_distribution<uint64_t> blocks(0, 8 * assoc);
+        uint64_t expected_hits = 0;
+        for (int i = 0; i < 20000; i++) {
+            uint64_t block = blocks(rng);
+            auto& set = model[block % 4];
+            auto it = std::find(set.begin(), set.end(), block);
+            bool hit = it != set.end();
+            if (hit) {
+                set.erase(it);
+            } else if (set.size() == assoc) {
+                set.pop_back();
+            }
+            set.insert(set.begin(), block);
+            expected_hits += hit;
+
+            REQUIRE(cache.access(block * 64 + 5) == hit);
+        }
+        REQUIRE(cache.hits() == expected_hits);
+        for (uint64_t block = 0; block <= 8 * assoc; block++) {
+            const auto& set = model[block % 4];
+            REQUIRE(cache.exists(block * 64) == (std::find(set.begin(), set.end(), block) != set.end()));
+        }
+
+        // One word per line, the ranks of a set a permutation.
+        for (uint32_t s = 0; s < cache.sets(); s++) {
+            std::vector<uint64_t> ranks;
+            for (uint32_t way = 0; way < assoc; way++) {
+                ranks.push_back((cache.lines(s)[way] & Cache::RANK_MASK) >> Cache::TAG_BITS);
+            }
+            std::sort(ranks.begin(), ranks.end());
+            std::vector<uint64_t> expected(assoc);
+            std::iota(expected.begin(), expected.end(), 0);
+            REQUIRE(ranks == expected);
+        }
+    }
+    REQUIRE_THROWS_AS(Cache(64ull * (Cache::MAX_ASSOC * 2), Cache::MAX_ASSOC * 2, 64, ReplacementPolicy::PLRU),
+                      std::invalid_argument);
+}
+
+TEST_CASE("Indexed LRU keeps the exact LRU order at any associativity", "cache") {
+    // {sets, assoc}, the last one fully associative and beyond MAX_ASSOC.
+    for (auto [sets, assoc]: std::vector<std::pair<uint32_t, uint32_t>>{{4, 64}, {2, 1024}, {1, 2 * Cache::MAX_ASSOC}}) {
+        Cache cache(64ull * sets * assoc, sets, assoc, 64);
+        REQUIRE(cache.indexed_lru());
+        // Per set, the cached blocks from most to least recently used, and where they are.
+        std::vector<std::list<uint64_t>> model(sets);
+        std::unordered_map<uint64_t, std::list<uint64_t>::iterator> cached;
+
+        std::mt19937_64 rng(assoc);
+        std::uniform_int_distribution<uint64_t> blocks(0, 2ull * sets * assoc);
+        uint64_t expected_hits = 0;
+        for (int i = 0; i < 100000; i++) {
+            uint64_t block = blocks(rng);
+            auto& set = model[block % sets];
+            auto it = cached.find(block);
+            bool hit = it != cached.end();
+            if (hit) {
+                set.erase(it->second);
+            } else if (set.size() == assoc) {
+                cached.erase(set.back());
+                set.pop_back();
+            }
+            set.push_front(block);
+            cached[block] = set.begin();
+            expected_hits += hit;
+
+            REQUIRE(cache.access(block * 64 + 5) == hit);
+        }
+        REQUIRE(cache.hits() == expected_hits);
+        REQUIRE(expected_hits > 0);
+        for (uint64_t block = 0; block <= 2ull * sets * assoc; block += 7) {
+            REQUIRE(cache.exists(block * 64) == cached.count(block));
+        }
+    }
+    REQUIRE_FALSE(Cache(64 * 4 * 32, 32, 64).indexed_lru());
+    REQUIRE_FALSE(Cache(64 * 4 * 64, 64, 64, ReplacementPolicy::SRRIP).indexed_lru());
+}
+
+TEST_CASE("Cache kernels agree with the scalar ones", "cache") {
+    auto kernels = available_cache_kernels();
+    REQUIRE(std::string(kernels.front()->name) == "scalar");
+    REQUIRE(&cache_kernels() == kernels.back());
+    REQUIRE_THROWS_AS(select_cache_kernels("mmx"), std::invalid_argument);
+
+    const auto& scalar = *kernels.front();
+    std::mt19937_64 rng(18);
+    for (uint32_t assoc = 1; assoc <= 33; assoc++) {
+        // A set of lines in any state, ranks 0 .. assoc - 1 shuffled, and few distinct tags.
+        std::vector<uint64_t> ranks(assoc);
+        std::iota(ranks.begin(), ranks.end(), 0);
+        std::shuffle(ranks.begin(), ranks.end(), rng);
+        std::vector<uint64_t> set(assoc);
+        for (uint32_t way = 0; way < assoc; way++) {
+            set[way] = (rng() & Cache::VALID_BIT) | (ranks[way] << Cache::TAG_BITS) | (rng() % 8);
+        }
+
+        for (const auto *k: kernels) {
+            INFO(k->name << ", " << assoc << " ways");
+            for (uint64_t tag = 0; tag < 8; tag++) {
+                REQUIRE(k->find_line(set.data(), assoc, Cache::VALID_BIT | tag) ==
+                        scalar.find_line(set.data(), assoc, Cache::VALID_BIT | tag));
+            }
+            for (uint64_t rank = 0; rank <= assoc; rank++) {
+                REQUIRE(k->find_rank(set.data(), assoc, rank << Cache::TAG_BITS) ==
+                        scalar.find_rank(set.data(), assoc, rank << Cache::TAG_BITS));
+            }
+            uint64_t rank = (rng() % assoc) << Cache::TAG_BITS;
+            auto aged = set, expected = set;
+            k->age_below(aged.data(), assoc, rank);
+            scalar.age_below(expected.data(), assoc, rank);
+            REQUIRE(aged == expected);
+        }
+    }
+
+    // Caches built under each of them give the same results.
+    std::vector<uint64_t> misses;
+    for (const auto *k: kernels) {
+        select_cache_kernels(k->name);
+        Cache cache(64 * 64 * 12, 64, 12, 64);
+        std::mt19937_64 accesses(5);
+        for (int i = 0; i < 50000; i++) {
+            cache.access((accesses() % 2048) * 64);
+        }
+        misses.push_back(cache.misses());
+    }
+    select_cache_kernels(kernels.back()->name);
+    REQUIRE(std::adjacent_find(misses.begin(), misses.end(), std::not_equal_to<>()) == misses.end());
+}
+
+TEST_CASE("Specialized geometries match the generic access", "cache") {
+    REQUIRE(Cache::mask(0) == 0);
+    REQUIRE(Cache::mask(3) == 0b111);
+    REQUIRE(Cache::mask(64) == ~0ull);
+    REQUIRE(Cache::log2(1) == 0);
+    REQUIRE(Cache::log2(48) == 5);
+
+    // Block sizes and associativities with and without a specialized access.
+    for (auto policy: {ReplacementPolicy::LRU, ReplacementPolicy::PLRU, ReplacementPolicy::DRRIP})
+    for (uint32_t block_size: {32u, 64u, 256u}) {
+        for (uint32_t assoc: {1u, 4u, 7u, 16u, 32u}) {
+            Cache specialized(64 * 1024 * assoc, 64, assoc, block_size, policy);
+            Cache generic = specialized;
+            REQUIRE(specialized.block_bits() == Cache::log2(block_size));
+            REQUIRE(specialized.set_bits() == 6);
+
+            std::mt19937_64 rng(assoc);
+            for (int i = 0; i < 20000; i++) {
+                uint64_t addr = rng() % (4 * 64 * 1024 * assoc);
+                auto loc = Cache::compute_location_info(addr, block_size, 64, specialized.tag_bits());
+                REQUIRE(generic.location(addr).set_index == loc.set_index);
+                REQUIRE(generic.location(addr).tag == loc.tag);
+                REQUIRE(specialized.access(addr) == generic.access(loc, addr));
+            }
+            REQUIRE(specialized.misses() == generic.misses());
+            REQUIRE(specialized.hits() == generic.hits());
+        }
+    }
+}
+
+TEST_CASE("Replacement policies pick their victims", "cache") {
+    REQUIRE(parse_replacement_policy("srrip") == ReplacementPolicy::SRRIP);
+    REQUIRE(std::string(replacement_policy_name(ReplacementPolicy::DRRIP)) == "drrip");
+    REQUIRE_THROWS_AS(parse_replacement_policy("random"), std::invalid_argument);
+
+    // One set of 4 ways, blocks A, B, C, ... at 64 * (i + 1).
+    auto block = [](char name) { return (uint64_t) (name - 'A' + 1) * 64; };
+    auto replay = [&](ReplacementPolicy policy, const std::string& names) {
+        Cache cache(4 * 64, 4, 64, policy);
+        for (char name: names) {
+            cache.access(block(name));
+        }
+        return cache;
+    };
+    auto cached = [&](const Cache& cache, const std::string& names) {
+        std::string result;
+        for (char name: names) {
+            if (cache.exists(block(name))) {
+                result += name;
+            }
+        }
+        return result;
+    };
+
+    // The tree points away from the last ways used: E replaces A, and after B, F replaces C.
+    REQUIRE(cached(replay(ReplacementPolicy::PLRU, "ABCDEBF"), "ABCDEF") == "BDEF");
+    // No way is left unused, so E replaces the first one; then the first unused one is B.
+    REQUIRE(cached(replay(ReplacementPolicy::NRU, "ABCDECF"), "ABCDEF") == "CDEF");
+    // A line used again outlives a scan of four new ones under SRRIP, not under LRU.
+    REQUIRE(cached(replay(ReplacementPolicy::SRRIP, "ABCDAEFGH"), "A") == "A");
+    REQUIRE(cached(replay(ReplacementPolicy::LRU, "ABCDAEFGH"), "A").empty());
+
+    // A loop over one line more than a set holds: LRU always misses, BRRIP keeps most of it.
+    auto loop_hits = [](ReplacementPolicy policy) {
+        Cache cache(64 * 64 * 4, 4, 64, policy);
+        for (int i = 0; i < 2000; i++) {
+            for (uint64_t line = 0; line < 5; line++) {
+                for (uint64_t set = 0; set < 64; set++) {
+                    cache.access((line * 64 + set) * 64);
+                }
+            }
+        }
+        return cache.hits();
+    };
+    uint64_t total = 2000 * 5 * 64;
+    REQUIRE(loop_hits(ReplacementPolicy::LRU) == 0);
+    REQUIRE(loop_hits(ReplacementPolicy::SRRIP) == 0);
+    REQUIRE(loop_hits(ReplacementPolicy::BRRIP) > total / 2);
+    // Set dueling sees SRRIP leaders miss and follows BRRIP.
+    REQUIRE(loop_hits(ReplacementPolicy::DRRIP) > total / 2);
+
+    // Every scheme builds its caches with the policy, any associativity.
+    WayPartitioning way_partitioning(16 * 64 * 16, 64, {3, 13}, ReplacementPolicy::PLRU);
+    REQUIRE(way_partitioning.get_cache(0).policy() == ReplacementPolicy::PLRU);
+    std::mt19937_64 rng(20);
+    for (int i = 0; i < 10000; i++) {
+        way_partitioning.access(i % 2, (rng() % 256) * 64);
+    }
+    REQUIRE(way_partitioning.hits(0) + way_partitioning.misses(0) == 5000);
+    REQUIRE(way_partitioning.hits(1) > way_partitioning.hits(0));
+}
+
+TEST_CASE("Skewed and zcache organizations", "cache") {
+    REQUIRE(parse_cache_organization("zcache") == CacheOrganization::ZCACHE);
+    REQUIRE(std::string(cache_organization_name(CacheOrganization::SKEWED)) == "skewed");
+    REQUIRE_THROWS_AS(parse_cache_organization("direct"), std::invalid_argument);
+    REQUIRE_THROWS_AS(Cache(64 * 64 * 4, 4, 64, ReplacementPolicy::SRRIP, CacheOrganization::SKEWED), std::invalid_argument);
+
+    // Every valid line is where the hash of its way puts its block, and holds a different block.
+    auto consistent = [](const Cache& cache) {
+        std::set<uint64_t> blocks;
+        for (uint32_t row = 0; row < cache.sets(); row++) {
+            for (uint32_t way = 0; way < cache.assoc(); way++) {
+                uint64_t line = cache.lines(row)[way];
+                if ((line & Cache::VALID_BIT) != 0) {
+                    uint64_t block = line & Cache::TAG_MASK;
+                    if (!blocks.insert(block).second || !cache.exists(block * 64)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    };
+
+    // A loop over 5 blocks of one set of a 4-way cache: LRU always misses, skewing spreads them.
+    auto loop_hits = [](CacheOrganization organization) {
+        Cache cache(64 * 64 * 4, 4, 64, ReplacementPolicy::LRU, organization);
+        for (int i = 0; i < 1000; i++) {
+            cache.access((i % 5) * 64 * 64);
+        }
+        return cache.hits();
+    };
+    REQUIRE(loop_hits(CacheOrganization::SET_ASSOCIATIVE) == 0);
+    REQUIRE(loop_hits(CacheOrganization::SKEWED) > 900);
+    REQUIRE(loop_hits(CacheOrganization::ZCACHE) > 900);
+
+    // A working set of 90% of the lines: the relocations of the zcache find room for more of it.
+    auto random_hits = [&](CacheOrganization organization) {
+        Cache cache(64 * 256 * 4, 4, 64, ReplacementPolicy::LRU, organization);
+        std::mt19937_64 rng(23);
+        for (int i = 0; i < 100000; i++) {
+            uint64_t addr = (rng() % 920) * 64;
+            cache.access(addr);
+            REQUIRE(cache.exists(addr));
+            REQUIRE(cache.access(addr));
+        }
+        REQUIRE(consistent(cache));
+        return cache.hits();
+    };
+    auto skewed_hits = random_hits(CacheOrganization::SKEWED);
+    REQUIRE(random_hits(CacheOrganization::ZCACHE) > skewed_hits);
+
+    // They plug into the partitioning schemes and MultiLevelCache like any cache.
+    MultiLevelCache<ClusterWayPartitioning> multi_level{
+        2, Cache(1024, 2, 64), ClusterWayPartitioning(2, 16 * 1024, 64, {1, 3}, ReplacementPolicy::LRU, CacheOrganization::ZCACHE)};
+    for (uint64_t i = 0; i < 20000; i++) {
+        multi_level.access(i % 2, i % 2, (i * 7919 % 1024) * 64);
+    }
+    REQUIRE(multi_level.num_total_accesses(0) + multi_level.num_total_accesses(1) > 0);
+    REQUIRE(multi_level.get_shared_cache().clusters()[0].get_cache(1).organization() == CacheOrganization::ZCACHE);
+
+    // Except the node partitioning schemes, whose aux tables pick the set of every access.
+    vector<fixed_bits_t> aux_table{fixed_bits_t{bitset<32>{0x0}, 1}, fixed_bits_t{bitset<32>{0x1}, 1}};
+    REQUIRE_THROWS_AS(IntraNodePartitioning(256, 4, 16, aux_table, ReplacementPolicy::LRU, CacheOrganization::SKEWED),
+                      std::invalid_argument);
+    vector<inter_intra_aux_table_t> aux_tables{{2, {{0, 1}, {1, 2}}}};
+    REQUIRE_THROWS_AS(InterIntraNodePartitioning(2, 16, {{64}, {64}}, aux_tables, ReplacementPolicy::LRU, CacheOrganization::ZCACHE),
+                      std::invalid_argument);
+    REQUIRE_NOTHROW(InterIntraNodePartitioning(2, 16, {{64}, {64}}, aux_tables));
+}
+
+TEST_CASE("Sets are allocated on first touch", "cache") {
+    // 1 TiB, 2^30 sets: only the blocks of the sets of a 1 MiB footprint are allocated.
+    const uint64_t TiB = 1ull << 40;
+    Cache cache(TiB, 16, 64);
+    REQUIRE(cache.sets() == (1u << 30));
+    REQUIRE(cache.allocated_sets() == 0);
+    REQUIRE((cache.lines(12345678)[0] & Cache::VALID_BIT) == 0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint64_t addr = 0; addr < (1 << 20); addr += 64) {
+            cache.access(addr + 5 * TiB / 16);
+        }
+    }
+    REQUIRE(cache.misses() == (1 << 14));
+    REQUIRE(cache.hits() == (1 << 14));
+    REQUIRE(cache.allocated_sets() == (1 << 14));
+    REQUIRE(cache.exists(5 * TiB / 16 + 4096));
+    REQUIRE(!cache.exists(4096));
+
+    // Set counts that are not powers of 2, and copies, which share nothing.
+    Cache odd(64 * 7 * 3000, 3000, 7, 64, ReplacementPolicy::SRRIP);
+    Cache copy = odd;
+    for (uint32_t set = 0; set < 3000; set++) {
+        odd.access(LocationInfo{.set_index = set, .tag = 1}, 0);
+    }
+    REQUIRE(odd.allocated_sets() == 3000);
+    REQUIRE(odd.lines(2999)[0] == (Cache::VALID_BIT | ((Cache::RRPV_MAX - 1) << Cache::TAG_BITS) | 1));
+    REQUIRE(copy.allocated_sets() == 0);
+    REQUIRE(!copy.access(0));
+
+    // Counters past 2^32.
+    odd.add_hits(UINT32_MAX);
+    odd.add_hits(UINT32_MAX);
+    REQUIRE(odd.hits() == 2ull * UINT32_MAX);
+}
+
+TEST_CASE("Scattered footprints allocate whole set blocks", "cache") {
+    // 64 MiB, 16 ways: 2^16 sets, in blocks of 16 sets and pages of 256 blocks of 1 KiB.
+#ifdef ASGARD_CACHE_DEBUG_ADDR
+    // The line words and their addresses.
+    const uint64_t arrays = 2;
+#else
+    const uint64_t arrays = 1;
+#endif
+    const uint64_t set_bytes = arrays * 16 * 8;
+    const uint64_t block_bytes = Cache::SET_BLOCK_SETS * set_bytes;
+    const uint64_t page_bytes = Cache::SET_PAGE_BLOCKS * 4;
+    auto touch = [](Cache& cache, uint32_t sets, uint32_t stride) {
+        for (uint64_t set = 0; set < (uint64_t) sets * stride; set += stride) {
+            cache.access(set * 64);
+        }
+    };
+
+    // Contiguous sets: their own words only, plus the page.
+    Cache dense(64 << 20, 16, 64);
+    REQUIRE(dense.allocated_bytes() == 0);
+    touch(dense, 1024, 1);
+    REQUIRE(dense.allocated_bytes() == 1024 * set_bytes + page_bytes);
+
+    // One set per block: a whole block each, 16 times as much, and their pages.
+    Cache strided(64 << 20, 16, 64);
+    touch(strided, 1024, Cache::SET_BLOCK_SETS);
+    REQUIRE(strided.allocated_sets() == 1024 * Cache::SET_BLOCK_SETS);
+    REQUIRE(strided.allocated_bytes() == 1024 * block_bytes + 4 * page_bytes);
+
+    // One set per page: a block and a page each.
+    Cache scattered(64 << 20, 16, 64);
+    touch(scattered, 16, Cache::SET_BLOCK_SETS * Cache::SET_PAGE_BLOCKS);
+    REQUIRE(scattered.allocated_bytes() == 16 * (block_bytes + page_bytes));
+
+    // Caches that hold all their sets.
+    Cache skewed(64 * 1024, 4, 64, ReplacementPolicy::LRU, CacheOrganization::SKEWED);
+    REQUIRE(skewed.allocated_bytes() == arrays * 64 * 1024 / 8);
+}
+
+TEST_CASE("Tag stores in a file simulate the same as in memory", "cache") {
+    // 8 MiB of line words in chunks of 1 MiB, at most 2 of them resident.
+    TagStoreOptions options{.directory = std::filesystem::temp_directory_path().string(), .resident_bytes = 0};
+    for (auto policy: {ReplacementPolicy::LRU, ReplacementPolicy::SRRIP}) {
+        Cache in_memory(64 * 1024 * 1024, 8, 64, policy);
+        Cache mapped = in_memory;
+        mapped.set_tag_store(options);
+        REQUIRE(mapped.tag_store().mapped());
+        REQUIRE(!in_memory.tag_store().mapped());
+
+        // A scan with random accesses over twice the capacity, so chunks leave and come back.
+        std::mt19937_64 rng(25);
+        auto next_addr = [&rng](uint64_t i) {
+            return (rng() % 32 == 0 ? rng() % (1 << 21) : i * 17 % (1 << 21)) * 64;
+        };
+        for (uint64_t i = 0; i < 100000; i++) {
+            uint64_t addr = next_addr(i);
+            REQUIRE(in_memory.access(addr) == mapped.access(addr));
+        }
+        REQUIRE(mapped.tag_store().resident_bytes() <= 2 * TAG_STORE_CHUNK_BYTES);
+        REQUIRE(mapped.allocated_sets() == in_memory.allocated_sets());
+
+        // Copies go on on their own.
+        Cache copy = mapped;
+        REQUIRE(copy.tag_store().mapped());
+        for (uint64_t i = 0; i < 30000; i++) {
+            uint64_t addr = next_addr(i);
+            bool hit = in_memory.access(addr);
+            REQUIRE(mapped.access(addr) == hit);
+            REQUIRE(copy.access(addr) == hit);
+        }
+        for (uint32_t set = 0; set < in_memory.sets(); set += 97) {
+            REQUIRE(std::equal(in_memory.lines(set), in_memory.lines(set) + 8, mapped.lines(set)));
+            REQUIRE(std::equal(in_memory.lines(set), in_memory.lines(set) + 8, copy.lines(set)));
+        }
+        REQUIRE(copy.misses() == in_memory.misses());
+        REQUIRE_THROWS_AS(mapped.set_tag_store(options), std::logic_error);
+    }
+
+    REQUIRE_THROWS_AS(Cache(64 * 64 * 4, 4, 64, ReplacementPolicy::LRU, CacheOrganization::SKEWED).set_tag_store(options),
+                      std::invalid_argument);
+    REQUIRE_THROWS_AS(Cache(1024, 2, 64).set_tag_store({.directory = "/nonexistent/directory"}), std::runtime_error);
+}
+
+TEST_CASE("Partitioned caches share one resident budget", "cache") {
+    // Three caches of 8 to 16 MiB of set blocks, in chunks of 1 MiB, within 3 MiB in all.
+    const uint64_t budget = 3 * TAG_STORE_CHUNK_BYTES;
+    TagStoreOptions options{.directory = std::filesystem::temp_directory_path().string(), .resident_bytes = budget};
+    WayPartitioning in_memory(256 * 1024 * 1024, 64, {4, 4, 8});
+    WayPartitioning mapped = in_memory;
+    mapped.set_tag_store(options);
+
+    auto resident_bytes = [&mapped] {
+        uint64_t bytes = 0;
+        for (uint32_t client = 0; client < 3; client++) {
+            bytes += mapped.get_cache(client).tag_store().resident_bytes();
+        }
+        return bytes;
+    };
+    std::mt19937_64 rng(26);
+    uint64_t max_resident = 0;
+    for (uint64_t i = 0; i < 30000; i++) {
+        uint32_t client = rng() % 3;
+        uint64_t addr = (rng() % (1 << 20)) * 64;
+        REQUIRE(in_memory.access(client, addr) == mapped.access(client, addr));
+        if (i % 100 == 0) {
+            max_resident = std::max(max_resident, resident_bytes());
+        }
+    }
+    REQUIRE(max_resident <= budget);
+    REQUIRE(resident_bytes() > 0);
+    REQUIRE(resident_bytes() <= budget);
+    for (uint32_t client = 0; client < 3; client++) {
+        REQUIRE(mapped.misses(client) == in_memory.misses(client));
+    }
+
+    // Stores of separate options have budgets of their own, at least two chunks each.
+    TagStoreOptions small{.directory = options.directory, .resident_bytes = 0};
+    Cache first(64 * 1024 * 1024, 8, 64), second = first;
+    first.set_tag_store(small);
+    second.set_tag_store(small);
+    for (uint64_t addr = 0; addr < (64ull << 20); addr += 64) {
+        first.access(addr);
+        second.access(addr);
+    }
+    REQUIRE(first.tag_store().resident_bytes() == 2 * TAG_STORE_CHUNK_BYTES);
+    REQUIRE(second.tag_store().resident_bytes() == 2 * TAG_STORE_CHUNK_BYTES);
+
+    // Unless they share one.
+    auto shared = small.shared();
+    Cache third(64 * 1024 * 1024, 8, 64), fourth = third;
+    third.set_tag_store(shared);
+    fourth.set_tag_store(shared);
+    for (uint64_t addr = 0; addr < (64ull << 20); addr += 64) {
+        third.access(addr);
+        fourth.access(addr);
+    }
+    REQUIRE(third.tag_store().resident_bytes() + fourth.tag_store().resident_bytes() == 2 * TAG_STORE_CHUNK_BYTES);
+    REQUIRE(shared.residency->resident_bytes() == 2 * TAG_STORE_CHUNK_BYTES);
+}
+
 TEST_CASE("Way partitioning valid input", "Way partitioning") {
     vector<uint32_t> partition{1, 2, 1};
 
@@ -687,7 +1193,7 @@ TEST_CASE("Cluster partitioning normal way", "Cluster partitioning normal") {
 
 TEST_CASE("Inter-intra node partitioning input", "Inter-intra node partitioning") {
     //Non divisible number of rows
-    vector<vector<uint32_t>> cache_sizes = {{60, 64, 0}, {64, 32, 32}, {0, 0, 128}, {32, 32, 32}};
+    vector<vector<uint64_t>> cache_sizes = {{60, 64, 0}, {64, 32, 32}, {0, 0, 128}, {32, 32, 32}};
     vector<inter_intra_aux_table_t> aux_table = {
             {5, {{0, 1}, {1, 3}, {3, 4}}},
             {4, {{0, 1}, {1, 2}, {3, 3}}},
@@ -736,7 +1242,7 @@ TEST_CASE("Inter-intra node partitioning input", "Inter-intra node partitioning"
 // NOTE: Test case was designed for a different implementation in mind. Not applicable.
 //TEST_CASE("Inter-intra node partitioning", "Inter-intra node partitioning") {
 //    //We have three clients with unequal distributions. Note that the last cluster has an unused row!
-//    vector<vector<uint32_t>> cache_sizes = {{64, 64, 0}, {64, 32, 32}, {0, 0, 128}, {32, 32, 32}};
+//    vector<vector<uint64_t>> cache_sizes = {{64, 64, 0}, {64, 32, 32}, {0, 0, 128}, {32, 32, 32}};
 //    vector<inter_intra_aux_table_t> aux_table = {
 //            {5, {{0, 1}, {1, 3}, {3, 4}}},
 //            {4, {{0, 1}, {1, 2}, {3, 3}}},
@@ -880,3 +1386,1396 @@ TEST_CASE("Inter-intra node partitioning input", "Inter-intra node partitioning"
 //    REQUIRE(inp.hits(2) == 5);
 //    REQUIRE(inp.misses(2) == 11);
 //}
+
+static string temp_trace_path(const string& name) {
+    return (std::filesystem::temp_directory_path() / ("asgard_test_" + name)).string();
+}
+
+static void write_binary_record(ofstream& out, uint64_t paddr, uint64_t ts, uint8_t type, uint8_t cpu) {
+    uint8_t buffer[18];
+    memcpy(buffer, &paddr, 8);
+    memcpy(buffer + 8, &ts, 8);
+    buffer[16] = type;
+    buffer[17] = cpu;
+    out.write(reinterpret_cast<const char *>(buffer), sizeof(buffer));
+}
+
+TEST_CASE("Binary trace reader", "Trace reader") {
+    auto path = temp_trace_path("binary.trace");
+    {
+        ofstream out(path, ios::binary);
+        write_binary_record(out, 0x1234, 100, 0, 0);
+        write_binary_record(out, 0xdeadbeef00, 200, 1, 1);
+        write_binary_record(out, 0x40, 300, 2, 3);
+    }
+
+    REQUIRE(detect_trace_format(path) == TraceFormat::BINARY);
+
+    BinaryTraceReader reader(path);
+    REQUIRE(reader.num_records() == 3);
+
+    vector<TraceRecord> records(2);
+    REQUIRE(reader.read(records.data(), records.size()) == 2);
+    REQUIRE(records[0].addr == 0x1234);
+    REQUIRE(records[0].timestamp == 100);
+    REQUIRE(records[0].type == AccessType::INSTRUCTION);
+    REQUIRE(records[1].addr == 0xdeadbeef00);
+    REQUIRE(records[1].type == AccessType::LOAD);
+    REQUIRE(records[1].cpu_index == 1);
+
+    REQUIRE(reader.read(records.data(), records.size()) == 1);
+    REQUIRE(records[0].is_store());
+    REQUIRE(records[0].cpu_index == 3);
+    REQUIRE(reader.read(records.data(), records.size()) == 0);
+
+    // The legacy callable interface sees the same records.
+    BinaryTraceReader legacy_reader(path);
+    vector<uintptr_t> addrs, cpus;
+    uint32_t stores = 0;
+    for_each_trace_record(legacy_reader, [&](uintptr_t addr, uintptr_t cpu_index, bool is_store) {
+        addrs.push_back(addr);
+        cpus.push_back(cpu_index);
+        stores += is_store;
+    });
+    REQUIRE(addrs == vector<uintptr_t>{0x1234, 0xdeadbeef00, 0x40});
+    REQUIRE(cpus == vector<uintptr_t>{0, 1, 3});
+    REQUIRE(stores == 1);
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Text trace reader", "Trace reader") {
+    auto path = temp_trace_path("text");
+    {
+        ofstream out(path);
+        out << "0x1f40 0 0\n" << "abc 1 1\n" << "zz 1 1\n";
+    }
+
+    REQUIRE(detect_trace_format(path) == TraceFormat::TEXT);
+
+    TextTraceReader reader(path);
+    vector<TraceRecord> records(4);
+    REQUIRE(reader.read(records.data(), 2) == 2);
+    REQUIRE(records[0].addr == 0x1f40);
+    REQUIRE(records[0].type == AccessType::LOAD);
+    REQUIRE(records[1].addr == 0xabc);
+    REQUIRE(records[1].cpu_index == 1);
+    REQUIRE(records[1].is_store());
+
+    REQUIRE_THROWS_WITH(reader.read(records.data(), records.size()), "Format error on line 3");
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Zig-zag varint encoding", "Columnar trace") {
+    for (int64_t v: {0L, 1L, -1L, 63L, -64L, 1L << 40, -(1L << 40), INT64_MAX, INT64_MIN}) {
+        vector<uint8_t> bytes;
+        varint_encode(zigzag_encode(v), bytes);
+        uint64_t decoded;
+        REQUIRE(varint_decode(bytes.data(), bytes.data() + bytes.size(), decoded) == bytes.data() + bytes.size());
+        REQUIRE(zigzag_decode(decoded) == v);
+    }
+
+    // Small deltas of either sign fit in a single byte.
+    vector<uint8_t> bytes;
+    varint_encode(zigzag_encode(-64), bytes);
+    REQUIRE(bytes.size() == 1);
+}
+
+static vector<TraceRecord> make_test_records(size_t n, bool timestamps) {
+    vector<TraceRecord> records;
+    uint64_t addr[4] = {0x10000000, 0x20000000, 0x7fff0000, 0x40};
+    for (size_t i = 0; i < n; i++) {
+        uint8_t cpu = (i * 7) % 4;
+        addr[cpu] += (i % 5 == 0) ? -(int64_t) (i % 300) : 64 * (i % 3);
+        records.push_back(TraceRecord{
+                .addr = addr[cpu],
+                .timestamp = timestamps ? 1000000 + i * 37 - (i % 2) * 11 : 0,
+                .type = static_cast<AccessType>(i % 3),
+                .cpu_index = cpu
+        });
+    }
+    return records;
+}
+
+static bool same_record(const TraceRecord& a, const TraceRecord& b) {
+    return a.addr == b.addr && a.timestamp == b.timestamp && a.type == b.type && a.cpu_index == b.cpu_index;
+}
+
+TEST_CASE("Columnar trace round trip", "Columnar trace") {
+    auto path = temp_trace_path("columnar");
+    auto records = make_test_records(2500, true);
+    {
+        ColumnarTraceWriter writer(path, 1000);
+        writer.write(records.data(), 1200);
+        writer.write(records.data() + 1200, records.size() - 1200);
+        writer.close();
+        REQUIRE(writer.num_records() == records.size());
+        // Much smaller than the plugin's 18 bytes per record.
+        REQUIRE(writer.bytes_written() < records.size() * 8);
+    }
+
+    REQUIRE(detect_trace_format(path) == TraceFormat::COLUMNAR);
+
+    auto index = read_columnar_index(path);
+    REQUIRE(index.size() == 3);
+    REQUIRE(index[1].first_record == 1000);
+    REQUIRE(index[2].num_records == 500);
+    REQUIRE(index[2].first_timestamp == records[2000].timestamp);
+
+    auto reader = open_trace_reader(path, TraceFormat::COLUMNAR);
+    vector<TraceRecord> decoded;
+    for_each_trace_record(*reader, [&](const TraceRecord& record) { decoded.push_back(record); });
+    REQUIRE(decoded.size() == records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        REQUIRE(same_record(decoded[i], records[i]));
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Columnar conversion from binary trace", "Columnar trace") {
+    auto binary_path = temp_trace_path("convert.trace");
+    auto columnar_path = temp_trace_path("convert.col");
+    auto records = make_test_records(100, true);
+    {
+        ofstream out(binary_path, ios::binary);
+        for (const auto& r: records) {
+            write_binary_record(out, r.addr, r.timestamp, static_cast<uint8_t>(r.type), r.cpu_index);
+        }
+    }
+
+    BinaryTraceReader binary(binary_path);
+    REQUIRE(convert_to_columnar(binary, columnar_path) == records.size());
+
+    ColumnarTraceReader columnar(columnar_path);
+    vector<TraceRecord> decoded(200);
+    REQUIRE(columnar.read(decoded.data(), decoded.size()) == records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        REQUIRE(same_record(decoded[i], records[i]));
+    }
+
+    std::filesystem::remove(binary_path);
+    std::filesystem::remove(columnar_path);
+}
+
+TEST_CASE("Parallel text parser matches iostream parser", "Text trace parser") {
+    auto path = temp_trace_path("parallel_text");
+    {
+        ofstream out(path);
+        for (uint32_t i = 0; i < 5000; i++) {
+            out << (i % 3 == 0 ? "0x" : "") << std::hex << (0x7f000000ULL + i * 0x40 + (i % 7)) << (i % 11 == 0 ? "\t" : " ")
+                << (i % 4) << " " << (i % 2) << (i % 13 == 0 ? "\r\n" : "\n");
+        }
+    }
+
+    TextTraceReader reference(path);
+    vector<TraceRecord> expected;
+    for_each_trace_record(reference, [&](const TraceRecord& record) { expected.push_back(record); });
+
+    // Tiny chunks force many windows and records split across read() calls.
+    ParallelTextTraceReader parallel(path, TextParserOptions{.threads = 3, .chunk_bytes = 1000});
+    vector<TraceRecord> parsed;
+    for_each_trace_record(parallel, [&](const TraceRecord& record) { parsed.push_back(record); });
+
+    REQUIRE(parsed.size() == 5000);
+    REQUIRE(parsed.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        REQUIRE(same_record(parsed[i], expected[i]));
+    }
+
+    // As read for a merge, on the calling thread only.
+    auto sequential = open_trace_reader(path, TraceFormat::TEXT, true);
+    size_t n = 0;
+    bool same = true;
+    for_each_trace_record(*sequential, [&](const TraceRecord& record) { same = same && n < expected.size() && same_record(record, expected[n++]); });
+    REQUIRE(same);
+    REQUIRE(n == expected.size());
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Parallel text parser reports format errors", "Text trace parser") {
+    auto path = temp_trace_path("parallel_text_error");
+    {
+        ofstream out(path);
+        for (uint32_t i = 0; i < 300; i++) {
+            out << std::hex << (0x1000 + i) << " 1 " << (i == 250 ? "2" : "0") << "\n";
+        }
+    }
+
+    ParallelTextTraceReader parallel(path, TextParserOptions{.threads = 2, .chunk_bytes = 256});
+    size_t n = 0;
+    REQUIRE_THROWS_WITH(for_each_trace_record(parallel, [&](const TraceRecord&) { n++; }), "Format error on line 251");
+    // Every record before the malformed one was delivered.
+    REQUIRE(n == 250);
+
+    vector<TraceRecord> records;
+    auto result = parse_text_chunk("12 0 1\n0x34 1 0\nzz 0 0\n", 23, records);
+    REQUIRE(records.size() == 2);
+    REQUIRE(records[1].addr == 0x34);
+    REQUIRE(result.error);
+    REQUIRE(result.error_line == 2);
+
+    std::filesystem::remove(path);
+}
+
+// Hands out `total` synthetic records in short reads, failing after `fail_after` if set.
+class SyntheticTraceReader : public TraceReader {
+public:
+    SyntheticTraceReader(uint64_t total, uint64_t fail_after = UINT64_MAX) : total_(total), fail_after_(fail_after), next_(0) {}
+
+    size_t read(TraceRecord *records, size_t max_records) override {
+        if (next_ == fail_after_) {
+            throw std::runtime_error("Synthetic failure");
+        }
+        size_t n = std::min<uint64_t>({max_records, total_ - next_, 37, fail_after_ - next_});
+        for (size_t i = 0; i < n; i++, next_++) {
+            records[i] = TraceRecord{.addr = next_ * 64, .timestamp = next_, .type = AccessType::LOAD, .cpu_index = (uint8_t) (next_ % 3)};
+        }
+        return n;
+    }
+private:
+    uint64_t total_, fail_after_, next_;
+};
+
+TEST_CASE("Prefetching reader preserves order", "Trace prefetcher") {
+    PrefetchingTraceReader reader(std::make_unique<SyntheticTraceReader>(10000), PrefetchOptions{.buffer_records = 100, .depth = 2});
+
+    uint64_t expected = 0;
+    bool in_order = true;
+    for_each_trace_record(reader, [&](const TraceRecord& record) {
+        in_order &= record.timestamp == expected && record.addr == expected * 64;
+        expected++;
+    });
+    REQUIRE(in_order);
+    REQUIRE(expected == 10000);
+    REQUIRE(reader.stats().buffers_filled == 100);
+
+    REQUIRE_THROWS(PrefetchingTraceReader(std::make_unique<SyntheticTraceReader>(1), PrefetchOptions{.buffer_records = 100, .depth = 1}));
+}
+
+TEST_CASE("Prefetching reader forwards errors after the records read before them", "Trace prefetcher") {
+    PrefetchingTraceReader reader(std::make_unique<SyntheticTraceReader>(1000, 250), PrefetchOptions{.buffer_records = 64, .depth = 3});
+    uint64_t n = 0;
+    REQUIRE_THROWS_WITH(for_each_trace_record(reader, [&](const TraceRecord&) { n++; }), "Synthetic failure");
+    REQUIRE(n == 250);
+
+    // Stopping early must not hang the reader thread.
+    PrefetchingTraceReader abandoned(std::make_unique<SyntheticTraceReader>(100000), PrefetchOptions{.buffer_records = 16, .depth = 2});
+    TraceRecord record;
+    REQUIRE(abandoned.read(&record, 1) == 1);
+}
+
+TEST_CASE("Buffered binary reader matches mapped reader", "Trace reader") {
+    auto path = temp_trace_path("buffered.trace");
+    auto records = make_test_records(1000, true);
+    {
+        ofstream out(path, ios::binary);
+        for (const auto& r: records) {
+            write_binary_record(out, r.addr, r.timestamp, static_cast<uint8_t>(r.type), r.cpu_index);
+        }
+        // Torn trailing record.
+        out.write("abc", 3);
+    }
+
+    // A buffer that does not divide the file exercises refills.
+    BufferedBinaryTraceReader reader(path, 18 * 7);
+    vector<TraceRecord> decoded;
+    for_each_trace_record(reader, [&](const TraceRecord& record) { decoded.push_back(record); });
+    REQUIRE(decoded.size() == records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        REQUIRE(same_record(decoded[i], records[i]));
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Traces can be streamed through a FIFO", "Trace reader") {
+    auto fifo_path = temp_trace_path("fifo.trace");
+    std::filesystem::remove(fifo_path);
+    REQUIRE(mkfifo(fifo_path.c_str(), 0600) == 0);
+
+    REQUIRE(is_stream_trace(fifo_path));
+    REQUIRE(is_stream_trace(STDIN_TRACE_PATH));
+    // Streams are never sniffed, so only the name is used.
+    REQUIRE(detect_trace_format(fifo_path) == TraceFormat::BINARY);
+    REQUIRE_THROWS(detect_trace_format(STDIN_TRACE_PATH));
+
+    auto records = make_test_records(3000, true);
+    std::thread writer([&]() {
+        ofstream out(fifo_path, ios::binary);
+        for (const auto& r: records) {
+            write_binary_record(out, r.addr, r.timestamp, static_cast<uint8_t>(r.type), r.cpu_index);
+        }
+    });
+
+    auto reader = open_trace_reader(fifo_path, TraceFormat::BINARY);
+    vector<TraceRecord> decoded;
+    for_each_trace_record(*reader, [&](const TraceRecord& record) { decoded.push_back(record); });
+    writer.join();
+
+    REQUIRE(decoded.size() == records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        REQUIRE(same_record(decoded[i], records[i]));
+    }
+
+    std::filesystem::remove(fifo_path);
+}
+
+TEST_CASE("Prefetching readers of silent streams can be destroyed", "Trace prefetcher") {
+    auto fifo_path = temp_trace_path("silent_fifo.trace");
+    std::filesystem::remove(fifo_path);
+    REQUIRE(mkfifo(fifo_path.c_str(), 0600) == 0);
+
+    // The writer keeps the FIFO open, but stops writing before the first buffer is full.
+    std::promise<void> destroyed;
+    std::thread writer([&fifo_path, done = destroyed.get_future()]() {
+        ofstream out(fifo_path, ios::binary);
+        write_binary_record(out, 64, 1, 1, 0);
+        out.flush();
+        done.wait();
+    });
+    auto start = std::chrono::steady_clock::now();
+    {
+        PrefetchingTraceReader reader(open_trace_reader(fifo_path, TraceFormat::BINARY), PrefetchOptions{.buffer_records = 16, .depth = 2});
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    {
+        // No producer ever attaches to the ring.
+        auto name = "/asgard_test_silent_ring_" + std::to_string(getpid());
+        PrefetchingTraceReader reader(std::make_unique<ShmTraceReader>(name, 64), PrefetchOptions{.buffer_records = 16, .depth = 2});
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    destroyed.set_value();
+    writer.join();
+
+    std::filesystem::remove(fifo_path);
+}
+
+TEST_CASE("Shared-memory ring delivers every record of every producer in order", "Shared-memory ring") {
+    auto name = "/asgard_test_ring_" + std::to_string(getpid());
+    REQUIRE(is_shm_trace(SHM_TRACE_PREFIX + name));
+    REQUIRE(is_stream_trace(SHM_TRACE_PREFIX + name));
+    REQUIRE_THROWS_AS(ShmTraceReader(name, 100), std::invalid_argument);
+
+    // A small ring, so that producers hit backpressure.
+    ShmTraceReader reader(name, 64);
+
+    const int num_producers = 4;
+    const uint64_t records_per_producer = 20000;
+    std::thread producers([&]() {
+        ShmTraceWriter writer(name);
+        vector<std::thread> threads;
+        for (int p = 0; p < num_producers; p++) {
+            threads.emplace_back([&, p]() {
+                for (uint64_t i = 0; i < records_per_producer; i++) {
+                    writer.write(TraceRecord{.addr = i, .timestamp = i, .type = AccessType::LOAD,
+                                             .cpu_index = static_cast<uint8_t>(p)});
+                }
+            });
+        }
+        for (auto& t: threads) {
+            t.join();
+        }
+        writer.close();
+    });
+
+    vector<uint64_t> next(num_producers, 0);
+    uint64_t total = 0;
+    bool in_order = true;
+    for_each_trace_record(reader, [&](const TraceRecord& record) {
+        in_order = in_order && record.cpu_index < num_producers && record.addr == next[record.cpu_index];
+        next[record.cpu_index]++;
+        total++;
+    });
+    producers.join();
+
+    REQUIRE(in_order);
+    REQUIRE(total == num_producers * records_per_producer);
+}
+
+TEST_CASE("Shared-memory ring reader stops once the ring is closed", "Shared-memory ring") {
+    auto name = "/asgard_test_closed_ring_" + std::to_string(getpid());
+    ShmTraceReader reader(name, 64);
+    {
+        // Closed with records left in the ring, which are still read.
+        ShmTraceWriter writer(name);
+        for (uint64_t i = 0; i < 10; i++) {
+            writer.write(TraceRecord{.addr = i, .timestamp = i, .type = AccessType::LOAD, .cpu_index = 0});
+        }
+        writer.close();
+    }
+
+    vector<TraceRecord> records(64);
+    REQUIRE(reader.read(records.data(), records.size()) == 10);
+    REQUIRE(records[9].addr == 9);
+    REQUIRE(reader.read(records.data(), records.size()) == 0);
+    REQUIRE(reader.read(records.data(), records.size()) == 0);
+}
+
+class VectorTraceReader : public TraceReader {
+public:
+    explicit VectorTraceReader(vector<TraceRecord> records) : records_(std::move(records)), next_(0) {}
+
+    size_t read(TraceRecord *records, size_t max_records) override {
+        size_t n = std::min<size_t>({max_records, records_.size() - next_, 29});
+        std::copy_n(records_.begin() + next_, n, records);
+        next_ += n;
+        return n;
+    }
+private:
+    vector<TraceRecord> records_;
+    size_t next_;
+};
+
+TEST_CASE("Merged reader interleaves traces by timestamp", "Trace merger") {
+    // Hundreds of inputs of different lengths, with many equal timestamps across inputs.
+    std::mt19937_64 rng(7);
+    const size_t num_inputs = 300;
+    vector<TraceRecord> expected;
+    vector<std::unique_ptr<TraceReader>> inputs;
+    for (size_t i = 0; i < num_inputs; i++) {
+        vector<TraceRecord> records(rng() % 200);
+        uint64_t timestamp = rng() % 50;
+        for (size_t j = 0; j < records.size(); j++) {
+            timestamp += rng() % 4;
+            records[j] = TraceRecord{.addr = i * 1000000 + j, .timestamp = timestamp, .type = AccessType::LOAD,
+                                     .cpu_index = static_cast<uint8_t>(i % 4)};
+        }
+        expected.insert(expected.end(), records.begin(), records.end());
+        inputs.push_back(std::make_unique<VectorTraceReader>(std::move(records)));
+    }
+    // Ties keep the input order.
+    std::stable_sort(expected.begin(), expected.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    MergedTraceReader reader(std::move(inputs), MergeOptions{.core_offsets = {}, .batch_records = 16});
+    vector<TraceRecord> merged;
+    for_each_trace_record(reader, [&](const TraceRecord& record) { merged.push_back(record); });
+
+    REQUIRE(merged.size() == expected.size());
+    bool same = true;
+    for (size_t i = 0; i < merged.size(); i++) {
+        same = same && same_record(merged[i], expected[i]);
+    }
+    REQUIRE(same);
+}
+
+TEST_CASE("Merged reader offsets the cores of each input", "Trace merger") {
+    auto make_input = [](uint8_t cpu_index) {
+        vector<TraceRecord> records;
+        for (uint64_t i = 0; i < 10; i++) {
+            records.push_back(TraceRecord{.addr = i, .timestamp = i, .type = AccessType::STORE, .cpu_index = cpu_index});
+        }
+        return std::make_unique<VectorTraceReader>(records);
+    };
+
+    vector<std::unique_ptr<TraceReader>> inputs;
+    inputs.push_back(make_input(1));
+    inputs.push_back(make_input(1));
+    inputs.push_back(make_input(3));
+    MergedTraceReader reader(std::move(inputs), MergeOptions{.core_offsets = {0, 4, 8}});
+
+    vector<uint8_t> cores;
+    for_each_trace_record(reader, [&](const TraceRecord& record) { cores.push_back(record.cpu_index); });
+    REQUIRE(cores.size() == 30);
+    REQUIRE(cores[0] == 1);
+    REQUIRE(cores[1] == 5);
+    REQUIRE(cores[2] == 11);
+
+    vector<std::unique_ptr<TraceReader>> overflowing;
+    overflowing.push_back(make_input(200));
+    MergedTraceReader overflow_reader(std::move(overflowing), MergeOptions{.core_offsets = {100}});
+    REQUIRE_THROWS(for_each_trace_record(overflow_reader, [](const TraceRecord&) {}));
+
+    REQUIRE_THROWS(MergedTraceReader({}, {}));
+}
+
+TEST_CASE("Trace writers round trip through the readers", "Trace writer") {
+    auto records = make_test_records(5000, true);
+    for (auto format: {TraceFormat::TEXT, TraceFormat::BINARY, TraceFormat::COLUMNAR, TraceFormat::COMPRESSED}) {
+        auto path = temp_trace_path("written.trace");
+        auto writer = open_trace_writer(path, format);
+        writer->write(records.data(), records.size());
+        writer->close();
+
+        vector<TraceRecord> decoded;
+        auto reader = open_trace_reader(path, format);
+        for_each_trace_record(*reader, [&](const TraceRecord& record) { decoded.push_back(record); });
+
+        REQUIRE(decoded.size() == records.size());
+        bool same = true;
+        for (size_t i = 0; i < records.size(); i++) {
+            if (format == TraceFormat::TEXT) {
+                // Text keeps only the address, the core and whether it is a store.
+                same = same && decoded[i].addr == records[i].addr && decoded[i].cpu_index == records[i].cpu_index &&
+                       decoded[i].is_store() == records[i].is_store();
+            } else {
+                same = same && same_record(decoded[i], records[i]);
+            }
+        }
+        REQUIRE(same);
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_CASE("Trace splitter partitions by core, client and address range", "Trace splitter") {
+    auto records = make_test_records(20000, true);
+    auto prefix = temp_trace_path("split");
+
+    auto check_split = [&](const SplitOptions& options, auto expected_output) {
+        auto source = std::make_unique<VectorTraceReader>(records);
+        auto outputs = split_trace(*source, prefix, options);
+
+        uint64_t total = 0;
+        for (const auto& output: outputs) {
+            vector<TraceRecord> expected;
+            for (const auto& r: records) {
+                if (expected_output(r) == output.index) {
+                    expected.push_back(r);
+                }
+            }
+            auto reader = open_trace_reader(output.path, detect_trace_format(output.path));
+            vector<TraceRecord> decoded;
+            for_each_trace_record(*reader, [&](const TraceRecord& record) { decoded.push_back(record); });
+
+            REQUIRE(output.records == expected.size());
+            REQUIRE(decoded.size() == expected.size());
+            bool same = true;
+            for (size_t i = 0; i < expected.size(); i++) {
+                same = same && same_record(decoded[i], expected[i]);
+            }
+            REQUIRE(same);
+            total += output.records;
+            std::filesystem::remove(output.path);
+        }
+        REQUIRE(total == records.size());
+        return outputs.size();
+    };
+
+    SECTION("core") {
+        auto n = check_split(SplitOptions{.mode = SplitMode::CORE, .core_clients = {}, .address_bounds = {}, .output_format = TraceFormat::BINARY,
+                                          .threads = 3, .batch_records = 777},
+                             [](const TraceRecord& r) { return (uint32_t) r.cpu_index; });
+        REQUIRE(n > 1);
+    }
+    SECTION("client") {
+        vector<uint32_t> clients(256);
+        for (size_t i = 0; i < clients.size(); i++) {
+            clients[i] = i % 2;
+        }
+        auto n = check_split(SplitOptions{.mode = SplitMode::CLIENT, .core_clients = clients, .address_bounds = {},
+                                          .output_format = TraceFormat::COLUMNAR, .threads = 2},
+                             [&](const TraceRecord& r) { return clients[r.cpu_index]; });
+        REQUIRE(n == 2);
+    }
+    SECTION("address range") {
+        vector<uint64_t> bounds{1ull << 20, 1ull << 30, 1ull << 40};
+        check_split(SplitOptions{.mode = SplitMode::ADDRESS_RANGE, .core_clients = {}, .address_bounds = bounds,
+                                 .output_format = TraceFormat::BINARY, .threads = 4, .batch_records = 1000},
+                    [&](const TraceRecord& r) { return (uint32_t) (std::upper_bound(bounds.begin(), bounds.end(), r.addr) - bounds.begin()); });
+    }
+    SECTION("invalid options") {
+        VectorTraceReader source(records);
+        REQUIRE_THROWS(split_trace(source, prefix, SplitOptions{.mode = SplitMode::CLIENT, .core_clients = {}, .address_bounds = {}}));
+        REQUIRE_THROWS(split_trace(source, prefix, SplitOptions{.mode = SplitMode::CLIENT, .core_clients = {0}, .address_bounds = {}}));
+        REQUIRE_THROWS(split_trace(source, prefix, SplitOptions{.mode = SplitMode::ADDRESS_RANGE, .core_clients = {}, .address_bounds = {5, 5}}));
+    }
+}
+
+TEST_CASE("Trace index slices traces by record and timestamp", "Trace index") {
+    auto records = make_test_records(10000, true);
+    for (auto format: {TraceFormat::TEXT, TraceFormat::BINARY, TraceFormat::COLUMNAR, TraceFormat::COMPRESSED}) {
+        auto path = temp_trace_path("indexed.trace");
+        if (format == TraceFormat::COLUMNAR) {
+            ColumnarTraceWriter writer(path, 500);
+            writer.write(records.data(), records.size());
+        } else if (format == TraceFormat::COMPRESSED) {
+            CompressedTraceWriter writer(path, 500);
+            writer.write(records.data(), records.size());
+        } else {
+            auto writer = open_trace_writer(path, format);
+            writer->write(records.data(), records.size());
+        }
+
+        auto index = TraceIndex::build(path, format, 300);
+        REQUIRE(index.num_records() == records.size());
+
+        auto read_slice = [&](const TraceSlice& slice) {
+            vector<TraceRecord> sliced;
+            auto reader = open_trace_slice(path, index, slice);
+            for_each_trace_record(*reader, [&](const TraceRecord& record) { sliced.push_back(record); });
+            return sliced;
+        };
+
+        auto sliced = read_slice(TraceSlice{.begin_record = 1234, .end_record = 4321});
+        REQUIRE(sliced.size() == 4321 - 1234);
+        REQUIRE(sliced.front().addr == records[1234].addr);
+        REQUIRE(sliced.back().addr == records[4320].addr);
+
+        if (format != TraceFormat::TEXT) {
+            // The first record stamped at or after the start, up to the first one stamped at or after the end.
+            uint64_t begin_ts = records[2000].timestamp, end_ts = records[7000].timestamp;
+            auto first = std::find_if(records.begin(), records.end(), [&](const TraceRecord& r) { return r.timestamp >= begin_ts; });
+            auto last = std::find_if(first, records.end(), [&](const TraceRecord& r) { return r.timestamp >= end_ts; });
+            auto timed = read_slice(TraceSlice{.begin_timestamp = begin_ts, .end_timestamp = end_ts});
+            REQUIRE(timed.size() == (size_t) (last - first));
+            REQUIRE(same_record(timed.front(), *first));
+        }
+
+        uint64_t total = 0, expected_begin = 0;
+        for (const auto& partition: index.partitions(7)) {
+            REQUIRE(partition.begin_record == expected_begin);
+            total += read_slice(partition).size();
+            expected_begin = partition.end_record;
+        }
+        REQUIRE(total == records.size());
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_CASE("Trace index sidecar is rebuilt when the trace changes", "Trace index") {
+    auto path = temp_trace_path("sidecar.trace");
+    auto records = make_test_records(1000, true);
+    {
+        BinaryTraceWriter writer(path);
+        writer.write(records.data(), records.size());
+    }
+    std::filesystem::remove(trace_index_path(path));
+
+    auto built = TraceIndex::load_or_build(path, TraceFormat::BINARY, 100);
+    REQUIRE(std::filesystem::exists(trace_index_path(path)));
+    auto loaded = TraceIndex::load(trace_index_path(path));
+    REQUIRE(loaded.num_records() == 1000);
+    REQUIRE(loaded.entries().size() == 10);
+    REQUIRE(loaded.entries()[3].byte_offset == 300 * BinaryTraceReader::RECORD_SIZE);
+
+    {
+        BinaryTraceWriter writer(path);
+        writer.write(records.data(), 500);
+    }
+    REQUIRE(TraceIndex::load_or_build(path, TraceFormat::BINARY, 100).num_records() == 500);
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(trace_index_path(path));
+}
+
+TEST_CASE("Cached trace replays the same records every time", "Trace cache") {
+    auto records = make_test_records(50000, true);
+    for (size_t budget: {SIZE_MAX, (size_t) 100000}) {
+        VectorTraceReader source(records);
+        CachedTrace cache(source, TraceCacheOptions{.raw_budget_bytes = budget, .block_records = 4096});
+        REQUIRE(cache.num_records() == records.size());
+        REQUIRE(cache.compressed() == (budget != SIZE_MAX));
+        if (cache.compressed()) {
+            REQUIRE(cache.memory_bytes() < records.size() * sizeof(TraceRecord) / 2);
+        }
+
+        for (int replay = 0; replay < 2; replay++) {
+            auto reader = cache.replay();
+            size_t i = 0;
+            bool same = true;
+            for_each_trace_record(*reader, [&](const TraceRecord& record) {
+                same = same && i < records.size() && same_record(record, records[i]);
+                i++;
+            });
+            REQUIRE(same);
+            REQUIRE(i == records.size());
+        }
+    }
+}
+
+TEST_CASE("Filtered columnar reader skips blocks that can not match", "Trace filter") {
+    // Each block of 1000 records holds the records of two cores only.
+    vector<TraceRecord> records;
+    for (uint64_t i = 0; i < 16000; i++) {
+        uint8_t core = (i / 1000) % 8 * 2 + i % 2;
+        records.push_back(TraceRecord{.addr = (uint64_t) core << 32 | (i * 64), .timestamp = i,
+                                      .type = static_cast<AccessType>(i % 3), .cpu_index = core});
+    }
+    auto path = temp_trace_path("filtered.col");
+    {
+        ColumnarTraceWriter writer(path, 1000);
+        writer.write(records.data(), records.size());
+    }
+
+    TraceFilter filter;
+    filter.keep_only_cores({3, 4});
+    filter.keep_only_types({AccessType::LOAD, AccessType::STORE});
+    REQUIRE(!filter.keeps_everything());
+
+    vector<TraceRecord> expected;
+    std::copy_if(records.begin(), records.end(), std::back_inserter(expected), [&](const TraceRecord& r) { return filter.matches(r); });
+
+    auto read_all = [](TraceReader& reader) {
+        vector<TraceRecord> result;
+        for_each_trace_record(reader, [&](const TraceRecord& record) { result.push_back(record); });
+        return result;
+    };
+    auto same_records = [](const vector<TraceRecord>& a, const vector<TraceRecord>& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), same_record);
+    };
+
+    FilteredColumnarTraceReader reader(path, filter);
+    REQUIRE(same_records(read_all(reader), expected));
+    // Cores 3 and 4 live in 4 of the 16 blocks.
+    REQUIRE(reader.blocks_skipped() == 12);
+
+    FilteredTraceReader generic(open_trace_reader(path, TraceFormat::COLUMNAR), filter);
+    REQUIRE(same_records(read_all(generic), expected));
+
+    // Address ranges are pushed down too.
+    TraceFilter range;
+    range.min_addr = 5ull << 32;
+    range.max_addr = (6ull << 32) - 1;
+    FilteredColumnarTraceReader range_reader(path, range);
+    auto in_range = read_all(range_reader);
+    REQUIRE(in_range.size() == 1000);
+    REQUIRE(range_reader.blocks_skipped() == 14);
+
+    // Version 1 files have no summaries but are still filtered.
+    {
+        std::fstream file(path, ios::in | ios::out | ios::binary);
+        uint32_t version = 1;
+        file.seekp(offsetof(ColumnarFileHeader, version));
+        file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    }
+    REQUIRE(read_columnar_summaries(path).empty());
+    FilteredColumnarTraceReader v1_reader(path, filter);
+    REQUIRE(same_records(read_all(v1_reader), expected));
+    REQUIRE(v1_reader.blocks_skipped() == 0);
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Collapsed traces give the same hits and misses", "Trace collapse") {
+    // Two cores walking small working sets, each access repeated a few times, interleaved.
+    std::mt19937_64 rng(11);
+    vector<TraceRecord> records;
+    for (uint64_t i = 0; i < 50000; i++) {
+        uint8_t core = rng() % 2;
+        uint64_t addr = (rng() % 4096) * 64 + rng() % 64;
+        for (uint64_t repeat = rng() % 4; repeat > 0; repeat--) {
+            records.push_back(TraceRecord{.addr = addr + rng() % 8, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = core});
+        }
+        if (rng() % 2) {
+            records.push_back(TraceRecord{.addr = rng() % (1 << 20), .timestamp = 0, .type = AccessType::LOAD, .cpu_index = (uint8_t) (1 - core)});
+        }
+    }
+
+    auto simulate = [](TraceReader& reader) {
+        MultiLevelCache<Cache> cache{2, Cache(1024, 2, 64), Cache(16 * 1024, 4, 64)};
+        uint64_t accesses = 0, records = 0;
+        for_each_trace_record(reader, [&](const TraceRecord& record) {
+            cache.access(record.cpu_index, 0, record.addr, record.weight);
+            accesses += record.weight;
+            records++;
+        });
+        vector<uint64_t> stats = {cache.get_private_cache(0).hits(), cache.get_private_cache(0).misses(),
+                                  cache.get_private_cache(1).hits(), cache.get_private_cache(1).misses(),
+                                  cache.get_shared_cache().hits(), cache.get_shared_cache().misses()};
+        return std::make_tuple(stats, accesses, records);
+    };
+
+    VectorTraceReader plain(records);
+    auto [expected, expected_accesses, expected_records] = simulate(plain);
+    REQUIRE(expected_accesses == records.size());
+
+    CollapsingTraceReader collapsed(std::make_unique<VectorTraceReader>(records), 64);
+    auto [stats, accesses, collapsed_records] = simulate(collapsed);
+    REQUIRE(stats == expected);
+    REQUIRE(accesses == records.size());
+    REQUIRE(collapsed_records < expected_records);
+    REQUIRE(collapsed.records_in() == records.size());
+    REQUIRE(collapsed.records_out() == collapsed_records);
+
+    REQUIRE_THROWS_AS(CollapsingTraceReader(std::make_unique<VectorTraceReader>(records), 48), std::invalid_argument);
+}
+
+TEST_CASE("Trace metadata sidecar is reused until the trace changes", "Trace metadata") {
+    auto path = temp_trace_path("metadata.trace");
+    auto records = make_test_records(20000, true);
+    {
+        BinaryTraceWriter writer(path);
+        writer.write(records.data(), records.size());
+    }
+    std::filesystem::remove(trace_metadata_path(path));
+    REQUIRE(!TraceMetadata::load_current(path, TraceFormat::BINARY).has_value());
+
+    std::set<uint64_t> lines;
+    std::array<uint64_t, 4> core_counts{};
+    for (const auto& record: records) {
+        lines.insert(record.addr / TRACE_METADATA_LINE_BYTES);
+        core_counts[record.cpu_index]++;
+    }
+
+    auto built = TraceMetadata::load_or_build(path, TraceFormat::BINARY);
+    REQUIRE(built.num_records == records.size());
+    REQUIRE(built.num_cores() == 4);
+    REQUIRE(std::equal(core_counts.begin(), core_counts.end(), built.core_counts.begin()));
+    REQUIRE(built.type_counts[1] == (uint64_t) std::count_if(records.begin(), records.end(), [](const TraceRecord& r) { return r.type == AccessType::LOAD; }));
+    REQUIRE(built.min_addr == std::min_element(records.begin(), records.end(), [](auto& a, auto& b) { return a.addr < b.addr; })->addr);
+    REQUIRE(built.max_timestamp == std::max_element(records.begin(), records.end(), [](auto& a, auto& b) { return a.timestamp < b.timestamp; })->timestamp);
+    REQUIRE(std::abs((double) built.unique_lines - (double) lines.size()) < 0.03 * lines.size());
+
+    auto loaded = TraceMetadata::load_current(path, TraceFormat::BINARY);
+    REQUIRE(loaded.has_value());
+    REQUIRE(loaded->content_hash == built.content_hash);
+    REQUIRE(loaded->unique_lines == built.unique_lines);
+    REQUIRE(!TraceMetadata::load_current(path, TraceFormat::TEXT).has_value());
+
+    // A touched trace keeps its metadata, one rewritten with the same size but other ends does not.
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(5));
+    REQUIRE(TraceMetadata::load_current(path, TraceFormat::BINARY).has_value());
+    REQUIRE(records.size() * BinaryTraceReader::RECORD_SIZE > 2 * TRACE_METADATA_SAMPLE_BYTES);
+    for (size_t i: {(size_t) 10, records.size() - 10}) {
+        std::swap(records[i], records[i + 5]);
+        {
+            BinaryTraceWriter writer(path);
+            writer.write(records.data(), records.size());
+        }
+        std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(10));
+        REQUIRE(!TraceMetadata::load_current(path, TraceFormat::BINARY).has_value());
+        auto rebuilt = TraceMetadata::load_or_build(path, TraceFormat::BINARY);
+        REQUIRE(rebuilt.content_hash != built.content_hash);
+        REQUIRE(rebuilt.sample_hash != built.sample_hash);
+        built = rebuilt;
+    }
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(trace_metadata_path(path));
+}
+
+TEST_CASE("HyperLogLog estimates large cardinalities", "Trace metadata") {
+    HyperLogLog small, large;
+    std::mt19937_64 rng(5);
+    for (uint64_t i = 0; i < 1000000; i++) {
+        uint64_t hash = rng();
+        large.add(hash);
+        if (i < 100) {
+            small.add(hash);
+            small.add(hash);
+        }
+    }
+    REQUIRE(std::abs((double) large.estimate() - 1e6) < 0.03 * 1e6);
+    REQUIRE(small.estimate() >= 98);
+    REQUIRE(small.estimate() <= 102);
+    small.merge(large);
+    REQUIRE(small.estimate() == large.estimate());
+}
+
+TEST_CASE("Block codec round trips and rejects corrupt blocks", "Block compression") {
+    std::mt19937_64 rng(3);
+    vector<vector<uint8_t>> inputs = {{}, {42}, vector<uint8_t>(13, 7), vector<uint8_t>(100000, 0)};
+    vector<uint8_t> random(70000), text(200000), runs(150000);
+    for (auto& b: random) {
+        b = rng();
+    }
+    for (auto& b: text) {
+        b = "abcdefgh"[rng() % 8];
+    }
+    for (size_t i = 0; i < runs.size(); i++) {
+        // Runs with every short period, and matches further back than the largest offset.
+        runs[i] = i < 70000 ? (i / 100) % (i % 7 + 1) : runs[i - 70000] ^ (i % 1000 == 0);
+    }
+    inputs.push_back(random);
+    inputs.push_back(text);
+    inputs.push_back(runs);
+
+    for (const auto& input: inputs) {
+        vector<uint8_t> compressed(block_compress_bound(input.size()));
+        size_t size = compress_block(input.data(), input.size(), compressed.data());
+        REQUIRE(size <= compressed.size());
+        vector<uint8_t> output(input.size());
+        decompress_block(compressed.data(), size, output.data(), output.size());
+        REQUIRE(output == input);
+
+        if (input.size() > 1000) {
+            REQUIRE_THROWS_AS(decompress_block(compressed.data(), size / 2, output.data(), output.size()), std::runtime_error);
+            REQUIRE_THROWS_AS(decompress_block(compressed.data(), size, output.data(), output.size() - 1), std::runtime_error);
+        }
+    }
+
+    // An offset reaching before the start of the output.
+    uint8_t bad[] = {0x10, 'a', 0x10, 0x00, 0x10, 'b'};
+    vector<uint8_t> output(8);
+    REQUIRE_THROWS_AS(decompress_block(bad, sizeof(bad), output.data(), 6), std::runtime_error);
+
+    vector<uint8_t> planes(24), unshuffled(24), elements(24);
+    std::iota(elements.begin(), elements.end(), 0);
+    shuffle_bytes(elements.data(), 3, 8, planes.data());
+    REQUIRE(planes[1] == 8);
+    unshuffle_bytes(planes.data(), 3, 8, unshuffled.data());
+    REQUIRE(unshuffled == elements);
+}
+
+TEST_CASE("Compressed traces shrink and decode on several threads", "Block compression") {
+    auto records = make_test_records(100000, true);
+    auto path = temp_trace_path("compressed.trace");
+    {
+        CompressedTraceWriter writer(path, 4096);
+        writer.write(records.data(), records.size());
+    }
+    REQUIRE(detect_trace_format(path) == TraceFormat::COMPRESSED);
+    REQUIRE(std::filesystem::file_size(path) * 3 < records.size() * BinaryTraceReader::RECORD_SIZE);
+
+    auto read_all = [](TraceReader& reader) {
+        vector<TraceRecord> result;
+        for_each_trace_record(reader, [&](const TraceRecord& record) { result.push_back(record); });
+        return result;
+    };
+    auto same_records = [&](const vector<TraceRecord>& decoded) {
+        return decoded.size() == records.size() && std::equal(decoded.begin(), decoded.end(), records.begin(), same_record);
+    };
+
+    for (uint32_t threads: {1u, 3u}) {
+        auto reader = open_compressed_trace_reader(path, threads);
+        REQUIRE(same_records(read_all(*reader)));
+    }
+
+    // Columnar blocks with and without LZ compression.
+    auto columnar_path = temp_trace_path("compressed.col");
+    uint64_t plain_size;
+    {
+        ColumnarTraceWriter writer(columnar_path, 4096);
+        writer.write(records.data(), records.size());
+        writer.close();
+        plain_size = writer.bytes_written();
+    }
+    {
+        ColumnarTraceWriter writer(columnar_path, 4096, true);
+        writer.write(records.data(), records.size());
+        writer.close();
+        REQUIRE(writer.bytes_written() < plain_size);
+    }
+    ColumnarTraceReader columnar(columnar_path);
+    REQUIRE(same_records(read_all(columnar)));
+    auto parallel = open_parallel_columnar_reader(columnar_path, 3);
+    REQUIRE(same_records(read_all(*parallel)));
+
+    // A corrupt block is reported after the records of the blocks before it.
+    {
+        std::fstream file(path, ios::in | ios::out | ios::binary);
+        file.seekp(sizeof(CompressedTraceHeader));
+        CompressedBlockHeader header{};
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        file.seekp(sizeof(CompressedTraceHeader) + sizeof(header) + header.stored_bytes);
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        vector<char> garbage(header.stored_bytes, 0x7f);
+        file.write(garbage.data(), garbage.size());
+    }
+    vector<TraceRecord> batch(100000);
+    for (uint32_t threads: {1u, 2u}) {
+        auto corrupt = open_compressed_trace_reader(path, threads);
+        REQUIRE(corrupt->read(batch.data(), batch.size()) == 4096);
+        REQUIRE_THROWS_AS(corrupt->read(batch.data(), batch.size()), std::runtime_error);
+        REQUIRE(corrupt->read(batch.data(), batch.size()) == 0);
+    }
+
+    // So is a block claiming more records than the file header allows, before it is allocated.
+    {
+        std::fstream file(path, ios::in | ios::out | ios::binary);
+        file.seekp(sizeof(CompressedTraceHeader));
+        CompressedBlockHeader header{.num_records = UINT32_MAX, .stored_bytes = 16};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+    REQUIRE_THROWS_WITH(open_compressed_trace_reader(path, 1)->read(batch.data(), batch.size()), "Corrupt compressed trace block header");
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(columnar_path);
+}
+
+TEST_CASE("Sampled replay simulates the warming and window records only", "Trace sampling") {
+    vector<TraceRecord> records(95);
+    for (size_t i = 0; i < records.size(); i++) {
+        records[i].addr = i;
+        records[i].weight = 2;
+    }
+
+    SamplingOptions options;
+    options.period = 10;
+    options.window = 3;
+    options.warming = 2;
+    options.validate();
+
+    vector<uint64_t> simulated;
+    vector<uint64_t> window_starts, window_accesses;
+    VectorTraceReader reader(records);
+    uint64_t total = for_each_sampled_record(reader, options, [&](const TraceRecord& record) { simulated.push_back(record.addr); },
+                                             [&] { window_starts.push_back(simulated.size()); },
+                                             [&](uint64_t accesses) { window_accesses.push_back(accesses); });
+    REQUIRE(total == 2 * records.size());
+    // Units of 10 records, 5 skipped, 2 warming, 3 measured. The last unit ends before its warming.
+    REQUIRE(simulated.size() == 9 * 5);
+    REQUIRE(simulated[0] == 5);
+    REQUIRE(simulated[5] == 15);
+    REQUIRE(window_starts.size() == 9);
+    REQUIRE(window_starts[1] == 7);
+    REQUIRE(window_accesses == vector<uint64_t>(9, 6));
+
+    // Continuous warming simulates everything.
+    options.warming = 0;
+    simulated.clear();
+    VectorTraceReader all(records);
+    for_each_sampled_record(all, options, [&](const TraceRecord& record) { simulated.push_back(record.addr); }, [] {}, [](uint64_t) {});
+    REQUIRE(simulated.size() == records.size());
+
+    options.warming = 8;
+    REQUIRE_THROWS_AS(options.validate(), std::invalid_argument);
+    options.warming = 0;
+    options.window = 0;
+    REQUIRE_THROWS_AS(options.validate(), std::invalid_argument);
+}
+
+TEST_CASE("Sampled misses estimate the misses of a full replay", "Trace sampling") {
+    // A working set that moves at random times, so the miss rate changes over the trace. Moves
+    // in step with the sampling period would bias the windows.
+    std::mt19937_64 rng(5);
+    vector<TraceRecord> records(400000);
+    uint64_t base = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (rng() % 1000 == 0) {
+            base += 64 * 64;
+        }
+        uint64_t line = rng() % 4 == 0 ? rng() % 8192 : rng() % 512;
+        records[i].addr = base + line * 64;
+    }
+
+    auto new_caches = [] {
+        return vector<Cache>{Cache(16 * 1024, 4, 64), Cache(64 * 1024, 8, 64)};
+    };
+    auto miss_counts = [](const vector<Cache>& caches) {
+        return vector<uint64_t>{caches[0].misses(), caches[1].misses()};
+    };
+
+    auto full = new_caches();
+    for (const auto& record: records) {
+        for (auto& cache: full) {
+            cache.access(record.addr);
+        }
+    }
+
+    SamplingOptions options;
+    options.period = 2000;
+    options.window = 200;
+    auto sampled = new_caches();
+    auto set_stats_enabled = [&](bool enabled) {
+        for (auto& cache: sampled) {
+            cache.set_stats_enabled(enabled);
+        }
+    };
+    SampledMisses misses(sampled.size());
+    VectorTraceReader reader(records);
+    // Warming records are not counted, as in the experiments.
+    set_stats_enabled(false);
+    uint64_t total = for_each_sampled_record(reader, options, [&](const TraceRecord& record) {
+        for (auto& cache: sampled) {
+            cache.access(record.addr);
+        }
+    }, [&] {
+        misses.begin_window(miss_counts(sampled));
+        set_stats_enabled(true);
+    }, [&](uint64_t accesses) {
+        misses.end_window(miss_counts(sampled), accesses);
+        set_stats_enabled(false);
+    });
+
+    REQUIRE(total == records.size());
+    REQUIRE(misses.windows() == 200);
+    REQUIRE(misses.measured_accesses() == 200 * 200);
+    REQUIRE(sampled[0].hits() + sampled[0].misses() == misses.measured_accesses());
+    auto estimates = misses.estimates(total, 0.99);
+    for (size_t i = 0; i < estimates.size(); i++) {
+        double actual = miss_counts(full)[i];
+        REQUIRE(std::abs(estimates[i].value - actual) <= estimates[i].half_width);
+        REQUIRE(estimates[i].relative_error() < 0.05);
+    }
+
+    SampledMisses empty(2);
+    REQUIRE_THROWS_AS(empty.estimates(total, 0.95), std::runtime_error);
+}
+
+TEST_CASE("Sampled misses weigh the windows by their accesses", "Trace sampling") {
+    // Windows of collapsed records differ in accesses. A large window with a low miss rate and a
+    // small one with a high miss rate: the ratio of the sums, not the mean of the rates.
+    SampledMisses misses(1);
+    misses.begin_window({0});
+    misses.end_window({10}, 1000);
+    misses.begin_window({10});
+    misses.end_window({15}, 10);
+    misses.begin_window({15});
+    misses.end_window({26}, 990);
+
+    REQUIRE(misses.windows() == 3);
+    REQUIRE(misses.measured_accesses() == 2000);
+    auto estimates = misses.estimates(20000, 0.95);
+    REQUIRE(estimates[0].value == Approx(26.0 / 2000 * 20000));
+
+    // Windows with the same miss rate estimate it exactly.
+    SampledMisses constant(1);
+    constant.begin_window({0});
+    constant.end_window({10}, 1000);
+    constant.begin_window({10});
+    constant.end_window({11}, 100);
+    REQUIRE(constant.estimates(5500, 0.95)[0].value == Approx(55));
+    REQUIRE(constant.estimates(5500, 0.95)[0].half_width == Approx(0).margin(1e-9));
+}
+
+static TraceRecord marker_record(TraceMarker marker, uint8_t core = 0) {
+    return TraceRecord{.addr = static_cast<uint64_t>(marker), .timestamp = 0, .type = AccessType::MARKER, .cpu_index = core};
+}
+
+TEST_CASE("Region of interest markers split the trace", "Trace ROI") {
+    // 100 setup accesses, a region of 50, 30 between regions, a reset, a region of 20 and 10 more.
+    vector<TraceRecord> records;
+    auto add_accesses = [&](uint64_t first, uint64_t n) {
+        for (uint64_t i = first; i < first + n; i++) {
+            records.push_back(TraceRecord{.addr = i * 64, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = (uint8_t) (i % 2)});
+        }
+    };
+    add_accesses(0, 100);
+    records.push_back(marker_record(TraceMarker::ROI_BEGIN, 1));
+    add_accesses(100, 50);
+    records.push_back(marker_record(TraceMarker::ROI_END, 1));
+    add_accesses(150, 30);
+    records.push_back(marker_record(TraceMarker::RESET_STATS));
+    records.push_back(TraceRecord{.addr = 7, .timestamp = 0, .type = AccessType::MARKER, .cpu_index = 0});
+    records.push_back(marker_record(TraceMarker::ROI_BEGIN));
+    add_accesses(180, 20);
+    records.push_back(marker_record(TraceMarker::ROI_END));
+    add_accesses(200, 10);
+
+    auto replay = [&](RoiMode mode) {
+        RoiTraceReader reader(std::make_unique<VectorTraceReader>(records), mode);
+        // Per access: whether it was inside a region, and the resets before it.
+        vector<std::tuple<uint64_t, bool, uint64_t>> seen;
+        vector<TraceRecord> batch(64);
+        size_t n;
+        while ((n = reader.read(batch.data(), batch.size())) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                REQUIRE(!batch[i].is_marker());
+                seen.emplace_back(batch[i].addr / 64, reader.in_roi(), reader.resets());
+            }
+        }
+        REQUIRE(reader.regions() == (mode == RoiMode::OFF ? 0 : 2));
+        return seen;
+    };
+
+    auto off = replay(RoiMode::OFF);
+    REQUIRE(off.size() == 210);
+
+    auto warm = replay(RoiMode::WARM);
+    REQUIRE(warm.size() == 210);
+    for (const auto& [line, in_roi, resets]: warm) {
+        REQUIRE(in_roi == ((line >= 100 && line < 150) || (line >= 180 && line < 200)));
+        REQUIRE(resets == (line >= 180 ? 1 : 0));
+    }
+
+    auto skip = replay(RoiMode::SKIP);
+    REQUIRE(skip.size() == 70);
+    REQUIRE(std::get<0>(skip.front()) == 100);
+    REQUIRE(std::get<0>(skip.back()) == 199);
+
+    REQUIRE(parse_roi_mode("warm") == RoiMode::WARM);
+    REQUIRE_THROWS_AS(parse_roi_mode("on"), std::invalid_argument);
+}
+
+TEST_CASE("Caches warm without counting while their stats are disabled", "Trace ROI") {
+    MultiLevelCache<WayPartitioning> cache{2, Cache(1024, 2, 64), WayPartitioning(16 * 1024, 64, {2, 2})};
+    cache.set_stats_enabled(false);
+    for (uint64_t addr = 0; addr < 4096; addr += 64) {
+        cache.access(addr / 64 % 2, 0, addr, 3);
+    }
+    REQUIRE(cache.misses(0) == 0);
+    REQUIRE(cache.num_total_accesses(0) == 0);
+    REQUIRE(cache.get_private_cache(0).hits() == 0);
+
+    // The warmed lines hit.
+    cache.set_stats_enabled(true);
+    for (uint64_t addr = 0; addr < 4096; addr += 64) {
+        cache.access(addr / 64 % 2, 0, addr);
+    }
+    REQUIRE(cache.misses(0) == 0);
+    REQUIRE(cache.get_shared_cache().hits(0) > 0);
+
+    cache.reset_stats();
+    REQUIRE(cache.num_total_accesses(0) == 0);
+    REQUIRE(cache.get_private_cache(1).hits() == 0);
+    REQUIRE(cache.get_private_cache(1).misses() == 0);
+
+    // Markers pass every filter and end collapsed runs.
+    TraceFilter filter;
+    filter.keep_only_cores({1});
+    filter.keep_only_types({AccessType::STORE});
+    REQUIRE(filter.matches(marker_record(TraceMarker::ROI_BEGIN)));
+    vector<TraceRecord> records = {
+        TraceRecord{.addr = 64, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = 0},
+        marker_record(TraceMarker::ROI_BEGIN),
+        TraceRecord{.addr = 64, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = 0},
+        TraceRecord{.addr = 72, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = 0},
+    };
+    CollapsingTraceReader collapsed(std::make_unique<VectorTraceReader>(records), 64);
+    vector<TraceRecord> out(8);
+    REQUIRE(collapsed.read(out.data(), out.size()) == 3);
+    REQUIRE(out[0].weight == 1);
+    REQUIRE(out[1].is_marker());
+    REQUIRE(out[2].weight == 2);
+}
+
+TEST_CASE("Next uses are built by partition and streamed back in order", "Trace next use") {
+    std::mt19937_64 rng(21);
+    vector<uint64_t> blocks(20000);
+    for (auto& block: blocks) {
+        block = rng() % 300 + (rng() % 4 == 0 ? 1ull << 40 : 0);
+    }
+
+    auto path = temp_trace_path("next_use");
+    {
+        NextUseBuilder builder(path, 3);
+        for (auto block: blocks) {
+            builder.add(block);
+        }
+        REQUIRE(builder.finish() == blocks.size());
+    }
+    REQUIRE(std::filesystem::file_size(path) == blocks.size() * sizeof(NextUseEntry));
+    REQUIRE_FALSE(std::filesystem::exists(path + ".spill0"));
+
+    NextUseReader reader(path);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        reader.advance(blocks[i]);
+        auto next = std::find(blocks.begin() + i + 1, blocks.end(), blocks[i]);
+        REQUIRE(reader.position() == i);
+        REQUIRE(reader.next_use() == (next == blocks.end() ? NextUseReader::NEVER : (uint64_t) (next - blocks.begin())));
+    }
+    REQUIRE_THROWS_AS(reader.advance(blocks[0]), std::runtime_error);
+
+    NextUseReader mismatched(path);
+    REQUIRE_THROWS_AS(mismatched.advance(blocks[0] + 1), std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("MIN replacement is optimal", "Trace next use") {
+    // One set of 4 ways, against a direct simulation of Belady's algorithm.
+    std::mt19937_64 rng(22);
+    vector<uint64_t> blocks(3000);
+    for (auto& block: blocks) {
+        block = rng() % 9;
+    }
+    auto path = temp_trace_path("next_use_min");
+    {
+        NextUseBuilder builder(path, 2);
+        for (auto block: blocks) {
+            builder.add(block);
+        }
+        builder.finish();
+    }
+
+    uint32_t expected_misses = 0;
+    vector<uint64_t> lines;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (std::find(lines.begin(), lines.end(), blocks[i]) != lines.end()) {
+            continue;
+        }
+        expected_misses++;
+        if (lines.size() == 4) {
+            auto next_use = [&](uint64_t block) {
+                return std::find(blocks.begin() + i + 1, blocks.end(), block) - blocks.begin();
+            };
+            auto victim = std::max_element(lines.begin(), lines.end(), [&](uint64_t a, uint64_t b) {
+                return next_use(a) < next_use(b);
+            });
+            lines.erase(victim);
+        }
+        lines.push_back(blocks[i]);
+    }
+
+    Cache cache(4 * 64, 4, 64, ReplacementPolicy::MIN);
+    REQUIRE_THROWS_AS(cache.access(0), std::runtime_error);
+    auto reader = std::make_shared<NextUseReader>(path);
+    cache.set_next_use(reader);
+    for (auto block: blocks) {
+        reader->advance(block);
+        cache.access(block * 64);
+    }
+    REQUIRE(cache.misses() == expected_misses);
+    std::filesystem::remove(path);
+
+    // Behind private caches, the next uses come from a replay of the private caches alone.
+    vector<TraceRecord> records;
+    for (int i = 0; i < 50000; i++) {
+        uint64_t addr = (rng() % 2 == 0 ? rng() % 512 : rng() % 8192) * 64;
+        records.push_back(TraceRecord{.addr = addr, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = (uint8_t) (rng() % 2)});
+    }
+    Cache private_cache(1024, 2, 64);
+    auto shared_misses = [&](ReplacementPolicy policy) {
+        MultiLevelCache<Cache> multi_level{2, private_cache, Cache(16 * 1024, 4, 64, policy)};
+        if (policy == ReplacementPolicy::MIN) {
+            multi_level.set_next_use(std::make_shared<NextUseReader>(path));
+        }
+        for (const auto& record: records) {
+            multi_level.access(record.cpu_index, 0, record.addr);
+        }
+        return multi_level.misses(0);
+    };
+    VectorTraceReader trace(records);
+    build_shared_next_use(trace, 2, private_cache, 64, path);
+    auto min_misses = shared_misses(ReplacementPolicy::MIN);
+    for (auto policy: {ReplacementPolicy::LRU, ReplacementPolicy::PLRU, ReplacementPolicy::NRU, ReplacementPolicy::SRRIP,
+                       ReplacementPolicy::BRRIP, ReplacementPolicy::DRRIP}) {
+        REQUIRE(min_misses < shared_misses(policy));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("MIN replacement behind private caches of smaller blocks", "Trace next use") {
+    // Private caches of 32-byte blocks in front of a shared set of 4 ways of 128-byte blocks: the
+    // next uses are of the shared blocks, so MIN is still Belady's algorithm on them.
+    std::mt19937_64 rng(21);
+    vector<TraceRecord> records;
+    for (int i = 0; i < 20000; i++) {
+        uint64_t addr = (rng() % 10) * 128 + (rng() % 4) * 32;
+        records.push_back(TraceRecord{.addr = addr, .timestamp = 0, .type = AccessType::LOAD, .cpu_index = (uint8_t) (rng() % 2)});
+    }
+    Cache private_cache(2 * 32, 2, 32);
+
+    // The shared blocks of the private cache misses.
+    vector<uint64_t> blocks;
+    vector<Cache> private_caches(2, private_cache);
+    for (const auto& record: records) {
+        if (!private_caches[record.cpu_index].access(record.addr)) {
+            blocks.push_back(record.addr / 128);
+        }
+    }
+    uint64_t expected_misses = 0;
+    vector<uint64_t> lines;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (std::find(lines.begin(), lines.end(), blocks[i]) != lines.end()) {
+            continue;
+        }
+        expected_misses++;
+        if (lines.size() == 4) {
+            auto next_use = [&](uint64_t block) {
+                return std::find(blocks.begin() + i + 1, blocks.end(), block) - blocks.begin();
+            };
+            lines.erase(std::max_element(lines.begin(), lines.end(), [&](uint64_t a, uint64_t b) {
+                return next_use(a) < next_use(b);
+            }));
+        }
+        lines.push_back(blocks[i]);
+    }
+
+    auto path = temp_trace_path("next_use_blocks");
+    VectorTraceReader trace(records);
+    REQUIRE(build_shared_next_use(trace, 2, private_cache, 128, path) == blocks.size());
+    MultiLevelCache<Cache> multi_level{2, private_cache, Cache(4 * 128, 4, 128, ReplacementPolicy::MIN)};
+    multi_level.set_next_use(std::make_shared<NextUseReader>(path));
+    for (const auto& record: records) {
+        multi_level.access(record.cpu_index, 0, record.addr);
+    }
+    REQUIRE(multi_level.misses(0) == expected_misses);
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,407 @@
+#include "text_trace_parser.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASGARD_X86 1
+#endif
+
+namespace {
+    // Character classes, as bits of `CharTables::classes`.
+    constexpr uint8_t WHITESPACE = 0x1;
+    constexpr uint8_t NEWLINE = 0x2;
+    constexpr uint8_t HEX_DIGIT = 0x4;
+
+    struct CharTables {
+        uint8_t classes[256];
+        uint8_t hex_values[256];
+
+        CharTables() : classes(), hex_values() {
+            for (char c: {' ', '\t', '\r', '\n'}) {
+                classes[(uint8_t) c] |= WHITESPACE;
+            }
+            classes[(uint8_t) '\n'] |= NEWLINE;
+            for (int c = 0; c < 256; c++) {
+                if (c >= '0' && c <= '9') {
+                    hex_values[c] = c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                    hex_values[c] = c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                    hex_values[c] = c - 'A' + 10;
+                } else {
+                    continue;
+                }
+                classes[c] |= HEX_DIGIT;
+            }
+        }
+    };
+
+    const CharTables tables;
+
+    // Classifies 64 bytes into one bit per byte for each class.
+    using ClassifyFn = void (*)(const char *p, uint64_t& whitespace, uint64_t& newline, uint64_t& hex);
+
+    [[maybe_unused]] void classify_scalar(const char *p, uint64_t& whitespace, uint64_t& newline, uint64_t& hex) {
+        whitespace = newline = hex = 0;
+        for (uint32_t i = 0; i < 64; i++) {
+            uint8_t c = tables.classes[(uint8_t) p[i]];
+            whitespace |= (uint64_t) (c & WHITESPACE) << i;
+            newline |= (uint64_t) ((c & NEWLINE) >> 1) << i;
+            hex |= (uint64_t) ((c & HEX_DIGIT) >> 2) << i;
+        }
+    }
+
+#ifdef ASGARD_X86
+    // Signed byte compares are fine: every class lives in the ASCII range.
+    inline __m128i in_range_sse2(__m128i v, char lo, char hi) {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char) (lo - 1))),
+                             _mm_cmplt_epi8(v, _mm_set1_epi8((char) (hi + 1))));
+    }
+
+    void classify_sse2(const char *p, uint64_t& whitespace, uint64_t& newline, uint64_t& hex) {
+        whitespace = newline = hex = 0;
+        for (uint32_t k = 0; k < 4; k++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * k));
+            __m128i nl = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+            __m128i ws = _mm_or_si128(_mm_or_si128(nl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+            __m128i hx = _mm_or_si128(in_range_sse2(v, '0', '9'),
+                                      _mm_or_si128(in_range_sse2(v, 'a', 'f'), in_range_sse2(v, 'A', 'F')));
+            whitespace |= (uint64_t) (uint32_t) _mm_movemask_epi8(ws) << (16 * k);
+            newline |= (uint64_t) (uint32_t) _mm_movemask_epi8(nl) << (16 * k);
+            hex |= (uint64_t) (uint32_t) _mm_movemask_epi8(hx) << (16 * k);
+        }
+    }
+
+    __attribute__((target("avx2"))) inline __m256i in_range_avx2(__m256i v, char lo, char hi) {
+        return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char) (lo - 1))),
+                                _mm256_cmpgt_epi8(_mm256_set1_epi8((char) (hi + 1)), v));
+    }
+
+    __attribute__((target("avx2"))) void classify_avx2(const char *p, uint64_t& whitespace, uint64_t& newline, uint64_t& hex) {
+        whitespace = newline = hex = 0;
+        for (uint32_t k = 0; k < 2; k++) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32 * k));
+            __m256i nl = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+            __m256i ws = _mm256_or_si256(_mm256_or_si256(nl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '))),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+            __m256i hx = _mm256_or_si256(in_range_avx2(v, '0', '9'),
+                                         _mm256_or_si256(in_range_avx2(v, 'a', 'f'), in_range_avx2(v, 'A', 'F')));
+            whitespace |= (uint64_t) (uint32_t) _mm256_movemask_epi8(ws) << (32 * k);
+            newline |= (uint64_t) (uint32_t) _mm256_movemask_epi8(nl) << (32 * k);
+            hex |= (uint64_t) (uint32_t) _mm256_movemask_epi8(hx) << (32 * k);
+        }
+    }
+#endif
+
+    struct Kernel {
+        ClassifyFn classify;
+        const char *name;
+    };
+
+    Kernel select_kernel() {
+#ifdef ASGARD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {classify_avx2, "avx2"};
+        }
+        return {classify_sse2, "sse2"};
+#else
+        return {classify_scalar, "scalar"};
+#endif
+    }
+
+    const Kernel kernel = select_kernel();
+
+    struct ClassMasks {
+        std::vector<uint64_t> whitespace, newline, hex;
+        size_t size;
+
+        ClassMasks(const char *data, size_t n) : size(n) {
+            size_t words = (n + 63) / 64;
+            whitespace.resize(words);
+            newline.resize(words);
+            hex.resize(words);
+
+            size_t full_words = n / 64;
+            for (size_t w = 0; w < full_words; w++) {
+                kernel.classify(data + 64 * w, whitespace[w], newline[w], hex[w]);
+            }
+            if (full_words < words) {
+                // Pad the tail with whitespace so tokens never run past the end.
+                char tail[64];
+                std::memset(tail, ' ', sizeof(tail));
+                std::memcpy(tail, data + 64 * full_words, n - 64 * full_words);
+                kernel.classify(tail, whitespace[full_words], newline[full_words], hex[full_words]);
+            }
+        }
+
+        // First position >= pos whose whitespace bit equals `value`, or `size`.
+        size_t find_whitespace(size_t pos, bool value) const {
+            while (pos < size) {
+                uint64_t word = whitespace[pos / 64];
+                if (!value) {
+                    word = ~word;
+                }
+                word &= ~0ULL << (pos % 64);
+                if (word != 0) {
+                    return std::min(size, (pos & ~(size_t) 63) + std::countr_zero(word));
+                }
+                pos = (pos | 63) + 1;
+            }
+            return size;
+        }
+
+        bool all_hex(size_t begin, size_t end) const {
+            for (size_t pos = begin; pos < end;) {
+                size_t bits = std::min<size_t>(64 - pos % 64, end - pos);
+                uint64_t want = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (pos % 64);
+                if ((hex[pos / 64] & want) != want) {
+                    return false;
+                }
+                pos += bits;
+            }
+            return true;
+        }
+
+        uint64_t count_newlines(size_t end) const {
+            uint64_t count = 0;
+            for (size_t w = 0; w < end / 64; w++) {
+                count += std::popcount(newline[w]);
+            }
+            if (end % 64 != 0) {
+                count += std::popcount(newline[end / 64] & ((1ULL << (end % 64)) - 1));
+            }
+            return count;
+        }
+    };
+
+    // Parses the hex token [begin, end), accepting an optional 0x prefix like `std::hex` does.
+    bool parse_hex(const char *data, const ClassMasks& masks, size_t begin, size_t end, uint64_t& value) {
+        if (end - begin >= 2 && data[begin] == '0' && (data[begin + 1] | 0x20) == 'x') {
+            begin += 2;
+        }
+        if (begin == end || end - begin > 16 || !masks.all_hex(begin, end)) {
+            return false;
+        }
+        value = 0;
+        for (size_t i = begin; i < end; i++) {
+            value = (value << 4) | tables.hex_values[(uint8_t) data[i]];
+        }
+        return true;
+    }
+
+    // Store flags are read as decimal booleans, so only 0 and 1 are valid.
+    bool parse_flag(const char *data, size_t begin, size_t end, bool& value) {
+        uint64_t v = 0;
+        for (size_t i = begin; i < end; i++) {
+            if (data[i] < '0' || data[i] > '9' || v > 1) {
+                return false;
+            }
+            v = v * 10 + (data[i] - '0');
+        }
+        if (v > 1) {
+            return false;
+        }
+        value = v == 1;
+        return true;
+    }
+}
+
+const char *text_parser_kernel() {
+    return kernel.name;
+}
+
+TextChunkResult parse_text_chunk(const char *data, size_t size, std::vector<TraceRecord>& records) {
+    ClassMasks masks(data, size);
+    TextChunkResult result;
+
+    size_t pos = 0;
+    while (true) {
+        size_t record_start = masks.find_whitespace(pos, false);
+        if (record_start == size) {
+            break;
+        }
+
+        size_t token_begin[3], token_end[3];
+        bool complete = true;
+        pos = record_start;
+        for (uint32_t t = 0; t < 3; t++) {
+            token_begin[t] = masks.find_whitespace(pos, false);
+            if (token_begin[t] == size) {
+                complete = false;
+                break;
+            }
+            token_end[t] = masks.find_whitespace(token_begin[t], true);
+            pos = token_end[t];
+        }
+
+        uint64_t addr, cpu_index;
+        bool is_store;
+        if (!complete ||
+            !parse_hex(data, masks, token_begin[0], token_end[0], addr) ||
+            !parse_hex(data, masks, token_begin[1], token_end[1], cpu_index) ||
+            !parse_flag(data, token_begin[2], token_end[2], is_store)) {
+            result.error = true;
+            result.error_line = masks.count_newlines(record_start);
+            break;
+        }
+
+        records.push_back(TraceRecord{
+                .addr = addr,
+                .timestamp = 0,
+                .type = is_store ? AccessType::STORE : AccessType::LOAD,
+                .cpu_index = static_cast<uint8_t>(cpu_index)
+        });
+    }
+
+    result.lines = masks.count_newlines(size);
+    return result;
+}
+
+ParallelTextTraceReader::ParallelTextTraceReader(const std::string& path, TextParserOptions options)
+    : eof_(false), cancelled_(false), buffer_len_(0), chunk_idx_(0), record_idx_(0), line_base_(0) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Could not open '" + path + "': " + std::strerror(errno));
+    }
+    if (options.start_offset != 0 && ::lseek(fd_, options.start_offset, SEEK_SET) < 0) {
+        int error = errno;
+        ::close(fd_);
+        throw std::runtime_error("Could not seek in '" + path + "': " + std::strerror(error));
+    }
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    threads_ = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    chunk_bytes_ = std::max<size_t>(options.chunk_bytes, 64);
+    buffer_.resize(chunk_bytes_ * threads_);
+}
+
+ParallelTextTraceReader::~ParallelTextTraceReader() {
+    ::close(fd_);
+}
+
+void ParallelTextTraceReader::cancel() noexcept {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool ParallelTextTraceReader::parse_next_window() {
+    if (eof_ && buffer_len_ == 0) {
+        return false;
+    }
+
+    // Top the buffer up behind the partial line carried over from the previous window.
+    while (!eof_ && buffer_len_ < buffer_.size()) {
+        if (!wait_readable(fd_, cancelled_)) {
+            // Whatever is left of the stream is dropped, partial line included.
+            eof_ = true;
+            buffer_len_ = 0;
+            return false;
+        }
+        ssize_t n = ::read(fd_, buffer_.data() + buffer_len_, buffer_.size() - buffer_len_);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Error reading trace: ") + std::strerror(errno));
+        }
+        if (n == 0) {
+            eof_ = true;
+        }
+        buffer_len_ += n;
+    }
+
+    // Only whole lines are parsed, unless this is the end of the file.
+    size_t cut = buffer_len_;
+    if (!eof_) {
+        auto *last_newline = static_cast<const char *>(::memrchr(buffer_.data(), '\n', buffer_len_));
+        if (last_newline == nullptr) {
+            // A single line longer than the whole window, make room and try again.
+            buffer_.resize(buffer_.size() * 2);
+            return parse_next_window();
+        }
+        cut = last_newline - buffer_.data() + 1;
+    }
+
+    // Split [0, cut) into one chunk per thread, each ending at a newline.
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t begin = 0;
+    for (uint32_t t = 0; t < threads_ && begin < cut; t++) {
+        size_t end = (t + 1 == threads_) ? cut : std::min(cut, begin + std::max<size_t>(cut / threads_, 1));
+        if (end < cut) {
+            auto *newline = static_cast<const char *>(std::memchr(buffer_.data() + end, '\n', cut - end));
+            end = newline == nullptr ? cut : newline - buffer_.data() + 1;
+        }
+        ranges.emplace_back(begin, end);
+        begin = end;
+    }
+
+    chunks_.resize(ranges.size());
+    std::vector<std::thread> workers;
+    for (size_t c = 0; c < ranges.size(); c++) {
+        chunks_[c].records.clear();
+        auto parse = [this, c, &ranges]() {
+            auto& chunk = chunks_[c];
+            chunk.records.reserve((ranges[c].second - ranges[c].first) / 16);
+            chunk.result = parse_text_chunk(buffer_.data() + ranges[c].first, ranges[c].second - ranges[c].first, chunk.records);
+        };
+        if (c + 1 == ranges.size()) {
+            // The calling thread takes the last chunk.
+            parse();
+        } else {
+            workers.emplace_back(parse);
+        }
+    }
+    for (auto& worker: workers) {
+        worker.join();
+    }
+
+    std::memmove(buffer_.data(), buffer_.data() + cut, buffer_len_ - cut);
+    buffer_len_ -= cut;
+    chunk_idx_ = 0;
+    record_idx_ = 0;
+    return !chunks_.empty();
+}
+
+size_t ParallelTextTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records) {
+        if (chunk_idx_ == chunks_.size()) {
+            chunks_.clear();
+            chunk_idx_ = 0;
+            if (!parse_next_window()) {
+                break;
+            }
+            continue;
+        }
+
+        auto& chunk = chunks_[chunk_idx_];
+        size_t count = std::min(chunk.records.size() - record_idx_, max_records - n);
+        std::memcpy(records + n, chunk.records.data() + record_idx_, count * sizeof(TraceRecord));
+        record_idx_ += count;
+        n += count;
+
+        if (record_idx_ == chunk.records.size()) {
+            if (chunk.result.error) {
+                // Hand out what was parsed before the error first, like the iostream parser does.
+                if (n > 0) {
+                    return n;
+                }
+                throw std::runtime_error("Format error on line " + std::to_string(line_base_ + chunk.result.error_line + 1));
+            }
+            line_base_ += chunk.result.lines;
+            chunk_idx_++;
+            record_idx_ = 0;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+struct TextParserOptions {
+    // Number of parser threads, 0 uses every hardware thread.
+    uint32_t threads = 0;
+    // Bytes handed to each thread at a time. Chunks always end at a newline.
+    size_t chunk_bytes = 4 * 1024 * 1024;
+    // Byte offset of the first line to parse. Error line numbers count from there.
+    uint64_t start_offset = 0;
+};
+
+struct TextChunkResult {
+    // Number of newlines in the chunk.
+    uint64_t lines = 0;
+    bool error = false;
+    // Line of the first malformed record, relative to the start of the chunk (0-based).
+    uint64_t error_line = 0;
+};
+
+// Parses whole records from `data[0, size)` and appends them to `records`. Stops at the first
+// malformed record.
+TextChunkResult parse_text_chunk(const char *data, size_t size, std::vector<TraceRecord>& records);
+
+// Name of the character classification kernel picked for this CPU ("avx2", "sse2" or "scalar").
+const char *text_parser_kernel();
+
+// Parses the hex text format in parallel chunks while handing records out in file order.
+// Whitespace, newlines and hex digits are classified with SIMD, tokens are then walked with bit scans.
+class ParallelTextTraceReader : public TraceReader {
+public:
+    explicit ParallelTextTraceReader(const std::string& path, TextParserOptions options = {});
+    ~ParallelTextTraceReader() override;
+
+    ParallelTextTraceReader(const ParallelTextTraceReader&) = delete;
+    ParallelTextTraceReader& operator=(const ParallelTextTraceReader&) = delete;
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    struct Chunk {
+        std::vector<TraceRecord> records;
+        TextChunkResult result;
+    };
+
+    int fd_;
+    bool eof_;
+    std::atomic<bool> cancelled_;
+    uint32_t threads_;
+    size_t chunk_bytes_;
+    std::vector<char> buffer_;
+    size_t buffer_len_;
+    std::vector<Chunk> chunks_;
+    size_t chunk_idx_;
+    size_t record_idx_;
+    // Lines before the chunk being served.
+    uint64_t line_base_;
+
+    bool parse_next_window();
+};
@@ -0,0 +1,105 @@
+#include "trace_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+class CachedTrace::Reader : public TraceReader {
+public:
+    explicit Reader(const CachedTrace& trace) : trace_(trace), block_idx_(0), block_pos_(0) {}
+
+    size_t read(TraceRecord *records, size_t max_records) override {
+        size_t n = 0;
+        while (n < max_records && block_idx_ < trace_.blocks_.size()) {
+            const auto& block = trace_.blocks_[block_idx_];
+            const auto& source = trace_.compressed_ ? decoded(block) : block.records;
+
+            size_t count = std::min(source.size() - block_pos_, max_records - n);
+            std::memcpy(records + n, source.data() + block_pos_, count * sizeof(TraceRecord));
+            block_pos_ += count;
+            n += count;
+            if (block_pos_ == source.size()) {
+                block_idx_++;
+                block_pos_ = 0;
+                decoded_.clear();
+            }
+        }
+        return n;
+    }
+private:
+    const CachedTrace& trace_;
+    size_t block_idx_;
+    size_t block_pos_;
+    std::vector<TraceRecord> decoded_;
+
+    const std::vector<TraceRecord>& decoded(const Block& block) {
+        if (decoded_.empty()) {
+            decode_columnar_block(block.header, block.payload.data(), block.payload.size(), decoded_);
+        }
+        return decoded_;
+    }
+};
+
+CachedTrace::CachedTrace(TraceReader& source, TraceCacheOptions options)
+    : num_records_(0), memory_bytes_(0), compressed_(false) {
+    if (options.block_records == 0) {
+        throw std::invalid_argument("Cached trace blocks should hold at least one record!");
+    }
+    if (options.expected_records > 0) {
+        blocks_.reserve((options.expected_records + options.block_records - 1) / options.block_records);
+        compressed_ = options.expected_records * sizeof(TraceRecord) > options.raw_budget_bytes;
+    }
+
+    while (true) {
+        Block block{};
+        block.records.resize(options.block_records);
+        size_t n = 0, count;
+        while (n < block.records.size() && (count = source.read(block.records.data() + n, block.records.size() - n)) > 0) {
+            n += count;
+        }
+        if (n == 0) {
+            break;
+        }
+        block.records.resize(n);
+        block.records.shrink_to_fit();
+        num_records_ += n;
+
+        // Over budget: switch the whole trace to compressed blocks, once.
+        if (!compressed_ && memory_bytes_ + n * sizeof(TraceRecord) > options.raw_budget_bytes) {
+            compressed_ = true;
+            memory_bytes_ = 0;
+            for (auto& previous: blocks_) {
+                compress(previous);
+            }
+        }
+        if (compressed_) {
+            compress(block);
+        } else {
+            memory_bytes_ += n * sizeof(TraceRecord);
+        }
+        blocks_.push_back(std::move(block));
+    }
+}
+
+void CachedTrace::compress(Block& block) {
+    encode_columnar_block(block.records.data(), block.records.size(), block.header, block.payload);
+    block.payload.shrink_to_fit();
+    block.records = {};
+    memory_bytes_ += block.payload.size();
+}
+
+std::unique_ptr<TraceReader> CachedTrace::replay() const {
+    return std::make_unique<Reader>(*this);
+}
+
+uint64_t CachedTrace::num_records() const noexcept {
+    return num_records_;
+}
+
+size_t CachedTrace::memory_bytes() const noexcept {
+    return memory_bytes_;
+}
+
+bool CachedTrace::compressed() const noexcept {
+    return compressed_;
+}
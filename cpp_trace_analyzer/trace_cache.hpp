@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "columnar_trace.hpp"
+#include "trace_reader.hpp"
+
+struct TraceCacheOptions {
+    // Decoded records are kept as is while they fit in this many bytes. Past it, the whole trace
+    // is kept as columnar blocks, typically 4-6x smaller, which are decoded again on replay.
+    size_t raw_budget_bytes = 2ull * 1024 * 1024 * 1024;
+    uint32_t block_records = COLUMNAR_DEFAULT_BLOCK_RECORDS;
+    // Records the source is known to hold, e.g. from its TraceMetadata, or 0 if unknown. Sizes
+    // the block list up front and compresses from the first block if the trace will not fit raw.
+    uint64_t expected_records = 0;
+};
+
+// A trace decoded once into memory, to be replayed any number of times.
+class CachedTrace {
+public:
+    // Reads `source` to the end.
+    explicit CachedTrace(TraceReader& source, TraceCacheOptions options = {});
+
+    CachedTrace(const CachedTrace&) = delete;
+    CachedTrace& operator=(const CachedTrace&) = delete;
+
+    // A new reader positioned at the first record. Readers are independent and may be used from
+    // different threads, but must not outlive the cache.
+    std::unique_ptr<TraceReader> replay() const;
+
+    uint64_t num_records() const noexcept;
+    size_t memory_bytes() const noexcept;
+    bool compressed() const noexcept;
+private:
+    struct Block {
+        // Raw blocks keep `records`, compressed ones `header` and `payload`.
+        std::vector<TraceRecord> records;
+        ColumnarBlockHeader header;
+        std::vector<uint8_t> payload;
+    };
+
+    class Reader;
+
+    std::vector<Block> blocks_;
+    uint64_t num_records_;
+    size_t memory_bytes_;
+    bool compressed_;
+
+    void compress(Block& block);
+};
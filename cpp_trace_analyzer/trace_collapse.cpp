@@ -0,0 +1,65 @@
+#include "trace_collapse.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "cache.hpp"
+
+CollapsingTraceReader::CollapsingTraceReader(std::unique_ptr<TraceReader> source, uint32_t line_bytes)
+    : source_(std::move(source)), line_shift_(0), line_{}, last_{}, batch_{}, batch_id_(0), records_in_(0), records_out_(0) {
+    if (line_bytes == 0 || !Cache::is_power_of_2(line_bytes)) {
+        throw std::invalid_argument("Line size should be a power of 2!");
+    }
+    while ((1u << line_shift_) < line_bytes) {
+        line_shift_++;
+    }
+}
+
+size_t CollapsingTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = source_->read(records, std::min<size_t>(max_records, UINT32_MAX));
+    if (n == 0) {
+        return 0;
+    }
+    // Bumping the batch id forgets the previous batch without clearing the tables.
+    batch_id_++;
+
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        const auto& record = records[i];
+        if (record.is_marker()) {
+            // Runs end at markers, whose accesses on either side may be counted differently.
+            batch_id_++;
+            records[out++] = record;
+            continue;
+        }
+        uint8_t core = record.cpu_index;
+        uint64_t line = record.addr >> line_shift_;
+        if (batch_[core] == batch_id_ && line_[core] == line) {
+            auto& first = records[last_[core]];
+            if (first.weight <= UINT32_MAX - record.weight) {
+                first.weight += record.weight;
+                continue;
+            }
+        }
+        batch_[core] = batch_id_;
+        line_[core] = line;
+        last_[core] = out;
+        records[out++] = record;
+    }
+
+    records_in_ += n;
+    records_out_ += out;
+    return out;
+}
+
+void CollapsingTraceReader::cancel() noexcept {
+    source_->cancel();
+}
+
+uint64_t CollapsingTraceReader::records_in() const noexcept {
+    return records_in_;
+}
+
+uint64_t CollapsingTraceReader::records_out() const noexcept {
+    return records_out_;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+
+#include "trace_reader.hpp"
+
+// Folds runs of accesses of a core to the same cache line into the first record of the run,
+// whose `weight` counts the accesses it stands for.
+//
+// The fold is exact for a hierarchy with a private L1 per core of `line_bytes` lines, such as
+// MultiLevelCache when core_id == cpu_index: the repeats of a run are L1 hits on the MRU line, so
+// they change neither the L1 replacement state nor anything below it. Records of other cores may be
+// interleaved with a run. Runs are folded within each batch read from `source`, and end at marker
+// records.
+class CollapsingTraceReader : public TraceReader {
+public:
+    CollapsingTraceReader(std::unique_ptr<TraceReader> source, uint32_t line_bytes);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+
+    // Records read from `source` and records returned so far.
+    uint64_t records_in() const noexcept;
+    uint64_t records_out() const noexcept;
+private:
+    std::unique_ptr<TraceReader> source_;
+    uint32_t line_shift_;
+
+    // Per core: the line of its last record in the current batch and where that record is, valid
+    // when `batch_[core]` equals `batch_id_`.
+    std::array<uint64_t, 256> line_;
+    std::array<uint32_t, 256> last_;
+    std::array<uint64_t, 256> batch_;
+    uint64_t batch_id_;
+
+    uint64_t records_in_;
+    uint64_t records_out_;
+};
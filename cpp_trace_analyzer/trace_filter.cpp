@@ -0,0 +1,142 @@
+#include "trace_filter.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+void TraceFilter::keep_only_cores(const std::vector<uint32_t>& kept_cores) {
+    cores.fill(0);
+    for (auto core: kept_cores) {
+        if (core >= cores.size()) {
+            throw std::invalid_argument("Core " + std::to_string(core) + " does not exist");
+        }
+        cores[core] = 1;
+    }
+}
+
+void TraceFilter::keep_only_types(const std::vector<AccessType>& kept_types) {
+    types.fill(0);
+    for (auto type: kept_types) {
+        types[static_cast<uint8_t>(type) & 0x3] = 1;
+    }
+}
+
+bool TraceFilter::keeps_everything() const noexcept {
+    return min_addr == 0 && max_addr == UINT64_MAX &&
+           std::all_of(cores.begin(), cores.end(), [](uint8_t keep) { return keep != 0; }) &&
+           std::all_of(types.begin(), types.end(), [](uint8_t keep) { return keep != 0; });
+}
+
+bool TraceFilter::matches(const TraceRecord& record) const noexcept {
+    return (cores[record.cpu_index] & types[static_cast<uint8_t>(record.type) & 0x3] &
+            (record.addr - min_addr <= max_addr - min_addr)) | record.is_marker();
+}
+
+bool TraceFilter::may_match(const ColumnarBlockSummary& summary) const noexcept {
+    if (summary.type_counts[static_cast<uint8_t>(AccessType::MARKER)] > 0) {
+        return true;
+    }
+    if (summary.max_addr < min_addr || summary.min_addr > max_addr) {
+        return false;
+    }
+    bool any_type = false;
+    for (size_t t = 0; t < types.size(); t++) {
+        any_type |= types[t] && summary.type_counts[t] > 0;
+    }
+    bool any_core = false;
+    for (size_t c = 0; c < cores.size() && !any_core; c++) {
+        any_core = cores[c] && summary.has_core(c);
+    }
+    return any_type && any_core;
+}
+
+size_t TraceFilter::apply(TraceRecord *records, size_t n) const {
+    // Two branch-free passes: the match flags first, which the compiler vectorizes, then an
+    // unconditional store compaction.
+    constexpr size_t BATCH = 1024;
+    uint8_t keep[BATCH];
+    const uint64_t range = max_addr - min_addr;
+
+    size_t kept = 0;
+    for (size_t begin = 0; begin < n; begin += BATCH) {
+        size_t count = std::min(BATCH, n - begin);
+        const TraceRecord *batch = records + begin;
+        for (size_t i = 0; i < count; i++) {
+            keep[i] = (cores[batch[i].cpu_index] & types[static_cast<uint8_t>(batch[i].type) & 0x3] &
+                       (batch[i].addr - min_addr <= range)) | batch[i].is_marker();
+        }
+        for (size_t i = 0; i < count; i++) {
+            records[kept] = batch[i];
+            kept += keep[i];
+        }
+    }
+    return kept;
+}
+
+FilteredTraceReader::FilteredTraceReader(std::unique_ptr<TraceReader> source, const TraceFilter& filter)
+    : source_(std::move(source)), filter_(filter) {}
+
+size_t FilteredTraceReader::read(TraceRecord *records, size_t max_records) {
+    // Keep reading until something matches, 0 means the end of the trace.
+    while (true) {
+        size_t n = source_->read(records, max_records);
+        if (n == 0) {
+            return 0;
+        }
+        size_t kept = filter_.apply(records, n);
+        if (kept > 0) {
+            return kept;
+        }
+    }
+}
+
+void FilteredTraceReader::cancel() noexcept {
+    source_->cancel();
+}
+
+FilteredColumnarTraceReader::FilteredColumnarTraceReader(const std::string& path, const TraceFilter& filter)
+    : reader_(path), filter_(filter), index_(read_columnar_index(path)), summaries_(read_columnar_summaries(path)),
+      next_block_(0), block_remaining_(0), positioned_(true), blocks_skipped_(0) {}
+
+size_t FilteredColumnarTraceReader::read(TraceRecord *records, size_t max_records) {
+    while (true) {
+        if (block_remaining_ == 0) {
+            // Version 1 files have no summaries, every block has to be read.
+            while (next_block_ < index_.size() && !summaries_.empty() && !filter_.may_match(summaries_[next_block_])) {
+                next_block_++;
+                blocks_skipped_++;
+                positioned_ = false;
+            }
+            if (next_block_ == index_.size()) {
+                return 0;
+            }
+            if (!positioned_) {
+                reader_.seek(index_[next_block_].offset);
+                positioned_ = true;
+            }
+            block_remaining_ = index_[next_block_].num_records;
+            next_block_++;
+        }
+
+        size_t n = reader_.read(records, std::min<uint64_t>(max_records, block_remaining_));
+        if (n == 0) {
+            throw std::runtime_error("Columnar trace ended before its index");
+        }
+        block_remaining_ -= n;
+        size_t kept = filter_.apply(records, n);
+        if (kept > 0) {
+            return kept;
+        }
+    }
+}
+
+uint64_t FilteredColumnarTraceReader::blocks_skipped() const noexcept {
+    return blocks_skipped_;
+}
+
+std::unique_ptr<TraceReader> open_filtered_trace_reader(const std::string& path, TraceFormat format, const TraceFilter& filter,
+                                                        bool sequential) {
+    if (format == TraceFormat::COLUMNAR && !is_stream_trace(path)) {
+        return std::make_unique<FilteredColumnarTraceReader>(path, filter);
+    }
+    return std::make_unique<FilteredTraceReader>(open_trace_reader(path, format, sequential), filter);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "columnar_trace.hpp"
+#include "trace_reader.hpp"
+
+// Selects records by core, physical address range and access type. Marker records delimit the
+// regions of interest of every core and are always kept.
+struct TraceFilter {
+    // cores[i] is 1 to keep the records of core i.
+    std::array<uint8_t, 256> cores;
+    // types[i] is 1 to keep AccessType i.
+    std::array<uint8_t, 4> types;
+    // Inclusive address range to keep.
+    uint64_t min_addr = 0;
+    uint64_t max_addr = UINT64_MAX;
+
+    TraceFilter() { cores.fill(1); types.fill(1); }
+
+    void keep_only_cores(const std::vector<uint32_t>& kept_cores);
+    void keep_only_types(const std::vector<AccessType>& kept_types);
+
+    bool keeps_everything() const noexcept;
+    bool matches(const TraceRecord& record) const noexcept;
+    // False only if no record of the block can match.
+    bool may_match(const ColumnarBlockSummary& summary) const noexcept;
+    // Moves the matching records of records[0, n) to the front, in order, and returns how many.
+    size_t apply(TraceRecord *records, size_t n) const;
+};
+
+// Filters the records of any reader.
+class FilteredTraceReader : public TraceReader {
+public:
+    FilteredTraceReader(std::unique_ptr<TraceReader> source, const TraceFilter& filter);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    std::unique_ptr<TraceReader> source_;
+    TraceFilter filter_;
+};
+
+// Filters a columnar trace, skipping the blocks whose summary rules out every record without
+// reading or decoding them.
+class FilteredColumnarTraceReader : public TraceReader {
+public:
+    FilteredColumnarTraceReader(const std::string& path, const TraceFilter& filter);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+
+    uint64_t blocks_skipped() const noexcept;
+private:
+    ColumnarTraceReader reader_;
+    TraceFilter filter_;
+    std::vector<ColumnarBlockIndexEntry> index_;
+    std::vector<ColumnarBlockSummary> summaries_;
+    size_t next_block_;
+    // Records of the current block still to be read from `reader_`.
+    uint64_t block_remaining_;
+    // Whether `reader_` is positioned at `next_block_`.
+    bool positioned_;
+    uint64_t blocks_skipped_;
+};
+
+// Opens `path` with the best reader for `filter`: block skipping for columnar files, per-record
+// filtering otherwise. See open_trace_reader for `sequential`.
+std::unique_ptr<TraceReader> open_filtered_trace_reader(const std::string& path, TraceFormat format, const TraceFilter& filter,
+                                                        bool sequential = false);
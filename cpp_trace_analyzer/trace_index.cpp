@@ -0,0 +1,341 @@
+#include "trace_index.hpp"
+#include "columnar_trace.hpp"
+#include "compressed_trace.hpp"
+#include "text_trace_parser.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+void trace_file_identity(const std::string& path, uint64_t& size, uint64_t& mtime_ns) {
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0) {
+        throw std::runtime_error("Could not stat '" + path + "': " + std::strerror(errno));
+    }
+    size = st.st_size;
+    mtime_ns = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+TraceIndex TraceIndex::build(const std::string& path, TraceFormat format, uint64_t interval) {
+    if (interval == 0) {
+        throw std::invalid_argument("Index interval should be at least one record!");
+    }
+
+    TraceIndex index;
+    index.format_ = format;
+    index.interval_ = interval;
+    index.num_records_ = 0;
+    trace_file_identity(path, index.trace_size_, index.trace_mtime_ns_);
+
+    switch (format) {
+        case TraceFormat::BINARY: {
+            BinaryTraceReader reader(path);
+            reader.for_each([&](const TraceRecord& record) {
+                if (index.num_records_ % interval == 0) {
+                    index.entries_.push_back(TraceIndexEntry{
+                            .first_record = index.num_records_,
+                            .byte_offset = index.num_records_ * BinaryTraceReader::RECORD_SIZE,
+                            .min_timestamp = record.timestamp,
+                            .max_timestamp = record.timestamp
+                    });
+                }
+                auto& entry = index.entries_.back();
+                entry.min_timestamp = std::min(entry.min_timestamp, record.timestamp);
+                entry.max_timestamp = std::max(entry.max_timestamp, record.timestamp);
+                index.num_records_++;
+            });
+            break;
+        }
+        case TraceFormat::TEXT: {
+            // Text records carry no timestamps, only the line offsets are needed.
+            MappedFile file(path);
+            const char *data = reinterpret_cast<const char *>(file.data());
+            size_t pos = 0;
+            while (pos < file.size()) {
+                auto *newline = static_cast<const char *>(std::memchr(data + pos, '\n', file.size() - pos));
+                size_t end = newline == nullptr ? file.size() : newline - data;
+                bool blank = std::all_of(data + pos, data + end, [](char c) { return c == ' ' || c == '\t' || c == '\r'; });
+                if (!blank) {
+                    if (index.num_records_ % interval == 0) {
+                        index.entries_.push_back(TraceIndexEntry{
+                                .first_record = index.num_records_,
+                                .byte_offset = pos,
+                                .min_timestamp = 0,
+                                .max_timestamp = 0
+                        });
+                    }
+                    index.num_records_++;
+                }
+                pos = end + 1;
+            }
+            break;
+        }
+        case TraceFormat::COLUMNAR:
+            // Blocks only record their first and last timestamps, which bound the block well
+            // enough for timestamp seeks on the plugin's nearly sorted traces.
+            for (const auto& block: read_columnar_index(path)) {
+                index.entries_.push_back(TraceIndexEntry{
+                        .first_record = block.first_record,
+                        .byte_offset = block.offset,
+                        .min_timestamp = std::min(block.first_timestamp, block.last_timestamp),
+                        .max_timestamp = std::max(block.first_timestamp, block.last_timestamp)
+                });
+                index.num_records_ += block.num_records;
+            }
+            index.interval_ = index.entries_.size() > 1 ? index.entries_[1].first_record : interval;
+            break;
+        case TraceFormat::COMPRESSED: {
+            // One entry per block, the only places reading can start.
+            std::ifstream file(path, std::ios::binary);
+            CompressedTraceHeader header{};
+            if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+                std::memcmp(header.magic, COMPRESSED_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+                throw std::runtime_error("'" + path + "' is not a compressed trace");
+            }
+            CompressedBlockHeader block{};
+            std::vector<uint8_t> stored;
+            std::vector<TraceRecord> records;
+            uint64_t offset = sizeof(header);
+            while (read_compressed_block(file, header.block_records, block, stored)) {
+                decode_compressed_block(block, stored.data(), records);
+                auto [min, max] = std::minmax_element(records.begin(), records.end(),
+                                                      [](const TraceRecord& a, const TraceRecord& b) { return a.timestamp < b.timestamp; });
+                index.entries_.push_back(TraceIndexEntry{
+                        .first_record = index.num_records_,
+                        .byte_offset = offset,
+                        .min_timestamp = min->timestamp,
+                        .max_timestamp = max->timestamp
+                });
+                index.num_records_ += block.num_records;
+                offset += sizeof(block) + block.stored_bytes;
+            }
+            index.interval_ = header.block_records;
+            break;
+        }
+    }
+    return index;
+}
+
+TraceIndex TraceIndex::load(const std::string& index_path) {
+    std::ifstream file(index_path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open '" + index_path + "'");
+    }
+
+    TraceIndexHeader header{};
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, TRACE_INDEX_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + index_path + "' is not a trace index");
+    }
+    if (header.version != TRACE_INDEX_VERSION) {
+        throw std::runtime_error("Unsupported trace index version " + std::to_string(header.version));
+    }
+
+    TraceIndex index;
+    index.format_ = static_cast<TraceFormat>(header.format);
+    index.interval_ = header.interval;
+    index.num_records_ = header.num_records;
+    index.trace_size_ = header.trace_size;
+    index.trace_mtime_ns_ = header.trace_mtime_ns;
+    index.entries_.resize(header.num_entries);
+    if (!file.read(reinterpret_cast<char *>(index.entries_.data()), index.entries_.size() * sizeof(TraceIndexEntry))) {
+        throw std::runtime_error("Truncated trace index '" + index_path + "'");
+    }
+    return index;
+}
+
+TraceIndex TraceIndex::load_or_build(const std::string& path, TraceFormat format, uint64_t interval) {
+    if (format == TraceFormat::COLUMNAR) {
+        return build(path, format, interval);
+    }
+
+    auto index_path = trace_index_path(path);
+    uint64_t size, mtime_ns;
+    trace_file_identity(path, size, mtime_ns);
+    try {
+        auto index = load(index_path);
+        if (index.format_ == format && index.trace_size_ == size && index.trace_mtime_ns_ == mtime_ns) {
+            return index;
+        }
+    } catch (const std::runtime_error&) {
+        // Missing or unreadable, rebuild it.
+    }
+
+    auto index = build(path, format, interval);
+    try {
+        index.save(index_path);
+    } catch (const std::runtime_error& ex) {
+        // Read-only trace directories still work, the index is just rebuilt every time.
+        std::cerr << "Warning: " << ex.what() << std::endl;
+    }
+    return index;
+}
+
+void TraceIndex::save(const std::string& index_path) const {
+    std::ofstream file(index_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not create trace index '" + index_path + "'");
+    }
+
+    TraceIndexHeader header{};
+    std::memcpy(header.magic, TRACE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = TRACE_INDEX_VERSION;
+    header.format = static_cast<uint32_t>(format_);
+    header.interval = interval_;
+    header.num_records = num_records_;
+    header.num_entries = entries_.size();
+    header.trace_size = trace_size_;
+    header.trace_mtime_ns = trace_mtime_ns_;
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(entries_.data()), entries_.size() * sizeof(TraceIndexEntry));
+    file.close();
+    if (file.fail()) {
+        throw std::runtime_error("Error while writing trace index '" + index_path + "'");
+    }
+}
+
+TraceFormat TraceIndex::format() const noexcept {
+    return format_;
+}
+
+uint64_t TraceIndex::num_records() const noexcept {
+    return num_records_;
+}
+
+const std::vector<TraceIndexEntry>& TraceIndex::entries() const noexcept {
+    return entries_;
+}
+
+size_t TraceIndex::start_entry(const TraceSlice& slice) const {
+    if (entries_.empty()) {
+        return 0;
+    }
+    auto itr = std::upper_bound(entries_.begin(), entries_.end(), slice.begin_record,
+                                [](uint64_t record, const TraceIndexEntry& entry) { return record < entry.first_record; });
+    size_t entry = itr - entries_.begin() - 1;
+    // Every record of the skipped entries is stamped before the slice begins.
+    while (entry + 1 < entries_.size() && entries_[entry].max_timestamp < slice.begin_timestamp) {
+        entry++;
+    }
+    return entry;
+}
+
+std::vector<TraceSlice> TraceIndex::partitions(uint32_t k) const {
+    if (k == 0) {
+        throw std::invalid_argument("A trace should be split into at least one partition!");
+    }
+
+    // Partition boundaries fall on index entries, so that every partition starts with a seek.
+    auto boundary = [this](uint64_t target) -> uint64_t {
+        auto itr = std::lower_bound(entries_.begin(), entries_.end(), target,
+                                    [](const TraceIndexEntry& entry, uint64_t record) { return entry.first_record < record; });
+        uint64_t after = itr == entries_.end() ? num_records_ : itr->first_record;
+        uint64_t before = itr == entries_.begin() ? 0 : (itr - 1)->first_record;
+        return target - before < after - target ? before : after;
+    };
+
+    std::vector<TraceSlice> slices(k);
+    uint64_t begin = 0;
+    for (uint32_t i = 0; i < k; i++) {
+        uint64_t end = i + 1 == k ? num_records_ : std::max(begin, boundary(num_records_ * (i + 1) / k));
+        slices[i].begin_record = begin;
+        slices[i].end_record = end;
+        begin = end;
+    }
+    return slices;
+}
+
+std::string trace_index_path(const std::string& path) {
+    return path + TRACE_INDEX_EXTENSION;
+}
+
+std::unique_ptr<TraceReader> open_trace_slice(const std::string& path, const TraceIndex& index, const TraceSlice& slice,
+                                              bool sequential) {
+    TraceIndexEntry start{};
+    if (!index.entries().empty()) {
+        start = index.entries()[index.start_entry(slice)];
+    }
+
+    std::unique_ptr<TraceReader> source;
+    switch (index.format()) {
+        case TraceFormat::TEXT: {
+            TextParserOptions options;
+            options.start_offset = start.byte_offset;
+            if (sequential) {
+                options.threads = 1;
+                options.chunk_bytes = SEQUENTIAL_READER_BUFFER_BYTES;
+            }
+            source = std::make_unique<ParallelTextTraceReader>(path, options);
+            break;
+        }
+        case TraceFormat::BINARY: {
+            auto reader = std::make_unique<BinaryTraceReader>(path);
+            reader->seek(start.first_record);
+            source = std::move(reader);
+            break;
+        }
+        case TraceFormat::COLUMNAR: {
+            auto reader = std::make_unique<ColumnarTraceReader>(path);
+            if (!index.entries().empty()) {
+                reader->seek(start.byte_offset);
+            }
+            source = std::move(reader);
+            break;
+        }
+        case TraceFormat::COMPRESSED:
+            source = open_compressed_trace_reader(path, sequential ? 1 : 0, start.byte_offset);
+            break;
+    }
+    return std::make_unique<SlicedTraceReader>(std::move(source), start.first_record, slice);
+}
+
+SlicedTraceReader::SlicedTraceReader(std::unique_ptr<TraceReader> source, uint64_t first_record, const TraceSlice& slice)
+    : source_(std::move(source)), slice_(slice), next_record_(first_record), started_(false), finished_(false) {}
+
+size_t SlicedTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records && !finished_) {
+        if (next_record_ >= slice_.end_record) {
+            finished_ = true;
+            break;
+        }
+        // Do not decode records past the end of the slice.
+        size_t wanted = std::min<uint64_t>(max_records - n, slice_.end_record - next_record_);
+        size_t count = source_->read(records + n, wanted);
+        if (count == 0) {
+            finished_ = true;
+            break;
+        }
+
+        // Compact the kept records in place.
+        size_t kept = n;
+        for (size_t i = n; i < n + count; i++, next_record_++) {
+            const auto& record = records[i];
+            if (next_record_ < slice_.begin_record) {
+                continue;
+            }
+            if (!started_) {
+                if (record.timestamp < slice_.begin_timestamp) {
+                    continue;
+                }
+                started_ = true;
+            }
+            if (record.timestamp >= slice_.end_timestamp) {
+                finished_ = true;
+                break;
+            }
+            records[kept++] = record;
+        }
+        n = kept;
+    }
+    return n;
+}
+
+void SlicedTraceReader::cancel() noexcept {
+    source_->cancel();
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+/*
+ * Sidecar index for random access into text and binary traces, stored next to the trace as
+ * `<trace>.idx`. Columnar traces carry their own block index, which is used instead.
+ *
+ * Every `interval` records the index keeps the record number, the byte offset where that record
+ * starts and the timestamp range of the records up to the next entry. Text traces are expected
+ * to hold one record per line.
+ *
+ * File layout: TraceIndexHeader, then num_entries TraceIndexEntry.
+ */
+
+constexpr char TRACE_INDEX_MAGIC[8] = {'A', 'S', 'G', 'T', 'I', 'D', 'X', '1'};
+constexpr uint32_t TRACE_INDEX_VERSION = 1;
+constexpr uint64_t TRACE_INDEX_DEFAULT_INTERVAL = 64 * 1024;
+constexpr const char *TRACE_INDEX_EXTENSION = ".idx";
+
+struct TraceIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint64_t interval;
+    uint64_t num_records;
+    uint64_t num_entries;
+    // Size and modification time of the indexed trace, to detect stale indexes.
+    uint64_t trace_size;
+    uint64_t trace_mtime_ns;
+};
+
+struct TraceIndexEntry {
+    uint64_t first_record;
+    uint64_t byte_offset;
+    // Timestamp range of the records covered by the entry.
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+};
+
+static_assert(sizeof(TraceIndexHeader) == 56);
+static_assert(sizeof(TraceIndexEntry) == 32);
+
+// A range of a trace. The records kept are those in [begin_record, end_record), starting at the
+// first one stamped at or after begin_timestamp and stopping before the first one stamped at or
+// after end_timestamp.
+struct TraceSlice {
+    uint64_t begin_record = 0;
+    uint64_t end_record = UINT64_MAX;
+    uint64_t begin_timestamp = 0;
+    uint64_t end_timestamp = UINT64_MAX;
+
+    bool whole_trace() const noexcept {
+        return begin_record == 0 && end_record == UINT64_MAX && begin_timestamp == 0 && end_timestamp == UINT64_MAX;
+    }
+};
+
+class TraceIndex {
+public:
+    // Scans the trace.
+    static TraceIndex build(const std::string& path, TraceFormat format, uint64_t interval = TRACE_INDEX_DEFAULT_INTERVAL);
+    static TraceIndex load(const std::string& index_path);
+    // Loads the sidecar index of `path`, or builds and saves it if it is missing or stale.
+    // Columnar traces are indexed from their footer.
+    static TraceIndex load_or_build(const std::string& path, TraceFormat format, uint64_t interval = TRACE_INDEX_DEFAULT_INTERVAL);
+
+    void save(const std::string& index_path) const;
+
+    TraceFormat format() const noexcept;
+    uint64_t num_records() const noexcept;
+    const std::vector<TraceIndexEntry>& entries() const noexcept;
+
+    // Entry from which reading must start to reach the first record of `slice`.
+    size_t start_entry(const TraceSlice& slice) const;
+
+    // Splits the trace into `k` slices with as many records each as the index granularity allows.
+    std::vector<TraceSlice> partitions(uint32_t k) const;
+private:
+    TraceFormat format_;
+    uint64_t interval_;
+    uint64_t num_records_;
+    uint64_t trace_size_;
+    uint64_t trace_mtime_ns_;
+    std::vector<TraceIndexEntry> entries_;
+};
+
+// Size and modification time of the file at `path`, which identify a version of a trace.
+void trace_file_identity(const std::string& path, uint64_t& size, uint64_t& mtime_ns);
+
+// Path of the sidecar index of `path`.
+std::string trace_index_path(const std::string& path);
+
+// Reads only `slice` of the trace at `path`, seeking through `index`. See open_trace_reader for
+// `sequential`.
+std::unique_ptr<TraceReader> open_trace_slice(const std::string& path, const TraceIndex& index, const TraceSlice& slice,
+                                              bool sequential = false);
+
+// Keeps the records of `source` that belong to `slice`, given that `source` starts at record
+// `first_record` of the trace.
+class SlicedTraceReader : public TraceReader {
+public:
+    SlicedTraceReader(std::unique_ptr<TraceReader> source, uint64_t first_record, const TraceSlice& slice);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    std::unique_ptr<TraceReader> source_;
+    TraceSlice slice_;
+    uint64_t next_record_;
+    bool started_;
+    bool finished_;
+};
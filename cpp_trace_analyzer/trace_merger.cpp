@@ -0,0 +1,120 @@
+#include "trace_merger.hpp"
+
+#include <stdexcept>
+#include <string>
+
+MergedTraceReader::MergedTraceReader(std::vector<std::unique_ptr<TraceReader>> inputs, MergeOptions options) {
+    if (inputs.empty()) {
+        throw std::invalid_argument("At least one trace should be merged!");
+    }
+    if (!options.core_offsets.empty() && options.core_offsets.size() != inputs.size()) {
+        throw std::invalid_argument("There should be one core offset per merged trace!");
+    }
+    if (options.batch_records == 0) {
+        throw std::invalid_argument("Merge batches should hold at least one record!");
+    }
+
+    inputs_.resize(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+        auto& input = inputs_[i];
+        input.reader = std::move(inputs[i]);
+        input.buffer.resize(options.batch_records);
+        input.pos = 0;
+        input.size = 0;
+        input.core_offset = options.core_offsets.empty() ? 0 : options.core_offsets[i];
+        input.exhausted = false;
+        advance(i);
+    }
+    build();
+}
+
+// Moves `input` to its next record, refilling its buffer when needed.
+void MergedTraceReader::advance(uint32_t input) {
+    auto& in = inputs_[input];
+    if (in.pos + 1 < in.size) {
+        in.pos++;
+        return;
+    }
+    in.pos = 0;
+    in.size = in.exhausted ? 0 : in.reader->read(in.buffer.data(), in.buffer.size());
+    in.exhausted = in.size == 0;
+}
+
+// Exhausted inputs lose against everything, ties go to the lowest input.
+bool MergedTraceReader::beats(uint32_t a, uint32_t b) const {
+    const auto& in_a = inputs_[a];
+    const auto& in_b = inputs_[b];
+    if (in_a.exhausted || in_b.exhausted) {
+        return !in_a.exhausted && (in_b.exhausted || a < b);
+    }
+    uint64_t ts_a = in_a.buffer[in_a.pos].timestamp;
+    uint64_t ts_b = in_b.buffer[in_b.pos].timestamp;
+    return ts_a < ts_b || (ts_a == ts_b && a < b);
+}
+
+void MergedTraceReader::build() {
+    const auto n = static_cast<uint32_t>(inputs_.size());
+    tree_.assign(n, 0);
+    if (n == 1) {
+        return;
+    }
+
+    // Play every match bottom up, remembering the winners that move on.
+    std::vector<uint32_t> winner(n);
+    auto node_winner = [&](uint32_t node) { return node >= n ? node - n : winner[node]; };
+    for (uint32_t node = n - 1; node >= 1; node--) {
+        uint32_t left = node_winner(2 * node);
+        uint32_t right = node_winner(2 * node + 1);
+        if (beats(left, right)) {
+            winner[node] = left;
+            tree_[node] = right;
+        } else {
+            winner[node] = right;
+            tree_[node] = left;
+        }
+    }
+    tree_[0] = winner[1];
+}
+
+// Replays the matches on the path of `input`, the previous winner, after it advanced.
+void MergedTraceReader::replay(uint32_t input) {
+    const auto n = static_cast<uint32_t>(inputs_.size());
+    uint32_t winner = input;
+    for (uint32_t node = (n + input) / 2; node >= 1; node /= 2) {
+        if (beats(tree_[node], winner)) {
+            std::swap(tree_[node], winner);
+        }
+    }
+    tree_[0] = winner;
+}
+
+size_t MergedTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records) {
+        uint32_t winner = tree_[0];
+        auto& in = inputs_[winner];
+        // The winner is exhausted only when every input is.
+        if (in.exhausted) {
+            break;
+        }
+
+        auto record = in.buffer[in.pos];
+        uint32_t cpu_index = record.cpu_index + in.core_offset;
+        if (cpu_index > UINT8_MAX) {
+            throw std::runtime_error("Core " + std::to_string(cpu_index) + " of merged trace " +
+                                     std::to_string(winner) + " does not fit in a record");
+        }
+        record.cpu_index = static_cast<uint8_t>(cpu_index);
+        records[n++] = record;
+
+        advance(winner);
+        replay(winner);
+    }
+    return n;
+}
+
+void MergedTraceReader::cancel() noexcept {
+    for (auto& input: inputs_) {
+        input.reader->cancel();
+    }
+}
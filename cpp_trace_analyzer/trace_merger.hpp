@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+struct MergeOptions {
+    // Added to the cpu index of the records of input i, e.g. to give each VM its own cores.
+    // Empty means no offsets.
+    std::vector<uint32_t> core_offsets;
+    // Records buffered per input.
+    size_t batch_records = 1024;
+};
+
+// Interleaves N traces by timestamp, e.g. per-vCPU traces or traces of different VMs.
+// Each input must be sorted by timestamp. Records with equal timestamps come out in input order,
+// so traces without timestamps are simply concatenated.
+//
+// The inputs are the leaves of a loser tree: every internal node keeps the input that lost the
+// comparison there, so replacing the winner only replays the comparisons on its path to the
+// root, ceil(log2 N) per record.
+class MergedTraceReader : public TraceReader {
+public:
+    explicit MergedTraceReader(std::vector<std::unique_ptr<TraceReader>> inputs, MergeOptions options = {});
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    struct Input {
+        std::unique_ptr<TraceReader> reader;
+        std::vector<TraceRecord> buffer;
+        size_t pos;
+        size_t size;
+        uint32_t core_offset;
+        bool exhausted;
+    };
+
+    std::vector<Input> inputs_;
+    // tree_[0] is the current winner, tree_[1..N-1] the loser of each internal node.
+    // Leaf i is node N + i.
+    std::vector<uint32_t> tree_;
+
+    void advance(uint32_t input);
+    bool beats(uint32_t a, uint32_t b) const;
+    void build();
+    void replay(uint32_t input);
+};
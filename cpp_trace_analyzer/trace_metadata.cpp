@@ -0,0 +1,277 @@
+#include "trace_metadata.hpp"
+#include "trace_index.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+// Finalizer of splitmix64, spreads line numbers over the whole 64 bits.
+static uint64_t mix64(uint64_t x) noexcept {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+HyperLogLog::HyperLogLog() : registers_{} {}
+
+void HyperLogLog::add(uint64_t hash) noexcept {
+    // The top bits pick the register, the rest gives the rank: one more than its leading zeros.
+    // The guard bit caps the rank when the remaining bits are all zero.
+    uint32_t index = hash >> (64 - PRECISION);
+    uint64_t rest = (hash << PRECISION) | (1ull << (PRECISION - 1));
+    auto rank = static_cast<uint8_t>(std::countl_zero(rest) + 1);
+    registers_[index] = std::max(registers_[index], rank);
+}
+
+void HyperLogLog::merge(const HyperLogLog& other) noexcept {
+    for (size_t i = 0; i < registers_.size(); i++) {
+        registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+}
+
+uint64_t HyperLogLog::estimate() const noexcept {
+    const double m = registers_.size();
+    double sum = 0;
+    uint32_t zeros = 0;
+    for (auto reg: registers_) {
+        sum += std::ldexp(1.0, -reg);
+        zeros += reg == 0;
+    }
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Small cardinalities are counted better by the empty registers (linear counting).
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * std::log(m / zeros);
+    }
+    return static_cast<uint64_t>(std::llround(estimate));
+}
+
+void TraceMetadataBuilder::add(const TraceRecord *records, size_t n) noexcept {
+    auto& m = metadata_;
+    for (size_t i = 0; i < n; i++) {
+        const auto& record = records[i];
+        m.min_timestamp = std::min(m.min_timestamp, record.timestamp);
+        m.max_timestamp = std::max(m.max_timestamp, record.timestamp);
+        m.type_counts[static_cast<uint8_t>(record.type) & 0x3]++;
+        m.core_counts[record.cpu_index]++;
+        if (record.is_marker()) {
+            continue;
+        }
+        m.min_addr = std::min(m.min_addr, record.addr);
+        m.max_addr = std::max(m.max_addr, record.addr);
+        lines_.add(mix64(record.addr / TRACE_METADATA_LINE_BYTES));
+    }
+    m.num_records += n;
+}
+
+TraceMetadata TraceMetadataBuilder::finish(const std::string& path, TraceFormat format) const {
+    TraceMetadata metadata = metadata_;
+    metadata.format = format;
+    metadata.unique_lines = metadata.num_records == 0 ? 0 : std::max<uint64_t>(1, lines_.estimate());
+    trace_file_identity(path, metadata.trace_size, metadata.trace_mtime_ns);
+    metadata.content_hash = hash_trace_file(path);
+    metadata.sample_hash = hash_trace_sample(path);
+    return metadata;
+}
+
+MetadataCollectingTraceReader::MetadataCollectingTraceReader(std::unique_ptr<TraceReader> source)
+    : source_(std::move(source)) {}
+
+size_t MetadataCollectingTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = source_->read(records, max_records);
+    builder_.add(records, n);
+    return n;
+}
+
+void MetadataCollectingTraceReader::cancel() noexcept {
+    source_->cancel();
+}
+
+const TraceMetadataBuilder& MetadataCollectingTraceReader::builder() const noexcept {
+    return builder_;
+}
+
+// Four independent multiply-rotate lanes over 32-byte stripes keep up with the page cache.
+static uint64_t hash_bytes(const uint8_t *data, size_t size) noexcept {
+    constexpr uint64_t P1 = 0x9e3779b185ebca87ull;
+    constexpr uint64_t P2 = 0xc2b2ae3d27d4eb4full;
+
+    uint64_t lanes[4] = {P1 + P2, P2, 0, -P1};
+    size_t pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        for (size_t lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, data + pos + lane * 8, sizeof(word));
+            lanes[lane] = std::rotl(lanes[lane] + word * P2, 31) * P1;
+        }
+    }
+    uint64_t hash = size;
+    for (auto lane: lanes) {
+        hash = mix64(hash ^ lane);
+    }
+    for (; pos < size; pos++) {
+        hash = (hash ^ data[pos]) * P1;
+    }
+    return mix64(hash);
+}
+
+uint64_t hash_trace_file(const std::string& path) {
+    MappedFile file(path);
+    return hash_bytes(file.data(), file.size());
+}
+
+uint64_t hash_trace_sample(const std::string& path) {
+    // Only the pages of both ends are faulted in.
+    MappedFile file(path);
+    const size_t size = file.size();
+    const size_t head = std::min(size, TRACE_METADATA_SAMPLE_BYTES);
+    const size_t tail = std::min(size - head, TRACE_METADATA_SAMPLE_BYTES);
+    return mix64(hash_bytes(file.data(), head) ^ std::rotl(hash_bytes(file.data() + size - tail, tail), 1) ^ size);
+}
+
+TraceMetadata TraceMetadata::build(const std::string& path, TraceFormat format) {
+    MetadataCollectingTraceReader reader(open_trace_reader(path, format));
+    for_each_trace_record(reader, [](const TraceRecord&) {});
+    return reader.builder().finish(path, format);
+}
+
+TraceMetadata TraceMetadata::load(const std::string& metadata_path) {
+    std::ifstream file(metadata_path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open '" + metadata_path + "'");
+    }
+
+    TraceMetadataHeader header{};
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, TRACE_METADATA_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("'" + metadata_path + "' is not a trace metadata file");
+    }
+    if (header.version != TRACE_METADATA_VERSION) {
+        throw std::runtime_error("Unsupported trace metadata version " + std::to_string(header.version));
+    }
+
+    TraceMetadata metadata;
+    metadata.format = static_cast<TraceFormat>(header.format);
+    metadata.trace_size = header.trace_size;
+    metadata.trace_mtime_ns = header.trace_mtime_ns;
+    metadata.content_hash = header.content_hash;
+    metadata.sample_hash = header.sample_hash;
+    metadata.num_records = header.num_records;
+    metadata.unique_lines = header.unique_lines;
+    metadata.min_addr = header.min_addr;
+    metadata.max_addr = header.max_addr;
+    metadata.min_timestamp = header.min_timestamp;
+    metadata.max_timestamp = header.max_timestamp;
+    std::copy(std::begin(header.type_counts), std::end(header.type_counts), metadata.type_counts.begin());
+    std::copy(std::begin(header.core_counts), std::end(header.core_counts), metadata.core_counts.begin());
+    return metadata;
+}
+
+std::optional<TraceMetadata> TraceMetadata::load_current(const std::string& path, TraceFormat format) {
+    auto metadata_path = trace_metadata_path(path);
+    TraceMetadata metadata;
+    try {
+        metadata = load(metadata_path);
+    } catch (const std::runtime_error&) {
+        // Missing or unreadable.
+        return std::nullopt;
+    }
+
+    uint64_t size, mtime_ns;
+    trace_file_identity(path, size, mtime_ns);
+    if (metadata.format != format || metadata.trace_size != size) {
+        return std::nullopt;
+    }
+    if (metadata.trace_mtime_ns != mtime_ns) {
+        if (hash_trace_sample(path) != metadata.sample_hash) {
+            return std::nullopt;
+        }
+        // Same ends, remember the new time to skip hashing next time.
+        metadata.trace_mtime_ns = mtime_ns;
+        try {
+            metadata.save(metadata_path);
+        } catch (const std::runtime_error&) {
+            // Read-only trace directories just hash again next time.
+        }
+    }
+    return metadata;
+}
+
+TraceMetadata TraceMetadata::load_or_build(const std::string& path, TraceFormat format) {
+    if (auto metadata = load_current(path, format)) {
+        return *metadata;
+    }
+
+    auto metadata = build(path, format);
+    try {
+        metadata.save(trace_metadata_path(path));
+    } catch (const std::runtime_error& ex) {
+        // Read-only trace directories still work, the metadata is just rebuilt every time.
+        std::cerr << "Warning: " << ex.what() << std::endl;
+    }
+    return metadata;
+}
+
+void TraceMetadata::save(const std::string& metadata_path) const {
+    std::ofstream file(metadata_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not create trace metadata '" + metadata_path + "'");
+    }
+
+    TraceMetadataHeader header{};
+    std::memcpy(header.magic, TRACE_METADATA_MAGIC, sizeof(header.magic));
+    header.version = TRACE_METADATA_VERSION;
+    header.format = static_cast<uint32_t>(format);
+    header.trace_size = trace_size;
+    header.trace_mtime_ns = trace_mtime_ns;
+    header.content_hash = content_hash;
+    header.sample_hash = sample_hash;
+    header.num_records = num_records;
+    header.unique_lines = unique_lines;
+    header.min_addr = min_addr;
+    header.max_addr = max_addr;
+    header.min_timestamp = min_timestamp;
+    header.max_timestamp = max_timestamp;
+    std::copy(type_counts.begin(), type_counts.end(), header.type_counts);
+    std::copy(core_counts.begin(), core_counts.end(), header.core_counts);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    if (file.fail()) {
+        throw std::runtime_error("Error while writing trace metadata '" + metadata_path + "'");
+    }
+}
+
+uint32_t TraceMetadata::num_cores() const noexcept {
+    return std::count_if(core_counts.begin(), core_counts.end(), [](uint64_t count) { return count > 0; });
+}
+
+uint64_t TraceMetadata::footprint_bytes() const noexcept {
+    return unique_lines * TRACE_METADATA_LINE_BYTES;
+}
+
+std::ostream& operator<<(std::ostream& out, const TraceMetadata& metadata) {
+    out << metadata.num_records << " records from " << metadata.num_cores() << " cores ("
+        << metadata.type_counts[0] << " insn, " << metadata.type_counts[1] << " load, " << metadata.type_counts[2] << " store";
+    if (metadata.type_counts[3] > 0) {
+        out << ", " << metadata.type_counts[3] << " markers";
+    }
+    out << "), ~"
+        << metadata.unique_lines << " unique lines (" << metadata.footprint_bytes() / (1024 * 1024) << " MiB)";
+    if (metadata.num_records > 0) {
+        out << std::hex << ", addresses 0x" << metadata.min_addr << "-0x" << metadata.max_addr << std::dec;
+        if (metadata.max_timestamp > 0) {
+            out << ", " << (metadata.max_timestamp - metadata.min_timestamp) / 1e9 << " s";
+        }
+    }
+    return out;
+}
+
+std::string trace_metadata_path(const std::string& path) {
+    return path + TRACE_METADATA_EXTENSION;
+}
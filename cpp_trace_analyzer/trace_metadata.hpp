@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <string>
+
+#include "trace_reader.hpp"
+
+/*
+ * Metadata sidecar of a trace file, stored next to it as `<trace>.meta`: record, core and access
+ * type counts, address and timestamp ranges and an estimate of the unique line footprint, so later
+ * runs can size their structures and print a summary without scanning the trace.
+ *
+ * The sidecar records the size, modification time and a content hash of the trace, and a hash of its
+ * first and last TRACE_METADATA_SAMPLE_BYTES. A sidecar whose size differs is stale. One whose
+ * modification time differs is checked against the sample hash only, so a copied or touched trace
+ * keeps its metadata without being read whole again: a trace rewritten with the same size but
+ * differing only in its middle is not told apart.
+ *
+ * File layout: a single TraceMetadataHeader.
+ */
+
+constexpr char TRACE_METADATA_MAGIC[8] = {'A', 'S', 'G', 'T', 'M', 'E', 'T', 'A'};
+constexpr uint32_t TRACE_METADATA_VERSION = 2;
+constexpr const char *TRACE_METADATA_EXTENSION = ".meta";
+// Unique lines are counted at this granularity.
+constexpr uint32_t TRACE_METADATA_LINE_BYTES = 64;
+// Bytes hashed at each end of the trace to check a touched trace, see hash_trace_sample.
+constexpr size_t TRACE_METADATA_SAMPLE_BYTES = 64 * 1024;
+
+struct TraceMetadataHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint64_t trace_size;
+    uint64_t trace_mtime_ns;
+    uint64_t content_hash;
+    uint64_t sample_hash;
+    uint64_t num_records;
+    uint64_t unique_lines;
+    uint64_t min_addr;
+    uint64_t max_addr;
+    uint64_t min_timestamp;
+    uint64_t max_timestamp;
+    uint64_t type_counts[4];
+    uint64_t core_counts[256];
+};
+
+static_assert(sizeof(TraceMetadataHeader) == 2176);
+
+// Cardinality estimate in fixed memory, with a standard error of about 1.04 / sqrt(2^PRECISION).
+class HyperLogLog {
+public:
+    static constexpr uint32_t PRECISION = 14;
+
+    HyperLogLog();
+
+    // `hash` should be a well mixed 64-bit hash of the item.
+    void add(uint64_t hash) noexcept;
+    void merge(const HyperLogLog& other) noexcept;
+    uint64_t estimate() const noexcept;
+private:
+    std::array<uint8_t, 1 << PRECISION> registers_;
+};
+
+struct TraceMetadata {
+    TraceFormat format = TraceFormat::TEXT;
+    uint64_t trace_size = 0;
+    uint64_t trace_mtime_ns = 0;
+    uint64_t content_hash = 0;
+    uint64_t sample_hash = 0;
+
+    uint64_t num_records = 0;
+    // Estimated number of distinct TRACE_METADATA_LINE_BYTES lines, with a standard error of about
+    // 0.8% (see HyperLogLog), so within about 1.6% 95% of the time.
+    uint64_t unique_lines = 0;
+    // Address and timestamp ranges, min > max for an empty trace. Text traces have no timestamps.
+    uint64_t min_addr = UINT64_MAX;
+    uint64_t max_addr = 0;
+    uint64_t min_timestamp = UINT64_MAX;
+    uint64_t max_timestamp = 0;
+    std::array<uint64_t, 4> type_counts{};
+    std::array<uint64_t, 256> core_counts{};
+
+    // Scans the trace.
+    static TraceMetadata build(const std::string& path, TraceFormat format);
+    static TraceMetadata load(const std::string& metadata_path);
+    // The sidecar metadata of `path`, or nothing if it is missing or stale.
+    static std::optional<TraceMetadata> load_current(const std::string& path, TraceFormat format);
+    // Loads the sidecar metadata of `path`, or builds and saves it if it is missing or stale.
+    static TraceMetadata load_or_build(const std::string& path, TraceFormat format);
+
+    void save(const std::string& metadata_path) const;
+
+    // Number of cores with at least one record.
+    uint32_t num_cores() const noexcept;
+    uint64_t footprint_bytes() const noexcept;
+};
+
+std::ostream& operator<<(std::ostream& out, const TraceMetadata& metadata);
+
+// Path of the metadata sidecar of `path`.
+std::string trace_metadata_path(const std::string& path);
+
+// Hash of the whole content of the file at `path`.
+uint64_t hash_trace_file(const std::string& path);
+// Hash of the first and last TRACE_METADATA_SAMPLE_BYTES of the file at `path`, and of its size.
+uint64_t hash_trace_sample(const std::string& path);
+
+// Accumulates the statistics of TraceMetadata from records.
+class TraceMetadataBuilder {
+public:
+    void add(const TraceRecord *records, size_t n) noexcept;
+
+    // The metadata of the trace at `path`, which holds exactly the records added.
+    TraceMetadata finish(const std::string& path, TraceFormat format) const;
+private:
+    TraceMetadata metadata_;
+    HyperLogLog lines_;
+};
+
+// Passes the records of `source` through while collecting their metadata, so a trace that is read
+// anyway needs no extra scan.
+class MetadataCollectingTraceReader : public TraceReader {
+public:
+    explicit MetadataCollectingTraceReader(std::unique_ptr<TraceReader> source);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+
+    const TraceMetadataBuilder& builder() const noexcept;
+private:
+    std::unique_ptr<TraceReader> source_;
+    TraceMetadataBuilder builder_;
+};
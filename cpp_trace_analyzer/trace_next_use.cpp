@@ -0,0 +1,302 @@
+#include "trace_next_use.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Words of a spill buffer before it is written out.
+static constexpr size_t SPILL_BUFFER_WORDS = 8192;
+// Words read at once when walking a file backwards. Even, so chunks hold whole pairs.
+static constexpr size_t BACKWARD_CHUNK_WORDS = 16384;
+
+static int open_or_throw(const std::string& path, int flags) {
+    int fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open '" + path + "': " + std::strerror(errno));
+    }
+    return fd;
+}
+
+static void write_all(int fd, const void *data, size_t bytes, const std::string& path) {
+    auto bytes_data = static_cast<const uint8_t *>(data);
+    size_t written = 0;
+    while (written < bytes) {
+        ssize_t n = ::write(fd, bytes_data + written, bytes - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Error writing '" + path + "': " + std::strerror(errno));
+        }
+        written += n;
+    }
+}
+
+// Reads up to `bytes` bytes at `offset`, or from the current position when `offset` is negative.
+// Returns fewer only at the end of the file.
+static size_t read_all(int fd, void *data, size_t bytes, off_t offset, const std::string& path) {
+    auto bytes_data = static_cast<uint8_t *>(data);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = offset < 0 ? ::read(fd, bytes_data + done, bytes - done)
+                               : ::pread(fd, bytes_data + done, bytes - done, offset + (off_t) done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Error reading '" + path + "': " + std::strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// The pairs of words of a file, from the last pair to the first.
+class BackwardPairReader {
+public:
+    explicit BackwardPairReader(const std::string& path)
+        : path_(path), fd_(open_or_throw(path, O_RDONLY)), pos_(0) {
+        offset_ = ::lseek(fd_, 0, SEEK_END);
+        if (offset_ < 0 || offset_ % (2 * sizeof(uint64_t)) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("Truncated next-use spill file '" + path + "'");
+        }
+    }
+
+    ~BackwardPairReader() {
+        ::close(fd_);
+    }
+
+    BackwardPairReader(const BackwardPairReader&) = delete;
+    BackwardPairReader& operator=(const BackwardPairReader&) = delete;
+
+    // Returns false past the first pair.
+    bool next(uint64_t& first, uint64_t& second) {
+        if (pos_ == 0) {
+            if (offset_ == 0) {
+                return false;
+            }
+            size_t bytes = std::min<uint64_t>(offset_, BACKWARD_CHUNK_WORDS * sizeof(uint64_t));
+            offset_ -= (off_t) bytes;
+            chunk_.resize(bytes / sizeof(uint64_t));
+            if (read_all(fd_, chunk_.data(), bytes, offset_, path_) != bytes) {
+                throw std::runtime_error("Truncated next-use spill file '" + path_ + "'");
+            }
+            pos_ = chunk_.size();
+        }
+        second = chunk_[--pos_];
+        first = chunk_[--pos_];
+        return true;
+    }
+private:
+    std::string path_;
+    int fd_;
+    off_t offset_;
+    std::vector<uint64_t> chunk_;
+    size_t pos_;
+};
+
+static uint64_t pack_entry(const NextUseEntry& entry) {
+    uint64_t word;
+    std::memcpy(&word, &entry, sizeof(word));
+    return word;
+}
+
+static NextUseEntry unpack_entry(uint64_t word) {
+    NextUseEntry entry;
+    std::memcpy(&entry, &word, sizeof(entry));
+    return entry;
+}
+
+NextUseBuilder::NextUseBuilder(std::string path, uint32_t partitions)
+    : path_(std::move(path)), spill_buffers_(partitions), accesses_(0) {
+    if (partitions == 0) {
+        throw std::invalid_argument("Next uses need at least one partition");
+    }
+    for (uint32_t partition = 0; partition < partitions; partition++) {
+        spill_paths_.push_back(path_ + ".spill" + std::to_string(partition));
+        ::close(open_or_throw(spill_paths_.back(), O_WRONLY | O_CREAT | O_TRUNC));
+        spill_buffers_[partition].reserve(SPILL_BUFFER_WORDS);
+    }
+}
+
+NextUseBuilder::~NextUseBuilder() {
+    remove_spills();
+}
+
+void NextUseBuilder::add(uint64_t block) {
+    // Fibonacci hashing, so that strided blocks spread over the partitions.
+    auto partition = (uint32_t) (((block * 0x9e3779b97f4a7c15ull) >> 32) % spill_buffers_.size());
+    auto& buffer = spill_buffers_[partition];
+    buffer.push_back(accesses_++);
+    buffer.push_back(block);
+    if (buffer.size() >= SPILL_BUFFER_WORDS) {
+        flush_spill(partition);
+    }
+}
+
+void NextUseBuilder::flush_spill(uint32_t partition) {
+    auto& buffer = spill_buffers_[partition];
+    if (buffer.empty()) {
+        return;
+    }
+    int fd = open_or_throw(spill_paths_[partition], O_WRONLY | O_APPEND);
+    try {
+        write_all(fd, buffer.data(), buffer.size() * sizeof(uint64_t), spill_paths_[partition]);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    buffer.clear();
+}
+
+uint64_t NextUseBuilder::finish() {
+    // Backwards through each partition, the last access seen to a block is its next use. The
+    // results come out in decreasing order and replace the spill file.
+    const uint32_t partitions = spill_buffers_.size();
+    for (uint32_t partition = 0; partition < partitions; partition++) {
+        flush_spill(partition);
+        auto& buffer = spill_buffers_[partition];
+        std::unordered_map<uint64_t, uint64_t> next_access;
+        auto result_path = spill_paths_[partition] + ".next";
+        {
+            BackwardPairReader spill(spill_paths_[partition]);
+            int fd = open_or_throw(result_path, O_WRONLY | O_CREAT | O_TRUNC);
+            try {
+                uint64_t index, block;
+                while (spill.next(index, block)) {
+                    auto [it, first] = next_access.try_emplace(block, index);
+                    uint64_t distance = first ? 0 : it->second - index;
+                    it->second = index;
+                    buffer.push_back(index);
+                    buffer.push_back(pack_entry({distance > UINT32_MAX ? 0 : (uint32_t) distance, (uint32_t) block}));
+                    if (buffer.size() >= SPILL_BUFFER_WORDS) {
+                        write_all(fd, buffer.data(), buffer.size() * sizeof(uint64_t), result_path);
+                        buffer.clear();
+                    }
+                }
+                write_all(fd, buffer.data(), buffer.size() * sizeof(uint64_t), result_path);
+                buffer.clear();
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+        }
+        std::filesystem::rename(result_path, spill_paths_[partition]);
+    }
+
+    // Merged by access index, every partition read backwards to get them in increasing order.
+    std::vector<std::unique_ptr<BackwardPairReader>> results;
+    using Head = std::pair<uint64_t, uint32_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+    std::vector<uint64_t> head_entries(partitions);
+    for (uint32_t partition = 0; partition < partitions; partition++) {
+        results.push_back(std::make_unique<BackwardPairReader>(spill_paths_[partition]));
+        uint64_t index;
+        if (results.back()->next(index, head_entries[partition])) {
+            heads.emplace(index, partition);
+        }
+    }
+
+    int fd = open_or_throw(path_, O_WRONLY | O_CREAT | O_TRUNC);
+    try {
+        std::vector<NextUseEntry> entries;
+        entries.reserve(SPILL_BUFFER_WORDS);
+        for (uint64_t expected = 0; !heads.empty(); expected++) {
+            auto [index, partition] = heads.top();
+            heads.pop();
+            if (index != expected) {
+                throw std::runtime_error("Next-use spill files of '" + path_ + "' are inconsistent");
+            }
+            entries.push_back(unpack_entry(head_entries[partition]));
+            if (results[partition]->next(index, head_entries[partition])) {
+                heads.emplace(index, partition);
+            }
+            if (entries.size() == SPILL_BUFFER_WORDS) {
+                write_all(fd, entries.data(), entries.size() * sizeof(NextUseEntry), path_);
+                entries.clear();
+            }
+        }
+        write_all(fd, entries.data(), entries.size() * sizeof(NextUseEntry), path_);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    remove_spills();
+    return accesses_;
+}
+
+void NextUseBuilder::remove_spills() noexcept {
+    for (const auto& spill_path: spill_paths_) {
+        std::error_code error;
+        std::filesystem::remove(spill_path, error);
+        std::filesystem::remove(spill_path + ".next", error);
+    }
+    spill_paths_.clear();
+}
+
+NextUseReader::NextUseReader(const std::string& path)
+    : path_(path), fd_(open_or_throw(path, O_RDONLY)), buffer_(SPILL_BUFFER_WORDS), buffer_pos_(0), buffer_end_(0),
+      position_(NEVER), next_use_(NEVER) {}
+
+NextUseReader::~NextUseReader() {
+    ::close(fd_);
+}
+
+void NextUseReader::advance(uint64_t block) {
+    if (buffer_pos_ == buffer_end_) {
+        size_t bytes = read_all(fd_, buffer_.data(), buffer_.size() * sizeof(NextUseEntry), -1, path_);
+        if (bytes % sizeof(NextUseEntry) != 0) {
+            throw std::runtime_error("Truncated next-use file '" + path_ + "'");
+        }
+        if (bytes == 0) {
+            throw std::runtime_error("The replay has more shared cache accesses than the next-use file '" + path_ + "'");
+        }
+        buffer_pos_ = 0;
+        buffer_end_ = bytes / sizeof(NextUseEntry);
+    }
+
+    const auto& entry = buffer_[buffer_pos_++];
+    position_++;
+    if (entry.block_check != (uint32_t) block) {
+        throw std::runtime_error("Shared cache access " + std::to_string(position_) + " does not match the next-use file '" +
+                                 path_ + "'");
+    }
+    next_use_ = entry.distance == 0 ? NEVER : position_ + entry.distance;
+}
+
+uint64_t NextUseReader::position() const noexcept {
+    return position_;
+}
+
+uint64_t NextUseReader::next_use() const noexcept {
+    return next_use_;
+}
+
+uint64_t build_shared_next_use(TraceReader& trace, uint32_t num_cores, const Cache& private_cache,
+                               uint32_t shared_block_size, const std::string& path) {
+    std::vector<Cache> private_caches(num_cores, private_cache);
+    const uint32_t shared_block_bits = Cache::log2(shared_block_size);
+    NextUseBuilder builder(path);
+    for_each_trace_record(trace, [&](const TraceRecord& record) {
+        if (!record.is_marker() && !private_caches.at(record.cpu_index).access(record.addr)) {
+            builder.add(record.addr >> shared_block_bits);
+        }
+    });
+    return builder.finish();
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cache.hpp"
+#include "trace_reader.hpp"
+
+/*
+ * Next uses of the accesses that reach a shared cache, for Belady's MIN replacement (see
+ * ReplacementPolicy::MIN).
+ *
+ * NextUseBuilder takes the blocks of the accesses in order and writes one NextUseEntry per access
+ * to a file. So that traces of billions of accesses fit, it never holds the whole footprint: the
+ * accesses are spilled to `partitions` files by block, each file is walked backwards with a map of
+ * the blocks of that partition only, and the partial results are merged back in trace order. All
+ * the I/O is sequential. NextUseReader streams the file back during the simulation.
+ */
+
+struct NextUseEntry {
+    // Accesses until the next one to the same block, 0 if there is none or it is 2^32 accesses
+    // away or more.
+    uint32_t distance;
+    // Low bits of the block, to catch a replay that does not match the built file.
+    uint32_t block_check;
+};
+
+static_assert(sizeof(NextUseEntry) == 8);
+
+class NextUseBuilder {
+public:
+    // Writes the next uses to `path`, spilling to files next to it.
+    explicit NextUseBuilder(std::string path, uint32_t partitions = 64);
+    ~NextUseBuilder();
+
+    NextUseBuilder(const NextUseBuilder&) = delete;
+    NextUseBuilder& operator=(const NextUseBuilder&) = delete;
+
+    // Adds the next access, to `block`.
+    void add(uint64_t block);
+    // Writes the file and returns the number of accesses. Throws std::runtime_error on I/O errors.
+    uint64_t finish();
+private:
+    std::string path_;
+    std::vector<std::string> spill_paths_;
+    std::vector<std::vector<uint64_t>> spill_buffers_;
+    uint64_t accesses_;
+
+    void flush_spill(uint32_t partition);
+    void remove_spills() noexcept;
+};
+
+class NextUseReader {
+public:
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // Throws std::runtime_error if `path` can not be opened.
+    explicit NextUseReader(const std::string& path);
+    ~NextUseReader();
+
+    NextUseReader(const NextUseReader&) = delete;
+    NextUseReader& operator=(const NextUseReader&) = delete;
+
+    // Moves to the next access, which should be to `block`. Throws std::runtime_error past the end
+    // of the file or if the block does not match it.
+    void advance(uint64_t block);
+    // Index of the current access, from 0. NEVER before the first one.
+    uint64_t position() const noexcept;
+    // Index of the next access to the block of the current one, NEVER if none.
+    uint64_t next_use() const noexcept;
+private:
+    std::string path_;
+    int fd_;
+    std::vector<NextUseEntry> buffer_;
+    size_t buffer_pos_;
+    size_t buffer_end_;
+    uint64_t position_;
+    uint64_t next_use_;
+};
+
+// Builds at `path` the next uses of the accesses of `trace` that miss in per-core copies of
+// `private_cache`, i.e. of the accesses MultiLevelCache sends to its shared cache. The uses are of
+// the blocks of the shared cache, of `shared_block_size` bytes. Returns their number.
+uint64_t build_shared_next_use(TraceReader& trace, uint32_t num_cores, const Cache& private_cache,
+                               uint32_t shared_block_size, const std::string& path);
@@ -0,0 +1,146 @@
+#include "trace_prefetcher.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+PrefetchingTraceReader::PrefetchingTraceReader(std::unique_ptr<TraceReader> source, PrefetchOptions options)
+    : source_(std::move(source)), done_(false), stop_(false), has_current_(false), current_(0), current_pos_(0),
+      consumer_stall_(0), producer_stall_(0), buffers_filled_(0) {
+    if (options.depth < 2) {
+        throw std::invalid_argument("Prefetch depth should be at least 2!");
+    }
+    if (options.buffer_records == 0) {
+        throw std::invalid_argument("Prefetch buffers should hold at least one record!");
+    }
+
+    buffers_.resize(options.depth);
+    for (size_t i = 0; i < buffers_.size(); i++) {
+        buffers_[i].records.resize(options.buffer_records);
+        buffers_[i].size = 0;
+        free_.push_back(i);
+    }
+
+    reader_ = std::thread(&PrefetchingTraceReader::produce, this);
+}
+
+PrefetchingTraceReader::~PrefetchingTraceReader() {
+    // The reader thread may be waiting for a stream, not just for a free buffer.
+    cancel();
+    reader_.join();
+}
+
+void PrefetchingTraceReader::cancel() noexcept {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    free_cv_.notify_all();
+    filled_cv_.notify_all();
+    source_->cancel();
+}
+
+void PrefetchingTraceReader::produce() {
+    while (true) {
+        size_t idx;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            auto start = std::chrono::steady_clock::now();
+            free_cv_.wait(lock, [this] { return stop_ || !free_.empty(); });
+            producer_stall_ += std::chrono::steady_clock::now() - start;
+            if (stop_) {
+                return;
+            }
+            idx = free_.front();
+            free_.pop_front();
+        }
+
+        // Fill the whole buffer, sources may return short reads.
+        auto& buffer = buffers_[idx];
+        buffer.size = 0;
+        std::exception_ptr error;
+        try {
+            size_t n;
+            while (buffer.size < buffer.records.size() &&
+                   (n = source_->read(buffer.records.data() + buffer.size, buffer.records.size() - buffer.size)) > 0) {
+                buffer.size += n;
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        bool exhausted = error != nullptr || buffer.size < buffer.records.size();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (buffer.size > 0) {
+                filled_.push_back(idx);
+                buffers_filled_++;
+            } else {
+                free_.push_back(idx);
+            }
+            if (exhausted) {
+                done_ = true;
+                error_ = error;
+            }
+        }
+        filled_cv_.notify_one();
+
+        if (exhausted) {
+            return;
+        }
+    }
+}
+
+size_t PrefetchingTraceReader::read(TraceRecord *records, size_t max_records) {
+    size_t n = 0;
+    while (n < max_records) {
+        if (!has_current_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (filled_.empty() && !done_ && !stop_) {
+                auto start = std::chrono::steady_clock::now();
+                filled_cv_.wait(lock, [this] { return done_ || stop_ || !filled_.empty(); });
+                consumer_stall_ += std::chrono::steady_clock::now() - start;
+            }
+            if (stop_) {
+                break;
+            }
+            if (filled_.empty()) {
+                // Errors are raised only after every record read before them was handed out.
+                if (error_ != nullptr && n == 0) {
+                    std::rethrow_exception(std::exchange(error_, nullptr));
+                }
+                break;
+            }
+            current_ = filled_.front();
+            filled_.pop_front();
+            current_pos_ = 0;
+            has_current_ = true;
+        }
+
+        auto& buffer = buffers_[current_];
+        size_t count = std::min(buffer.size - current_pos_, max_records - n);
+        std::memcpy(records + n, buffer.records.data() + current_pos_, count * sizeof(TraceRecord));
+        current_pos_ += count;
+        n += count;
+
+        if (current_pos_ == buffer.size) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                free_.push_back(current_);
+            }
+            free_cv_.notify_one();
+            has_current_ = false;
+        }
+    }
+    return n;
+}
+
+PrefetchStats PrefetchingTraceReader::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return PrefetchStats{
+            .consumer_stall_seconds = std::chrono::duration<double>(consumer_stall_).count(),
+            .producer_stall_seconds = std::chrono::duration<double>(producer_stall_).count(),
+            .buffers_filled = buffers_filled_
+    };
+}
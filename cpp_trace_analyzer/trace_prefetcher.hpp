@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+struct PrefetchOptions {
+    // Records per decoded buffer.
+    size_t buffer_records = 256 * 1024;
+    // Number of buffers in the ring. Two is plain double buffering.
+    uint32_t depth = 4;
+};
+
+struct PrefetchStats {
+    // Time the consumer waited for a filled buffer, i.e. time the simulation was I/O bound.
+    double consumer_stall_seconds;
+    // Time the reader thread waited for a free buffer, i.e. time the simulation was the bottleneck.
+    double producer_stall_seconds;
+    uint64_t buffers_filled;
+};
+
+// Decodes `source` on a dedicated thread into a ring of record buffers, so that reading and
+// decoding the trace overlaps with simulation.
+class PrefetchingTraceReader : public TraceReader {
+public:
+    explicit PrefetchingTraceReader(std::unique_ptr<TraceReader> source, PrefetchOptions options = {});
+    ~PrefetchingTraceReader() override;
+
+    PrefetchingTraceReader(const PrefetchingTraceReader&) = delete;
+    PrefetchingTraceReader& operator=(const PrefetchingTraceReader&) = delete;
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    // Also stops the reader thread.
+    void cancel() noexcept override;
+
+    PrefetchStats stats() const;
+private:
+    struct Buffer {
+        std::vector<TraceRecord> records;
+        size_t size;
+    };
+
+    std::unique_ptr<TraceReader> source_;
+    std::vector<Buffer> buffers_;
+    std::deque<size_t> filled_;
+    std::deque<size_t> free_;
+    mutable std::mutex mutex_;
+    std::condition_variable filled_cv_;
+    std::condition_variable free_cv_;
+    // Set by the reader thread once `source_` is exhausted or failed.
+    bool done_;
+    // Set by cancel() to stop the reader thread early.
+    bool stop_;
+    std::exception_ptr error_;
+    // Buffer being handed out to the consumer, if any.
+    bool has_current_;
+    size_t current_;
+    size_t current_pos_;
+    std::chrono::steady_clock::duration consumer_stall_;
+    std::chrono::steady_clock::duration producer_stall_;
+    uint64_t buffers_filled_;
+    std::thread reader_;
+
+    void produce();
+};
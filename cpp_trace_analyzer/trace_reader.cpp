@@ -0,0 +1,310 @@
+#include "trace_reader.hpp"
+#include "columnar_trace.hpp"
+#include "compressed_trace.hpp"
+#include "shm_trace_ring.hpp"
+#include "text_trace_parser.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open '" + path + "': " + std::strerror(errno));
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Could not stat '" + path + "': " + std::strerror(errno));
+    }
+    size_ = st.st_size;
+
+    // mmap rejects empty mappings, an empty file is simply an empty trace.
+    if (size_ > 0) {
+        void *addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Could not map '" + path + "': " + std::strerror(errno));
+        }
+        data_ = static_cast<uint8_t *>(addr);
+        // Traces are replayed front to back.
+        ::madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+
+    // The mapping stays valid after closing the descriptor.
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        ::munmap(data_, size_);
+    }
+}
+
+const uint8_t *MappedFile::data() const noexcept {
+    return data_;
+}
+
+size_t MappedFile::size() const noexcept {
+    return size_;
+}
+
+TextTraceReader::TextTraceReader(const std::string& path) : file_(path), line_no_(1) {
+    if (!file_.is_open()) {
+        throw std::runtime_error("Could not open '" + path + "'");
+    }
+}
+
+size_t TextTraceReader::read(TraceRecord *records, size_t max_records) {
+    uintptr_t addr, cpu_index;
+    bool is_store;
+    size_t n = 0;
+    while (n < max_records) {
+        // This reads until it encounters white space, not just newline.
+        if (!(file_ >> std::hex >> addr >> std::hex >> cpu_index >> is_store)) {
+            if (file_.eof()) {
+                break;
+            }
+            throw std::runtime_error("Format error on line " + std::to_string(line_no_));
+        }
+        ++line_no_;
+        records[n++] = TraceRecord{
+                .addr = addr,
+                .timestamp = 0,
+                .type = is_store ? AccessType::STORE : AccessType::LOAD,
+                .cpu_index = static_cast<uint8_t>(cpu_index)
+        };
+    }
+    return n;
+}
+
+BinaryTraceReader::BinaryTraceReader(const std::string& path) : file_(path), next_record_(0) {
+    if (file_.size() % RECORD_SIZE != 0) {
+        // The plugin may have been killed in the middle of a write, ignore the torn record.
+        std::cerr << "Warning: '" << path << "' ends with a partial record, ignoring its last "
+                  << file_.size() % RECORD_SIZE << " bytes" << std::endl;
+    }
+}
+
+uint64_t BinaryTraceReader::num_records() const noexcept {
+    return file_.size() / RECORD_SIZE;
+}
+
+void BinaryTraceReader::seek(uint64_t record) noexcept {
+    next_record_ = std::min(record, num_records());
+}
+
+TraceRecord BinaryTraceReader::decode(const uint8_t *bytes) noexcept {
+    // The plugin writes little-endian fields, same as the hosts we run on.
+    TraceRecord record{};
+    std::memcpy(&record.addr, bytes, sizeof(uint64_t));
+    std::memcpy(&record.timestamp, bytes + 8, sizeof(uint64_t));
+    record.type = static_cast<AccessType>(bytes[16]);
+    record.cpu_index = bytes[17];
+    return record;
+}
+
+size_t BinaryTraceReader::read(TraceRecord *records, size_t max_records) {
+    uint64_t remaining = num_records() - next_record_;
+    size_t n = remaining < max_records ? remaining : max_records;
+
+    const uint8_t *bytes = file_.data() + next_record_ * RECORD_SIZE;
+    for (size_t i = 0; i < n; i++) {
+        records[i] = decode(bytes + i * RECORD_SIZE);
+    }
+    next_record_ += n;
+    return n;
+}
+
+BufferedBinaryTraceReader::BufferedBinaryTraceReader(const std::string& path, size_t buffer_bytes)
+    : use_pread_(true), cancelled_(false), eof_(false), offset_(0), buffer_begin_(0), buffer_end_(0) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("Could not open '" + path + "': " + std::strerror(errno));
+    }
+    ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Whole records only, so a refill never has to deal with more than one torn record.
+    buffer_.resize(std::max<size_t>(buffer_bytes / BinaryTraceReader::RECORD_SIZE, 1) * BinaryTraceReader::RECORD_SIZE);
+}
+
+BufferedBinaryTraceReader::~BufferedBinaryTraceReader() {
+    ::close(fd_);
+}
+
+void BufferedBinaryTraceReader::refill() {
+    // Keep the partial record at the end of the buffer, if any.
+    size_t leftover = buffer_end_ - buffer_begin_;
+    std::memmove(buffer_.data(), buffer_.data() + buffer_begin_, leftover);
+    buffer_begin_ = 0;
+    buffer_end_ = leftover;
+
+    while (!eof_ && buffer_end_ < buffer_.size()) {
+        ssize_t n;
+        if (use_pread_) {
+            n = ::pread(fd_, buffer_.data() + buffer_end_, buffer_.size() - buffer_end_, offset_);
+            if (n < 0 && errno == ESPIPE) {
+                // Pipes and FIFOs can not be read at an offset.
+                use_pread_ = false;
+                continue;
+            }
+        } else {
+            if (!wait_readable(fd_, cancelled_)) {
+                // Whatever is left of the stream is dropped, partial record included.
+                eof_ = true;
+                buffer_begin_ = buffer_end_ = 0;
+                return;
+            }
+            n = ::read(fd_, buffer_.data() + buffer_end_, buffer_.size() - buffer_end_);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Error reading trace: ") + std::strerror(errno));
+        }
+        if (n == 0) {
+            eof_ = true;
+        }
+        buffer_end_ += n;
+        offset_ += n;
+    }
+}
+
+size_t BufferedBinaryTraceReader::read(TraceRecord *records, size_t max_records) {
+    constexpr size_t RECORD_SIZE = BinaryTraceReader::RECORD_SIZE;
+    size_t n = 0;
+    while (n < max_records) {
+        if (buffer_end_ - buffer_begin_ < RECORD_SIZE) {
+            if (eof_) {
+                if (buffer_end_ != buffer_begin_) {
+                    std::cerr << "Warning: trace ends with a partial record, ignoring its last "
+                              << buffer_end_ - buffer_begin_ << " bytes" << std::endl;
+                    buffer_begin_ = buffer_end_;
+                }
+                break;
+            }
+            refill();
+            continue;
+        }
+        size_t count = std::min((buffer_end_ - buffer_begin_) / RECORD_SIZE, max_records - n);
+        for (size_t i = 0; i < count; i++) {
+            records[n + i] = BinaryTraceReader::decode(buffer_.data() + buffer_begin_ + i * RECORD_SIZE);
+        }
+        buffer_begin_ += count * RECORD_SIZE;
+        n += count;
+    }
+    return n;
+}
+
+void BufferedBinaryTraceReader::cancel() noexcept {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool wait_readable(int fd, const std::atomic<bool>& cancelled) {
+    pollfd poll_fd{.fd = fd, .events = POLLIN, .revents = 0};
+    while (!cancelled.load(std::memory_order_relaxed)) {
+        int ready = ::poll(&poll_fd, 1, STREAM_CANCEL_POLL_MS);
+        // Errors and hangups are left for the read to report.
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_stream_trace(const std::string& path) {
+    if (path == STDIN_TRACE_PATH || is_shm_trace(path)) {
+        return true;
+    }
+    struct stat st {};
+    return ::stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+// Streams are opened through their /dev/stdin alias so every reader can take a path.
+static std::string resolve_trace_path(const std::string& path) {
+    return path == STDIN_TRACE_PATH ? "/dev/stdin" : path;
+}
+
+TraceFormat detect_trace_format(const std::string& path) {
+    if (path == STDIN_TRACE_PATH) {
+        throw std::invalid_argument("The format of a trace read from the standard input must be given explicitly");
+    }
+    if (is_shm_trace(path)) {
+        return TraceFormat::BINARY;
+    }
+    // Sniffing the magic would consume the head of a stream.
+    if (!is_stream_trace(path) && is_columnar_trace(path)) {
+        return TraceFormat::COLUMNAR;
+    }
+    if (!is_stream_trace(path) && is_compressed_trace(path)) {
+        return TraceFormat::COMPRESSED;
+    }
+
+    const std::string extension = ".trace";
+    if (path.size() >= extension.size() &&
+        path.compare(path.size() - extension.size(), extension.size(), extension) == 0) {
+        return TraceFormat::BINARY;
+    }
+    return TraceFormat::TEXT;
+}
+
+TraceFormat parse_trace_format(const std::string& name) {
+    if (name == "text") {
+        return TraceFormat::TEXT;
+    } else if (name == "binary") {
+        return TraceFormat::BINARY;
+    } else if (name == "columnar") {
+        return TraceFormat::COLUMNAR;
+    } else if (name == "compressed") {
+        return TraceFormat::COMPRESSED;
+    }
+    throw std::invalid_argument("Unknown trace format '" + name + "'");
+}
+
+std::unique_ptr<TraceReader> open_trace_reader(const std::string& path, TraceFormat format, bool sequential) {
+    // The ring carries binary records whatever the requested format.
+    if (is_shm_trace(path)) {
+        return std::make_unique<ShmTraceReader>(path.substr(std::strlen(SHM_TRACE_PREFIX)));
+    }
+    bool stream = is_stream_trace(path);
+    auto resolved_path = resolve_trace_path(path);
+    switch (format) {
+        case TraceFormat::TEXT: {
+            TextParserOptions options;
+            if (sequential) {
+                options.threads = 1;
+                options.chunk_bytes = SEQUENTIAL_READER_BUFFER_BYTES;
+            }
+            return std::make_unique<ParallelTextTraceReader>(resolved_path, options);
+        }
+        case TraceFormat::BINARY:
+            // Pipes can not be mapped.
+            if (stream && sequential) {
+                return std::make_unique<BufferedBinaryTraceReader>(resolved_path, SEQUENTIAL_READER_BUFFER_BYTES);
+            }
+            if (stream) {
+                return std::make_unique<BufferedBinaryTraceReader>(resolved_path);
+            }
+            return std::make_unique<BinaryTraceReader>(resolved_path);
+        case TraceFormat::COLUMNAR:
+            // Blocks are decoded in parallel, a stream has a single reader for them.
+            if (stream || sequential) {
+                return std::make_unique<ColumnarTraceReader>(resolved_path);
+            }
+            return open_parallel_columnar_reader(resolved_path);
+        case TraceFormat::COMPRESSED:
+            return open_compressed_trace_reader(resolved_path, sequential ? 1 : 0);
+    }
+    throw std::invalid_argument("Unknown trace format!");
+}
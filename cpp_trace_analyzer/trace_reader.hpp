@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Type byte written by the QEMU tracer plugin (see qemu-tracer/.../components/trace/mod.rs).
+enum class AccessType : uint8_t {
+    INSTRUCTION = 0,
+    LOAD = 1,
+    STORE = 2,
+    // Not an access: `addr` holds a TraceMarker (see trace_roi.hpp).
+    MARKER = 3
+};
+
+struct TraceRecord {
+    uint64_t addr;
+    // Nanoseconds since the UNIX epoch. Zero for formats that do not carry timestamps.
+    uint64_t timestamp;
+    AccessType type;
+    uint8_t cpu_index;
+    // Number of accesses the record stands for, see CollapsingTraceReader. Never stored in
+    // trace files. Sits in what would otherwise be padding.
+    uint32_t weight = 1;
+
+    bool is_store() const noexcept { return type == AccessType::STORE; }
+    bool is_marker() const noexcept { return type == AccessType::MARKER; }
+};
+
+static_assert(sizeof(TraceRecord) == 24);
+
+enum class TraceFormat {
+    // One "<addr> <cpu_index> <is_store>" hex record per line.
+    TEXT,
+    // Fixed 18-byte little-endian records written by the QEMU tracer plugin.
+    BINARY,
+    // Delta/varint encoded blocks, see columnar_trace.hpp.
+    COLUMNAR,
+    // Plugin records in LZ compressed blocks, see compressed_trace.hpp.
+    COMPRESSED
+};
+
+// Pull-based source of trace records.
+class TraceReader {
+public:
+    virtual ~TraceReader() = default;
+
+    // Fills `records` with up to `max_records` records and returns how many were read.
+    // Returns 0 once the trace is exhausted.
+    virtual size_t read(TraceRecord *records, size_t max_records) = 0;
+
+    // Gives up on the rest of a stream: a read waiting for its data returns early, later reads
+    // return 0. The only member that may be called from another thread than the reading one.
+    // Files are never waited on, so by default this does nothing.
+    virtual void cancel() noexcept {}
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t *data() const noexcept;
+    size_t size() const noexcept;
+private:
+    uint8_t *data_;
+    size_t size_;
+};
+
+// Reads the hex text format through iostreams. Reference implementation for ParallelTextTraceReader.
+class TextTraceReader : public TraceReader {
+public:
+    explicit TextTraceReader(const std::string& path);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+private:
+    std::ifstream file_;
+    size_t line_no_;
+};
+
+// Zero-copy reader for the tracer plugin's binary records, straight from a memory mapping.
+class BinaryTraceReader : public TraceReader {
+public:
+    static constexpr size_t RECORD_SIZE = 18;
+
+    explicit BinaryTraceReader(const std::string& path);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+
+    uint64_t num_records() const noexcept;
+
+    // Continues reading from record `record`.
+    void seek(uint64_t record) noexcept;
+
+    // Decodes the record starting at `bytes`.
+    static TraceRecord decode(const uint8_t *bytes) noexcept;
+
+    // Calls `callable(const TraceRecord&)` for every remaining record, decoding in place.
+    template <class Callable>
+    void for_each(Callable callable);
+private:
+    MappedFile file_;
+    uint64_t next_record_;
+};
+
+// Reads the tracer plugin's binary records with large explicit reads instead of a mapping: `pread`
+// on regular files, falling back to `read` for pipes. Meant to run on a prefetch thread.
+class BufferedBinaryTraceReader : public TraceReader {
+public:
+    explicit BufferedBinaryTraceReader(const std::string& path, size_t buffer_bytes = 4 * 1024 * 1024);
+    ~BufferedBinaryTraceReader() override;
+
+    BufferedBinaryTraceReader(const BufferedBinaryTraceReader&) = delete;
+    BufferedBinaryTraceReader& operator=(const BufferedBinaryTraceReader&) = delete;
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+private:
+    int fd_;
+    bool use_pread_;
+    std::atomic<bool> cancelled_;
+    bool eof_;
+    uint64_t offset_;
+    std::vector<uint8_t> buffer_;
+    size_t buffer_begin_;
+    size_t buffer_end_;
+
+    void refill();
+};
+
+// Waits until `fd` can be read without blocking, checking `cancelled` every
+// STREAM_CANCEL_POLL_MS. Returns false once it is set.
+constexpr int STREAM_CANCEL_POLL_MS = 100;
+bool wait_readable(int fd, const std::atomic<bool>& cancelled);
+
+// Path that stands for the standard input.
+constexpr const char *STDIN_TRACE_PATH = "-";
+
+// True for the standard input, pipes, FIFOs and shared-memory rings ("shm:/name"): inputs that can
+// only be read once, front to back.
+bool is_stream_trace(const std::string& path);
+
+// Guesses the format of a trace file. Columnar traces are recognized by their magic, otherwise
+// the file name decides: the plugin writes binary traces with a `.trace` extension. Streams are
+// never read ahead, so their format can only come from the name; the standard input has none.
+TraceFormat detect_trace_format(const std::string& path);
+
+// Parses "text", "binary", "columnar" or "compressed".
+TraceFormat parse_trace_format(const std::string& name);
+
+// Buffer of each `sequential` reader, see open_trace_reader.
+constexpr size_t SEQUENTIAL_READER_BUFFER_BYTES = 256 * 1024;
+
+// Opens a file or stream (see STDIN_TRACE_PATH and SHM_TRACE_PREFIX). Streams are read sequentially, without mappings or seeks.
+// `sequential` readers decode on the calling thread, with small buffers: meant for the inputs of a
+// merge, which can be many and are each read a few records at a time.
+std::unique_ptr<TraceReader> open_trace_reader(const std::string& path, TraceFormat format, bool sequential = false);
+
+// Calls `callable` for every record of `reader`. The callable takes either a `const TraceRecord&`
+// or the legacy `(addr, cpu_index, is_store)` triple.
+template <class Callable>
+void for_each_trace_record(TraceReader& reader, Callable callable) {
+    constexpr size_t BATCH_RECORDS = 4096;
+    std::vector<TraceRecord> batch(BATCH_RECORDS);
+
+    size_t n;
+    while ((n = reader.read(batch.data(), batch.size())) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const auto& record = batch[i];
+            if constexpr (std::is_invocable_v<Callable&, const TraceRecord&>) {
+                callable(record);
+            } else {
+                callable(static_cast<uintptr_t>(record.addr), static_cast<uintptr_t>(record.cpu_index), record.is_store());
+            }
+        }
+    }
+}
+
+template <class Callable>
+void BinaryTraceReader::for_each(Callable callable) {
+    const uint8_t *bytes = file_.data();
+    uint64_t total = num_records();
+    for (; next_record_ < total; next_record_++) {
+        callable(decode(bytes + next_record_ * RECORD_SIZE));
+    }
+}
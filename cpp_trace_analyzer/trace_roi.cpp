@@ -0,0 +1,105 @@
+#include "trace_roi.hpp"
+
+#include <stdexcept>
+
+RoiMode parse_roi_mode(const std::string& name) {
+    if (name == "off") {
+        return RoiMode::OFF;
+    }
+    if (name == "skip") {
+        return RoiMode::SKIP;
+    }
+    if (name == "warm") {
+        return RoiMode::WARM;
+    }
+    throw std::invalid_argument("Unknown region of interest mode '" + name + "'");
+}
+
+RoiTraceReader::RoiTraceReader(std::unique_ptr<TraceReader> source, RoiMode mode)
+    : source_(std::move(source)), mode_(mode), buffer_pos_(0), buffer_end_(0), in_roi_(false), resets_(0), regions_(0) {
+    if (mode_ != RoiMode::OFF) {
+        buffer_.resize(4096);
+    }
+}
+
+void RoiTraceReader::apply(const TraceRecord& marker) noexcept {
+    switch (static_cast<TraceMarker>(marker.addr)) {
+        case TraceMarker::ROI_BEGIN:
+            regions_ += !in_roi_;
+            in_roi_ = true;
+            break;
+        case TraceMarker::ROI_END:
+            in_roi_ = false;
+            break;
+        case TraceMarker::RESET_STATS:
+            resets_++;
+            break;
+        default:
+            // Hints of other tools.
+            break;
+    }
+}
+
+size_t RoiTraceReader::read(TraceRecord *records, size_t max_records) {
+    if (mode_ == RoiMode::OFF) {
+        // Only the markers go, in place.
+        while (true) {
+            size_t n = source_->read(records, max_records);
+            if (n == 0) {
+                return 0;
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < n; i++) {
+                records[kept] = records[i];
+                kept += !records[i].is_marker();
+            }
+            if (kept > 0) {
+                return kept;
+            }
+        }
+    }
+
+    size_t n = 0;
+    while (n < max_records) {
+        if (buffer_pos_ == buffer_end_) {
+            buffer_pos_ = 0;
+            buffer_end_ = source_->read(buffer_.data(), buffer_.size());
+            if (buffer_end_ == 0) {
+                break;
+            }
+        }
+
+        const auto& record = buffer_[buffer_pos_];
+        if (record.is_marker()) {
+            // The records before the marker go first, so they are all under the same state.
+            if (n > 0) {
+                break;
+            }
+            apply(record);
+        } else if (in_roi_ || mode_ == RoiMode::WARM) {
+            records[n++] = record;
+        }
+        buffer_pos_++;
+    }
+    return n;
+}
+
+void RoiTraceReader::cancel() noexcept {
+    source_->cancel();
+}
+
+RoiMode RoiTraceReader::mode() const noexcept {
+    return mode_;
+}
+
+bool RoiTraceReader::in_roi() const noexcept {
+    return in_roi_;
+}
+
+uint64_t RoiTraceReader::resets() const noexcept {
+    return resets_;
+}
+
+uint64_t RoiTraceReader::regions() const noexcept {
+    return regions_;
+}
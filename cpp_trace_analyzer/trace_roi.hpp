@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+// Values of marker records: the immediate of the `hint #<value>` instruction a vCPU executed (see
+// qemu-tracer/.../components/marker). Other values are ignored.
+enum class TraceMarker : uint64_t {
+    // Start and end of a region of interest. Regions are global, whichever core marks them.
+    ROI_BEGIN = 91,
+    ROI_END = 92,
+    // Zeroes the cache statistics, e.g. after a warmup phase.
+    RESET_STATS = 93
+};
+
+enum class RoiMode {
+    // Markers are dropped and every access is simulated and counted.
+    OFF,
+    // Only the accesses inside regions of interest are simulated.
+    SKIP,
+    // The accesses outside regions of interest are simulated to warm the caches, but not counted.
+    WARM
+};
+
+// Parses "off", "skip" or "warm". Throws std::invalid_argument otherwise.
+RoiMode parse_roi_mode(const std::string& name);
+
+// Turns a trace with marker records into plain accesses, keeping track of the regions of interest.
+//
+// read() returns accesses only, dropping the ones outside the regions in SKIP mode. The records of
+// a read never straddle a marker, so in_roi() and resets() describe all of them. Before the first
+// ROI_BEGIN marker the accesses are outside any region.
+class RoiTraceReader : public TraceReader {
+public:
+    RoiTraceReader(std::unique_ptr<TraceReader> source, RoiMode mode);
+
+    size_t read(TraceRecord *records, size_t max_records) override;
+    void cancel() noexcept override;
+
+    RoiMode mode() const noexcept;
+    // Whether the records of the last read are inside a region of interest.
+    bool in_roi() const noexcept;
+    // RESET_STATS markers before the records of the last read.
+    uint64_t resets() const noexcept;
+    // Regions of interest begun so far.
+    uint64_t regions() const noexcept;
+private:
+    std::unique_ptr<TraceReader> source_;
+    RoiMode mode_;
+    // Records read from `source_` and not returned yet, when not OFF.
+    std::vector<TraceRecord> buffer_;
+    size_t buffer_pos_;
+    size_t buffer_end_;
+
+    bool in_roi_;
+    uint64_t resets_;
+    uint64_t regions_;
+
+    // Applies a marker to the region state.
+    void apply(const TraceRecord& marker) noexcept;
+};
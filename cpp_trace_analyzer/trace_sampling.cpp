@@ -0,0 +1,106 @@
+#include "trace_sampling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+bool SamplingOptions::enabled() const noexcept {
+    return period > 0;
+}
+
+void SamplingOptions::validate() const {
+    if (!enabled()) {
+        return;
+    }
+    if (window == 0) {
+        throw std::invalid_argument("Sampling windows should be at least one record!");
+    }
+    if (window > period || warming > period - window) {
+        throw std::invalid_argument("Sampling window and warming should fit in the sampling period!");
+    }
+    if (!(confidence > 0 && confidence < 1)) {
+        throw std::invalid_argument("Sampling confidence should be between 0 and 1!");
+    }
+}
+
+double normal_quantile(double p) {
+    if (!(p > 0 && p < 1)) {
+        throw std::invalid_argument("Quantiles are defined between 0 and 1!");
+    }
+    // Bisection on the distribution function, 0.5 * erfc(-x / sqrt(2)), to double precision.
+    double low = -40, high = 40;
+    for (int i = 0; i < 100; i++) {
+        double mid = (low + high) / 2;
+        if (0.5 * std::erfc(-mid / std::sqrt(2.0)) < p) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return (low + high) / 2;
+}
+
+double SampledEstimate::relative_error() const noexcept {
+    return value == 0 ? 0 : half_width / value;
+}
+
+std::ostream& operator<<(std::ostream& out, const SampledEstimate& estimate) {
+    return out << std::llround(estimate.value) << " +- " << std::llround(estimate.half_width);
+}
+
+SampledMisses::SampledMisses(size_t num_caches)
+    : window_start_(num_caches), sums_(num_caches), windows_(0), measured_accesses_(0), accesses_squared_(0) {}
+
+void SampledMisses::begin_window(const std::vector<uint64_t>& misses) {
+    window_start_ = misses;
+}
+
+void SampledMisses::end_window(const std::vector<uint64_t>& misses, uint64_t accesses) {
+    if (misses.size() != sums_.size() || accesses == 0) {
+        throw std::invalid_argument("Window does not match the sampled caches!");
+    }
+    auto window_accesses = static_cast<double>(accesses);
+    for (size_t i = 0; i < misses.size(); i++) {
+        auto window_misses = static_cast<double>(misses[i] - window_start_[i]);
+        sums_[i].misses += window_misses;
+        sums_[i].misses_squared += window_misses * window_misses;
+        sums_[i].misses_accesses += window_misses * window_accesses;
+    }
+    windows_++;
+    measured_accesses_ += accesses;
+    accesses_squared_ += window_accesses * window_accesses;
+}
+
+uint64_t SampledMisses::windows() const noexcept {
+    return windows_;
+}
+
+uint64_t SampledMisses::measured_accesses() const noexcept {
+    return measured_accesses_;
+}
+
+std::vector<SampledEstimate> SampledMisses::estimates(uint64_t total_accesses, double confidence) const {
+    if (windows_ == 0) {
+        throw std::runtime_error("No sampling window was measured, the trace is shorter than a sampling period");
+    }
+    auto n = static_cast<double>(windows_);
+    auto accesses = static_cast<double>(measured_accesses_);
+    double quantile = normal_quantile(0.5 + confidence / 2);
+
+    std::vector<SampledEstimate> result;
+    result.reserve(sums_.size());
+    for (const auto& sums: sums_) {
+        double ratio = sums.misses / accesses;
+        double half_width = 0;
+        if (windows_ > 1) {
+            // Sample variance of the residuals m - ratio * a, and from it the variance of the ratio.
+            double residuals = sums.misses_squared - 2 * ratio * sums.misses_accesses
+                               + ratio * ratio * accesses_squared_;
+            double variance = std::max(residuals, 0.0) / (n - 1);
+            double mean_accesses = accesses / n;
+            half_width = quantile * std::sqrt(variance / n) / mean_accesses;
+        }
+        result.push_back({ratio * total_accesses, half_width * total_accesses});
+    }
+    return result;
+}
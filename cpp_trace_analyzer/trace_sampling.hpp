@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+/*
+ * Statistical sampling of a replay, after SMARTS: the records are split into units of `period`
+ * records, and only the last `window` records of each unit are measured. The records before a
+ * window only warm the caches, so they are simulated but their hits and misses are not counted.
+ *
+ *   unit:  | skipped ... | warming | window |
+ *
+ * With continuous warming (warming == 0) every record between two windows warms the caches and
+ * nothing is skipped, so the windows see the same cache state as a full replay. Otherwise only the
+ * `warming` records before each window are simulated, which is faster but can leave caches much
+ * larger than the warming records cold at the start of the window.
+ *
+ * The misses of the whole trace are estimated with a ratio estimator, the misses of all the windows
+ * per access of all the windows, so windows of different sizes (e.g. of collapsed records) are
+ * weighted by their accesses. The confidence interval comes from the variance of the windows'
+ * misses around that ratio.
+ */
+
+struct SamplingOptions {
+    // Records per sampling unit. Zero replays every record in detail.
+    uint64_t period = 0;
+    // Records measured at the end of each unit.
+    uint64_t window = 10000;
+    // Records simulated right before each window without being measured. Zero warms with every
+    // record between windows.
+    uint64_t warming = 0;
+    // Of the reported confidence intervals, between 0 and 1.
+    double confidence = 0.95;
+
+    bool enabled() const noexcept;
+    // Throws std::invalid_argument when the windows do not fit in the period.
+    void validate() const;
+};
+
+// Quantile of the standard normal distribution, e.g. 1.96 for 0.975.
+double normal_quantile(double p);
+
+struct SampledEstimate {
+    double value;
+    // Half width of the confidence interval.
+    double half_width;
+
+    // Half width relative to the value, zero for a zero value.
+    double relative_error() const noexcept;
+};
+
+std::ostream& operator<<(std::ostream& out, const SampledEstimate& estimate);
+
+// Estimates the misses of several caches from their miss counts at the start and end of each window.
+class SampledMisses {
+public:
+    explicit SampledMisses(size_t num_caches);
+
+    // `misses` are the current miss counts of the caches, always in the same order.
+    void begin_window(const std::vector<uint64_t>& misses);
+    void end_window(const std::vector<uint64_t>& misses, uint64_t accesses);
+
+    uint64_t windows() const noexcept;
+    uint64_t measured_accesses() const noexcept;
+    // Estimated misses of each cache over `total_accesses` accesses. Throws std::runtime_error
+    // before the first window ends.
+    std::vector<SampledEstimate> estimates(uint64_t total_accesses, double confidence) const;
+private:
+    // Per cache sums over the windows of m, m * m and m * a, for the misses m and accesses a of each window.
+    struct WindowSums {
+        double misses = 0;
+        double misses_squared = 0;
+        double misses_accesses = 0;
+    };
+
+    std::vector<uint64_t> window_start_;
+    std::vector<WindowSums> sums_;
+    uint64_t windows_;
+    uint64_t measured_accesses_;
+    double accesses_squared_;
+};
+
+// Replays the records of `reader` that are simulated under `options` into `callable`. Calls
+// `begin_window()` before the first record of each window and `end_window(accesses)` after its
+// last one, with the accesses (record weights) of the window. Returns the accesses of all the
+// records, the skipped ones included. A window cut short by the end of the trace is not ended.
+template <class Callable, class BeginWindow, class EndWindow>
+uint64_t for_each_sampled_record(TraceReader& reader, const SamplingOptions& options, Callable callable,
+                                 BeginWindow begin_window, EndWindow end_window) {
+    const uint64_t measure_begin = options.period - options.window;
+    const uint64_t warm_begin = options.warming == 0 ? 0 : measure_begin - options.warming;
+
+    uint64_t position = 0;
+    uint64_t total_accesses = 0;
+    uint64_t window_accesses = 0;
+    for_each_trace_record(reader, [&](const TraceRecord& record) {
+        total_accesses += record.weight;
+        if (position >= warm_begin) {
+            if (position == measure_begin) {
+                begin_window();
+                window_accesses = 0;
+            }
+            callable(record);
+            if (position >= measure_begin) {
+                window_accesses += record.weight;
+            }
+        }
+        if (++position == options.period) {
+            end_window(window_accesses);
+            position = 0;
+        }
+    });
+    return total_accesses;
+}
@@ -0,0 +1,157 @@
+#include "trace_splitter.hpp"
+#include "trace_writer.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+// Runs fn(0) .. fn(count - 1) on their own threads, the last one on the calling thread, and
+// rethrows the first exception raised by any of them once they all finished.
+template <class Fn>
+static void run_on_threads(uint32_t count, Fn fn) {
+    std::vector<std::exception_ptr> errors(count);
+    auto guarded = [&](uint32_t t) {
+        try {
+            fn(t);
+        } catch (...) {
+            errors[t] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t + 1 < count; t++) {
+        workers.emplace_back(guarded, t);
+    }
+    if (count > 0) {
+        guarded(count - 1);
+    }
+    for (auto& worker: workers) {
+        worker.join();
+    }
+    for (auto& error: errors) {
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+static uint32_t num_split_outputs(const SplitOptions& options) {
+    switch (options.mode) {
+        case SplitMode::CORE:
+            return UINT8_MAX + 1;
+        case SplitMode::CLIENT:
+            if (options.core_clients.empty()) {
+                throw std::invalid_argument("Splitting by client needs the client of every core!");
+            }
+            return *std::max_element(options.core_clients.begin(), options.core_clients.end()) + 1;
+        case SplitMode::ADDRESS_RANGE:
+            if (!std::is_sorted(options.address_bounds.begin(), options.address_bounds.end(), std::less_equal<>())) {
+                throw std::invalid_argument("Address range bounds should be strictly increasing!");
+            }
+            return options.address_bounds.size() + 1;
+    }
+    throw std::invalid_argument("Unknown split mode!");
+}
+
+static uint32_t split_output_index(const SplitOptions& options, const TraceRecord& record) {
+    switch (options.mode) {
+        case SplitMode::CORE:
+            return record.cpu_index;
+        case SplitMode::CLIENT:
+            if (record.cpu_index >= options.core_clients.size()) {
+                throw std::runtime_error("Core " + std::to_string(record.cpu_index) + " has no client");
+            }
+            return options.core_clients[record.cpu_index];
+        case SplitMode::ADDRESS_RANGE:
+            return std::upper_bound(options.address_bounds.begin(), options.address_bounds.end(), record.addr) -
+                   options.address_bounds.begin();
+    }
+    return 0;
+}
+
+static std::string split_output_path(const std::string& output_prefix, const SplitOptions& options, uint32_t index) {
+    const char *kind = options.mode == SplitMode::CORE ? "core" : options.mode == SplitMode::CLIENT ? "client" : "range";
+    auto path = output_prefix + "_" + kind + "_" + std::to_string(index);
+    if (options.output_format == TraceFormat::BINARY) {
+        path += ".trace";
+    }
+    return path;
+}
+
+std::vector<SplitOutput> split_trace(TraceReader& reader, const std::string& output_prefix, const SplitOptions& options) {
+    if (options.batch_records == 0) {
+        throw std::invalid_argument("Split batches should hold at least one record!");
+    }
+    const uint32_t num_outputs = num_split_outputs(options);
+    const uint32_t threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<std::unique_ptr<TraceWriter>> writers(num_outputs);
+    std::vector<uint64_t> counts(num_outputs, 0);
+    std::vector<TraceRecord> batch(options.batch_records);
+    // parts[t][o]: records of output o in the t-th slice of the batch.
+    std::vector<std::vector<std::vector<TraceRecord>>> parts(threads, std::vector<std::vector<TraceRecord>>(num_outputs));
+
+    while (true) {
+        size_t n = 0;
+        size_t count;
+        while (n < batch.size() && (count = reader.read(batch.data() + n, batch.size() - n)) > 0) {
+            n += count;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        run_on_threads(threads, [&](uint32_t t) {
+            for (auto& part: parts[t]) {
+                part.clear();
+            }
+            size_t end = n * (t + 1) / threads;
+            for (size_t i = n * t / threads; i < end; i++) {
+                parts[t][split_output_index(options, batch[i])].push_back(batch[i]);
+            }
+        });
+
+        for (uint32_t o = 0; o < num_outputs; o++) {
+            for (uint32_t t = 0; t < threads && writers[o] == nullptr; t++) {
+                if (!parts[t][o].empty()) {
+                    writers[o] = open_trace_writer(split_output_path(output_prefix, options, o), options.output_format);
+                }
+            }
+        }
+
+        // Every output is owned by one thread, which appends the slices in order.
+        run_on_threads(threads, [&](uint32_t w) {
+            for (uint32_t o = w; o < num_outputs; o += threads) {
+                for (uint32_t t = 0; t < threads; t++) {
+                    if (!parts[t][o].empty()) {
+                        writers[o]->write(parts[t][o].data(), parts[t][o].size());
+                        counts[o] += parts[t][o].size();
+                    }
+                }
+            }
+        });
+    }
+
+    std::vector<SplitOutput> outputs;
+    for (uint32_t o = 0; o < num_outputs; o++) {
+        if (writers[o] != nullptr) {
+            writers[o]->close();
+            outputs.push_back(SplitOutput{.index = o, .path = split_output_path(output_prefix, options, o), .records = counts[o]});
+        }
+    }
+    return outputs;
+}
+
+SplitMode parse_split_mode(const std::string& name) {
+    if (name == "core") {
+        return SplitMode::CORE;
+    } else if (name == "client") {
+        return SplitMode::CLIENT;
+    } else if (name == "address") {
+        return SplitMode::ADDRESS_RANGE;
+    }
+    throw std::invalid_argument("Unknown split mode '" + name + "'");
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+enum class SplitMode {
+    // One output per core.
+    CORE,
+    // One output per client, clients are given as a core -> client table.
+    CLIENT,
+    // One output per physical address range.
+    ADDRESS_RANGE
+};
+
+struct SplitOptions {
+    SplitMode mode = SplitMode::CORE;
+    // CLIENT: core_clients[i] is the client of core i. Every core in the trace must be listed.
+    std::vector<uint32_t> core_clients;
+    // ADDRESS_RANGE: increasing boundaries, range i is [address_bounds[i - 1], address_bounds[i]).
+    // The first range starts at 0 and the last one ends at the end of the address space.
+    std::vector<uint64_t> address_bounds;
+    TraceFormat output_format = TraceFormat::BINARY;
+    // Partitioning and encoding threads, 0 means one per hardware thread.
+    uint32_t threads = 0;
+    // Records read and partitioned at once.
+    size_t batch_records = 1024 * 1024;
+};
+
+struct SplitOutput {
+    // Index of the core, client or address range.
+    uint32_t index;
+    std::string path;
+    uint64_t records;
+};
+
+// Splits `reader` into files named `<output_prefix>_<core|client|range>_<index>`, with a
+// `.trace` extension for binary outputs so they are recognized by detect_trace_format.
+// Each output keeps the relative order of its records. Outputs are created on their first
+// record, so only non-empty ones are returned, sorted by index.
+//
+// Batches are partitioned by several threads, and the outputs are then encoded and written
+// concurrently, each from a single thread, in batch order.
+std::vector<SplitOutput> split_trace(TraceReader& reader, const std::string& output_prefix, const SplitOptions& options);
+
+// Parses "core", "client" or "address".
+SplitMode parse_split_mode(const std::string& name);
@@ -0,0 +1,135 @@
+#include "trace_writer.hpp"
+#include "columnar_trace.hpp"
+#include "compressed_trace.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+BufferedTraceWriter::BufferedTraceWriter(const std::string& path, size_t buffer_bytes)
+    : path_(path), buffer_(std::max<size_t>(buffer_bytes, 4096)), buffer_len_(0) {
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error("Could not create '" + path + "': " + std::strerror(errno));
+    }
+}
+
+BufferedTraceWriter::~BufferedTraceWriter() {
+    try {
+        close();
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+    }
+}
+
+uint8_t *BufferedTraceWriter::reserve(size_t bytes) {
+    if (buffer_.size() - buffer_len_ < bytes) {
+        flush();
+        if (buffer_.size() < bytes) {
+            buffer_.resize(bytes);
+        }
+    }
+    return buffer_.data() + buffer_len_;
+}
+
+void BufferedTraceWriter::commit(uint8_t *end) {
+    buffer_len_ = end - buffer_.data();
+}
+
+void BufferedTraceWriter::flush() {
+    size_t written = 0;
+    while (written < buffer_len_) {
+        ssize_t n = ::write(fd_, buffer_.data() + written, buffer_len_ - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            buffer_len_ = 0;
+            throw std::runtime_error("Error writing '" + path_ + "': " + std::strerror(errno));
+        }
+        written += n;
+    }
+    buffer_len_ = 0;
+}
+
+void BufferedTraceWriter::close() {
+    if (fd_ < 0) {
+        return;
+    }
+    int fd = fd_;
+    try {
+        flush();
+    } catch (...) {
+        ::close(fd);
+        fd_ = -1;
+        throw;
+    }
+    fd_ = -1;
+    if (::close(fd) != 0) {
+        throw std::runtime_error("Error closing '" + path_ + "': " + std::strerror(errno));
+    }
+}
+
+TextTraceWriter::TextTraceWriter(const std::string& path, size_t buffer_bytes) : BufferedTraceWriter(path, buffer_bytes) {}
+
+static uint8_t *write_hex(uint8_t *out, uint64_t value) {
+    static constexpr char digits[] = "0123456789abcdef";
+    int num_digits = value == 0 ? 1 : (64 - __builtin_clzll(value) + 3) / 4;
+    for (int i = num_digits - 1; i >= 0; i--) {
+        out[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return out + num_digits;
+}
+
+void TextTraceWriter::write(const TraceRecord *records, size_t n) {
+    // "0x" + 16 digits + " " + 2 digits + " " + flag + "\n"
+    constexpr size_t MAX_LINE = 24;
+    for (size_t i = 0; i < n; i++) {
+        if (records[i].is_marker()) {
+            continue;
+        }
+        uint8_t *out = reserve(MAX_LINE);
+        *out++ = '0';
+        *out++ = 'x';
+        out = write_hex(out, records[i].addr);
+        *out++ = ' ';
+        out = write_hex(out, records[i].cpu_index);
+        *out++ = ' ';
+        *out++ = records[i].is_store() ? '1' : '0';
+        *out++ = '\n';
+        commit(out);
+    }
+}
+
+BinaryTraceWriter::BinaryTraceWriter(const std::string& path, size_t buffer_bytes) : BufferedTraceWriter(path, buffer_bytes) {}
+
+void BinaryTraceWriter::write(const TraceRecord *records, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t *out = reserve(BinaryTraceReader::RECORD_SIZE);
+        std::memcpy(out, &records[i].addr, sizeof(uint64_t));
+        std::memcpy(out + 8, &records[i].timestamp, sizeof(uint64_t));
+        out[16] = static_cast<uint8_t>(records[i].type);
+        out[17] = records[i].cpu_index;
+        commit(out + BinaryTraceReader::RECORD_SIZE);
+    }
+}
+
+std::unique_ptr<TraceWriter> open_trace_writer(const std::string& path, TraceFormat format) {
+    switch (format) {
+        case TraceFormat::TEXT:
+            return std::make_unique<TextTraceWriter>(path);
+        case TraceFormat::BINARY:
+            return std::make_unique<BinaryTraceWriter>(path);
+        case TraceFormat::COLUMNAR:
+            return std::make_unique<ColumnarTraceWriter>(path);
+        case TraceFormat::COMPRESSED:
+            return std::make_unique<CompressedTraceWriter>(path);
+    }
+    throw std::invalid_argument("Unknown trace format!");
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "trace_reader.hpp"
+
+// Sink of trace records, the counterpart of TraceReader.
+class TraceWriter {
+public:
+    virtual ~TraceWriter() = default;
+
+    virtual void write(const TraceRecord *records, size_t n) = 0;
+    // Flushes everything to disk. Writers close themselves on destruction, but report errors
+    // only when closed explicitly.
+    virtual void close() = 0;
+};
+
+// Writes through a large buffer with plain write(2) calls, bypassing iostreams.
+class BufferedTraceWriter : public TraceWriter {
+public:
+    BufferedTraceWriter(const std::string& path, size_t buffer_bytes);
+    ~BufferedTraceWriter() override;
+
+    BufferedTraceWriter(const BufferedTraceWriter&) = delete;
+    BufferedTraceWriter& operator=(const BufferedTraceWriter&) = delete;
+
+    void close() override;
+protected:
+    // Returns room for at least `bytes` bytes, to be committed with `commit`.
+    uint8_t *reserve(size_t bytes);
+    void commit(uint8_t *end);
+private:
+    std::string path_;
+    int fd_;
+    std::vector<uint8_t> buffer_;
+    size_t buffer_len_;
+
+    void flush();
+};
+
+// "0x<addr> <cpu_index> <is_store>" hex lines, as read by TextTraceReader. Drops timestamps,
+// markers and the instruction/load distinction.
+class TextTraceWriter : public BufferedTraceWriter {
+public:
+    explicit TextTraceWriter(const std::string& path, size_t buffer_bytes = 4 * 1024 * 1024);
+
+    void write(const TraceRecord *records, size_t n) override;
+};
+
+// 18-byte records in the tracer plugin layout, as read by BinaryTraceReader.
+class BinaryTraceWriter : public BufferedTraceWriter {
+public:
+    explicit BinaryTraceWriter(const std::string& path, size_t buffer_bytes = 4 * 1024 * 1024);
+
+    void write(const TraceRecord *records, size_t n) override;
+};
+
+// Creates `path`, truncating it.
+std::unique_ptr<TraceWriter> open_trace_writer(const std::string& path, TraceFormat format);
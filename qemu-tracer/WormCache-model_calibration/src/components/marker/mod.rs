@@ -1,5 +1,9 @@
 // This plugin capture the hint instruction in ARM and print debug information.
+// Each captured hint is also written to the trace as a marker record, so the simulator can follow
+// the regions of interest of the workload: `hint #91` begins one, `hint #92` ends it and
+// `hint #93` resets the statistics.
 
+use crate::components::trace;
 use crate::qemu_api;
 use std::ffi;
 
@@ -7,6 +11,7 @@ pub struct MarkerPlugin {}
 
 unsafe extern "C" fn on_hint_executed(vcpu_index: u32, hint_value: *mut ffi::c_void) {
     let hint_value = hint_value as u32;
+    trace::emit_marker(vcpu_index, hint_value);
 
     if hint_value == 91 {
         // print the current timestamp, in us.
@@ -3,13 +3,19 @@ use std::{
     ffi,
     fs::File,
     io::{BufWriter, Write},
-    sync::Mutex,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Mutex,
+    },
 };
 
 use once_cell::sync::Lazy;
 
 use crate::qemu_api;
 
+mod shm_ring;
+use shm_ring::ShmRing;
+
 fn get_memory_ts() -> u128 {
     return std::time::SystemTime::now()
         .duration_since(std::time::SystemTime::UNIX_EPOCH)
@@ -18,12 +24,59 @@ fn get_memory_ts() -> u128 {
 }
 
 static TRACE_FILE: Lazy<Mutex<BufWriter<File>>> = Lazy::new(|| {
-    // open a file to store the trace.
-    let mut file = std::fs::File::create("trace.trace").unwrap();
+    // open a file to store the trace. TRACE_OUTPUT may point to a FIFO that cpp_trace_analyzer
+    // reads from, so the trace is simulated live instead of being written to disk.
+    let path = std::env::var("TRACE_OUTPUT").unwrap_or_else(|_| "trace.trace".to_string());
+    let mut file = std::fs::File::create(path).unwrap();
     let mut b = BufWriter::with_capacity(64 * 1024 * 1024, file);
     return Mutex::new(b);
 });
 
+// When TRACE_SHM names a ring created by cpp_trace_analyzer (`--trace shm:/name`), records go
+// straight to the simulator through shared memory and the vCPUs do not contend on TRACE_FILE.
+static TRACE_RING: Lazy<Option<ShmRing>> =
+    Lazy::new(|| std::env::var("TRACE_SHM").ok().map(|name| ShmRing::attach(&name)));
+
+// Set once the trace plugin is initialized. Other plugins only add to a trace that is being taken.
+static TRACING: AtomicBool = AtomicBool::new(false);
+
+#[inline]
+fn emit(buffer: &[u8; 18]) {
+    match TRACE_RING.as_ref() {
+        Some(ring) => ring.push(buffer),
+        None => {
+            TRACE_FILE.lock().unwrap().write(buffer).unwrap();
+        }
+    }
+}
+
+/// Emits a marker record: type 3, with `value` in place of the address. cpp_trace_analyzer uses
+/// them to delimit regions of interest (see trace_roi.hpp). Does nothing without the trace plugin,
+/// so the marker plugin alone does not create a trace.
+pub fn emit_marker(vcpu_idx: u32, value: u32) {
+    if !TRACING.load(Ordering::Acquire) {
+        return;
+    }
+    let mut buffer = [0u8; 18];
+    buffer[0..8].copy_from_slice(&(value as u64).to_le_bytes());
+    buffer[8..16].copy_from_slice(&(get_memory_ts() as u64).to_le_bytes());
+    buffer[16] = 3;
+    buffer[17] = vcpu_idx as u8;
+    emit(&buffer);
+}
+
+/// Ends the trace: closes the ring, so the simulator stops waiting for records, or flushes the
+/// file. Must be called at exit, once the vCPUs stopped. Nothing is created for a trace that was
+/// never opened.
+pub fn finish() {
+    if let Some(Some(ring)) = Lazy::get(&TRACE_RING) {
+        ring.close();
+    }
+    if let Some(file) = Lazy::get(&TRACE_FILE) {
+        file.lock().unwrap().flush().unwrap();
+    }
+}
+
 #[cfg(target_pointer_width = "64")]
 #[derive(Debug)]
 pub struct PluginFetchBlockContext {
@@ -49,7 +102,7 @@ unsafe extern "C" fn vcpu_insn_exec(
     buffer[8..16].copy_from_slice(&(get_memory_ts() as u64).to_le_bytes());
     buffer[16] = 0;
     buffer[17] = vcpu_idx as u8;
-    TRACE_FILE.lock().unwrap().write(&buffer).unwrap();
+    emit(&buffer);
 }
 
 unsafe extern "C" fn vcpu_mem_access(
@@ -70,7 +123,7 @@ unsafe extern "C" fn vcpu_mem_access(
         buffer[8..16].copy_from_slice(&(get_memory_ts() as u64).to_le_bytes());
         buffer[16] = if is_store { 2 } else { 1 };
         buffer[17] = cpu_idx as u8;
-        TRACE_FILE.lock().unwrap().write(&buffer).unwrap();
+        emit(&buffer);
     } else {
         // TODO: check the I/O event
     }
@@ -82,14 +135,19 @@ pub struct TracePlugin {}
 impl super::Plugin for TracePlugin {
     #[inline]
     fn init() {
-        // make sure the file is initialized.
-        TRACE_FILE.lock().unwrap().flush().unwrap();
+        // make sure the file or the ring is initialized.
+        if TRACE_RING.is_none() {
+            TRACE_FILE.lock().unwrap().flush().unwrap();
+        }
+        TRACING.store(true, Ordering::Release);
         println!("Trace plugin initialized.");
     }
 
     #[inline]
     fn dump_snapshot() {
-        TRACE_FILE.lock().unwrap().flush().unwrap();
+        if TRACE_RING.is_none() {
+            TRACE_FILE.lock().unwrap().flush().unwrap();
+        }
     }
 
     unsafe fn on_translation(tb: *mut crate::qemu_api::qemu_plugin_tb) {
@@ -0,0 +1,138 @@
+// Producer end of the shared-memory trace ring read by cpp_trace_analyzer (`--trace shm:/name`).
+// The layout mirrors cpp_trace_analyzer/shm_trace_ring.hpp, keep both in sync:
+//
+//   header (256 bytes): magic u64 @0, version u32 @8, slot_size u32 @12, capacity u64 @16,
+//                       head u64 @64, tail u64 @128, closed u32 @192
+//   slots (32 bytes each): sequence u64 @0, 18-byte trace record @8
+//
+// Producers claim a position with a CAS on `head` once the slot sequence equals the position,
+// fill the record and publish it by storing position + 1. The consumer creates the segment.
+
+use std::{
+    ffi,
+    fs::OpenOptions,
+    os::unix::io::AsRawFd,
+    sync::atomic::{AtomicU32, AtomicU64, Ordering},
+};
+
+const SHM_RING_MAGIC: u64 = 0x474e495254475341; // "ASGTRING"
+const SHM_RING_VERSION: u32 = 1;
+const HEADER_SIZE: usize = 256;
+const SLOT_SIZE: usize = 32;
+
+const PROT_READ: i32 = 0x1;
+const PROT_WRITE: i32 = 0x2;
+const MAP_SHARED: i32 = 0x01;
+
+extern "C" {
+    fn mmap(
+        addr: *mut ffi::c_void,
+        len: usize,
+        prot: i32,
+        flags: i32,
+        fd: i32,
+        offset: i64,
+    ) -> *mut ffi::c_void;
+}
+
+pub struct ShmRing {
+    base: *mut u8,
+    mask: u64,
+}
+
+// The ring is only accessed through atomics and slots owned by the claiming producer.
+unsafe impl Send for ShmRing {}
+unsafe impl Sync for ShmRing {}
+
+impl ShmRing {
+    /// Attaches to the ring created by the simulator. `name` is the shm object name, e.g. "/asgard".
+    pub fn attach(name: &str) -> ShmRing {
+        let path = format!("/dev/shm/{}", name.trim_start_matches('/'));
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(&path)
+            .unwrap_or_else(|e| panic!("Could not open trace ring {}: {}", path, e));
+        let len = file.metadata().unwrap().len() as usize;
+        assert!(len >= HEADER_SIZE, "Trace ring {} is too small", path);
+
+        let base = unsafe {
+            mmap(
+                std::ptr::null_mut(),
+                len,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        assert!(base as isize != -1, "Could not map trace ring {}", path);
+        let base = base as *mut u8;
+
+        let ring = ShmRing { base, mask: 0 };
+        while ring.atomic_u64(0).load(Ordering::Acquire) != SHM_RING_MAGIC {
+            std::thread::yield_now();
+        }
+        let (version, slot_size, capacity) = unsafe {
+            (
+                *(base.add(8) as *const u32),
+                *(base.add(12) as *const u32),
+                *(base.add(16) as *const u64),
+            )
+        };
+        assert_eq!(version, SHM_RING_VERSION, "Incompatible trace ring version");
+        assert_eq!(slot_size as usize, SLOT_SIZE, "Incompatible trace ring slot size");
+        assert!(HEADER_SIZE + capacity as usize * SLOT_SIZE <= len, "Truncated trace ring");
+
+        ShmRing { base, mask: capacity - 1 }
+    }
+
+    #[inline]
+    fn atomic_u64(&self, offset: usize) -> &AtomicU64 {
+        unsafe { &*(self.base.add(offset) as *const AtomicU64) }
+    }
+
+    #[inline]
+    fn slot(&self, pos: u64) -> *mut u8 {
+        unsafe { self.base.add(HEADER_SIZE + (pos & self.mask) as usize * SLOT_SIZE) }
+    }
+
+    /// Appends a record, waiting for the simulator while the ring is full.
+    pub fn push(&self, record: &[u8; 18]) {
+        let head = self.atomic_u64(64);
+        let mut pos = head.load(Ordering::Relaxed);
+        let mut attempt = 0u32;
+        loop {
+            let slot = self.slot(pos);
+            let sequence = unsafe { &*(slot as *const AtomicU64) };
+            let diff = sequence.load(Ordering::Acquire).wrapping_sub(pos) as i64;
+            if diff == 0 {
+                match head.compare_exchange_weak(pos, pos + 1, Ordering::Relaxed, Ordering::Relaxed) {
+                    Ok(_) => {
+                        unsafe { std::ptr::copy_nonoverlapping(record.as_ptr(), slot.add(8), 18) };
+                        sequence.store(pos + 1, Ordering::Release);
+                        return;
+                    }
+                    Err(current) => pos = current,
+                }
+            } else if diff < 0 {
+                // Full: backpressure on the guest instead of dropping records.
+                if attempt < 64 {
+                    std::hint::spin_loop();
+                } else {
+                    std::thread::yield_now();
+                }
+                attempt += 1;
+                pos = head.load(Ordering::Relaxed);
+            } else {
+                pos = head.load(Ordering::Relaxed);
+            }
+        }
+    }
+
+    /// Tells the simulator no more records will come. Call once every vCPU stopped.
+    pub fn close(&self) {
+        let closed = unsafe { &*(self.base.add(192) as *const AtomicU32) };
+        closed.store(1, Ordering::Release);
+    }
+}
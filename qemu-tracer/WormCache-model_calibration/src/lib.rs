@@ -22,6 +22,8 @@ pub static qemu_plugin_version: u32 = qemu_api::QEMU_PLUGIN_VERSION;
 unsafe extern "C" fn plugin_exit(_: qemu_api::qemu_plugin_id_t, _: *mut ffi::c_void) {
     MemoryPlugin::dump_snapshot();
     VirtualTimePlugin::dump_snapshot();
+    // Whichever plugins are enabled, a live `shm:` run only ends once its ring is closed.
+    components::trace::finish();
 }
 
 #[no_mangle]